@@ -0,0 +1,94 @@
+// arrays.c
+/************************************************************************
+ Array addressing on the IR
+
+ a[i] is RAM[a + i]; the that segment already adds a constant, so a
+ constant part of the index moves into the access: a[3] reads that 3
+ through pointer 1 = a, and a[i + 1] reads that 1 through a + i, the
+ same address as a[i]. Accesses left sharing one address register then
+ reuse pointer 1 when lowered (see irLower).
+*************************************************************************/
+#include "ir.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THAT_INDEX 32767
+
+// constant value of register r, if it has one
+static int constOf(const IrFunction *ir, const int *defAt, int r, int *v) {
+    if (defAt[r] < 0 || ir->code[defAt[r]].op != IR_CONST) return 0;
+    *v = ir->code[defAt[r]].imm;
+    return 1;
+}
+
+// x is available at the instruction defining y
+static int definedBefore(const int *defAt, const int *defBlock, int x, int y) {
+    return defBlock[x] != defBlock[y] || defAt[x] < defAt[y];
+}
+
+// rewrite the address of one access; returns 1 if it changed
+static int foldOnce(IrFunction *ir, IrInstr *in, int *uses, const int *defAt, const int *defBlock) {
+    int r = in->a, k;
+    if (defAt[r] < 0) return 0;
+    IrInstr *d = &ir->code[defAt[r]];
+    if (d->op == IR_ADD) {
+        for (int side = 0; side < 2; side++) {
+            int x = side ? d->b : d->a, y = side ? d->a : d->b;
+            if (constOf(ir, defAt, y, &k) && k >= 0 && in->imm + k <= MAX_THAT_INDEX) {
+                in->a = x;
+                in->imm += k;
+                uses[r]--;
+                uses[x]++;
+                return 1;
+            }
+        }
+        // a + (z + k) => (a + z) + k, reusing the inner add
+        int x = d->a, y = d->b;
+        if (uses[r] == 1 && uses[y] == 1 && defAt[y] >= 0 && ir->code[defAt[y]].op == IR_ADD &&
+            definedBefore(defAt, defBlock, x, y)) {
+            IrInstr *e = &ir->code[defAt[y]];
+            for (int side = 0; side < 2; side++) {
+                int z = side ? e->b : e->a, c = side ? e->a : e->b;
+                if (!constOf(ir, defAt, c, &k) || k < 0 || in->imm + k > MAX_THAT_INDEX) continue;
+                e->a = x;
+                e->b = z;
+                in->a = y;
+                in->imm += k;
+                uses[r] = 0;
+                uses[c]--;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int irFoldAddresses(IrFunction *ir) {
+    int nRegs = ir->nRegs + 1, folded = 0;
+    int *uses = malloc(sizeof(int) * (size_t)nRegs);
+    int *defAt = malloc(sizeof(int) * (size_t)nRegs);
+    int *defBlock = malloc(sizeof(int) * (size_t)nRegs);
+    if (!uses || !defAt || !defBlock) abort();
+    irCountUses(ir, uses);
+    for (int r = 0; r < nRegs; r++) defAt[r] = -1;
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++)
+            if (ir->code[k].dst >= 0) {
+                defAt[ir->code[k].dst] = k;
+                defBlock[ir->code[k].dst] = b;
+            }
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            IrInstr *in = &ir->code[k];
+            if ((in->op != IR_LOAD && in->op != IR_STORE) || in->seg != SEG_THAT) continue;
+            int changed = 0;
+            while (foldOnce(ir, in, uses, defAt, defBlock)) changed = 1;
+            folded += changed;
+        }
+    free(uses);
+    free(defAt);
+    free(defBlock);
+    if (folded) irRemoveDead(ir);
+    return folded;
+}
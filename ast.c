@@ -0,0 +1,293 @@
+// ast.c
+/************************************************************************
+ Abstract syntax tree storage: flat node pools with index links
+*************************************************************************/
+#include "ast.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int inMap(const ClassAst *c, const void *pool) {
+    const char *p = pool, *m = c->map;
+    return m && p >= m && p < m + c->mapLen;
+}
+
+// grow a pool so that it can hold at least need elements; a pool still in
+// the file mapping is copied out instead of reallocated
+static void* growPool(ClassAst *c, void *pool, int *cap, int need, size_t elem) {
+    if (need <= *cap) return pool;
+    int n = *cap ? *cap : 64;
+    while (n < need) n *= 2;
+    void *p;
+    if (inMap(c, pool)) {
+        p = malloc((size_t)n * elem);
+        if (p) memcpy(p, pool, (size_t)*cap * elem);
+    } else {
+        p = realloc(pool, (size_t)n * elem);
+    }
+    if (!p) abort();
+    *cap = n;
+    return p;
+}
+
+ClassAst* newClassAst(void) {
+    ClassAst *c = calloc(1, sizeof(ClassAst));
+    if (!c) abort();
+    c->name = AST_NONE;
+    c->vars = AST_NONE;
+    c->subs = AST_NONE;
+    astString(c, "");   // id 0 is the empty string
+    return c;
+}
+
+void freeClassAst(ClassAst *c) {
+    if (!c) return;
+    if (!inMap(c, c->exprs)) free(c->exprs);
+    if (!inMap(c, c->stmts)) free(c->stmts);
+    if (!inMap(c, c->decs)) free(c->decs);
+    if (!inMap(c, c->subDecs)) free(c->subDecs);
+    if (!inMap(c, c->strs)) free(c->strs);
+    if (c->map) munmap(c->map, c->mapLen);
+    free(c);
+}
+
+int astStringN(ClassAst *c, const char *s, int len) {
+    c->strs = growPool(c, c->strs, &c->strCap, c->strLen + len + 1, 1);
+    int id = c->strLen;
+    memcpy(c->strs + id, s, (size_t)len);
+    c->strs[id + len] = '\0';
+    c->strLen += len + 1;
+    return id;
+}
+
+int astString(ClassAst *c, const char *s) {
+    return astStringN(c, s, (int)strlen(s));
+}
+
+const char* astStr(const ClassAst *c, int id) {
+    return id < 0 ? "" : c->strs + id;
+}
+
+int newExpr(ClassAst *c, ExprKind kind, int ln) {
+    c->exprs = growPool(c, c->exprs, &c->capExprs, c->nExprs + 1, sizeof(Expr));
+    Expr *e = &c->exprs[c->nExprs];
+    e->kind = kind;
+    e->op = 0;
+    e->value = 0;
+    e->name = e->sub = AST_NONE;
+    e->a = e->b = e->next = AST_NONE;
+    e->ln = ln;
+    return c->nExprs++;
+}
+
+int newStmt(ClassAst *c, StmtKind kind, int ln) {
+    c->stmts = growPool(c, c->stmts, &c->capStmts, c->nStmts + 1, sizeof(Stmt));
+    Stmt *s = &c->stmts[c->nStmts];
+    s->kind = kind;
+    s->name = s->index = s->expr = AST_NONE;
+    s->body = s->orelse = s->next = AST_NONE;
+    s->ln = ln;
+    return c->nStmts++;
+}
+
+int newVarDec(ClassAst *c, int name, int type, int kind) {
+    c->decs = growPool(c, c->decs, &c->capDecs, c->nDecs + 1, sizeof(VarDec));
+    VarDec *d = &c->decs[c->nDecs];
+    d->name = name;
+    d->type = type;
+    d->kind = kind;
+    d->next = AST_NONE;
+    return c->nDecs++;
+}
+
+int newSubDec(ClassAst *c, SubKind kind, int ln) {
+    c->subDecs = growPool(c, c->subDecs, &c->capSubDecs, c->nSubDecs + 1, sizeof(SubDec));
+    SubDec *s = &c->subDecs[c->nSubDecs];
+    s->kind = kind;
+    s->type = s->name = AST_NONE;
+    s->params = s->locals = s->body = s->next = AST_NONE;
+    s->nParams = s->nLocals = 0;
+    s->ln = ln;
+    return c->nSubDecs++;
+}
+
+int findSubDec(const ClassAst *c, const char *name) {
+    for (int i = c->subs; i != AST_NONE; i = c->subDecs[i].next)
+        if (!strcmp(astStr(c, c->subDecs[i].name), name))
+            return i;
+    return AST_NONE;
+}
+
+//---------------------------------------------------------------------
+// binary files
+//---------------------------------------------------------------------
+
+#define AST_MAGIC   0x5453414Au      // "JAST" read as a little-endian word
+#define AST_VERSION 1
+#define AST_ALIGN   8
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t layout;                 // node sizes, one per byte
+    int32_t name, vars, subs;
+    int32_t nExprs, nStmts, nDecs, nSubDecs, strLen;
+    uint32_t offExprs, offStmts, offDecs, offSubDecs, offStrs;
+    uint32_t size;                   // whole file
+} AstFileHeader;
+
+static uint32_t nodeLayout(void) {
+    return (uint32_t)(sizeof(Expr) | sizeof(Stmt) << 8 | sizeof(VarDec) << 16 | sizeof(SubDec) << 24);
+}
+
+static uint32_t alignUp(uint32_t n) {
+    return (n + AST_ALIGN - 1) & ~(uint32_t)(AST_ALIGN - 1);
+}
+
+static int writeSection(FILE *f, const void *p, size_t len) {
+    static const char pad[AST_ALIGN];
+    size_t extra = alignUp((uint32_t)len) - len;
+    return fwrite(p, 1, len, f) == len && fwrite(pad, 1, extra, f) == extra;
+}
+
+// written to a temporary name and renamed, so readers never map half a file
+int writeClassAstFile(const ClassAst *c, const char *path) {
+    AstFileHeader h;
+    char tmp[600];
+    memset(&h, 0, sizeof(h));
+    h.magic = AST_MAGIC;
+    h.version = AST_VERSION;
+    h.layout = nodeLayout();
+    h.name = c->name;
+    h.vars = c->vars;
+    h.subs = c->subs;
+    h.nExprs = c->nExprs;
+    h.nStmts = c->nStmts;
+    h.nDecs = c->nDecs;
+    h.nSubDecs = c->nSubDecs;
+    h.strLen = c->strLen;
+    h.offExprs = alignUp(sizeof(h));
+    h.offStmts = h.offExprs + alignUp((uint32_t)(sizeof(Expr) * (size_t)c->nExprs));
+    h.offDecs = h.offStmts + alignUp((uint32_t)(sizeof(Stmt) * (size_t)c->nStmts));
+    h.offSubDecs = h.offDecs + alignUp((uint32_t)(sizeof(VarDec) * (size_t)c->nDecs));
+    h.offStrs = h.offSubDecs + alignUp((uint32_t)(sizeof(SubDec) * (size_t)c->nSubDecs));
+    h.size = h.offStrs + alignUp((uint32_t)c->strLen);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return 0;
+    int ok = writeSection(f, &h, sizeof(h)) &&
+             writeSection(f, c->exprs, sizeof(Expr) * (size_t)c->nExprs) &&
+             writeSection(f, c->stmts, sizeof(Stmt) * (size_t)c->nStmts) &&
+             writeSection(f, c->decs, sizeof(VarDec) * (size_t)c->nDecs) &&
+             writeSection(f, c->subDecs, sizeof(SubDec) * (size_t)c->nSubDecs) &&
+             writeSection(f, c->strs, (size_t)c->strLen);
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+static int sectionOk(const AstFileHeader *h, uint32_t off, int32_t n, size_t elem) {
+    return n >= 0 && off % AST_ALIGN == 0 && off <= h->size &&
+           (uint64_t)n * elem <= (uint64_t)(h->size - off);
+}
+
+// a link to one of n nodes, or none
+static int linkOk(int i, int n) {
+    return i == AST_NONE || (i >= 0 && i < n);
+}
+
+// every link, string id and node kind of a mapped file in range, in one
+// pass over the pools, so nothing later indexes outside the mapping
+static int nodesOk(const ClassAst *c) {
+    int nE = c->nExprs, nS = c->nStmts, nD = c->nDecs, nSub = c->nSubDecs, nStr = c->strLen;
+    if (!linkOk(c->name, nStr) || !linkOk(c->vars, nD) || !linkOk(c->subs, nSub)) return 0;
+    for (int i = 0; i < nE; i++) {
+        const Expr *e = &c->exprs[i];
+        if (e->kind < EX_INT || e->kind > EX_BINARY || !linkOk(e->name, nStr) ||
+            !linkOk(e->sub, nStr) || !linkOk(e->a, nE) || !linkOk(e->b, nE) || !linkOk(e->next, nE))
+            return 0;
+    }
+    for (int i = 0; i < nS; i++) {
+        const Stmt *t = &c->stmts[i];
+        if (t->kind < ST_LET || t->kind > ST_RETURN || !linkOk(t->name, nStr) ||
+            !linkOk(t->index, nE) || !linkOk(t->expr, nE) ||
+            !linkOk(t->body, nS) || !linkOk(t->orelse, nS) || !linkOk(t->next, nS))
+            return 0;
+    }
+    for (int i = 0; i < nD; i++) {
+        const VarDec *d = &c->decs[i];
+        if (!linkOk(d->name, nStr) || !linkOk(d->type, nStr) || !linkOk(d->next, nD)) return 0;
+    }
+    for (int i = 0; i < nSub; i++) {
+        const SubDec *d = &c->subDecs[i];
+        if (d->kind < SUB_CONSTRUCTOR || d->kind > SUB_METHOD || !linkOk(d->type, nStr) ||
+            !linkOk(d->name, nStr) || !linkOk(d->params, nD) || !linkOk(d->locals, nD) ||
+            !linkOk(d->body, nS) || !linkOk(d->next, nSub) || d->nParams < 0 || d->nLocals < 0)
+            return 0;
+    }
+    return 1;
+}
+
+ClassAst* mapClassAstFile(const char *path, char *err, int errLen) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, (size_t)errLen, "cannot open %s", path);
+        return NULL;
+    }
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(AstFileHeader))
+        // private and writable: passes like constant folding rewrite nodes in place
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        snprintf(err, (size_t)errLen, "cannot map %s", path);
+        return NULL;
+    }
+
+    const AstFileHeader *h = m;
+    const char *base = m;
+    if (h->magic != AST_MAGIC || h->version != AST_VERSION || h->layout != nodeLayout() ||
+        h->size != (uint64_t)st.st_size ||
+        !sectionOk(h, h->offExprs, h->nExprs, sizeof(Expr)) ||
+        !sectionOk(h, h->offStmts, h->nStmts, sizeof(Stmt)) ||
+        !sectionOk(h, h->offDecs, h->nDecs, sizeof(VarDec)) ||
+        !sectionOk(h, h->offSubDecs, h->nSubDecs, sizeof(SubDec)) ||
+        !sectionOk(h, h->offStrs, h->strLen, 1) ||
+        h->strLen < 1 || base[h->offStrs + h->strLen - 1] != '\0') {
+        snprintf(err, (size_t)errLen, "%s: not a version %d AST file of this build", path, AST_VERSION);
+        munmap(m, (size_t)st.st_size);
+        return NULL;
+    }
+
+    ClassAst *c = calloc(1, sizeof(ClassAst));
+    if (!c) abort();
+    c->map = m;
+    c->mapLen = (size_t)st.st_size;
+    c->name = h->name;
+    c->vars = h->vars;
+    c->subs = h->subs;
+    // empty pools stay NULL: their offset may be the end of the mapping
+    c->exprs = h->nExprs ? (Expr*)(base + h->offExprs) : NULL;
+    c->nExprs = c->capExprs = h->nExprs;
+    c->stmts = h->nStmts ? (Stmt*)(base + h->offStmts) : NULL;
+    c->nStmts = c->capStmts = h->nStmts;
+    c->decs = h->nDecs ? (VarDec*)(base + h->offDecs) : NULL;
+    c->nDecs = c->capDecs = h->nDecs;
+    c->subDecs = h->nSubDecs ? (SubDec*)(base + h->offSubDecs) : NULL;
+    c->nSubDecs = c->capSubDecs = h->nSubDecs;
+    c->strs = (char*)(base + h->offStrs);
+    c->strLen = c->strCap = h->strLen;
+    if (!nodesOk(c)) {
+        snprintf(err, (size_t)errLen, "%s: node or string index out of range", path);
+        freeClassAst(c);      // unmaps the file
+        return NULL;
+    }
+    return c;
+}
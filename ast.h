@@ -0,0 +1,129 @@
+#ifndef AST_H
+#define AST_H
+
+#include <stddef.h>
+#include "lexer.h"
+#include "parser.h"
+
+// Abstract syntax tree of one Jack class.
+// All nodes live in flat pools owned by the ClassAst and refer to each other
+// by index (-1 means "none"); strings are offsets into one string table.
+// Nothing holds a raw pointer into a pool, so pools may grow with realloc.
+
+#define AST_NONE (-1)
+
+typedef enum {
+    EX_INT,      // integer constant, value in .value
+    EX_STRING,   // string constant, text in .name
+    EX_TRUE,
+    EX_FALSE,
+    EX_NULL,
+    EX_THIS,
+    EX_VAR,      // variable .name
+    EX_INDEX,    // .name [ .a ]
+    EX_CALL,     // .name . .sub ( args ), .name == AST_NONE for f(args); args chained from .a via .next
+    EX_UNARY,    // .op .a
+    EX_BINARY    // .a .op .b
+} ExprKind;
+
+typedef struct {
+    int kind;    // ExprKind
+    int op;      // operator character for EX_UNARY / EX_BINARY
+    int value;   // EX_INT: constant value; EX_CALL: number of arguments
+    int name;    // string id (see ExprKind)
+    int sub;     // EX_CALL: subroutine name
+    int a, b;    // child expressions
+    int next;    // next argument when this expression is a call argument
+    int ln;      // source line
+} Expr;
+
+typedef enum { ST_LET, ST_IF, ST_WHILE, ST_DO, ST_RETURN } StmtKind;
+
+typedef struct {
+    int kind;    // StmtKind
+    int name;    // ST_LET: target variable
+    int index;   // ST_LET: array index expression or AST_NONE
+    int expr;    // let value / if, while condition / do call / return value (or AST_NONE)
+    int body;    // if, while: first statement of the body
+    int orelse;  // if: first statement of the else branch or AST_NONE
+    int next;    // next statement in the block
+    int ln;
+} Stmt;
+
+typedef struct {
+    int name;
+    int type;    // string id of int/char/boolean or a class name
+    int kind;    // Kind from symbols.h
+    int next;
+} VarDec;
+
+typedef enum { SUB_CONSTRUCTOR, SUB_FUNCTION, SUB_METHOD } SubKind;
+
+typedef struct {
+    int kind;    // SubKind
+    int type;    // return type (void/int/char/boolean/class)
+    int name;
+    int params;  // first VarDec of the parameter list
+    int nParams;
+    int locals;  // first VarDec of the var declarations
+    int nLocals;
+    int body;    // first statement
+    int next;
+    int ln;
+} SubDec;
+
+typedef struct {
+    int name;
+    int vars;    // first class VarDec (static/field)
+    int subs;    // first SubDec
+
+    Expr   *exprs; int nExprs, capExprs;
+    Stmt   *stmts; int nStmts, capStmts;
+    VarDec *decs;  int nDecs,  capDecs;
+    SubDec *subDecs; int nSubDecs, capSubDecs;
+    char   *strs;  int strLen, strCap;
+
+    void   *map;   size_t mapLen;   // file the pools were mapped from, NULL if all on the heap
+} ClassAst;
+
+ClassAst* newClassAst(void);
+void freeClassAst(ClassAst *c);
+
+// Intern a string in the class string table and return its id
+int astString(ClassAst *c, const char *s);
+int astStringN(ClassAst *c, const char *s, int len);
+const char* astStr(const ClassAst *c, int id);
+
+// Allocate a zeroed node (all links set to AST_NONE) and return its index
+int newExpr(ClassAst *c, ExprKind kind, int ln);
+int newStmt(ClassAst *c, StmtKind kind, int ln);
+int newVarDec(ClassAst *c, int name, int type, int kind);
+int newSubDec(ClassAst *c, SubKind kind, int ln);
+
+// Find a subroutine of the class by name; AST_NONE if absent
+int findSubDec(const ClassAst *c, const char *name);
+
+// Binary form of a class for caching parse results (<Class>.ast): a
+// header followed by the raw pools and the string table at offsets from
+// the start of the file. Nodes only link by index, so a loaded file is
+// used in place through a private mapping; a pool moves to the heap the
+// first time it has to grow. Files from a build with other node layouts
+// or byte order are rejected, and so are files with a link or string id
+// outside its pool.
+int writeClassAstFile(const ClassAst *c, const char *path);
+ClassAst* mapClassAstFile(const char *path, char *err, int errLen);
+
+// Parser hand-off: after a successful Parse() the parser owns the tree of the
+// class it just read; TakeParsedClass transfers it to the caller (or NULL).
+ClassAst* TakeParsedClass(void);
+// Parse() builds subroutine bodies on a heap stack of at most `limit`
+// frames instead of recursing on the C stack; deeper nesting is reported
+// as a syntaxError. 0 (the default) parses recursively
+void SetParserStackLimit(int limit);
+// With a path set (NULL for none), a successful Parse() also writes the
+// class there as a binary AST file, as read from the source, and
+// ParsedClassSaved() tells whether that worked
+void SetParserAstOutput(const char *path);
+int ParsedClassSaved(void);
+
+#endif
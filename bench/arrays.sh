@@ -0,0 +1,12 @@
+#!/bin/sh
+# Array access fast paths: VM instructions executed and Hack cycles for
+# bench/arrays with and without them (vmrun -noarrays, hackrun -noarrays).
+# Usage: bench/arrays.sh [VMRUN [HACKRUN]], from the repository root
+VMRUN=${1:-./vmrun}
+HACKRUN=${2:-./hackrun}
+DIR=$(dirname "$0")/arrays
+for flag in -noarrays ""; do
+    echo "${flag:-default}:"
+    "$VMRUN" $flag "$DIR" 2>&1 | grep instructions
+    "$HACKRUN" $flag "$DIR" 2>&1 | grep cycles
+done
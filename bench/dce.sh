@@ -0,0 +1,39 @@
+#!/bin/sh
+# Dead code elimination only applies to whole programs (with Main.main):
+# compiling the OS of os/ on its own, which has Sys.init but no
+# Main.main, must drop nothing, as user code calls most of it. A program
+# that brings its own OS class (project 12: Main.jack next to
+# Memory.jack) must keep all of it, as the other OS classes call into it
+# (Array.new calls Memory.alloc) where the call graph cannot see.
+# Usage: bench/dce.sh [JACKC], from the repository root
+JACKC=${1:-./jackc}
+OS=$(dirname "$0")/../os
+DIR=${TMPDIR:-/tmp}/dce.$$
+mkdir -p "$DIR"
+cp "$OS"/*.jack "$DIR"
+REPORT=$("$JACKC" -report "$DIR" 2>&1 | grep "dead code")
+echo "os alone: $REPORT"
+case "$REPORT" in
+    *" 0 subroutines"*) echo "ok" ;;
+    *) echo "FAILED: the OS lost subroutines" ;;
+esac
+rm -rf "${DIR:?}"
+
+mkdir -p "$DIR"
+cp "$OS/Memory.jack" "$DIR"
+cat > "$DIR/Main.jack" <<JACK
+class Main {
+    function void main() {
+        var Array a;
+        let a = Array.new(3);
+        do a.dispose();
+        return;
+    }
+}
+JACK
+"$JACKC" "$DIR" > /dev/null 2>&1
+ALL=$(grep -c "^ *function" "$DIR/Memory.jack")
+KEPT=$(grep -c "^function Memory\." "$DIR/Memory.vm" 2>/dev/null)
+echo "program with its own Memory: ${KEPT:-0} of $ALL Memory functions kept"
+if [ "${KEPT:-0}" -eq "$ALL" ]; then echo "ok"; else echo "FAILED: Memory lost functions"; fi
+rm -rf "${DIR:?}"
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Constant folding against the run-time Math routines: bench/fold prints
+# the same at -O0 (no folding) and optimised, e.g. 0 for -32768 / -1.
+# Usage: bench/fold.sh [VMRUN], from the repository root
+VMRUN=${1:-./vmrun}
+DIR=$(dirname "$0")/fold
+"$VMRUN" -O0 "$DIR" 2>/dev/null > "${TMPDIR:-/tmp}/fold.O0.$$"
+"$VMRUN" "$DIR" 2>/dev/null > "${TMPDIR:-/tmp}/fold.O2.$$"
+if cmp -s "${TMPDIR:-/tmp}/fold.O0.$$" "${TMPDIR:-/tmp}/fold.O2.$$"; then
+    echo "fold: same output at -O0 and optimised"
+else
+    echo "fold: output differs"
+    diff "${TMPDIR:-/tmp}/fold.O0.$$" "${TMPDIR:-/tmp}/fold.O2.$$"
+fi
+rm -f "${TMPDIR:-/tmp}/fold.O0.$$" "${TMPDIR:-/tmp}/fold.O2.$$"
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Size-class heap: bench/heap with the first-fit Memory of the OS stub and
+# with the size-class Memory of heap.c (vmrun -sizeheap, its allocation
+# and fragmentation statistics from -heapstats), then the latter with
+# alloc and deAlloc in C (-intrinsicscheck, checked against the VM code).
+# Usage: bench/heap.sh [VMRUN], from the repository root
+VMRUN=${1:-./vmrun}
+DIR="$(dirname "$0")/heap"
+"$VMRUN" "$DIR" 2>&1 | grep instructions
+"$VMRUN" -sizeheap -heapstats "$DIR" 2>&1 | grep -E "instructions|heap:"
+"$VMRUN" -sizeheap -intrinsicscheck "$DIR" 2>&1 | grep -E "instructions|check"
@@ -0,0 +1,8 @@
+#!/bin/sh
+# Native OS intrinsics: instructions and time of bench/oscalls interpreted
+# as plain VM code and with the OS routines of intrinsics.c in C (vmrun
+# -intrinsicscheck, which also checks that the output and RAM come out
+# the same).
+# Usage: bench/intrinsics.sh [VMRUN], from the repository root
+VMRUN=${1:-./vmrun}
+"$VMRUN" -intrinsicscheck "$(dirname "$0")/oscalls" 2>&1 | grep -E "instructions|check"
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Sequential against pipelined lexing on one large generated class.
+# parsetime is parper.c built with -DTEST_PARSER -DTEST_PARSETIME, lexer.c
+# with -DTEST, plus ast.c and symbols.c (and -lpthread). The lexer thread
+# needs a second CPU; with one, both lines time the sequential lexer.
+# Usage: bench/pipeline.sh [PARSETIME [FUNCTIONS]], from the repository root
+PARSETIME=${1:-./parsetime}
+N=${2:-4000}
+FILE=${TMPDIR:-/tmp}/Big.jack
+{
+    echo "class Big {"
+    echo "    field int x, y;"
+    i=0
+    while [ $i -lt "$N" ]; do
+        cat <<JACK
+    /* function $i: loops, arrays, calls and strings */
+    method int f$i(Array a, int n) {
+        var int i, s;
+        let i = 0;
+        let s = 0;
+        while (i < n) {
+            if ((a[i] & 1) = 0) { let s = s + (a[i] * $i) - (x / 3); }
+            else { let s = s - a[i + 1] + Math.max(y, i); }
+            let i = i + 1;
+        }
+        do Output.printString("done with f$i"); // trailing comment
+        return s;
+    }
+JACK
+        i=$((i + 1))
+    done
+    echo "}"
+} > "$FILE"
+"$PARSETIME" "$FILE"
+"$PARSETIME" -pipeline "$FILE"
+rm -f "$FILE"
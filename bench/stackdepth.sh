@@ -0,0 +1,20 @@
+#!/bin/sh
+# Stack depth analysis (vmstack.c): locals, deepest operand stack and
+# worst-case stack through the calls of every function of bench/dispatch
+# linked with the OS (vmrun -stackinfo), then bench/oscalls, whose pushes
+# and calls run without a stack check of their own.
+# The second table is bench/dispatch built with its own profile, whose
+# hot loops are rotated to test at the bottom (codegen.c): every function
+# should still be bounded, and the dispatches stay below the
+# instructions as superinstructions still apply.
+# Usage: bench/stackdepth.sh [VMRUN], from the repository root
+VMRUN=${1:-./vmrun}
+BENCH=$(dirname "$0")
+PROF=${TMPDIR:-/tmp}/stackdepth.$$.prof
+FILTER="^(function|Main\.|Counter\.)|functions bounded|: (at most|stack use)|instructions"
+"$VMRUN" -stackinfo "$BENCH/dispatch" 2>&1 | grep -E "$FILTER"
+"$VMRUN" "$BENCH/oscalls" 2>&1 | grep instructions
+echo "with a profile:"
+"$VMRUN" -genprofile "$PROF" "$BENCH/dispatch" > /dev/null 2>&1
+"$VMRUN" -useprofile "$PROF" -stackinfo "$BENCH/dispatch" 2>&1 | grep -E "$FILTER"
+rm -f "$PROF"
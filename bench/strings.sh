@@ -0,0 +1,50 @@
+#!/bin/sh
+# Long string constants and identifiers: compile time for classes holding
+# N literals of LEN characters each (twice the length should take about
+# twice the time), then vmrun checks that none of them lost characters by
+# printing the summed String.length() of all of them, N * LEN.
+# Usage: bench/strings.sh [JACKC [VMRUN [N]]], from the repository root
+JACKC=${1:-./jackc}
+VMRUN=${2:-./vmrun}
+N=${3:-6}
+DIR=${TMPDIR:-/tmp}/strings.$$
+mkdir -p "$DIR"
+
+# Main.jack with n literals of len characters and a 200 character name
+generate() {
+    awk -v n="$1" -v len="$2" 'BEGIN {
+        for (i = 0; i < 200; i++) id = id sprintf("%c", 97 + i % 26)
+        print "class Main {"
+        print "    function int " id "(String s) { return s.length(); }"
+        print "    function void main() {"
+        print "        var int total;"
+        print "        var String s;"
+        print "        let total = 0;"
+        for (k = 0; k < n; k++) {
+            # printable characters except the quote
+            s = ""
+            for (i = 0; i < len; i++) s = s sprintf("%c", 32 + (i + k) % 94 + ((i + k) % 94 >= 2))
+            print "        let s = \"" s "\";"
+            print "        let total = total + Main." id "(s);"
+            print "        do s.dispose();"
+        }
+        print "        do Output.printInt(total);"
+        print "        return;"
+        print "    }"
+        print "}"
+    }' > "$DIR/Main.jack"
+}
+
+for len in 1024 2048 4096 8192 16384; do
+    generate "$N" "$len"
+    t0=$(date +%s%N)
+    "$JACKC" "$DIR" > /dev/null
+    t1=$(date +%s%N)
+    echo "$N x $len characters: compiled in $(( (t1 - t0) / 1000 )) us"
+done
+
+# the VM takes 64K instructions; two per character
+generate "$N" 4096
+"$VMRUN" "$DIR" 2>&1 | head -1
+echo "expected $((N * 4096))"
+rm -rf "${DIR:?}"
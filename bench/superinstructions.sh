@@ -0,0 +1,19 @@
+#!/bin/sh
+# Superinstructions: instructions executed and dispatches of the
+# interpreter for bench/dispatch and bench/arrays with and without them
+# (vmrun -nosuper); the instruction counts and output stay the same.
+# vmngram (vminterp.c sources with -DTEST_VMNGRAM) then lists the most
+# executed sequences of the same corpus; "vmngram -header 16 DIR..." is
+# how vmsuper.h was made.
+# Usage: bench/superinstructions.sh [VMRUN [VMNGRAM]], from the repository root
+VMRUN=${1:-./vmrun}
+VMNGRAM=${2:-./vmngram}
+BENCH=$(dirname "$0")
+for dir in "$BENCH/dispatch" "$BENCH/arrays"; do
+    echo "$dir:"
+    for flag in -nosuper ""; do
+        printf '%-10s' "${flag:-default}"
+        "$VMRUN" $flag "$dir" 2>&1 | grep instructions
+    done
+done
+"$VMNGRAM" -top 12 "$BENCH/dispatch" "$BENCH/arrays" 2>/dev/null
@@ -0,0 +1,114 @@
+// callgraph.c
+/************************************************************************
+ Whole-program call graph over generated VM functions
+*************************************************************************/
+#include "callgraph.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const CallGraph *sortGraph;   // qsort has no context argument
+
+static int cmpByName(const void *a, const void *b) {
+    return strcmp(sortGraph->nodes[*(const int*)a].name,
+                  sortGraph->nodes[*(const int*)b].name);
+}
+
+int callGraphFind(const CallGraph *g, const char *name) {
+    int lo = 0, hi = g->n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int id = g->byName[mid];
+        int c = strcmp(g->nodes[id].name, name);
+        if (c == 0) return id;
+        if (c < 0) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+}
+
+CallGraph* buildCallGraph(VmProgram *p) {
+    CallGraph *g = calloc(1, sizeof(CallGraph));
+    if (!g) abort();
+    for (int i = 0; i < p->nClasses; i++)
+        g->n += p->classes[i]->nFuncs;
+    g->nodes = calloc((size_t)g->n + 1, sizeof(CallNode));
+    g->byName = malloc(sizeof(int) * ((size_t)g->n + 1));
+    if (!g->nodes || !g->byName) abort();
+
+    int id = 0;
+    for (int i = 0; i < p->nClasses; i++) {
+        VmClass *c = p->classes[i];
+        for (int f = 0; f < c->nFuncs; f++, id++) {
+            g->nodes[id].cls = c;
+            g->nodes[id].fn = f;
+            g->nodes[id].name = strdup(vmStr(c, c->funcs[f].name));
+            if (!g->nodes[id].name) abort();
+            g->byName[id] = id;
+        }
+    }
+    sortGraph = g;
+    qsort(g->byName, (size_t)g->n, sizeof(int), cmpByName);
+
+    // edges: one per distinct callee inside the program
+    for (id = 0; id < g->n; id++) {
+        CallNode *node = &g->nodes[id];
+        const VmFunction *fn = &node->cls->funcs[node->fn];
+        for (int k = 0; k < fn->len; k++) {
+            if (fn->code[k].op != VM_CALL) continue;
+            node->nCalls++;
+            int callee = callGraphFind(g, vmStr(node->cls, fn->code[k].sym));
+            if (callee < 0) {
+                node->external = 1;
+                continue;
+            }
+            int seen = 0;
+            for (int e = 0; e < node->nCallees && !seen; e++)
+                seen = node->callees[e] == callee;
+            if (seen) continue;
+            node->callees = realloc(node->callees, sizeof(int) * ((size_t)node->nCallees + 1));
+            if (!node->callees) abort();
+            node->callees[node->nCallees++] = callee;
+        }
+    }
+    return g;
+}
+
+void freeCallGraph(CallGraph *g) {
+    if (!g) return;
+    for (int i = 0; i < g->n; i++) {
+        free(g->nodes[i].callees);
+        free(g->nodes[i].name);
+    }
+    free(g->nodes);
+    free(g->byName);
+    free(g);
+}
+
+void markReachable(CallGraph *g, int root) {
+    if (root < 0) return;
+    // explicit work list: call chains can be long
+    int *work = malloc(sizeof(int) * ((size_t)g->n + 1));
+    if (!work) abort();
+    int top = 0;
+    if (!g->nodes[root].reachable) {
+        g->nodes[root].reachable = 1;
+        work[top++] = root;
+    }
+    while (top > 0) {
+        CallNode *node = &g->nodes[work[--top]];
+        for (int e = 0; e < node->nCallees; e++) {
+            int callee = node->callees[e];
+            if (!g->nodes[callee].reachable) {
+                g->nodes[callee].reachable = 1;
+                work[top++] = callee;
+            }
+        }
+    }
+    free(work);
+}
+
+int programEntry(const CallGraph *g) {
+    int main = callGraphFind(g, "Main.main");
+    if (main < 0) return -1;      // a library, e.g. the OS on its own
+    int init = callGraphFind(g, "Sys.init");
+    return init >= 0 ? init : main;
+}
@@ -0,0 +1,37 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include "vm.h"
+
+// Whole-program call graph over the VM functions of every compiled class.
+// Calls to functions outside the program (the Jack OS) are not edges; they
+// only set the node's `external` flag.
+
+typedef struct {
+    VmClass *cls;        // class holding the function
+    int fn;              // index in cls->funcs
+    char *name;          // "Class.sub", a copy: passes grow the string tables
+    int *callees;        // distinct callee nodes
+    int nCallees;
+    int nCalls;          // call instructions in the body, including external ones
+    int external;        // calls something outside the program
+    int reachable;       // set by markReachable
+} CallNode;
+
+typedef struct {
+    CallNode *nodes;
+    int n;
+    int *byName;         // node ids sorted by name, for callGraphFind
+} CallGraph;
+
+CallGraph* buildCallGraph(VmProgram *p);
+void freeCallGraph(CallGraph *g);
+// node id of function "Class.sub", -1 if it is not part of the program
+int callGraphFind(const CallGraph *g, const char *name);
+// flag every node reachable from root (a node id)
+void markReachable(CallGraph *g, int root);
+// the entry point of a whole program (one with Main.main): Sys.init if the
+// program brings its own, otherwise Main.main; -1 for a library
+int programEntry(const CallGraph *g);
+
+#endif
@@ -0,0 +1,493 @@
+// codegen.c
+/************************************************************************
+ Code generator: class AST -> Jack VM code
+*************************************************************************/
+#include "codegen.h"
+#include "symbols.h"
+#include "opt.h"
+#include "pgo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//---------------------
+// Generator state for the class / subroutine being translated
+//---------------------
+static const ClassAst *ast;
+static VmClass *vc;
+static VmFunction *fn;
+static const char *className;
+static int labelCount;
+static int poolStatic;          // static holding the string pool array, after the class's own
+static ParserInfo err;
+
+static void genStatements(int st);
+static void genExpr(int e);
+
+static void emit(VmOp op) { vmEmit(fn, op, SEG_CONSTANT, 0, -1); }
+static void push(VmSegment seg, int i) { vmEmit(fn, VM_PUSH, seg, i, -1); }
+static void pop(VmSegment seg, int i) { vmEmit(fn, VM_POP, seg, i, -1); }
+static void call(const char *name, int nArgs) { vmEmit(fn, VM_CALL, SEG_CONSTANT, nArgs, vmString(vc, name)); }
+static void jump(VmOp op, int label) { vmEmit(fn, op, SEG_CONSTANT, 0, label); }
+
+// "<cls>.<sub>", valid until the next call; names have no length limit
+static const char* qualified(const char *cls, const char *sub) {
+    static char *buf;
+    static size_t cap;
+    size_t need = strlen(cls) + strlen(sub) + 2;
+    if (need > cap) {
+        cap = need * 2;
+        buf = realloc(buf, cap);
+        if (!buf) abort();
+    }
+    snprintf(buf, cap, "%s.%s", cls, sub);
+    return buf;
+}
+
+// make a fresh label "<prefix><n>" unique within the current function
+static int newLabel(const char *prefix, int n) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%d", prefix, n);
+    return vmString(vc, buf);
+}
+
+static void semanticError(const char *name, int ln) {
+    if (err.er != none) return;
+    err.er = undecIdentifier;
+    err.tk.tp = ID;
+    err.tk.ec = 0;
+    err.tk.ln = ln;
+    snprintf(err.tk.lx, sizeof(err.tk.lx), "%s", name);
+    snprintf(err.tk.fl, sizeof(err.tk.fl), "%s.jack", className);
+}
+
+static VmSegment segmentOf(Kind k) {
+    switch (k) {
+        case STATIC_SYMBOL: return SEG_STATIC;
+        case FIELD_SYMBOL:  return SEG_THIS;
+        case ARG_SYMBOL:    return SEG_ARGUMENT;
+        default:            return SEG_LOCAL;
+    }
+}
+
+static void pushVar(const char *name, int ln) {
+    Kind k = kindOf(name);
+    if (k == NONE_SYMBOL) { semanticError(name, ln); return; }
+    push(segmentOf(k), indexOf(name));
+}
+
+static void popVar(const char *name, int ln) {
+    Kind k = kindOf(name);
+    if (k == NONE_SYMBOL) { semanticError(name, ln); return; }
+    pop(segmentOf(k), indexOf(name));
+}
+
+// push a 16-bit constant; the VM only has non-negative literals
+static void pushConst(int v) {
+    v = wrap16(v);
+    if (v >= 0) {
+        push(SEG_CONSTANT, v);
+    } else if (v == -32768) {
+        push(SEG_CONSTANT, 32767);
+        emit(VM_NEG);
+        push(SEG_CONSTANT, 1);
+        emit(VM_SUB);
+    } else {
+        push(SEG_CONSTANT, -v);
+        emit(VM_NEG);
+    }
+}
+
+static void genString(const char *s) {
+    int slot = poolString(s);
+    if (slot >= 0) {
+        // pooled: fetch the array on first use, then read the slot
+        int have = newLabel("STR_POOL", labelCount++);
+        push(SEG_STATIC, poolStatic);
+        jump(VM_IF_GOTO, have);
+        call(STRING_POOL_GET, 0);
+        pop(SEG_STATIC, poolStatic);
+        jump(VM_LABEL, have);
+        push(SEG_STATIC, poolStatic);
+        pop(SEG_POINTER, 1);
+        push(SEG_THAT, slot);
+        optStats.stringUsesPooled++;
+        return;
+    }
+    int n = (int)strlen(s);
+    push(SEG_CONSTANT, n);
+    call("String.new", 1);
+    int append = vmString(vc, "String.appendChar");
+    for (int i = 0; i < n; i++) {
+        push(SEG_CONSTANT, (unsigned char)s[i]);
+        vmEmit(fn, VM_CALL, SEG_CONSTANT, 2, append);
+    }
+}
+
+// f(args) / Class.f(args) / var.f(args)
+static void genCall(int e) {
+    const Expr *x = &ast->exprs[e];
+    int target;              // interned now: arguments may make calls of their own
+    int nArgs = x->value;
+    const char *sub = astStr(ast, x->sub);
+
+    if (x->name == AST_NONE) {
+        // own subroutine: methods get the current object as argument 0
+        int sd = findSubDec(ast, sub);
+        if (sd == AST_NONE || ast->subDecs[sd].kind == SUB_METHOD) {
+            push(SEG_POINTER, 0);
+            nArgs++;
+        }
+        target = vmString(vc, qualified(className, sub));
+    } else {
+        const char *recv = astStr(ast, x->name);
+        if (kindOf(recv) != NONE_SYMBOL) {
+            pushVar(recv, x->ln);
+            nArgs++;
+            target = vmString(vc, qualified(typeOf(recv), sub));
+        } else {
+            target = vmString(vc, qualified(recv, sub));
+        }
+    }
+
+    for (int arg = x->a; arg != AST_NONE; arg = ast->exprs[arg].next)
+        genExpr(arg);
+    vmEmit(fn, VM_CALL, SEG_CONSTANT, nArgs, target);
+}
+
+//---------------------
+// Strength reduction: x * k for constant k as a doubling/add chain.
+// The VM has no shifts, so x is doubled with add; temp 1 holds the
+// running product while it is doubled and temp 2 holds x unless x is a
+// plain variable that can simply be pushed again.
+//---------------------
+static int isSimple(int e) {
+    return ast->exprs[e].kind == EX_VAR;
+}
+
+static int topBit(int m) {
+    int top = 14;
+    while (!(m >> top & 1)) top--;
+    return top;
+}
+
+// number of VM instructions genMulConst emits for multiplier m > 1
+static int mulChainLength(int m, int simple) {
+    int top = topBit(m);
+    int n = simple ? 1 : 3;             // push x  |  <x> pop temp 2 push temp 2
+    for (int bit = top - 1; bit >= 0; bit--) {
+        n += bit == top - 1 ? 2 : 4;    // double
+        if (m >> bit & 1) n += 2;       // + x
+    }
+    return n;
+}
+
+static int genMulConst(int e, int k) {
+    int m = k < 0 ? -k : k;
+    if (m < 2 || m > 32767) return 0;
+    int simple = isSimple(e);
+    if (mulChainLength(m, simple) + (k < 0) > optOptions.mulChainLimit) return 0;
+
+    const char *name = astStr(ast, ast->exprs[e].name);
+    int ln = ast->exprs[e].ln;
+    if (simple) {
+        pushVar(name, ln);
+    } else {
+        genExpr(e);
+        pop(SEG_TEMP, 2);
+        push(SEG_TEMP, 2);
+    }
+
+    int top = topBit(m);
+    for (int bit = top - 1; bit >= 0; bit--) {
+        if (bit == top - 1) {           // acc == x: x + x
+            if (simple) pushVar(name, ln); else push(SEG_TEMP, 2);
+        } else {
+            pop(SEG_TEMP, 1);
+            push(SEG_TEMP, 1);
+            push(SEG_TEMP, 1);
+        }
+        emit(VM_ADD);
+        if (m >> bit & 1) {
+            if (simple) pushVar(name, ln); else push(SEG_TEMP, 2);
+            emit(VM_ADD);
+        }
+    }
+    if (k < 0) emit(VM_NEG);
+    optStats.multiplyCallsRemoved++;
+    return 1;
+}
+
+static void genExpr(int e) {
+    const Expr *x = &ast->exprs[e];
+    switch (x->kind) {
+        case EX_INT:    pushConst(x->value); break;
+        case EX_STRING: genString(astStr(ast, x->name)); break;
+        case EX_TRUE:   push(SEG_CONSTANT, 0); emit(VM_NOT); break;
+        case EX_FALSE:
+        case EX_NULL:   push(SEG_CONSTANT, 0); break;
+        case EX_THIS:   push(SEG_POINTER, 0); break;
+        case EX_VAR:    pushVar(astStr(ast, x->name), x->ln); break;
+        case EX_INDEX:
+            pushVar(astStr(ast, x->name), x->ln);
+            genExpr(x->a);
+            emit(VM_ADD);
+            pop(SEG_POINTER, 1);
+            push(SEG_THAT, 0);
+            break;
+        case EX_CALL:
+            genCall(e);
+            break;
+        case EX_UNARY:
+            genExpr(x->a);
+            emit(x->op == '-' ? VM_NEG : VM_NOT);
+            break;
+        case EX_BINARY: {
+            int k;
+            if (x->op == '*' && optOptions.strength) {
+                if (constValue(ast, x->b, &k) && genMulConst(x->a, k)) break;
+                if (constValue(ast, x->a, &k) && genMulConst(x->b, k)) break;
+            }
+            genExpr(x->a);
+            genExpr(x->b);
+            switch (x->op) {
+                case '+': emit(VM_ADD); break;
+                case '-': emit(VM_SUB); break;
+                case '*': call("Math.multiply", 2); break;
+                case '/': call("Math.divide", 2); break;
+                case '&': emit(VM_AND); break;
+                case '|': emit(VM_OR); break;
+                case '<': emit(VM_LT); break;
+                case '>': emit(VM_GT); break;
+                case '=': emit(VM_EQ); break;
+            }
+            break;
+        }
+    }
+}
+
+// jump to label when condition e is false
+static void genBranchIfFalse(int e, int label) {
+    const Expr *x = &ast->exprs[e];
+    if (x->kind == EX_UNARY && x->op == '~') {
+        genExpr(x->a);
+    } else {
+        genExpr(e);
+        emit(VM_NOT);
+    }
+    jump(VM_IF_GOTO, label);
+}
+
+//---------------------
+// Profile-guided layout. The counts of the profiled run say which way
+// each if/while went; the label a branch jumps to says what taken meant:
+//   IF_FALSEn / IF_TRUEn       condition false / true
+//   WHILE_ENDn / WHILE_BODYn   loop left / another iteration
+// The cold side of an if moves behind the function's last statement so
+// the hot path falls straight through, and loops that usually iterate
+// are rotated to test at the bottom.
+//---------------------
+#define MAX_COLD 256
+
+typedef struct {
+    int body;      // statements
+    int label;     // entry label
+    int back;      // label to jump back to
+} ColdBlock;
+
+static ColdBlock cold[MAX_COLD];
+static int nCold;
+
+// executed / taken counts of the if-goto to "<prefix><n>" in this function
+static int branchCounts(const char *prefix, int n, long long *executed, long long *taken) {
+    char label[64];
+    if (!optOptions.profile) return 0;
+    snprintf(label, sizeof(label), "%s%d", prefix, n);
+    return profileBranch(optOptions.profile, vmStr(vc, fn->name), label, executed, taken);
+}
+
+// how often if n found its condition true / false; 0 if it never ran
+static int ifCounts(int n, long long *t, long long *f) {
+    long long e, k;
+    if (branchCounts("IF_FALSE", n, &e, &k)) { *t = e - k; *f = k; }
+    else if (branchCounts("IF_TRUE", n, &e, &k)) { *t = k; *f = e - k; }
+    else return 0;
+    return e > 0;
+}
+
+// iterations of while n against times it was left by its test
+static int whileCounts(int n, long long *iter, long long *exits) {
+    long long e, k;
+    if (branchCounts("WHILE_END", n, &e, &k)) { *iter = e - k; *exits = k; }
+    else if (branchCounts("WHILE_BODY", n, &e, &k)) { *iter = k; *exits = e - k; }
+    else return 0;
+    return e > 0;
+}
+
+static void deferCold(int body, int label, int back) {
+    cold[nCold].body = body;
+    cold[nCold].label = label;
+    cold[nCold].back = back;
+    nCold++;
+    optStats.branchesLaidOut++;
+}
+
+// if with a cold side: "cond; if-goto IF_TRUEn; else" when then is cold,
+// "cond; not; if-goto IF_FALSEn; then" when else is cold
+static int genIfProfiled(const Stmt *s, int n) {
+    long long t, f;
+    if (nCold == MAX_COLD || !ifCounts(n, &t, &f)) return 0;
+    if (f > t) {
+        int lTrue = newLabel("IF_TRUE", n), lEnd = newLabel("IF_END", n);
+        genExpr(s->expr);
+        jump(VM_IF_GOTO, lTrue);
+        genStatements(s->orelse);
+        jump(VM_LABEL, lEnd);
+        deferCold(s->body, lTrue, lEnd);
+        return 1;
+    }
+    if (t > f && s->orelse != AST_NONE) {
+        int lFalse = newLabel("IF_FALSE", n), lEnd = newLabel("IF_END", n);
+        genBranchIfFalse(s->expr, lFalse);
+        genStatements(s->body);
+        jump(VM_LABEL, lEnd);
+        deferCold(s->orelse, lFalse, lEnd);
+        return 1;
+    }
+    return 0;
+}
+
+static void genLet(const Stmt *s) {
+    const char *name = astStr(ast, s->name);
+    if (s->index == AST_NONE) {
+        genExpr(s->expr);
+        popVar(name, s->ln);
+        return;
+    }
+    pushVar(name, s->ln);
+    genExpr(s->index);
+    emit(VM_ADD);
+    genExpr(s->expr);
+    pop(SEG_TEMP, 0);
+    pop(SEG_POINTER, 1);
+    push(SEG_TEMP, 0);
+    pop(SEG_THAT, 0);
+}
+
+static void genIf(const Stmt *s) {
+    int v;
+    if (constValue(ast, s->expr, &v)) {        // folded condition: keep one branch
+        genStatements(v ? s->body : s->orelse);
+        return;
+    }
+    int n = labelCount++;
+    if (genIfProfiled(s, n)) return;
+    int lFalse = newLabel("IF_FALSE", n);
+    genBranchIfFalse(s->expr, lFalse);
+    genStatements(s->body);
+    if (s->orelse == AST_NONE) {
+        jump(VM_LABEL, lFalse);
+        return;
+    }
+    int lEnd = newLabel("IF_END", n);
+    jump(VM_GOTO, lEnd);
+    jump(VM_LABEL, lFalse);
+    genStatements(s->orelse);
+    jump(VM_LABEL, lEnd);
+}
+
+static void genWhile(const Stmt *s) {
+    int v;
+    if (constValue(ast, s->expr, &v) && !v) return;
+    int n = labelCount++;
+    int lTop = newLabel("WHILE_EXP", n);
+    long long iter, exits;
+    if (!constValue(ast, s->expr, &v) && whileCounts(n, &iter, &exits) && iter > exits) {
+        // rotated: one jump per iteration instead of a test and a goto
+        int lBody = newLabel("WHILE_BODY", n);
+        jump(VM_GOTO, lTop);
+        jump(VM_LABEL, lBody);
+        genStatements(s->body);
+        jump(VM_LABEL, lTop);
+        genExpr(s->expr);
+        jump(VM_IF_GOTO, lBody);
+        optStats.branchesLaidOut++;
+        return;
+    }
+    int lEnd = newLabel("WHILE_END", n);
+    jump(VM_LABEL, lTop);
+    if (!constValue(ast, s->expr, &v))
+        genBranchIfFalse(s->expr, lEnd);
+    genStatements(s->body);
+    jump(VM_GOTO, lTop);
+    jump(VM_LABEL, lEnd);
+}
+
+static void genStatements(int st) {
+    for (; st != AST_NONE && err.er == none; st = ast->stmts[st].next) {
+        const Stmt *s = &ast->stmts[st];
+        switch (s->kind) {
+            case ST_LET:   genLet(s); break;
+            case ST_IF:    genIf(s); break;
+            case ST_WHILE: genWhile(s); break;
+            case ST_DO:
+                genCall(s->expr);
+                pop(SEG_TEMP, 0);
+                break;
+            case ST_RETURN:
+                if (s->expr != AST_NONE) genExpr(s->expr);
+                else push(SEG_CONSTANT, 0);
+                emit(VM_RETURN);
+                break;
+        }
+    }
+}
+
+static void genSubroutine(const SubDec *sd) {
+    startSubroutine();
+    if (sd->kind == SUB_METHOD)
+        defineSymbol("this", className, ARG_SYMBOL);
+    for (int d = sd->params; d != AST_NONE; d = ast->decs[d].next)
+        defineSymbol(astStr(ast, ast->decs[d].name), astStr(ast, ast->decs[d].type), ARG_SYMBOL);
+    for (int d = sd->locals; d != AST_NONE; d = ast->decs[d].next)
+        defineSymbol(astStr(ast, ast->decs[d].name), astStr(ast, ast->decs[d].type), VAR_SYMBOL);
+
+    int idx = vmAddFunction(vc, qualified(className, astStr(ast, sd->name)), sd->nLocals);
+    fn = &vc->funcs[idx];
+    labelCount = 0;
+    nCold = 0;
+
+    if (sd->kind == SUB_CONSTRUCTOR) {
+        push(SEG_CONSTANT, varCount(FIELD_SYMBOL));
+        call("Memory.alloc", 1);
+        pop(SEG_POINTER, 0);
+    } else if (sd->kind == SUB_METHOD) {
+        push(SEG_ARGUMENT, 0);
+        pop(SEG_POINTER, 0);
+    }
+    genStatements(sd->body);
+    // cold blocks may defer further cold blocks of their own
+    for (int i = 0; i < nCold && err.er == none; i++) {
+        ColdBlock b = cold[i];
+        jump(VM_LABEL, b.label);
+        genStatements(b.body);
+        jump(VM_GOTO, b.back);
+    }
+}
+
+ParserInfo generateClass(const ClassAst *c, VmClass *out) {
+    ast = c;
+    vc = out;
+    className = astStr(c, c->name);
+    err.er = none;
+    err.tk.tp = EOFile;
+
+    initSymbolTable();
+    for (int d = c->vars; d != AST_NONE; d = c->decs[d].next)
+        defineSymbol(astStr(c, c->decs[d].name), astStr(c, c->decs[d].type), (Kind)c->decs[d].kind);
+    poolStatic = varCount(STATIC_SYMBOL);
+
+    for (int s = c->subs; s != AST_NONE && err.er == none; s = c->subDecs[s].next)
+        genSubroutine(&c->subDecs[s]);
+    return err;
+}
@@ -0,0 +1,12 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include "ast.h"
+#include "vm.h"
+
+// Translate the tree of one class into VM functions appended to out.
+// Uses the symbol table module; returns er == none on success, otherwise a
+// semantic error whose token carries the offending name and line.
+ParserInfo generateClass(const ClassAst *ast, VmClass *out);
+
+#endif
@@ -7,14 +7,117 @@
 *************************************************************************/
 #include "compiler.h"
 #include "symbols.h"
+#include "ast.h"
+#include "codegen.h"
+#include "opt.h"
+#include "pgo.h"
+#include "ir.h"
+#include "lexpipe.h"
 #include <dirent.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static int compilerInited = 0;
 
+OptOptions optOptions;
+OptStats optStats;
+
+// 最近一次 compile() 的结果，供后续阶段（优化、输出）使用
+static ClassAst **classes = NULL;
+static int nClasses = 0;
+static VmProgram *program = NULL;
+
+void resetOptStats(void) {
+    memset(&optStats, 0, sizeof(optStats));
+}
+
+void printOptReport(FILE *f) {
+    fprintf(f, "constant folding: %d expressions folded, %d identities applied\n",
+            optStats.constantsFolded, optStats.identitiesApplied);
+    fprintf(f, "strength reduction: %d Math.multiply and %d Math.divide calls eliminated\n",
+            optStats.multiplyCallsRemoved, optStats.divideCallsRemoved);
+    fprintf(f, "inlining: %d call sites inlined\n", optStats.callsInlined);
+    fprintf(f, "dead code: %d subroutines (%d VM instructions) dropped\n",
+            optStats.functionsDropped, optStats.instructionsDropped);
+    if (optOptions.ir) {
+        fprintf(f, "common subexpressions: %d instructions eliminated\n", optStats.subexpressionsEliminated);
+        fprintf(f, "loop-invariant code motion: %d instructions hoisted\n", optStats.invariantsHoisted);
+        fprintf(f, "promotion: %d loop variables kept in temp slots\n", optStats.localsPromoted);
+        fprintf(f, "array accesses: %d constant indexes folded, %d pointer reloads dropped\n",
+                optStats.arrayIndexesFolded, optStats.pointerReloadsDropped);
+    }
+    if (optOptions.stringPool)
+        fprintf(f, "string pool: %d distinct literals built once for %d uses\n",
+                optStats.stringsPooled, optStats.stringUsesPooled);
+    if (optOptions.sizeClassHeap)
+        fprintf(f, "size-class heap: %s\n",
+                optStats.sizeClassHeap ? "Memory generated" : "not added (no Main.main, or the program has a Memory)");
+    if (optOptions.profile)
+        fprintf(f, "profile: %d if/while statements laid out for the hot path\n",
+                optStats.branchesLaidOut);
+}
+
+static void freeResults(void) {
+    for (int i = 0; i < nClasses; i++)
+        freeClassAst(classes[i]);
+    free(classes);
+    classes = NULL;
+    nClasses = 0;
+    vmFreeProgram(program);
+    program = NULL;
+}
+
+static ParserInfo compileError(const char* msg) {
+    ParserInfo pi;
+    pi.er = syntaxError;
+    pi.tk.tp = ERR;
+    pi.tk.ln = 0;
+    pi.tk.fl[0] = '\0';
+    snprintf(pi.tk.lx, sizeof(pi.tk.lx), "%s", msg);
+    return pi;
+}
+
+static int cmpNames(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// 缓存的 .ast 比 .jack 新时直接映射使用，否则返回 NULL（需要重新分析）
+static ClassAst* loadCachedClass(const char* jackPath, const char* astPath) {
+    struct stat js, as;
+    char err[256];
+    if (stat(jackPath, &js) != 0 || stat(astPath, &as) != 0) return NULL;
+    if (as.st_mtim.tv_sec < js.st_mtim.tv_sec ||
+        (as.st_mtim.tv_sec == js.st_mtim.tv_sec && as.st_mtim.tv_nsec <= js.st_mtim.tv_nsec))
+        return NULL;
+    ClassAst* c = mapClassAstFile(astPath, err, sizeof(err));
+    if (optOptions.log)
+        fprintf(optOptions.log, "ast cache: %s\n", c ? astPath : err);
+    return c;
+}
+
 int InitCompiler(void) {
     initSymbolTable();   // 清空/初始化符号表
+    optOptions.fold = 1;
+    optOptions.strength = 1;
+    optOptions.mulChainLimit = 40;
+    optOptions.dce = 1;
+    optOptions.inlineThreshold = 12;
+    optOptions.ir = 1;
+    optOptions.cse = 1;
+    optOptions.licm = 1;
+    optOptions.promote = 1;
+    optOptions.arrays = 1;
+    optOptions.profile = NULL;
+    optOptions.astCache = 0;
+    optOptions.pipelineLexer = 0;
+    optOptions.parseStackLimit = 1 << 16;
+    optOptions.stringPool = 0;
+    optOptions.sizeClassHeap = 0;
+    optOptions.vmBinary = 0;
+    optOptions.log = NULL;
+    resetOptStats();
     compilerInited = 1;
     return 1;
 }
@@ -22,71 +125,190 @@ int InitCompiler(void) {
 ParserInfo compile(const char* dir_name) {
     ParserInfo pi;
     pi.er = none;
+    pi.tk.tp = EOFile;
 
     if (!compilerInited) {
-        pi.er = syntaxError;
-        strcpy(pi.tk.lx, "Compiler not initialized");
-        return pi;
+        return compileError("Compiler not initialized");
     }
 
     DIR* d = opendir(dir_name);
     if (!d) {
-        pi.er = syntaxError;
-        strcpy(pi.tk.lx, "Cannot open directory");
-        return pi;
+        return compileError("Cannot open directory");
     }
 
+    // 先收集文件名并排序，保证输出顺序与 readdir 顺序无关
+    char** names = NULL;
+    int nNames = 0, capNames = 0;
     struct dirent* e;
     while ((e = readdir(d)) != NULL) {
         size_t L = strlen(e->d_name);
         if (L > 5 && strcmp(e->d_name + L - 5, ".jack") == 0) {
-            char path[512];
-            snprintf(path, sizeof(path), "%s/%s", dir_name, e->d_name);
+            if (nNames == capNames) {
+                capNames = capNames ? capNames * 2 : 16;
+                names = realloc(names, sizeof(char*) * (size_t)capNames);
+            }
+            names[nNames++] = strdup(e->d_name);
+        }
+    }
+    closedir(d);
+    if (nNames) qsort(names, (size_t)nNames, sizeof(char*), cmpNames);
 
-            // 每个 .jack 文件开始前，重置子例程作用域
-            startSubroutine();
+    freeResults();
+    resetOptStats();
+    classes = calloc((size_t)nNames + 1, sizeof(ClassAst*));
 
-            if (!InitParser(path)) {
-                pi.er = syntaxError;
-                strcpy(pi.tk.lx, "Parser init failed");
-                closedir(d);
-                return pi;
+    // 1) 语法分析：每个 .jack 文件得到一棵类语法树
+    //    打开 astCache 时先找 Xxx.ast 缓存，否则由语法分析器在分析完时写出（在折叠等修改之前）
+    for (int i = 0; i < nNames && pi.er == none; i++) {
+        char path[512], astPath[512];
+        snprintf(path, sizeof(path), "%s/%s", dir_name, names[i]);
+        snprintf(astPath, sizeof(astPath), "%s/%.*s.ast", dir_name,
+                 (int)strlen(names[i]) - 5, names[i]);
+        if (optOptions.astCache) {
+            ClassAst* cached = loadCachedClass(path, astPath);
+            if (cached) {
+                classes[nClasses++] = cached;
+                continue;
             }
+        }
 
-            pi = Parse();
-            StopParser();
-            if (pi.er != none) {
-                closedir(d);
-                return pi;
-            }
+        SetLexerPipelined(optOptions.pipelineLexer);
+        SetParserStackLimit(optOptions.parseStackLimit);
+        SetParserAstOutput(optOptions.astCache ? astPath : NULL);
+        if (!InitParser(path)) {
+            pi = compileError("Parser init failed");
+            break;
+        }
+        pi = Parse();
+        if (pi.er == none) {
+            classes[nClasses++] = TakeParsedClass();
+            if (optOptions.astCache && !ParsedClassSaved() && optOptions.log)
+                fprintf(optOptions.log, "ast cache: cannot write %s\n", astPath);
+        }
+        StopParser();
+    }
+    SetParserAstOutput(NULL);
+    for (int i = 0; i < nNames; i++)
+        free(names[i]);
+    free(names);
+    if (pi.er != none) return pi;
+
+    // 2) 语法树上的优化
+    if (optOptions.fold)
+        for (int i = 0; i < nClasses; i++)
+            foldClass(classes[i]);
 
-            // TODO: 这里可以调用你的代码生成模块，写出 .vm 文件
+    // 3) 代码生成；字符串池只给有入口 Main.main 的程序，库（如 OS）照常逐次构造
+    int hasMain = 0;
+    for (int i = 0; i < nClasses; i++)
+        if (!strcmp(astStr(classes[i], classes[i]->name), "Main") &&
+            findSubDec(classes[i], "main") != AST_NONE)
+            hasMain = 1;
+    beginStringPool(optOptions.stringPool && hasMain);
+    program = vmNewProgram();
+    for (int i = 0; i < nClasses; i++) {
+        VmClass* vc = vmNewClass(astStr(classes[i], classes[i]->name));
+        vmAddClass(program, vc);
+        pi = generateClass(classes[i], vc);
+        if (pi.er != none) {
+            beginStringPool(0);
+            return pi;
         }
     }
-    closedir(d);
+    endStringPool(program);
+
+    // 4) 整个程序上的优化（需要所有类的代码）
+    //    先内联，被内联掉的小函数随后可由死代码删除去掉
+    if (optOptions.inlineThreshold > 0)
+        inlineSmallFunctions(program);
+    if (optOptions.dce)
+        eliminateDeadFunctions(program);
+    // 分级空闲链表的 Memory 在死代码删除之后加入：它的函数只被 OS 调用
+    if (hasMain)
+        addSizeClassHeap(program);
+    if (optOptions.ir)
+        irOptimizeProgram(program);
+    // 有运行剖面时把热函数排在各类的前面
+    if (optOptions.profile)
+        orderFunctionsByProfile(program, optOptions.profile);
+
+    // 5) 写出 .vm 文件（或 .vmb 字节码）
+    for (int i = 0; i < program->nClasses; i++) {
+        const VmClass* vc = program->classes[i];
+        char path[512];
+        if (optOptions.vmBinary) {
+            snprintf(path, sizeof(path), "%s/%s.vmb", dir_name, vmStr(vc, vc->name));
+            if (!vmWriteClassBinary(vc, path)) return compileError("Cannot write .vmb file");
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s.vm", dir_name, vmStr(vc, vc->name));
+        FILE* f = fopen(path, "w");
+        if (!f) return compileError("Cannot write .vm file");
+        vmWriteClass(f, vc);
+        fclose(f);
+    }
     return pi;
 }
 
+VmProgram* TakeCompiledProgram(void) {
+    VmProgram* p = program;
+    program = NULL;
+    return p;
+}
+
 int StopCompiler(void) {
+    freeResults();
     compilerInited = 0;
     return 1;
 }
 
 #ifdef TEST_COMPILER
-int main(void) {
-    char dir[256];
-    printf("Enter directory with .jack files:\n");
-    scanf("%255s", dir);
+// usage: compiler [-O0] [-inline=N] [-profile=FILE] [-astcache] [-pipeline] [-stack=N] [-strpool] [-sizeheap] [-binary] [-report] [-v] [dir]
+int main(int argc, char** argv) {
+    char dir[256] = "", err[256];
+    int report = 0;
+    Profile* prof = NULL;
 
     InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-O0")) {
+            optOptions.fold = optOptions.strength = optOptions.dce = 0;
+            optOptions.inlineThreshold = optOptions.ir = 0;
+        }
+        else if (!strncmp(argv[i], "-inline=", 8)) optOptions.inlineThreshold = atoi(argv[i] + 8);
+        else if (!strncmp(argv[i], "-profile=", 9)) {
+            freeProfile(prof);
+            if (!(prof = loadProfile(argv[i] + 9, err, sizeof(err)))) {
+                printf("%s\n", err);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-astcache")) optOptions.astCache = 1;
+        else if (!strcmp(argv[i], "-pipeline")) optOptions.pipelineLexer = 1;
+        else if (!strncmp(argv[i], "-stack=", 7)) optOptions.parseStackLimit = atoi(argv[i] + 7);
+        else if (!strcmp(argv[i], "-strpool")) optOptions.stringPool = 1;
+        else if (!strcmp(argv[i], "-sizeheap")) optOptions.sizeClassHeap = 1;
+        else if (!strcmp(argv[i], "-binary")) optOptions.vmBinary = 1;
+        else if (!strcmp(argv[i], "-report")) report = 1;
+        else if (!strcmp(argv[i], "-v")) optOptions.log = stdout;
+        else snprintf(dir, sizeof(dir), "%s", argv[i]);
+    }
+    if (!dir[0]) {
+        printf("Enter directory with .jack files:\n");
+        scanf("%255s", dir);
+    }
+    optOptions.profile = prof;
+
     ParserInfo res = compile(dir);
     if (res.er == none) {
         printf("Compilation successful!\n");
+        if (report) printOptReport(stdout);
     } else {
         printf("Error type: %d lexeme=\"%s\" line=%d\n",
                res.er, res.tk.lx, res.tk.ln);
     }
     StopCompiler();
+    freeProfile(prof);
     return 0;
 }
 #endif
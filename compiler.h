@@ -3,6 +3,7 @@
 #define COMPILER_H
 
 #include "parser.h"
+#include "vm.h"
 
 // 初始化编译器（符号表、代码生成等全局状态）
 int InitCompiler(void);
@@ -11,6 +12,9 @@ int InitCompiler(void);
 // 返回第一个出现的语法/语义错误信息，或 er==none 表示成功
 ParserInfo compile(const char* dir_name);
 
+// 取走最近一次 compile() 生成的 VM 代码（调用者负责 vmFreeProgram），没有则返回 NULL
+VmProgram* TakeCompiledProgram(void);
+
 // 编译结束，释放全局资源
 int StopCompiler(void);
 
@@ -0,0 +1,243 @@
+// cse.c
+/************************************************************************
+ Common subexpression elimination: local value numbering on the IR
+
+ Within each block every register gets a value number; an expression
+ whose operator and operand numbers were seen before computes the same
+ value. A load is the same value as an earlier load or store of its
+ variable until something in between may write it (the alias rules of
+ licm.c). A repeat is only replaced when recomputing costs more VM
+ instructions than keeping the first result: the kept register leaves
+ the operand stack for a temp slot, one pop plus a push per use.
+*************************************************************************/
+#include "ir.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int op, seg, imm, va, vb;
+    int reg;                 // register holding the value, -1 empty, -2 killed
+} CseEntry;
+
+typedef struct {
+    IrFunction *ir;
+    CseEntry *tab;
+    int cap;
+    int *vn;                 // value number of each register: the first register computing it
+    int *uses, *defAt, *defBlock;
+    int *loads, nLoads;      // slots holding a load: a kill looks at these only
+} Cse;
+
+static unsigned hashEntry(const CseEntry *e) {
+    unsigned h = 2166136261u;
+    int key[5] = { e->op, e->seg, e->imm, e->va, e->vb };
+    for (int i = 0; i < 5; i++) h = (h ^ (unsigned)key[i]) * 16777619u;
+    return h;
+}
+
+static int sameKey(const CseEntry *x, const CseEntry *y) {
+    return x->op == y->op && x->seg == y->seg && x->imm == y->imm && x->va == y->va && x->vb == y->vb;
+}
+
+// slot of key e, or of the empty slot where it would go
+static CseEntry* lookup(Cse *S, const CseEntry *e) {
+    unsigned k = hashEntry(e) & (unsigned)(S->cap - 1);
+    CseEntry *killed = NULL;
+    while (S->tab[k].reg != -1) {
+        if (S->tab[k].reg == -2) {
+            if (!killed) killed = &S->tab[k];
+        } else if (sameKey(&S->tab[k], e)) {
+            return &S->tab[k];
+        }
+        k = (k + 1) & (unsigned)(S->cap - 1);
+    }
+    return killed ? killed : &S->tab[k];
+}
+
+static void record(Cse *S, const CseEntry *e, int reg) {
+    CseEntry *slot = lookup(S, e);
+    if (e->op == IR_LOAD && slot->reg < 0) S->loads[S->nLoads++] = (int)(slot - S->tab);
+    *slot = *e;
+    slot->reg = reg;
+}
+
+// forget loads that a store to seg[imm] (imm < 0: a call) may change
+static void kill(Cse *S, int seg, int imm) {
+    int kept = 0;
+    for (int i = 0; i < S->nLoads; i++) {
+        CseEntry *e = &S->tab[S->loads[i]];
+        int dead;
+        if (imm < 0)
+            dead = e->seg == SEG_STATIC || e->seg == SEG_THIS || e->seg == SEG_THAT;
+        else if (seg == SEG_THAT)
+            dead = e->seg == SEG_THAT || e->seg == SEG_THIS || e->seg == SEG_STATIC;
+        else if (seg == SEG_THIS)
+            dead = e->seg == SEG_THAT || (e->seg == SEG_THIS && e->imm == imm);
+        else if (seg == SEG_STATIC)
+            dead = e->seg == SEG_THAT || (e->seg == SEG_STATIC && e->imm == imm);
+        else if (seg == SEG_POINTER)
+            dead = e->seg == SEG_THIS || e->seg == SEG_POINTER;
+        else
+            dead = e->seg == seg && e->imm == imm;
+        if (dead) e->reg = -2;
+        else S->loads[kept++] = S->loads[i];
+    }
+    S->nLoads = kept;
+}
+
+// VM instructions spent computing r that go away once nothing uses it
+static int cost(const Cse *S, int r, int b, int depth) {
+    const IrInstr *in = &S->ir->code[S->defAt[r]];
+    int c, ops[2];
+    switch (in->op) {
+        case IR_PARAM: return 0;
+        case IR_CALL: return irIsPureInstr(S->ir, in) ? 8 : 0;
+        case IR_LOAD: c = in->seg == SEG_THAT ? 2 : 1; break;
+        default: c = 1; break;
+    }
+    if (depth > 16) return c;
+    int n = irOperands(S->ir, in, ops);
+    for (int i = 0; i < n; i++)
+        if (S->uses[ops[i]] == 1 && S->defBlock[ops[i]] == b) c += cost(S, ops[i], b, depth + 1);
+    return c;
+}
+
+static int commutes(int op) {
+    return op == IR_ADD || op == IR_AND || op == IR_OR || op == IR_EQ || op == IR_CALL;
+}
+
+// r is used once, as the address of the next array access after k: an
+// address equal to the previous one reuses pointer 1 and costs nothing
+static int nextThatUses(const Cse *S, int b, int k, int r) {
+    const IrBlock *blk = &S->ir->blocks[b];
+    if (S->uses[r] != 1) return 0;
+    for (k++; k < blk->first + blk->n; k++) {
+        const IrInstr *in = &S->ir->code[k];
+        if ((in->op == IR_LOAD || in->op == IR_STORE) && in->seg == SEG_THAT) return in->a == r;
+    }
+    return 0;
+}
+
+static void numberBlock(Cse *S, int b, int *repl) {
+    IrFunction *ir = S->ir;
+    const IrBlock *blk = &ir->blocks[b];
+    int lastThat = -1;       // address of the last array access: pointer 1 when lowered
+    for (int i = 0; i < S->cap; i++) S->tab[i].reg = -1;
+    S->nLoads = 0;
+    for (int k = blk->first; k < blk->first + blk->n; k++) {
+        const IrInstr *in = &ir->code[k];
+        if ((in->op == IR_LOAD || in->op == IR_STORE) && in->seg == SEG_THAT) lastThat = repl[in->a];
+        CseEntry e;
+        memset(&e, 0, sizeof(e));
+        e.op = in->op;
+        e.va = e.vb = -1;
+        switch (in->op) {
+            case IR_CONST:
+                e.imm = in->imm;
+                break;
+            case IR_LOAD:
+                e.seg = in->seg;
+                e.imm = in->imm;
+                if (in->seg == SEG_THAT) e.va = S->vn[in->a];
+                break;
+            case IR_STORE:
+                kill(S, in->seg, in->imm);
+                // a later load of the variable reads back the stored value
+                e.op = IR_LOAD;
+                e.seg = in->seg;
+                e.imm = in->imm;
+                if (in->seg == SEG_THAT) e.va = S->vn[in->a];
+                record(S, &e, S->vn[in->b]);
+                continue;
+            case IR_NEG: case IR_NOT:
+                e.va = S->vn[in->a];
+                break;
+            case IR_ADD: case IR_SUB: case IR_AND: case IR_OR:
+            case IR_LT: case IR_GT: case IR_EQ:
+                e.va = S->vn[in->a];
+                e.vb = S->vn[in->b];
+                break;
+            case IR_CALL:
+                if (!irIsPureInstr(ir, in)) {
+                    kill(S, -1, -1);
+                    continue;
+                }
+                e.imm = in->imm;
+                e.va = S->vn[ir->args[in->args]];
+                e.vb = S->vn[ir->args[in->args + 1]];
+                break;
+            default:
+                continue;
+        }
+        if (commutes(e.op) && e.va > e.vb) {
+            int t = e.va;
+            e.va = e.vb;
+            e.vb = t;
+        }
+        CseEntry *slot = lookup(S, &e);
+        if (slot->reg < 0) {
+            record(S, &e, in->dst);
+            continue;
+        }
+        int first = slot->reg, r = in->dst;
+        S->vn[r] = first;
+        // the first result moves to a temp: a pop, and a push for its old use
+        int extra = S->uses[r] + (S->uses[first] == 1 ? 2 : 0);
+        if (first == lastThat && nextThatUses(S, b, k, r)) extra = 0;
+        if (cost(S, r, b, 0) > extra) {
+            repl[r] = first;
+            S->uses[first] += S->uses[r];
+        }
+    }
+}
+
+int irCommonSubexpressions(IrFunction *ir) {
+    Cse S;
+    int maxBlock = 0, nRegs = ir->nRegs + 1;
+    memset(&S, 0, sizeof(S));
+    S.ir = ir;
+    irRemoveDead(ir);
+    for (int b = 0; b < ir->nBlocks; b++)
+        if (ir->blocks[b].n > maxBlock) maxBlock = ir->blocks[b].n;
+    for (S.cap = 16; S.cap < maxBlock * 2; S.cap *= 2) ;
+    S.tab = malloc(sizeof(CseEntry) * (size_t)S.cap);
+    S.loads = malloc(sizeof(int) * (size_t)S.cap);
+    S.vn = malloc(sizeof(int) * (size_t)nRegs);
+    S.uses = malloc(sizeof(int) * (size_t)nRegs);
+    S.defAt = malloc(sizeof(int) * (size_t)nRegs);
+    S.defBlock = malloc(sizeof(int) * (size_t)nRegs);
+    int *repl = malloc(sizeof(int) * (size_t)nRegs);
+    if (!S.tab || !S.loads || !S.vn || !S.uses || !S.defAt || !S.defBlock || !repl) abort();
+    irCountUses(ir, S.uses);
+    for (int r = 0; r < nRegs; r++) S.vn[r] = repl[r] = r;
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++)
+            if (ir->code[k].dst >= 0) {
+                S.defAt[ir->code[k].dst] = k;
+                S.defBlock[ir->code[k].dst] = b;
+            }
+
+    int replaced = 0;
+    for (int b = 0; b < ir->nBlocks; b++)
+        numberBlock(&S, b, repl);
+    for (int r = 0; r < ir->nRegs; r++)
+        if (repl[r] != r) replaced++;
+    if (replaced) {
+        for (int k = 0; k < ir->nCode; k++) {
+            IrInstr *in = &ir->code[k];
+            if (in->a >= 0) in->a = repl[in->a];
+            if (in->b >= 0) in->b = repl[in->b];
+            for (int i = 0; i < in->nArgs; i++)
+                ir->args[in->args + i] = repl[ir->args[in->args + i]];
+        }
+    }
+    free(S.tab);
+    free(S.loads);
+    free(S.vn);
+    free(S.uses);
+    free(S.defAt);
+    free(S.defBlock);
+    free(repl);
+    return replaced ? irRemoveDead(ir) : 0;
+}
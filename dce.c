@@ -0,0 +1,66 @@
+// dce.c
+/************************************************************************
+ Whole-program dead subroutine elimination
+
+ The roots are the program entry and every function of a class the
+ program brings in place of an OS class (project 12's Memory.jack next
+ to Main.jack): the other OS classes call into it, and calls from
+ outside the program are not in the graph.
+*************************************************************************/
+#include "opt.h"
+#include "callgraph.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *osClasses[] = {
+    "Array", "Keyboard", "Math", "Memory", "Output", "Screen", "String", "Sys"
+};
+
+static int isOsClass(const char *name) {
+    for (size_t i = 0; i < sizeof(osClasses) / sizeof(osClasses[0]); i++)
+        if (!strcmp(osClasses[i], name)) return 1;
+    return 0;
+}
+
+int eliminateDeadFunctions(VmProgram *p) {
+    CallGraph *g = buildCallGraph(p);
+    int entry = programEntry(g);
+    if (entry < 0) {
+        // a library: anything may be called from outside
+        freeCallGraph(g);
+        return 0;
+    }
+    markReachable(g, entry);
+    for (int i = 0; i < g->n; i++)
+        if (isOsClass(vmStr(g->nodes[i].cls, g->nodes[i].cls->name)))
+            markReachable(g, i);
+
+    int dropped = 0;
+    for (int i = 0; i < g->n; i++) {
+        const CallNode *node = &g->nodes[i];
+        if (node->reachable) continue;
+        const VmFunction *fn = &node->cls->funcs[node->fn];
+        if (optOptions.log)
+            fprintf(optOptions.log, "dce: dropped %s (%d instructions)\n", node->name, fn->len);
+        optStats.functionsDropped++;
+        optStats.instructionsDropped += fn->len;
+        dropped++;
+    }
+
+    // compact each class, keeping the order of the surviving functions
+    int id = 0;
+    for (int i = 0; i < p->nClasses; i++) {
+        VmClass *c = p->classes[i];
+        int kept = 0;
+        for (int f = 0; f < c->nFuncs; f++, id++) {
+            if (g->nodes[id].reachable) {
+                c->funcs[kept++] = c->funcs[f];
+            } else {
+                free(c->funcs[f].code);
+            }
+        }
+        c->nFuncs = kept;
+    }
+    freeCallGraph(g);
+    return dropped;
+}
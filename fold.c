@@ -0,0 +1,231 @@
+// fold.c
+/************************************************************************
+ Constant folding and algebraic simplification of expression trees.
+ Jack integers are 16-bit two's complement; true is -1, false/null 0.
+*************************************************************************/
+#include "opt.h"
+
+int wrap16(int v) {
+    v &= 0xFFFF;
+    return v >= 0x8000 ? v - 0x10000 : v;
+}
+
+int constValue(const ClassAst *c, int e, int *v) {
+    if (e == AST_NONE) return 0;
+    switch (c->exprs[e].kind) {
+        case EX_INT:   *v = wrap16(c->exprs[e].value); return 1;
+        case EX_TRUE:  *v = -1; return 1;
+        case EX_FALSE:
+        case EX_NULL:  *v = 0; return 1;
+        default:       return 0;
+    }
+}
+
+static int isBoolConst(const ClassAst *c, int e) {
+    return c->exprs[e].kind == EX_TRUE || c->exprs[e].kind == EX_FALSE;
+}
+
+// no calls below e, so evaluating it can be skipped without losing side effects
+static int isPure(const ClassAst *c, int e) {
+    if (e == AST_NONE) return 1;
+    const Expr *x = &c->exprs[e];
+    switch (x->kind) {
+        case EX_CALL:   return 0;
+        case EX_INDEX:
+        case EX_UNARY:  return isPure(c, x->a);
+        case EX_BINARY: return isPure(c, x->a) && isPure(c, x->b);
+        default:        return 1;
+    }
+}
+
+// turn node e into a constant, keeping its argument-list link
+static void makeConst(ClassAst *c, int e, int v, int boolean) {
+    Expr *x = &c->exprs[e];
+    x->kind = boolean ? (v ? EX_TRUE : EX_FALSE) : EX_INT;
+    x->value = boolean ? 0 : v;
+    x->a = x->b = AST_NONE;
+    x->op = 0;
+    optStats.constantsFolded++;
+}
+
+// overwrite node e with a copy of node src, keeping e's argument-list link
+static void replaceWith(ClassAst *c, int e, int src) {
+    int next = c->exprs[e].next;
+    c->exprs[e] = c->exprs[src];
+    c->exprs[e].next = next;
+    optStats.identitiesApplied++;
+}
+
+static int evalBinary(int op, int a, int b, int *r) {
+    switch (op) {
+        case '+': *r = wrap16(a + b); return 1;
+        case '-': *r = wrap16(a - b); return 1;
+        case '*': *r = wrap16(a * b); return 1;
+        case '/':
+            // leave these to Math.divide at run time: it fails on 0, and
+            // abs(-32768) stays negative, so its divPos gives 0 for every
+            // dividend of -32768
+            if (b == 0 || a == -32768) return 0;
+            *r = wrap16(a / b);             // C and Jack both truncate towards zero
+            return 1;
+        case '&': *r = wrap16(a & b); return 1;
+        case '|': *r = wrap16(a | b); return 1;
+        case '<': *r = a < b ? -1 : 0; return 1;
+        case '>': *r = a > b ? -1 : 0; return 1;
+        case '=': *r = a == b ? -1 : 0; return 1;
+    }
+    return 0;
+}
+
+// (x op1 c1) op2 c2  =>  x +/- c, for op1, op2 in {+, -}
+static int reassociate(ClassAst *c, int e) {
+    Expr *x = &c->exprs[e];
+    int c1, c2;
+    if (x->op != '+' && x->op != '-') return 0;
+    if (!constValue(c, x->b, &c2)) return 0;
+    const Expr *l = &c->exprs[x->a];
+    if (l->kind != EX_BINARY || (l->op != '+' && l->op != '-')) return 0;
+    if (!constValue(c, l->b, &c1)) return 0;
+
+    int k = wrap16((l->op == '+' ? c1 : -c1) + (x->op == '+' ? c2 : -c2));
+    int inner = l->a;
+    x->op = '+';
+    x->a = inner;
+    makeConst(c, x->b, k, 0);
+    return 1;
+}
+
+static void foldBinary(ClassAst *c, int e);
+
+void foldExpr(ClassAst *c, int e) {
+    if (e == AST_NONE) return;
+    Expr *x = &c->exprs[e];
+    int va;
+
+    switch (x->kind) {
+        case EX_INDEX:
+            foldExpr(c, x->a);
+            return;
+
+        case EX_CALL:
+            for (int arg = x->a; arg != AST_NONE; arg = c->exprs[arg].next)
+                foldExpr(c, arg);
+            return;
+
+        case EX_UNARY: {
+            foldExpr(c, x->a);
+            if (constValue(c, x->a, &va)) {
+                int boolean = x->op == '~' && isBoolConst(c, x->a);
+                makeConst(c, e, wrap16(x->op == '-' ? -va : ~va), boolean);
+                return;
+            }
+            // ~~x => x, --x => x
+            const Expr *in = &c->exprs[x->a];
+            if (in->kind == EX_UNARY && in->op == x->op)
+                replaceWith(c, e, in->a);
+            return;
+        }
+
+        case EX_BINARY: {
+            // count the Math.multiply / Math.divide calls that no longer happen
+            int op = x->op;
+            foldBinary(c, e);
+            if ((op == '*' || op == '/') &&
+                (c->exprs[e].kind != EX_BINARY || c->exprs[e].op != op)) {
+                if (op == '*') optStats.multiplyCallsRemoved++;
+                else optStats.divideCallsRemoved++;
+            }
+            return;
+        }
+
+        default:
+            return;
+    }
+}
+
+static void foldBinary(ClassAst *c, int e) {
+    Expr *x = &c->exprs[e];
+    int va, vb, r;
+
+    foldExpr(c, x->a);
+    foldExpr(c, x->b);
+    int ca = constValue(c, x->a, &va);
+    int cb = constValue(c, x->b, &vb);
+
+    if (ca && cb && evalBinary(x->op, va, vb, &r)) {
+        int boolean = x->op == '<' || x->op == '>' || x->op == '=' ||
+                      ((x->op == '&' || x->op == '|') &&
+                       isBoolConst(c, x->a) && isBoolConst(c, x->b));
+        makeConst(c, e, r, boolean);
+        return;
+    }
+
+    if (reassociate(c, e)) {
+        optStats.identitiesApplied++;
+        cb = constValue(c, x->b, &vb);
+    }
+
+    switch (x->op) {
+        case '+':
+            if (cb && vb == 0) { replaceWith(c, e, x->a); return; }
+            if (ca && va == 0) { replaceWith(c, e, x->b); return; }
+            if (cb && vb < 0 && vb != -32768) {   // x + -k => x - k
+                x->op = '-';
+                c->exprs[x->b].kind = EX_INT;
+                c->exprs[x->b].value = -vb;
+            }
+            break;
+        case '-':
+            if (cb && vb == 0) { replaceWith(c, e, x->a); return; }
+            if (ca && va == 0) {            // 0 - x => -x
+                x->kind = EX_UNARY;
+                x->a = x->b;
+                x->b = AST_NONE;
+                optStats.identitiesApplied++;
+                return;
+            }
+            break;
+        case '*':
+            if (cb && vb == 1) { replaceWith(c, e, x->a); return; }
+            if (ca && va == 1) { replaceWith(c, e, x->b); return; }
+            if ((cb && vb == 0 && isPure(c, x->a)) || (ca && va == 0 && isPure(c, x->b))) {
+                makeConst(c, e, 0, 0);
+                optStats.identitiesApplied++;
+                return;
+            }
+            if ((cb && vb == -1) || (ca && va == -1)) {   // x * -1 => -x
+                x->kind = EX_UNARY;
+                x->op = '-';
+                if (ca) x->a = x->b;
+                x->b = AST_NONE;
+                optStats.identitiesApplied++;
+                return;
+            }
+            break;
+        case '/':
+            // no x / 1 => x or x / -1 => -x: Math.divide gives 0 for
+            // x = -32768, and nothing here knows x is not that
+            break;
+        case '&':
+            if ((cb && vb == 0 && isPure(c, x->a)) || (ca && va == 0 && isPure(c, x->b))) {
+                makeConst(c, e, 0, isBoolConst(c, ca ? x->a : x->b));
+                optStats.identitiesApplied++;
+                return;
+            }
+            if (cb && vb == -1) { replaceWith(c, e, x->a); return; }
+            if (ca && va == -1) { replaceWith(c, e, x->b); return; }
+            break;
+        case '|':
+            if (cb && vb == 0) { replaceWith(c, e, x->a); return; }
+            if (ca && va == 0) { replaceWith(c, e, x->b); return; }
+            break;
+    }
+}
+
+void foldClass(ClassAst *c) {
+    // every expression tree hangs off exactly one statement
+    for (int i = 0; i < c->nStmts; i++) {
+        foldExpr(c, c->stmts[i].index);
+        foldExpr(c, c->stmts[i].expr);
+    }
+}
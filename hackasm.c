@@ -0,0 +1,259 @@
+// hackasm.c
+/************************************************************************
+ Hack assembler: symbol table, two passes, label resolution
+*************************************************************************/
+#include "hackasm.h"
+#include "jackos.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+//---------------------------------------------------------------------
+// symbol table
+//---------------------------------------------------------------------
+
+typedef struct {
+    char **names;     // open addressing, NULL = empty
+    int *values;
+    int cap, n;
+} SymTab;
+
+static unsigned hashName(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static int symFind(const SymTab *t, const char *s) {
+    unsigned k = hashName(s) & (unsigned)(t->cap - 1);
+    while (t->names[k]) {
+        if (!strcmp(t->names[k], s)) return t->values[k];
+        k = (k + 1) & (unsigned)(t->cap - 1);
+    }
+    return -1;
+}
+
+static void symAdd(SymTab *t, const char *s, int v);
+
+static void symGrow(SymTab *t) {
+    SymTab old = *t;
+    t->cap = old.cap ? old.cap * 2 : 256;
+    t->n = 0;
+    t->names = calloc((size_t)t->cap, sizeof(char*));
+    t->values = malloc(sizeof(int) * (size_t)t->cap);
+    if (!t->names || !t->values) abort();
+    for (int i = 0; i < old.cap; i++)
+        if (old.names[i]) {
+            symAdd(t, old.names[i], old.values[i]);
+            free(old.names[i]);
+        }
+    free(old.names);
+    free(old.values);
+}
+
+static void symAdd(SymTab *t, const char *s, int v) {
+    if ((t->n + 1) * 2 > t->cap) symGrow(t);
+    unsigned k = hashName(s) & (unsigned)(t->cap - 1);
+    while (t->names[k]) {
+        if (!strcmp(t->names[k], s)) return;     // first binding wins
+        k = (k + 1) & (unsigned)(t->cap - 1);
+    }
+    t->names[k] = strdup(s);
+    t->values[k] = v;
+    t->n++;
+}
+
+static void symFree(SymTab *t) {
+    for (int i = 0; i < t->cap; i++) free(t->names[i]);
+    free(t->names);
+    free(t->values);
+}
+
+//---------------------------------------------------------------------
+// C-instruction fields
+//---------------------------------------------------------------------
+
+static const struct { const char *s; int bits; } comps[] = {
+    { "0",   0x2A }, { "1",   0x3F }, { "-1",  0x3A }, { "D",   0x0C },
+    { "A",   0x30 }, { "!D",  0x0D }, { "!A",  0x31 }, { "-D",  0x0F },
+    { "-A",  0x33 }, { "D+1", 0x1F }, { "A+1", 0x37 }, { "D-1", 0x0E },
+    { "A-1", 0x32 }, { "D+A", 0x02 }, { "A+D", 0x02 }, { "D-A", 0x13 },
+    { "A-D", 0x07 }, { "D&A", 0x00 }, { "A&D", 0x00 }, { "D|A", 0x15 },
+    { "A|D", 0x15 },
+};
+
+static const char *jumps[] = { "", "JGT", "JEQ", "JGE", "JLT", "JNE", "JLE", "JMP" };
+
+// 7-bit a+comp field, -1 if unknown; "M" forms are the "A" forms with a=1
+static int compBits(const char *s) {
+    char buf[8];
+    int a = 0;
+    if (strlen(s) >= sizeof(buf)) return -1;
+    strcpy(buf, s);
+    for (char *p = buf; *p; p++)
+        if (*p == 'M') { *p = 'A'; a = 0x40; }
+    for (size_t i = 0; i < sizeof(comps) / sizeof(comps[0]); i++)
+        if (!strcmp(comps[i].s, buf)) return a | comps[i].bits;
+    return -1;
+}
+
+static int destBits(const char *s) {
+    int d = 0;
+    for (; *s; s++) {
+        int bit = *s == 'A' ? 4 : *s == 'D' ? 2 : *s == 'M' ? 1 : -1;
+        if (bit < 0 || (d & bit)) return -1;
+        d |= bit;
+    }
+    return d;
+}
+
+static int jumpBits(const char *s) {
+    for (int i = 0; i < 8; i++)
+        if (!strcmp(jumps[i], s)) return i;
+    return -1;
+}
+
+static int encodeC(char *s) {
+    char *eq = strchr(s, '='), *semi = strchr(s, ';');
+    const char *dest = "", *comp = s, *jump = "";
+    if (semi) { *semi = '\0'; jump = semi + 1; }
+    if (eq) { *eq = '\0'; dest = s; comp = eq + 1; }
+    int c = compBits(comp), d = destBits(dest), j = jumpBits(jump);
+    if (c < 0 || d < 0 || j < 0) return -1;
+    return 0xE000 | c << 6 | d << 3 | j;
+}
+
+//---------------------------------------------------------------------
+// assembler
+//---------------------------------------------------------------------
+
+static int isSymbol(const char *s) {
+    if (!*s || isdigit((unsigned char)*s)) return 0;
+    for (; *s; s++)
+        if (!isalnum((unsigned char)*s) && !strchr("_.$:", *s)) return 0;
+    return 1;
+}
+
+// strip comments and all white space
+static void cleanLine(char *s) {
+    char *cm = strstr(s, "//");
+    if (cm) *cm = '\0';
+    char *w = s;
+    for (char *r = s; *r; r++)
+        if (!isspace((unsigned char)*r)) *w++ = *r;
+    *w = '\0';
+}
+
+HackImage* hackAssemble(FILE *in, char *err, int errLen) {
+    static const char *regs[] = { "SP", "LCL", "ARG", "THIS", "THAT" };
+    SymTab syms;
+    memset(&syms, 0, sizeof(syms));
+    symGrow(&syms);
+    for (int i = 0; i < 5; i++) symAdd(&syms, regs[i], i);
+    for (int i = 0; i < 16; i++) {
+        char r[16];
+        snprintf(r, sizeof(r), "R%d", i);
+        symAdd(&syms, r, i);
+    }
+    symAdd(&syms, "SCREEN", HACK_SCREEN);
+    symAdd(&syms, "KBD", HACK_KBD);
+
+    // keep the cleaned lines for the second pass
+    char **lines = NULL;
+    int *lineNo = NULL, nLines = 0, capLines = 0;
+    char buf[512];
+    int ln = 0, pc = 0;
+    HackImage *img = calloc(1, sizeof(HackImage));
+    if (!img) abort();
+    img->rom = calloc(HACK_RAM_SIZE, sizeof(uint16_t));
+    img->labels = calloc(HACK_RAM_SIZE, sizeof(char*));
+    if (!img->rom || !img->labels) abort();
+
+    while (fgets(buf, sizeof(buf), in)) {
+        ln++;
+        cleanLine(buf);
+        if (!*buf) continue;
+        if (buf[0] == '(') {
+            size_t L = strlen(buf);
+            if (L < 3 || buf[L - 1] != ')') goto bad;
+            buf[L - 1] = '\0';
+            if (!isSymbol(buf + 1)) goto bad;
+            if (symFind(&syms, buf + 1) >= 0) {
+                snprintf(err, (size_t)errLen, "line %d: %s defined twice", ln, buf + 1);
+                goto fail;
+            }
+            symAdd(&syms, buf + 1, pc);
+            if (pc < HACK_RAM_SIZE && !img->labels[pc]) img->labels[pc] = strdup(buf + 1);
+            continue;
+        }
+        if (nLines == capLines) {
+            capLines = capLines ? capLines * 2 : 1024;
+            lines = realloc(lines, sizeof(char*) * (size_t)capLines);
+            lineNo = realloc(lineNo, sizeof(int) * (size_t)capLines);
+            if (!lines || !lineNo) abort();
+        }
+        lines[nLines] = strdup(buf);
+        lineNo[nLines++] = ln;
+        pc++;
+    }
+    if (pc > HACK_RAM_SIZE) {
+        snprintf(err, (size_t)errLen, "%d instructions do not fit in the 32K ROM", pc);
+        goto fail;
+    }
+
+    int nextVar = HACK_STATIC;
+    for (int i = 0; i < nLines; i++) {
+        char *s = lines[i];
+        int word;
+        ln = lineNo[i];
+        strcpy(buf, s);
+        if (s[0] == '@') {
+            if (isdigit((unsigned char)s[1])) {
+                char *end;
+                long v = strtol(s + 1, &end, 10);
+                if (*end || v > 0x7FFF) goto bad;
+                word = (int)v;
+            }
+            else {
+                if (!isSymbol(s + 1)) goto bad;
+                word = symFind(&syms, s + 1);
+                if (word < 0) {
+                    word = nextVar++;
+                    symAdd(&syms, s + 1, word);
+                }
+            }
+        }
+        else if ((word = encodeC(s)) < 0) goto bad;
+        img->rom[i] = (uint16_t)word;
+    }
+    img->size = nLines;
+    for (int i = 0; i < nLines; i++) free(lines[i]);
+    free(lines);
+    free(lineNo);
+    symFree(&syms);
+    return img;
+
+bad:
+    snprintf(err, (size_t)errLen, "line %d: cannot assemble \"%s\"", ln, buf);
+fail:
+    for (int i = 0; i < nLines; i++) free(lines[i]);
+    free(lines);
+    free(lineNo);
+    symFree(&syms);
+    hackFreeImage(img);
+    return NULL;
+}
+
+void hackFreeImage(HackImage *img) {
+    if (!img) return;
+    for (int i = 0; i < HACK_RAM_SIZE; i++) free(img->labels[i]);
+    free(img->labels);
+    free(img->rom);
+    free(img);
+}
+
+const char* hackLabelAt(const HackImage *img, int pc) {
+    for (; pc >= 0; pc--)
+        if (img->labels[pc]) return img->labels[pc];
+    return "";
+}
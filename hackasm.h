@@ -0,0 +1,23 @@
+#ifndef HACKASM_H
+#define HACKASM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Two-pass Hack assembler. Pass 1 binds (LABEL)s to ROM addresses, pass 2
+// encodes; other @symbols become variables from RAM[16] up, all in one
+// symbol table seeded with the predefined names (SP..THAT, R0-R15, SCREEN, KBD).
+
+typedef struct {
+    uint16_t *rom;     // HACK_RAM_SIZE words
+    int size;          // words assembled
+    char **labels;     // label bound to each ROM address (first one), NULL if none
+} HackImage;
+
+// Assemble .asm text; NULL with a message in err on a bad line
+HackImage* hackAssemble(FILE *in, char *err, int errLen);
+void hackFreeImage(HackImage *img);
+// the nearest label at or before ROM address pc, "" if there is none
+const char* hackLabelAt(const HackImage *img, int pc);
+
+#endif
@@ -0,0 +1,268 @@
+// hackemu.c
+/************************************************************************
+ Hack CPU emulator with a cycle counter and per-address profile
+*************************************************************************/
+#include "hackemu.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RAM_MASK (HACK_RAM_SIZE - 1)
+
+enum { K_A, K_C, K_HALT };
+
+struct HackInsn {
+    uint16_t value;     // K_A: the constant
+    unsigned char kind;
+    unsigned char comp; // a bit + c1..c6
+    unsigned char dest; // A D M = 4 2 1
+    unsigned char jump; // < = > = 4 2 1
+};
+
+HackCpu* hackNewCpu(const HackImage *img) {
+    HackCpu *cpu = calloc(1, sizeof(HackCpu));
+    if (!cpu) abort();
+    cpu->img = img;
+    cpu->out = stdout;
+    cpu->code = calloc((size_t)img->size + 1, sizeof(HackInsn));
+    if (!cpu->code) abort();
+    for (int pc = 0; pc < img->size; pc++) {
+        uint16_t w = img->rom[pc];
+        HackInsn *in = &cpu->code[pc];
+        if (!(w & 0x8000)) {
+            in->kind = K_A;
+            in->value = w;
+            continue;
+        }
+        in->kind = K_C;
+        in->comp = (w >> 6) & 0x7F;
+        in->dest = (w >> 3) & 7;
+        in->jump = w & 7;
+        // "@p; 0;JMP" sitting at p: the program spins there forever
+        if (in->jump == 7 && in->dest == 0 && pc > 0 &&
+            !(img->rom[pc - 1] & 0x8000) && img->rom[pc - 1] == pc - 1)
+            in->kind = K_HALT;
+    }
+    return cpu;
+}
+
+void hackFreeCpu(HackCpu *cpu) {
+    if (!cpu) return;
+    free(cpu->code);
+    free(cpu->profile);
+    free(cpu);
+}
+
+void hackEnableProfile(HackCpu *cpu) {
+    if (!cpu->profile)
+        cpu->profile = calloc((size_t)cpu->img->size + 1, sizeof(long long));
+    if (!cpu->profile) abort();
+}
+
+// the ALU for any comp field (zx nx zy ny f no)
+static uint16_t alu(int c, uint16_t x, uint16_t y) {
+    if (c & 0x20) x = 0;
+    if (c & 0x10) x = (uint16_t)~x;
+    if (c & 0x08) y = 0;
+    if (c & 0x04) y = (uint16_t)~y;
+    uint16_t o = (c & 0x02) ? (uint16_t)(x + y) : (uint16_t)(x & y);
+    return (c & 0x01) ? (uint16_t)~o : o;
+}
+
+static void portWrite(HackCpu *cpu, uint16_t c) {
+    if (c == 128) fputc('\n', cpu->out);
+    else if (c == 129) fputc('\b', cpu->out);
+    else fputc(c & 0xFF, cpu->out);
+}
+
+int hackRun(HackCpu *cpu, long long maxCycles) {
+    uint16_t *ram = cpu->ram;
+    const HackInsn *code = cpu->code;
+    long long *prof = cpu->profile;
+    long long n = 0, budget = maxCycles > 0 ? maxCycles : -1;
+    int size = cpu->img->size, pc = 0, status;
+    uint16_t A = 0, D = 0;
+
+    memset(ram, 0, sizeof(cpu->ram));
+    if (prof) memset(prof, 0, sizeof(long long) * (size_t)size);
+    for (;;) {
+        if (pc >= size) { status = HACK_OFF_ROM; break; }
+        if (n == budget) { status = HACK_LIMIT; break; }
+        const HackInsn *in = &code[pc];
+        if (prof) prof[pc]++;
+        n++;
+        if (in->kind == K_A) {
+            A = in->value;
+            pc++;
+            continue;
+        }
+        if (in->kind == K_HALT) { status = HACK_HALTED; break; }
+
+        uint16_t y = (in->comp & 0x40) ? ram[A & RAM_MASK] : A, out;
+        switch (in->comp & 0x3F) {
+            case 0x2A: out = 0; break;
+            case 0x3F: out = 1; break;
+            case 0x3A: out = 0xFFFF; break;
+            case 0x0C: out = D; break;
+            case 0x30: out = y; break;
+            case 0x0D: out = (uint16_t)~D; break;
+            case 0x31: out = (uint16_t)~y; break;
+            case 0x0F: out = (uint16_t)-D; break;
+            case 0x33: out = (uint16_t)-y; break;
+            case 0x1F: out = (uint16_t)(D + 1); break;
+            case 0x37: out = (uint16_t)(y + 1); break;
+            case 0x0E: out = (uint16_t)(D - 1); break;
+            case 0x32: out = (uint16_t)(y - 1); break;
+            case 0x02: out = (uint16_t)(D + y); break;
+            case 0x13: out = (uint16_t)(D - y); break;
+            case 0x07: out = (uint16_t)(y - D); break;
+            case 0x00: out = D & y; break;
+            case 0x15: out = D | y; break;
+            default:   out = alu(in->comp & 0x3F, D, y); break;
+        }
+        uint16_t a0 = A;      // M and the jump use A from before this instruction
+        if (in->dest & 1) {
+            ram[a0 & RAM_MASK] = out;
+            if ((a0 & RAM_MASK) == JACK_OUTPUT_PORT) portWrite(cpu, out);
+        }
+        if (in->dest & 2) D = out;
+        if (in->dest & 4) A = out;
+        int16_t s = (int16_t)out;
+        if ((in->jump & 4 && s < 0) || (in->jump & 2 && s == 0) || (in->jump & 1 && s > 0))
+            pc = a0;
+        else
+            pc++;
+    }
+    fflush(cpu->out);
+    cpu->cycles = n;
+    return status;
+}
+
+typedef struct {
+    const char *name;
+    int len;            // significant characters of name
+    long long cycles;
+} ProfileEntry;
+
+static int cmpCycles(const void *a, const void *b) {
+    long long x = ((const ProfileEntry*)a)->cycles, y = ((const ProfileEntry*)b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void hackWriteProfile(const HackCpu *cpu, FILE *f, int top) {
+    const HackImage *img = cpu->img;
+    if (!cpu->profile || cpu->cycles == 0) return;
+
+    // group addresses under their function: the label up to its first '$'
+    // ("Main.main$WHILE_EXP0"), shared routines ("$$CALL") keep their name
+    ProfileEntry *e = calloc((size_t)img->size + 1, sizeof(ProfileEntry));
+    if (!e) abort();
+    int n = 0;
+    const char *cur = "";
+    for (int pc = 0; pc < img->size; pc++) {
+        if (img->labels[pc]) cur = img->labels[pc];
+        const char *dollar = cur[0] == '$' ? NULL : strchr(cur, '$');
+        int len = dollar ? (int)(dollar - cur) : (int)strlen(cur);
+        if (n == 0 || e[n - 1].len != len || strncmp(e[n - 1].name, cur, (size_t)len)) {
+            e[n].name = cur;
+            e[n].len = len;
+            n++;
+        }
+        e[n - 1].cycles += cpu->profile[pc];
+    }
+    qsort(e, (size_t)n, sizeof(ProfileEntry), cmpCycles);
+    fprintf(f, "%-32s %14s %7s\n", "function", "cycles", "share");
+    for (int i = 0; i < n && i < top && e[i].cycles; i++)
+        fprintf(f, "%-32.*s %14lld %6.2f%%\n", e[i].len, e[i].name, e[i].cycles,
+                100.0 * (double)e[i].cycles / (double)cpu->cycles);
+
+    // hottest single addresses
+    for (int pc = 0; pc < img->size; pc++) {
+        e[pc].name = hackLabelAt(img, pc);
+        e[pc].len = pc;                 // reused: the address
+        e[pc].cycles = cpu->profile[pc];
+    }
+    qsort(e, (size_t)img->size, sizeof(ProfileEntry), cmpCycles);
+    fprintf(f, "\n%-8s %-32s %14s\n", "address", "after label", "executions");
+    for (int i = 0; i < img->size && i < top && e[i].cycles; i++)
+        fprintf(f, "%-8d %-32s %14lld\n", e[i].len, e[i].name, e[i].cycles);
+    free(e);
+}
+
+#ifdef TEST_HACKEMU
+#include "hackgen.h"
+#include "vminterp.h"
+#include "compiler.h"
+#include "opt.h"
+
+// usage: hackrun [-os DIR|-noos] [-O0] [-max N] [-profile] FILE.asm|DIR
+// A directory is compiled (or its .vmb/.vm files read) and translated first
+int main(int argc, char **argv) {
+    static const char *status[] = { "halted", "cycle limit", "ran off the ROM" };
+    const char *src = NULL, *osDir = "os";
+    long long max = 0;
+    int profile = 0;
+    char err[256];
+
+    InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-os") && i + 1 < argc) osDir = argv[++i];
+        else if (!strcmp(argv[i], "-noos")) osDir = NULL;
+        else if (!strcmp(argv[i], "-max") && i + 1 < argc) max = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-profile")) profile = 1;
+        else if (!strcmp(argv[i], "-O0")) {
+            optOptions.fold = optOptions.strength = optOptions.dce = 0;
+            optOptions.inlineThreshold = optOptions.ir = 0;
+        }
+        else if (!strcmp(argv[i], "-noarrays")) optOptions.arrays = 0;
+        else if (!strcmp(argv[i], "-strpool")) optOptions.stringPool = 1;
+        else if (!strcmp(argv[i], "-sizeheap")) optOptions.sizeClassHeap = 1;
+        else src = argv[i];
+    }
+    if (!src) {
+        fprintf(stderr, "usage: hackrun [-os DIR|-noos] [-O0] [-noarrays] [-strpool] [-sizeheap] [-max N] [-profile] FILE.asm|DIR\n");
+        return 2;
+    }
+
+    FILE *asmFile;
+    size_t L = strlen(src);
+    if (L > 4 && !strcmp(src + L - 4, ".asm")) asmFile = fopen(src, "r");
+    else {
+        VmProgram *progs[2];
+        int nProgs = 0;
+        if (!(progs[nProgs++] = vmLoadDirectory(src, err, sizeof(err))) ||
+            (osDir && !(progs[nProgs++] = vmLoadDirectory(osDir, err, sizeof(err))))) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        asmFile = tmpfile();
+        if (asmFile && vmToHack(progs, nProgs, asmFile, NULL, err, sizeof(err)) < 0) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        if (asmFile) rewind(asmFile);
+        for (int i = 0; i < nProgs; i++)
+            vmFreeProgram(progs[i]);
+    }
+    if (!asmFile) {
+        fprintf(stderr, "cannot read %s\n", src);
+        return 1;
+    }
+    HackImage *img = hackAssemble(asmFile, err, sizeof(err));
+    fclose(asmFile);
+    if (!img) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    HackCpu *cpu = hackNewCpu(img);
+    if (profile) hackEnableProfile(cpu);
+    int st = hackRun(cpu, max);
+    fprintf(stderr, "\n%s after %lld cycles (%d words of ROM)\n", status[st], cpu->cycles, img->size);
+    if (profile) hackWriteProfile(cpu, stderr, 20);
+
+    hackFreeCpu(cpu);
+    hackFreeImage(img);
+    StopCompiler();
+    return st == HACK_HALTED ? 0 : 3;
+}
+#endif
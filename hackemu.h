@@ -0,0 +1,39 @@
+#ifndef HACKEMU_H
+#define HACKEMU_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "hackasm.h"
+#include "jackos.h"
+
+// Hack CPU emulator: 32K ROM and RAM, one instruction per cycle.
+// ROM is pre-decoded once; "@p; 0;JMP" at address p (the halt loop) stops
+// the machine, and stores to JACK_OUTPUT_PORT are printed like vmrun does.
+
+typedef enum {
+    HACK_HALTED,
+    HACK_LIMIT,        // cycle budget used up
+    HACK_OFF_ROM       // ran past the end of the program
+} HackStatus;
+
+typedef struct HackInsn HackInsn;
+
+typedef struct {
+    uint16_t ram[HACK_RAM_SIZE];
+    const HackImage *img;
+    HackInsn *code;          // decoded ROM
+    long long cycles;
+    long long *profile;      // executions per ROM address, NULL = off
+    FILE *out;               // console port output
+} HackCpu;
+
+HackCpu* hackNewCpu(const HackImage *img);
+void hackFreeCpu(HackCpu *cpu);
+// Count executions per ROM address from now on
+void hackEnableProfile(HackCpu *cpu);
+// Reset RAM and run from ROM[0] for at most maxCycles (<= 0: no limit)
+int hackRun(HackCpu *cpu, long long maxCycles);
+// Cycles per function (labels up to the first '$') and the hottest addresses
+void hackWriteProfile(const HackCpu *cpu, FILE *f, int top);
+
+#endif
@@ -0,0 +1,492 @@
+// hackgen.c
+/************************************************************************
+ VM to Hack assembly translator with the top of stack cached in D
+*************************************************************************/
+#include "hackgen.h"
+#include "jackos.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    FILE *out;
+    int words;            // instructions written so far
+    int cycles;           // cycle estimate of the current function
+    int cached;           // the top of the VM stack is in D, not in RAM
+    const char *cls;      // class name, for statics
+    const char *fn;       // function name, for labels
+    int nLabels;          // return/compare labels in this function
+    int callCost, returnCost, eqCost, gtCost, ltCost;   // shared routine lengths
+} Hack;
+
+static void ins(Hack *h, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(h->out, fmt, ap);
+    va_end(ap);
+    fputc('\n', h->out);
+    h->words++;
+    h->cycles++;
+}
+
+static void label(Hack *h, const char *fmt, ...) {
+    va_list ap;
+    fputc('(', h->out);
+    va_start(ap, fmt);
+    vfprintf(h->out, fmt, ap);
+    va_end(ap);
+    fputs(")\n", h->out);
+}
+
+//---------------------------------------------------------------------
+// shared routines
+//---------------------------------------------------------------------
+
+// $$CALL:   R13 = return address, R14 = callee, D = argument count
+// $$RETURN: D = return value; leaves it in D with SP at the old ARG
+// $$EQ/GT/LT: R13 = y, x on the stack, D = return address; D = x op y
+// Comparisons look at the signs first, so they do not overflow like x-y.
+static void emitRoutines(Hack *h) {
+    static const char *saved[] = { "LCL", "ARG", "THIS", "THAT" };
+    int w = h->words;
+    label(h, "$$CALL");
+    ins(h, "@R15"); ins(h, "M=D");
+    ins(h, "@R13"); ins(h, "D=M");
+    ins(h, "@SP"); ins(h, "AM=M+1"); ins(h, "A=A-1"); ins(h, "M=D");
+    for (int i = 0; i < 4; i++) {
+        ins(h, "@%s", saved[i]); ins(h, "D=M");
+        ins(h, "@SP"); ins(h, "AM=M+1"); ins(h, "A=A-1"); ins(h, "M=D");
+    }
+    ins(h, "@SP"); ins(h, "D=M"); ins(h, "@LCL"); ins(h, "M=D");
+    ins(h, "@R15"); ins(h, "D=D-M"); ins(h, "@5"); ins(h, "D=D-A"); ins(h, "@ARG"); ins(h, "M=D");
+    ins(h, "@R14"); ins(h, "A=M"); ins(h, "0;JMP");
+    h->callCost = h->words - w;
+
+    w = h->words;
+    label(h, "$$RETURN");
+    ins(h, "@R13"); ins(h, "M=D");
+    ins(h, "@LCL"); ins(h, "D=M"); ins(h, "@R14"); ins(h, "M=D");
+    ins(h, "@5"); ins(h, "A=D-A"); ins(h, "D=M"); ins(h, "@R15"); ins(h, "M=D");
+    ins(h, "@ARG"); ins(h, "D=M"); ins(h, "@SP"); ins(h, "M=D");
+    for (int i = 3; i >= 0; i--) {
+        ins(h, "@R14"); ins(h, "AM=M-1"); ins(h, "D=M");
+        ins(h, "@%s", saved[i]); ins(h, "M=D");
+    }
+    ins(h, "@R13"); ins(h, "D=M");
+    ins(h, "@R15"); ins(h, "A=M"); ins(h, "0;JMP");
+    h->returnCost = h->words - w;
+
+    w = h->words;
+    label(h, "$$EQ");
+    ins(h, "@R15"); ins(h, "M=D");
+    ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M");
+    ins(h, "@R13"); ins(h, "D=D-M");
+    ins(h, "@$$TRUE"); ins(h, "D;JEQ");
+    ins(h, "@$$FALSE"); ins(h, "0;JMP");
+    h->eqCost = h->words - w + 4;
+
+    // R14 > R13, return address in R15
+    w = h->words;
+    label(h, "$$GTC");
+    ins(h, "@R13"); ins(h, "D=M"); ins(h, "@$$GTC_BNEG"); ins(h, "D;JLT");
+    ins(h, "@R14"); ins(h, "D=M"); ins(h, "@$$FALSE"); ins(h, "D;JLT");
+    ins(h, "@$$GTC_SUB"); ins(h, "0;JMP");
+    label(h, "$$GTC_BNEG");
+    ins(h, "@R14"); ins(h, "D=M"); ins(h, "@$$TRUE"); ins(h, "D;JGE");
+    label(h, "$$GTC_SUB");
+    ins(h, "@R13"); ins(h, "D=M"); ins(h, "@R14"); ins(h, "D=M-D");
+    ins(h, "@$$TRUE"); ins(h, "D;JGT");
+    label(h, "$$FALSE");
+    ins(h, "D=0"); ins(h, "@R15"); ins(h, "A=M"); ins(h, "0;JMP");
+    label(h, "$$TRUE");
+    ins(h, "D=-1"); ins(h, "@R15"); ins(h, "A=M"); ins(h, "0;JMP");
+    int core = 14 + 4;   // the longest path through $$GTC
+
+    w = h->words;
+    label(h, "$$GT");
+    ins(h, "@R15"); ins(h, "M=D");
+    ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M"); ins(h, "@R14"); ins(h, "M=D");
+    ins(h, "@$$GTC"); ins(h, "0;JMP");
+    h->gtCost = h->words - w + core;
+
+    w = h->words;
+    label(h, "$$LT");                 // x < y  <=>  y > x
+    ins(h, "@R15"); ins(h, "M=D");
+    ins(h, "@R13"); ins(h, "D=M"); ins(h, "@R14"); ins(h, "M=D");
+    ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M"); ins(h, "@R13"); ins(h, "M=D");
+    ins(h, "@$$GTC"); ins(h, "0;JMP");
+    h->ltCost = h->words - w + core;
+}
+
+//---------------------------------------------------------------------
+// stack and segments
+//---------------------------------------------------------------------
+
+// write the cached top of stack back to RAM
+static void spill(Hack *h) {
+    if (!h->cached) return;
+    ins(h, "@SP"); ins(h, "AM=M+1"); ins(h, "A=A-1"); ins(h, "M=D");
+    h->cached = 0;
+}
+
+// bring the top of stack into D (popping it from RAM if needed)
+static void topToD(Hack *h) {
+    if (h->cached) return;
+    ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M");
+    h->cached = 1;
+}
+
+// A = constant c, for any 16-bit c
+static void loadA(Hack *h, int c) {
+    c &= 0xFFFF;
+    if (c <= 0x7FFF) ins(h, "@%d", c);
+    else {
+        ins(h, "@%d", ~c & 0xFFFF);
+        ins(h, "A=!A");
+    }
+}
+
+static void constToD(Hack *h, int c) {
+    c &= 0xFFFF;
+    if (c == 0) ins(h, "D=0");
+    else if (c == 1) ins(h, "D=1");
+    else if (c == 0xFFFF) ins(h, "D=-1");
+    else if (c <= 0x7FFF) { ins(h, "@%d", c); ins(h, "D=A"); }
+    else { ins(h, "@%d", ~c & 0xFFFF); ins(h, "D=!A"); }
+}
+
+static const char* segBase(int seg) {
+    switch (seg) {
+        case SEG_LOCAL:    return "LCL";
+        case SEG_ARGUMENT: return "ARG";
+        case SEG_THIS:     return "THIS";
+        default:           return "THAT";
+    }
+}
+
+// Point A at seg[i] without touching D; 0 if that needs D
+static int directAddr(Hack *h, int seg, int i) {
+    switch (seg) {
+        case SEG_STATIC:  ins(h, "@%s.%d", h->cls, i); return 1;
+        case SEG_TEMP:    ins(h, "@%d", HACK_TEMP + i); return 1;
+        case SEG_POINTER: ins(h, i ? "@THAT" : "@THIS"); return 1;
+        case SEG_CONSTANT: return 0;
+    }
+    if (i > 3) return 0;
+    ins(h, "@%s", segBase(seg));
+    ins(h, i ? "A=M+1" : "A=M");
+    for (int k = 1; k < i; k++) ins(h, "A=A+1");
+    return 1;
+}
+
+static int isDirect(int seg, int i) {
+    return seg == SEG_STATIC || seg == SEG_TEMP || seg == SEG_POINTER ||
+           (seg != SEG_CONSTANT && i <= 3);
+}
+
+static void pushSeg(Hack *h, int seg, int i) {
+    spill(h);
+    if (seg == SEG_CONSTANT) constToD(h, i);
+    else if (directAddr(h, seg, i)) ins(h, "D=M");
+    else {
+        ins(h, "@%s", segBase(seg)); ins(h, "D=M");
+        ins(h, "@%d", i); ins(h, "A=D+A"); ins(h, "D=M");
+    }
+    h->cached = 1;
+}
+
+static void popSeg(Hack *h, int seg, int i) {
+    if (isDirect(seg, i)) {
+        topToD(h);
+        directAddr(h, seg, i);
+        ins(h, "M=D");
+    }
+    else if (h->cached) {
+        ins(h, "@R13"); ins(h, "M=D");
+        ins(h, "@%s", segBase(seg)); ins(h, "D=M"); ins(h, "@%d", i); ins(h, "D=D+A");
+        ins(h, "@R14"); ins(h, "M=D");
+        ins(h, "@R13"); ins(h, "D=M");
+        ins(h, "@R14"); ins(h, "A=M"); ins(h, "M=D");
+    }
+    else {
+        ins(h, "@%s", segBase(seg)); ins(h, "D=M"); ins(h, "@%d", i); ins(h, "D=D+A");
+        ins(h, "@R14"); ins(h, "M=D");
+        ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M");
+        ins(h, "@R14"); ins(h, "A=M"); ins(h, "M=D");
+    }
+    h->cached = 0;
+}
+
+static const char* arithComp(int op, int withA) {
+    switch (op) {
+        case VM_ADD: return withA ? "D=D+A" : "D=D+M";
+        case VM_SUB: return withA ? "D=D-A" : "D=D-M";
+        case VM_AND: return withA ? "D=D&A" : "D=D&M";
+        default:     return withA ? "D=D|A" : "D=D|M";
+    }
+}
+
+static int isArith(int op) {
+    return op == VM_ADD || op == VM_SUB || op == VM_AND || op == VM_OR;
+}
+
+//---------------------------------------------------------------------
+// functions
+//---------------------------------------------------------------------
+
+static void callRoutine(Hack *h, const char *routine, int cost) {
+    int n = h->nLabels++;
+    ins(h, "@%s$ret.%d", h->fn, n); ins(h, "D=A");
+    ins(h, "@%s", routine); ins(h, "0;JMP");
+    label(h, "%s$ret.%d", h->fn, n);
+    h->cycles += cost;
+}
+
+static void translateFunction(Hack *h, const VmClass *c, const VmFunction *fn) {
+    const VmInstr *code = fn->code;
+    h->fn = vmStr(c, fn->name);
+    h->cached = 0;
+    h->nLabels = 0;
+
+    label(h, "%s", h->fn);
+    if (fn->nLocals > 0) {
+        ins(h, "@SP"); ins(h, "A=M"); ins(h, "M=0");
+        for (int i = 1; i < fn->nLocals; i++) { ins(h, "A=A+1"); ins(h, "M=0"); }
+        ins(h, "D=A+1"); ins(h, "@SP"); ins(h, "M=D");
+    }
+
+    for (int k = 0; k < fn->len; k++) {
+        const VmInstr *in = &code[k];
+        int nx = k + 1 < fn->len ? code[k + 1].op : -1;
+        int nx2 = k + 2 < fn->len ? code[k + 2].op : -1;
+        switch (in->op) {
+            case VM_PUSH:
+                // push y; op  =>  D = D op y without going through RAM
+                if (isArith(nx) && (in->seg == SEG_CONSTANT || isDirect(in->seg, in->arg))) {
+                    topToD(h);
+                    if (in->seg == SEG_CONSTANT) {
+                        int y = in->arg & 0xFFFF;
+                        if (nx == VM_ADD && y == 1) ins(h, "D=D+1");
+                        else if (nx == VM_SUB && y == 1) ins(h, "D=D-1");
+                        else if (!(y == 0 && (nx == VM_ADD || nx == VM_SUB || nx == VM_OR))) {
+                            loadA(h, y);
+                            ins(h, "%s", arithComp(nx, 1));
+                        }
+                    }
+                    else {
+                        directAddr(h, in->seg, in->arg);
+                        ins(h, "%s", arithComp(nx, 0));
+                    }
+                    k++;
+                    break;
+                }
+                pushSeg(h, in->seg, in->arg);
+                break;
+            case VM_POP:
+                popSeg(h, in->seg, in->arg);
+                break;
+            case VM_ADD:
+            case VM_SUB:
+            case VM_AND:
+            case VM_OR:
+                topToD(h);
+                ins(h, "@SP"); ins(h, "AM=M-1");
+                ins(h, in->op == VM_ADD ? "D=D+M" : in->op == VM_SUB ? "D=M-D" :
+                       in->op == VM_AND ? "D=D&M" : "D=D|M");
+                break;
+            case VM_NEG:
+            case VM_NOT:
+                if (in->op == VM_NOT && nx == VM_IF_GOTO) {
+                    // not; if-goto L  =>  jump unless x is -1
+                    topToD(h);
+                    ins(h, "D=D+1");
+                    ins(h, "@%s$%s", h->fn, vmStr(c, code[k + 1].sym));
+                    ins(h, "D;JNE");
+                    h->cached = 0;
+                    k++;
+                }
+                else if (h->cached) ins(h, in->op == VM_NEG ? "D=-D" : "D=!D");
+                else { ins(h, "@SP"); ins(h, "A=M-1"); ins(h, in->op == VM_NEG ? "M=-M" : "M=!M"); }
+                break;
+            case VM_EQ:
+                topToD(h);
+                if (nx == VM_IF_GOTO || (nx == VM_NOT && nx2 == VM_IF_GOTO)) {
+                    // x - y wraps to 0 exactly when x == y
+                    int j = nx == VM_IF_GOTO ? k + 1 : k + 2;
+                    ins(h, "@SP"); ins(h, "AM=M-1"); ins(h, "D=M-D");
+                    ins(h, "@%s$%s", h->fn, vmStr(c, code[j].sym));
+                    ins(h, nx == VM_IF_GOTO ? "D;JEQ" : "D;JNE");
+                    h->cached = 0;
+                    k = j;
+                    break;
+                }
+                ins(h, "@R13"); ins(h, "M=D");
+                callRoutine(h, "$$EQ", h->eqCost);
+                break;
+            case VM_GT:
+            case VM_LT:
+                topToD(h);
+                ins(h, "@R13"); ins(h, "M=D");
+                callRoutine(h, in->op == VM_GT ? "$$GT" : "$$LT",
+                            in->op == VM_GT ? h->gtCost : h->ltCost);
+                break;
+            case VM_LABEL:
+                spill(h);
+                label(h, "%s$%s", h->fn, vmStr(c, in->sym));
+                break;
+            case VM_GOTO:
+                spill(h);
+                ins(h, "@%s$%s", h->fn, vmStr(c, in->sym));
+                ins(h, "0;JMP");
+                break;
+            case VM_IF_GOTO:
+                topToD(h);
+                ins(h, "@%s$%s", h->fn, vmStr(c, in->sym));
+                ins(h, "D;JNE");
+                h->cached = 0;
+                break;
+            case VM_CALL: {
+                spill(h);
+                int n = h->nLabels++;
+                ins(h, "@%s$ret.%d", h->fn, n); ins(h, "D=A"); ins(h, "@R13"); ins(h, "M=D");
+                ins(h, "@%s", vmStr(c, in->sym)); ins(h, "D=A"); ins(h, "@R14"); ins(h, "M=D");
+                constToD(h, in->arg);
+                ins(h, "@$$CALL"); ins(h, "0;JMP");
+                label(h, "%s$ret.%d", h->fn, n);
+                h->cycles += h->callCost + h->returnCost;
+                h->cached = 1;        // $$RETURN leaves the result in D
+                break;
+            }
+            case VM_RETURN:
+                topToD(h);
+                ins(h, "@$$RETURN"); ins(h, "0;JMP");
+                h->cached = 0;
+                break;
+        }
+    }
+}
+
+int vmToHack(VmProgram **progs, int nProgs, FILE *out, FILE *report, char *err, int errLen) {
+    Hack h;
+    memset(&h, 0, sizeof(h));
+    h.out = out;
+
+    // same class selection as vmLoad
+    int nCls = 0, capCls = 64;
+    const VmClass **cls = malloc(sizeof(VmClass*) * (size_t)capCls);
+    if (!cls) abort();
+    const char *entry = NULL;
+    for (int p = 0; p < nProgs; p++) {
+        for (int i = 0; i < progs[p]->nClasses; i++) {
+            const VmClass *c = progs[p]->classes[i];
+            int dup = 0;
+            for (int k = 0; k < nCls && !dup; k++)
+                dup = !strcmp(vmStr(cls[k], cls[k]->name), vmStr(c, c->name));
+            if (dup) continue;
+            if (nCls == capCls) {
+                capCls *= 2;
+                cls = realloc(cls, sizeof(VmClass*) * (size_t)capCls);
+                if (!cls) abort();
+            }
+            cls[nCls++] = c;
+            for (int f = 0; f < c->nFuncs; f++) {
+                const VmFunction *fn = &c->funcs[f];
+                for (int k = 0; k < fn->len; k++)
+                    if (fn->code[k].op == VM_POP && fn->code[k].seg == SEG_CONSTANT) {
+                        snprintf(err, (size_t)errLen, "pop constant in %s", vmStr(c, fn->name));
+                        free(cls);
+                        return -1;
+                    }
+                if (!strcmp(vmStr(c, fn->name), "Sys.init")) entry = "Sys.init";
+                if (!strcmp(vmStr(c, fn->name), "Main.main") && !entry) entry = "Main.main";
+            }
+        }
+    }
+    if (!entry) {
+        snprintf(err, (size_t)errLen, "no Sys.init or Main.main");
+        free(cls);
+        return -1;
+    }
+
+    // bootstrap: SP = 256, call the entry, then spin (the halt idiom)
+    fprintf(out, "// bootstrap\n");
+    ins(&h, "@%d", HACK_STACK); ins(&h, "D=A"); ins(&h, "@SP"); ins(&h, "M=D");
+    ins(&h, "@$$HALT"); ins(&h, "D=A"); ins(&h, "@R13"); ins(&h, "M=D");
+    ins(&h, "@%s", entry); ins(&h, "D=A"); ins(&h, "@R14"); ins(&h, "M=D");
+    ins(&h, "D=0"); ins(&h, "@$$CALL"); ins(&h, "0;JMP");
+    label(&h, "$$HALT");
+    ins(&h, "@$$HALT"); ins(&h, "0;JMP");
+    emitRoutines(&h);
+    if (report) fprintf(report, "%-32s %6d words\n", "(bootstrap and shared routines)", h.words);
+
+    for (int i = 0; i < nCls; i++) {
+        const VmClass *c = cls[i];
+        h.cls = vmStr(c, c->name);
+        for (int f = 0; f < c->nFuncs; f++) {
+            int w = h.words;
+            h.cycles = 0;
+            translateFunction(&h, c, &c->funcs[f]);
+            fprintf(out, "// %s: %d words, ~%d cycles per pass\n", h.fn, h.words - w, h.cycles);
+            if (report)
+                fprintf(report, "%-32s %6d words %7d cycles per pass\n", h.fn, h.words - w, h.cycles);
+        }
+    }
+    free(cls);
+    if (h.words > HACK_RAM_SIZE) {
+        snprintf(err, (size_t)errLen, "%d words do not fit in the 32K ROM", h.words);
+        return -1;
+    }
+    return h.words;
+}
+
+#ifdef TEST_HACKGEN
+#include "vminterp.h"
+#include "compiler.h"
+#include "opt.h"
+
+// usage: vmhack [-os DIR|-noos] [-O0] [-report] [-o FILE] DIR
+int main(int argc, char **argv) {
+    const char *dir = NULL, *osDir = "os", *outName = NULL;
+    int report = 0;
+    char err[256];
+
+    InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-os") && i + 1 < argc) osDir = argv[++i];
+        else if (!strcmp(argv[i], "-noos")) osDir = NULL;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) outName = argv[++i];
+        else if (!strcmp(argv[i], "-report")) report = 1;
+        else if (!strcmp(argv[i], "-O0")) {
+            optOptions.fold = optOptions.strength = optOptions.dce = 0;
+            optOptions.inlineThreshold = optOptions.ir = 0;
+        }
+        else dir = argv[i];
+    }
+    if (!dir) {
+        fprintf(stderr, "usage: vmhack [-os DIR|-noos] [-O0] [-report] [-o FILE] DIR\n");
+        return 2;
+    }
+
+    VmProgram *progs[2];
+    int nProgs = 0;
+    if (!(progs[nProgs++] = vmLoadDirectory(dir, err, sizeof(err))) ||
+        (osDir && !(progs[nProgs++] = vmLoadDirectory(osDir, err, sizeof(err))))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    FILE *out = outName ? fopen(outName, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "cannot write %s\n", outName);
+        return 1;
+    }
+    int words = vmToHack(progs, nProgs, out, report ? stderr : NULL, err, sizeof(err));
+    if (out != stdout) fclose(out);
+    if (words < 0) fprintf(stderr, "%s\n", err);
+    else fprintf(stderr, "%d words\n", words);
+
+    for (int i = 0; i < nProgs; i++)
+        vmFreeProgram(progs[i]);
+    StopCompiler();
+    return words < 0;
+}
+#endif
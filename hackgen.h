@@ -0,0 +1,19 @@
+#ifndef HACKGEN_H
+#define HACKGEN_H
+
+#include <stdio.h>
+#include "vm.h"
+
+// VM code to Hack assembly.
+// The top of the VM stack is kept in D between adjacent instructions of a
+// basic block; call, return and the comparisons go through shared routines
+// instead of being expanded at every use.
+
+// Translate the linked programs (earlier programs hide same-named classes
+// of later ones, as in vmLoad) into one .asm with bootstrap code.  Each
+// function is followed by a comment with its size and a cycle estimate,
+// also written to report if not NULL.  Returns the ROM size in words, -1
+// with a message in err on failure
+int vmToHack(VmProgram **progs, int nProgs, FILE *out, FILE *report, char *err, int errLen);
+
+#endif
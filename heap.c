@@ -0,0 +1,499 @@
+// heap.c
+/************************************************************************
+ Size-class heap: a generated Memory class
+
+ The OS Memory is first fit over one free list: alloc walks it, and a
+ program that creates and disposes many objects leaves it long and cut
+ into small pieces. With optOptions.sizeClassHeap a program with
+ Main.main and no Memory of its own gets this class instead; linked
+ before the OS it hides the OS one (Sys.init still calls Memory.init).
+
+ Blocks are segregated by size: class k < 16 holds blocks of k + 2
+ words, classes 16..24 blocks of 32, 64 .. 8192 words. A block is one
+ header word (the size asked for) and the data. Each class has its own
+ free list, so alloc and deAlloc are O(1): pop the list of the class,
+ else cut the block off the untouched top of the heap, else split the
+ first free block of a larger class (the tail goes onto the lists of
+ the classes it fills; a last single word is lost). Freed blocks are
+ never merged, and requests over 8191 words get Sys.error(6).
+
+ RAM 2048.. holds the list heads, the block size of each class and the
+ statistics words (HEAP_ALLOCS ...; counts kept modulo 10000 with a
+ second word for the ten thousands); the heap proper starts at 2108.
+ Statics: 0 heads, 1 sizes, 2 stats, 3 top. Memory.classOf$ is not a
+ Jack name: it marks the class as this one (intrinsics.c, vmrun).
+*************************************************************************/
+#include "opt.h"
+#include <string.h>
+
+static const char heapVm[] =
+    "function Memory.init 2\n"                 // local 0 class, 1 its block size
+    "push constant 2048\n"
+    "pop static 0\n"
+    "push constant 2073\n"
+    "pop static 1\n"
+    "push constant 2098\n"
+    "pop static 2\n"
+    "push constant 2108\n"
+    "pop static 3\n"
+    "push constant 0\n"
+    "pop local 0\n"
+    "push constant 2\n"
+    "pop local 1\n"
+    "label INIT_CLASS\n"
+    "push local 0\n"
+    "push constant 25\n"
+    "lt\n"
+    "not\n"
+    "if-goto INIT_STATS\n"
+    "push static 0\n"
+    "push local 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push constant 0\n"
+    "pop that 0\n"
+    "push static 1\n"
+    "push local 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push local 1\n"
+    "pop that 0\n"
+    // next size: 3 .. 17 one by one, then 32, 64 ..
+    "push local 1\n"
+    "push constant 17\n"
+    "lt\n"
+    "if-goto INIT_SMALL\n"
+    "push local 1\n"
+    "push constant 17\n"
+    "eq\n"
+    "if-goto INIT_POWER\n"
+    "push local 1\n"
+    "push local 1\n"
+    "add\n"
+    "pop local 1\n"
+    "goto INIT_NEXT\n"
+    "label INIT_POWER\n"
+    "push constant 32\n"
+    "pop local 1\n"
+    "goto INIT_NEXT\n"
+    "label INIT_SMALL\n"
+    "push local 1\n"
+    "push constant 1\n"
+    "add\n"
+    "pop local 1\n"
+    "label INIT_NEXT\n"
+    "push local 0\n"
+    "push constant 1\n"
+    "add\n"
+    "pop local 0\n"
+    "goto INIT_CLASS\n"
+    "label INIT_STATS\n"
+    "push constant 0\n"
+    "pop local 0\n"
+    "label INIT_STAT\n"
+    "push local 0\n"
+    "push constant 10\n"
+    "lt\n"
+    "not\n"
+    "if-goto INIT_DONE\n"
+    "push static 2\n"
+    "push local 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push constant 0\n"
+    "pop that 0\n"
+    "push local 0\n"
+    "push constant 1\n"
+    "add\n"
+    "pop local 0\n"
+    "goto INIT_STAT\n"
+    "label INIT_DONE\n"
+    "push constant 0\n"
+    "return\n"
+
+    "function Memory.peek 0\n"
+    "push argument 0\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "return\n"
+
+    "function Memory.poke 0\n"
+    "push argument 0\n"
+    "pop pointer 1\n"
+    "push argument 1\n"
+    "pop that 0\n"
+    "push constant 0\n"
+    "return\n"
+
+    // class of a block for size words of data (1 .. 8191)
+    "function Memory.classOf$ 2\n"             // local 0 class, 1 its block size
+    "push argument 0\n"
+    "push constant 17\n"
+    "lt\n"
+    "not\n"
+    "if-goto CLASS_POWER\n"
+    "push argument 0\n"
+    "push constant 1\n"
+    "sub\n"
+    "return\n"
+    "label CLASS_POWER\n"
+    "push constant 16\n"
+    "pop local 0\n"
+    "push constant 32\n"
+    "pop local 1\n"
+    "label CLASS_LOOP\n"
+    "push local 1\n"
+    "push argument 0\n"
+    "gt\n"
+    "if-goto CLASS_DONE\n"
+    "push local 1\n"
+    "push local 1\n"
+    "add\n"
+    "pop local 1\n"
+    "push local 0\n"
+    "push constant 1\n"
+    "add\n"
+    "pop local 0\n"
+    "goto CLASS_LOOP\n"
+    "label CLASS_DONE\n"
+    "push local 0\n"
+    "return\n"
+
+    // local 0 class, 1 block size, 2 block, 3 larger class, 4 tail, 5 tail words
+    "function Memory.alloc 6\n"
+    "push argument 0\n"
+    "push constant 1\n"
+    "lt\n"
+    "not\n"
+    "if-goto ALLOC_SIZE_OK\n"
+    "push constant 5\n"
+    "call Sys.error 1\n"
+    "pop temp 0\n"
+    "label ALLOC_SIZE_OK\n"
+    "push argument 0\n"
+    "push constant 8191\n"
+    "gt\n"
+    "not\n"
+    "if-goto ALLOC_FITS\n"
+    "push constant 6\n"
+    "call Sys.error 1\n"
+    "pop temp 0\n"
+    "label ALLOC_FITS\n"
+    "push argument 0\n"
+    "call Memory.classOf$ 1\n"
+    "pop local 0\n"
+    "push static 1\n"
+    "push local 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 1\n"
+    "push static 0\n"
+    "push local 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 2\n"
+    "push local 2\n"
+    "if-goto ALLOC_FROM_LIST\n"
+    // the untouched top of the heap
+    "push local 1\n"
+    "push constant 16384\n"
+    "push static 3\n"
+    "sub\n"
+    "gt\n"
+    "if-goto ALLOC_SPLIT\n"
+    "push static 3\n"
+    "pop local 2\n"
+    "push static 3\n"
+    "push local 1\n"
+    "add\n"
+    "pop static 3\n"
+    "goto ALLOC_DONE\n"
+    "label ALLOC_FROM_LIST\n"
+    "push static 0\n"
+    "push local 0\n"
+    "add\n"
+    "push local 2\n"
+    "pop pointer 1\n"
+    "push that 1\n"
+    "pop temp 0\n"
+    "pop pointer 1\n"
+    "push temp 0\n"
+    "pop that 0\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 7\n"
+    "push local 1\n"
+    "sub\n"
+    "pop that 7\n"
+    "goto ALLOC_DONE\n"
+    // a free block of a larger class
+    "label ALLOC_SPLIT\n"
+    "push local 0\n"
+    "pop local 3\n"
+    "label SPLIT_FIND\n"
+    "push local 3\n"
+    "push constant 1\n"
+    "add\n"
+    "pop local 3\n"
+    "push local 3\n"
+    "push constant 25\n"
+    "lt\n"
+    "if-goto SPLIT_LOOK\n"
+    "push constant 6\n"
+    "call Sys.error 1\n"
+    "pop temp 0\n"
+    "push constant 0\n"
+    "return\n"
+    "label SPLIT_LOOK\n"
+    "push static 0\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 2\n"
+    "push local 2\n"
+    "push constant 0\n"
+    "eq\n"
+    "if-goto SPLIT_FIND\n"
+    "push static 0\n"
+    "push local 3\n"
+    "add\n"
+    "push local 2\n"
+    "pop pointer 1\n"
+    "push that 1\n"
+    "pop temp 0\n"
+    "pop pointer 1\n"
+    "push temp 0\n"
+    "pop that 0\n"
+    "push static 1\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 5\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 7\n"
+    "push local 5\n"
+    "sub\n"
+    "pop that 7\n"
+    "push local 5\n"
+    "push local 1\n"
+    "sub\n"
+    "pop local 5\n"
+    "push local 2\n"
+    "push local 1\n"
+    "add\n"
+    "pop local 4\n"
+    // the tail onto the list of the largest class it fills, until under 2 words
+    "label SPLIT_TAIL\n"
+    "push local 5\n"
+    "push constant 2\n"
+    "lt\n"
+    "if-goto SPLIT_END\n"
+    "label SPLIT_CLASS\n"
+    "push local 3\n"
+    "push constant 1\n"
+    "sub\n"
+    "pop local 3\n"
+    "push static 1\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "push local 5\n"
+    "gt\n"
+    "if-goto SPLIT_CLASS\n"
+    "push static 0\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "push local 4\n"
+    "pop pointer 1\n"
+    "pop that 1\n"
+    "push static 0\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push local 4\n"
+    "pop that 0\n"
+    "push static 1\n"
+    "push local 3\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop temp 0\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 7\n"
+    "push temp 0\n"
+    "add\n"
+    "pop that 7\n"
+    "push local 4\n"
+    "push temp 0\n"
+    "add\n"
+    "pop local 4\n"
+    "push local 5\n"
+    "push temp 0\n"
+    "sub\n"
+    "pop local 5\n"
+    "goto SPLIT_TAIL\n"
+    "label SPLIT_END\n"
+    "push local 5\n"
+    "push constant 0\n"
+    "eq\n"
+    "if-goto ALLOC_DONE\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 9\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 9\n"
+    // header and statistics
+    "label ALLOC_DONE\n"
+    "push local 2\n"
+    "pop pointer 1\n"
+    "push argument 0\n"
+    "pop that 0\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 0\n"
+    "push that 0\n"
+    "push constant 10000\n"
+    "eq\n"
+    "not\n"
+    "if-goto ALLOC_COUNTED\n"
+    "push constant 0\n"
+    "pop that 0\n"
+    "push that 1\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 1\n"
+    "label ALLOC_COUNTED\n"
+    "push that 4\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 4\n"
+    "push that 5\n"
+    "push local 1\n"
+    "add\n"
+    "pop that 5\n"
+    "push that 8\n"
+    "push argument 0\n"
+    "add\n"
+    "pop that 8\n"
+    "push that 5\n"
+    "push that 6\n"
+    "gt\n"
+    "not\n"
+    "if-goto ALLOC_RETURN\n"
+    "push that 5\n"
+    "pop that 6\n"
+    "label ALLOC_RETURN\n"
+    "push local 2\n"
+    "push constant 1\n"
+    "add\n"
+    "return\n"
+
+    // local 0 block, 1 class, 2 block size, 3 size asked for
+    "function Memory.deAlloc 4\n"
+    "push argument 0\n"
+    "push constant 1\n"
+    "sub\n"
+    "pop local 0\n"
+    "push local 0\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 3\n"
+    "push local 3\n"
+    "call Memory.classOf$ 1\n"
+    "pop local 1\n"
+    "push static 1\n"
+    "push local 1\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "pop local 2\n"
+    "push static 0\n"
+    "push local 1\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "push local 0\n"
+    "pop pointer 1\n"
+    "pop that 1\n"
+    "push static 0\n"
+    "push local 1\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push local 0\n"
+    "pop that 0\n"
+    "push static 2\n"
+    "pop pointer 1\n"
+    "push that 2\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 2\n"
+    "push that 2\n"
+    "push constant 10000\n"
+    "eq\n"
+    "not\n"
+    "if-goto FREE_COUNTED\n"
+    "push constant 0\n"
+    "pop that 2\n"
+    "push that 3\n"
+    "push constant 1\n"
+    "add\n"
+    "pop that 3\n"
+    "label FREE_COUNTED\n"
+    "push that 4\n"
+    "push constant 1\n"
+    "sub\n"
+    "pop that 4\n"
+    "push that 5\n"
+    "push local 2\n"
+    "sub\n"
+    "pop that 5\n"
+    "push that 7\n"
+    "push local 2\n"
+    "add\n"
+    "pop that 7\n"
+    "push that 8\n"
+    "push local 3\n"
+    "sub\n"
+    "pop that 8\n"
+    "push constant 0\n"
+    "return\n"
+
+    // statistics word i, for the program itself
+    "function Memory.stat 0\n"
+    "push static 2\n"
+    "push argument 0\n"
+    "add\n"
+    "pop pointer 1\n"
+    "push that 0\n"
+    "return\n";
+
+int addSizeClassHeap(VmProgram *p) {
+    char err[256];
+    if (!optOptions.sizeClassHeap || vmFindClass(p, "Memory")) return 0;
+    FILE *f = fmemopen((void*)heapVm, strlen(heapVm), "r");
+    if (!f) return 0;
+    VmClass *c = vmReadClass(f, "Memory", err, sizeof(err));
+    fclose(f);
+    if (!c) {
+        fprintf(stderr, "%s\n", err);
+        return 0;
+    }
+    vmAddClass(p, c);
+    optStats.sizeClassHeap = 1;
+    if (optOptions.log)
+        fprintf(optOptions.log, "size-class heap: Memory generated (%d classes)\n", HEAP_CLASSES);
+    return 1;
+}
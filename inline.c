@@ -0,0 +1,169 @@
+// inline.c
+/************************************************************************
+ Small-function inlining at the VM level.
+
+ A call to a leaf function (no calls of its own) of at most
+ optOptions.inlineThreshold instructions is replaced by the callee's
+ body. The arguments are popped into fresh locals of the caller and
+ the callee's argument/local segments are remapped onto them:
+
+     argument k  =>  local base + k
+     local j     =>  local base + nArgs + j
+
+ Labels get a per-site suffix, and a return that is not the last
+ instruction becomes a jump to the end of the inlined body. A callee
+ that sets pointer 0 (a method) runs with the caller's pointer 0 saved
+ in one more local. A callee that touches static can only be inlined
+ into its own class, because statics are per class file.
+
+ With a profile (optOptions.profile) hot callees may be up to
+ HOT_INLINE_FACTOR times the threshold, and nothing is inlined into or
+ from functions the profiled run never entered.
+*************************************************************************/
+#include "opt.h"
+#include "callgraph.h"
+#include "pgo.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HOT_INLINE_FACTOR 4
+
+static int usesStatic(const VmFunction *f) {
+    for (int k = 0; k < f->len; k++)
+        if ((f->code[k].op == VM_PUSH || f->code[k].op == VM_POP) && f->code[k].seg == SEG_STATIC)
+            return 1;
+    return 0;
+}
+
+static int setsThis(const VmFunction *f) {
+    for (int k = 0; k < f->len; k++)
+        if (f->code[k].op == VM_POP && f->code[k].seg == SEG_POINTER && f->code[k].arg == 0)
+            return 1;
+    return 0;
+}
+
+// size limit for inlining callee `name`: with a profile, hot callees may
+// be larger and callees that never ran are not worth the code
+static int inlineLimit(const char *name) {
+    const Profile *prof = optOptions.profile;
+    if (!prof) return optOptions.inlineThreshold;
+    if (profileCalls(prof, name) == 0) return 0;
+    if (profileIsHot(prof, name)) return optOptions.inlineThreshold * HOT_INLINE_FACTOR;
+    return optOptions.inlineThreshold;
+}
+
+// callee node id if the call at `in` in class c may be inlined, else -1
+static int inlineTarget(const CallGraph *g, const VmClass *c, const VmInstr *in) {
+    int id = callGraphFind(g, vmStr(c, in->sym));
+    if (id < 0) return -1;
+    const CallNode *node = &g->nodes[id];
+    const VmFunction *f = &node->cls->funcs[node->fn];
+    if (node->nCalls > 0 || f->len > inlineLimit(node->name)) return -1;
+    if (node->cls != c && usesStatic(f)) return -1;
+    return id;
+}
+
+// append the body of callee f at the call site, f's arguments already on the stack
+static void expandCall(VmFunction *out, VmClass *c, const VmClass *fc, const VmFunction *f,
+                       int nArgs, int base, int site) {
+    char buf[160];
+    int save = base + nArgs + f->nLocals;    // slot for the caller's pointer 0
+    int saveThis = setsThis(f);
+    int endLabel = -1;
+
+    for (int a = nArgs - 1; a >= 0; a--)
+        vmEmit(out, VM_POP, SEG_LOCAL, base + a, -1);
+    for (int j = 0; j < f->nLocals; j++) {
+        vmEmit(out, VM_PUSH, SEG_CONSTANT, 0, -1);
+        vmEmit(out, VM_POP, SEG_LOCAL, base + nArgs + j, -1);
+    }
+    if (saveThis) {
+        vmEmit(out, VM_PUSH, SEG_POINTER, 0, -1);
+        vmEmit(out, VM_POP, SEG_LOCAL, save, -1);
+    }
+
+    for (int k = 0; k < f->len; k++) {
+        VmInstr in = f->code[k];
+        switch (in.op) {
+            case VM_PUSH:
+            case VM_POP:
+                if (in.seg == SEG_ARGUMENT) {
+                    in.seg = SEG_LOCAL;
+                    in.arg += base;
+                } else if (in.seg == SEG_LOCAL) {
+                    in.arg += base + nArgs;
+                }
+                break;
+            case VM_LABEL:
+            case VM_GOTO:
+            case VM_IF_GOTO:
+                snprintf(buf, sizeof(buf), "%s_INL%d", vmStr(fc, in.sym), site);
+                in.sym = vmString(c, buf);
+                break;
+            case VM_RETURN:
+                if (k == f->len - 1) continue;
+                if (endLabel < 0) {
+                    snprintf(buf, sizeof(buf), "INLINE_END%d", site);
+                    endLabel = vmString(c, buf);
+                }
+                in.op = VM_GOTO;
+                in.sym = endLabel;
+                break;
+        }
+        vmEmit(out, in.op, in.seg, in.arg, in.sym);
+    }
+    if (endLabel >= 0)
+        vmEmit(out, VM_LABEL, SEG_CONSTANT, 0, endLabel);
+    if (saveThis) {
+        // the return value stays on top of the stack
+        vmEmit(out, VM_PUSH, SEG_LOCAL, save, -1);
+        vmEmit(out, VM_POP, SEG_POINTER, 0, -1);
+    }
+}
+
+int inlineSmallFunctions(VmProgram *p) {
+    CallGraph *g = buildCallGraph(p);
+    int inlined = 0;
+
+    for (int id = 0; id < g->n; id++) {
+        VmClass *c = g->nodes[id].cls;
+        VmFunction *fn = &c->funcs[g->nodes[id].fn];
+        int k;
+        if (optOptions.profile && profileCalls(optOptions.profile, g->nodes[id].name) == 0)
+            continue;       // never ran: keep the calls, save the space
+        for (k = 0; k < fn->len; k++)
+            if (fn->code[k].op == VM_CALL && inlineTarget(g, c, &fn->code[k]) >= 0)
+                break;
+        if (k == fn->len) continue;
+
+        // rebuild the body; the inlined regions never overlap, so they
+        // all share the locals from the old nLocals upwards
+        VmFunction out;
+        memset(&out, 0, sizeof(out));
+        int base = fn->nLocals, need = fn->nLocals;
+        for (k = 0; k < fn->len; k++) {
+            const VmInstr *in = &fn->code[k];
+            int callee = in->op == VM_CALL ? inlineTarget(g, c, in) : -1;
+            if (callee < 0) {
+                vmEmit(&out, in->op, in->seg, in->arg, in->sym);
+                continue;
+            }
+            const CallNode *node = &g->nodes[callee];
+            const VmFunction *f = &node->cls->funcs[node->fn];
+            expandCall(&out, c, node->cls, f, in->arg, base, inlined);
+            int top = base + in->arg + f->nLocals + setsThis(f);
+            if (top > need) need = top;
+            if (optOptions.log)
+                fprintf(optOptions.log, "inline: %s into %s\n", node->name, g->nodes[id].name);
+            optStats.callsInlined++;
+            inlined++;
+        }
+        free(fn->code);
+        fn->code = out.code;
+        fn->len = out.len;
+        fn->cap = out.cap;
+        fn->nLocals = need;
+    }
+    freeCallGraph(g);
+    return inlined;
+}
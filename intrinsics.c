@@ -0,0 +1,350 @@
+// intrinsics.c
+/************************************************************************
+ Native OS intrinsics for the VM interpreter
+
+ Each routine is the Jack code of the OS stub in os/ done in C on
+ the same RAM: it reads the same statics and heap words (Math.twoToThe,
+ Screen.bit, the free list), writes the same ones, and leaves the
+ statics the Jack code would (Math.product after a division). Stores
+ through this and that still reach the console port. Where the Jack
+ code would call Sys.error the routine declines and the function is
+ interpreted, so the error output is the real one.
+
+ Left out of "the same": the dead stack above the return value, the
+ temp segment (dead across calls), and the counts of instructions and
+ calls. A routine is one interpreted instruction. The recursion of
+ Math.divPos cannot overflow the stack here.
+
+ A routine is bound only to the function of the OS program (linked
+ last), if that OS is the stub, and the Screen ones only when the Math
+ routines they call are bound too. The size-class Memory that heap.c
+ generates into a program has routines of its own, bound when the
+ program has that class.
+*************************************************************************/
+#include "intrinsics.h"
+#include "opt.h"
+#include <string.h>
+
+#define RAM_MASK (HACK_RAM_SIZE - 1)
+#define MAX_FREE_LIST HACK_RAM_SIZE   // Memory.alloc steps before giving up on a cycle
+
+typedef int16_t Int;
+
+typedef struct {
+    VmMachine *m;
+    Word *ram;
+    Word arg[4];
+    int statics;       // static 0 of the routine's class
+} Call;
+
+// statics of Math, for the Screen routines
+static int mathStatics;
+
+#define RAM(a) c->ram[(a) & RAM_MASK]
+
+// a store through this or that
+static void store(Call *c, int addr, Word v) {
+    addr &= RAM_MASK;
+    c->ram[addr] = v;
+    if (addr == JACK_OUTPUT_PORT) vmPortWrite(c->m, v);
+}
+
+//---------------------------------------------------------------------
+// Math: static 0 twoToThe, static 1 product
+//---------------------------------------------------------------------
+
+static Word multiply(Call *c, int statics, Word x, Word y) {
+    Word sum = 0, shifted = x, twoToThe = c->ram[statics];
+    for (int j = 0; j < 16; j++) {
+        if (y & RAM(twoToThe + j)) sum += shifted;
+        shifted += shifted;
+    }
+    return sum;
+}
+
+static Word absWord(Word x) {
+    return (Int)x < 0 ? (Word)-x : x;
+}
+
+// Math.divide without the y = 0 check; divPos leaves q * y in product
+static Word divide(Call *c, int statics, Word x, Word y) {
+    Word ax = absWord(x), ay = absWord(y);
+    Word q = (Int)ay > (Int)ax || (Int)ay < 0 ? 0 : (Word)((Int)ax / (Int)ay);
+    c->ram[statics + 1] = (Word)(q * ay);
+    return ((Int)x < 0) == ((Int)y < 0) ? q : (Word)-q;
+}
+
+static int mathMultiply(Call *c, Word *result) {
+    *result = multiply(c, c->statics, c->arg[0], c->arg[1]);
+    return 1;
+}
+
+static int mathDivide(Call *c, Word *result) {
+    if (c->arg[1] == 0) return 0;
+    *result = divide(c, c->statics, c->arg[0], c->arg[1]);
+    return 1;
+}
+
+static int mathSqrt(Call *c, Word *result) {
+    Word x = c->arg[0], y = 0, twoToThe = c->ram[c->statics];
+    if ((Int)x < 0) return 0;
+    for (int j = 7; j >= 0; j--) {
+        Word t = y + RAM(twoToThe + j);
+        Word tt = multiply(c, c->statics, t, t);
+        if (!((Int)tt > (Int)x) && (Int)tt > 0) y = t;
+    }
+    *result = y;
+    return 1;
+}
+
+//---------------------------------------------------------------------
+// String: field 0 chars, 1 length, 2 capacity
+//---------------------------------------------------------------------
+
+static int stringAppendChar(Call *c, Word *result) {
+    Word self = c->arg[0];
+    Word chars = RAM(self), length = RAM(self + 1);
+    if (!((Int)length < (Int)RAM(self + 2))) return 0;
+    store(c, chars + length, c->arg[1]);
+    store(c, self + 1, (Word)(length + 1));
+    *result = self;
+    return 1;
+}
+
+//---------------------------------------------------------------------
+// Memory: static 1 freeList
+//---------------------------------------------------------------------
+
+static int memoryAlloc(Call *c, Word *result) {
+    Word size = c->arg[0], need = (Word)(size + 1), prev = 0;
+    Word seg = c->ram[c->statics + 1];
+    if ((Int)size < 1) return 0;
+    for (int steps = 0; seg != 0 && steps < MAX_FREE_LIST; steps++) {
+        Word length = RAM(seg);
+        if (!((Int)length < (Int)need)) {
+            if ((Int)length > (Int)(Word)(need + 1)) {
+                // carve the block from the end of the segment
+                store(c, seg, (Word)(length - need));
+                Word block = (Word)(seg + RAM(seg));
+                store(c, block, need);
+                *result = (Word)(block + 1);
+                return 1;
+            }
+            if (prev == 0) c->ram[c->statics + 1] = RAM(seg + 1);
+            else store(c, prev + 1, RAM(seg + 1));
+            *result = (Word)(seg + 1);
+            return 1;
+        }
+        prev = seg;
+        seg = RAM(seg + 1);
+    }
+    // out of memory, or a free list that the Jack code would walk forever
+    return 0;
+}
+
+static int memoryDeAlloc(Call *c, Word *result) {
+    Word block = (Word)(c->arg[0] - 1);
+    store(c, block + 1, c->ram[c->statics + 1]);
+    c->ram[c->statics + 1] = block;
+    *result = 0;
+    return 1;
+}
+
+//---------------------------------------------------------------------
+// size-class Memory of heap.c: static 0 heads, 1 sizes, 2 stats, 3 top
+//---------------------------------------------------------------------
+
+// Memory.classOf$, for sizes 1 .. HEAP_MAX_REQUEST
+static int classOf(Word size) {
+    if ((Int)size < 17) return size - 1;
+    int k = 16;
+    for (Int b = 32; !(b > (Int)size); b = (Int)(b + b)) k++;
+    return k;
+}
+
+static void addStat(Call *c, Word stats, int i, Word d) {
+    store(c, stats + i, (Word)(RAM(stats + i) + d));
+}
+
+// a count kept modulo 10000 in word i, the ten thousands in word i + 1
+static void countStat(Call *c, Word stats, int i) {
+    addStat(c, stats, i, 1);
+    if (RAM(stats + i) == 10000) {
+        store(c, stats + i, 0);
+        addStat(c, stats, i + 1, 1);
+    }
+}
+
+static int sizeClassAlloc(Call *c, Word *result) {
+    Word size = c->arg[0];
+    Word heads = c->ram[c->statics], sizes = c->ram[c->statics + 1];
+    Word stats = c->ram[c->statics + 2], top = c->ram[c->statics + 3];
+    if ((Int)size < 1 || (Int)size > HEAP_MAX_REQUEST) return 0;
+    int k = classOf(size);
+    Word b = RAM(sizes + k), block = RAM(heads + k);
+    if (block) {
+        store(c, heads + k, RAM(block + 1));
+        addStat(c, stats, HEAP_FREE_WORDS, (Word)-b);
+    }
+    else if (!((Int)b > (Int)(Word)(HACK_SCREEN - top))) {
+        block = top;
+        c->ram[c->statics + 3] = (Word)(top + b);
+    }
+    else {
+        // split a block of a larger class; none left is Sys.error(6)
+        int j = k;
+        do {
+            if (++j >= HEAP_CLASSES) return 0;
+            block = RAM(heads + j);
+        } while (!block);
+        store(c, heads + j, RAM(block + 1));
+        Word r = RAM(sizes + j);
+        addStat(c, stats, HEAP_FREE_WORDS, (Word)-r);
+        r = (Word)(r - b);
+        Word tail = (Word)(block + b);
+        while (!((Int)r < 2)) {
+            do j--; while (j > 0 && (Int)RAM(sizes + j) > (Int)r);
+            store(c, tail + 1, RAM(heads + j));
+            store(c, heads + j, tail);
+            Word s = RAM(sizes + j);
+            addStat(c, stats, HEAP_FREE_WORDS, s);
+            tail = (Word)(tail + s);
+            r = (Word)(r - s);
+        }
+        if (r != 0) addStat(c, stats, HEAP_LOST_WORDS, 1);
+    }
+    store(c, block, size);
+    countStat(c, stats, HEAP_ALLOCS);
+    addStat(c, stats, HEAP_LIVE_BLOCKS, 1);
+    addStat(c, stats, HEAP_LIVE_WORDS, b);
+    addStat(c, stats, HEAP_REQUESTED_WORDS, size);
+    if ((Int)RAM(stats + HEAP_LIVE_WORDS) > (Int)RAM(stats + HEAP_PEAK_WORDS))
+        store(c, stats + HEAP_PEAK_WORDS, RAM(stats + HEAP_LIVE_WORDS));
+    *result = (Word)(block + 1);
+    return 1;
+}
+
+static int sizeClassDeAlloc(Call *c, Word *result) {
+    Word heads = c->ram[c->statics], sizes = c->ram[c->statics + 1], stats = c->ram[c->statics + 2];
+    Word block = (Word)(c->arg[0] - 1), size = RAM(block);
+    // a header no alloc wrote: the Jack code does what it does
+    if ((Int)size < 1 || (Int)size > HEAP_MAX_REQUEST) return 0;
+    int k = classOf(size);
+    Word b = RAM(sizes + k);
+    store(c, block + 1, RAM(heads + k));
+    store(c, heads + k, block);
+    countStat(c, stats, HEAP_FREES);
+    addStat(c, stats, HEAP_LIVE_BLOCKS, (Word)-1);
+    addStat(c, stats, HEAP_LIVE_WORDS, (Word)-b);
+    addStat(c, stats, HEAP_FREE_WORDS, b);
+    addStat(c, stats, HEAP_REQUESTED_WORDS, (Word)-size);
+    *result = 0;
+    return 1;
+}
+
+//---------------------------------------------------------------------
+// Screen: static 0 color, 1 screen, 2 bit
+//---------------------------------------------------------------------
+
+static void drawPixel(Call *c, Word x, Word y) {
+    Word address = (Word)(multiply(c, mathStatics, y, 32) + divide(c, mathStatics, x, 16));
+    Word color = c->ram[c->statics], screen = c->ram[c->statics + 1];
+    Word bit = RAM(c->ram[c->statics + 2] + (x & 15));
+    Word at = (Word)(screen + address);
+    store(c, at, color ? RAM(at) | bit : RAM(at) & (Word)~bit);
+}
+
+static int outside(Word x, Word y) {
+    return (Int)x < 0 || (Int)x > 511 || (Int)y < 0 || (Int)y > 255;
+}
+
+static int screenDrawPixel(Call *c, Word *result) {
+    if (outside(c->arg[0], c->arg[1])) return 0;
+    drawPixel(c, c->arg[0], c->arg[1]);
+    *result = 0;
+    return 1;
+}
+
+static int screenDrawRectangle(Call *c, Word *result) {
+    Int x1 = (Int)c->arg[0], y1 = (Int)c->arg[1], x2 = (Int)c->arg[2], y2 = (Int)c->arg[3];
+    if (x1 > x2 || y1 > y2 || outside((Word)x1, (Word)y1) || outside((Word)x2, (Word)y2)) return 0;
+    for (Int y = y1; y <= y2; y++)
+        for (Int x = x1; x <= x2; x++)
+            drawPixel(c, (Word)x, (Word)y);
+    *result = 0;
+    return 1;
+}
+
+//---------------------------------------------------------------------
+// binding
+//---------------------------------------------------------------------
+
+typedef struct {
+    const char *name;
+    int nArgs;
+    int needsMath;        // calls Math.multiply and Math.divide
+    int sizeClass;        // for the Memory of heap.c, not the OS stub
+    int (*run)(Call *c, Word *result);
+} Intrinsic;
+
+// index + 1 is VmFunc.intrinsic
+static const Intrinsic intrinsics[] = {
+    { "Math.multiply", 2, 0, 0, mathMultiply },
+    { "Math.divide", 2, 0, 0, mathDivide },
+    { "Math.sqrt", 1, 0, 0, mathSqrt },
+    { "String.appendChar", 2, 0, 0, stringAppendChar },
+    { "Memory.alloc", 1, 0, 0, memoryAlloc },
+    { "Memory.deAlloc", 1, 0, 0, memoryDeAlloc },
+    { "Memory.alloc", 1, 0, 1, sizeClassAlloc },
+    { "Memory.deAlloc", 1, 0, 1, sizeClassDeAlloc },
+    { "Screen.drawPixel", 2, 1, 0, screenDrawPixel },
+    { "Screen.drawRectangle", 4, 1, 0, screenDrawRectangle },
+};
+
+#define N_INTRINSICS ((int)(sizeof(intrinsics) / sizeof(intrinsics[0])))
+
+// the OS function of that name, -1 if absent or replaced by the program
+static int osFunc(const VmMachine *m, const char *name) {
+    int f = vmFindFunc(m, name);
+    if (f < 0 || m->nPrograms < 2 || m->funcs[f].program != m->nPrograms - 1) return -1;
+    return f;
+}
+
+// the function of that name in the program holding the size-class Memory
+static int heapFunc(const VmMachine *m, const char *name) {
+    int marker = vmFindFunc(m, HEAP_MARKER), f = vmFindFunc(m, name);
+    if (marker < 0 || f < 0 || m->funcs[f].program != m->funcs[marker].program) return -1;
+    return f;
+}
+
+int vmEnableIntrinsics(VmMachine *m, FILE *log) {
+    int bound = 0;
+    // Math.divPos only exists in the stub: another OS linked last gets none
+    int stub = osFunc(m, "Math.divPos") >= 0;
+    int multiplyF = osFunc(m, "Math.multiply"), divideF = osFunc(m, "Math.divide");
+    for (int i = 0; i < N_INTRINSICS; i++) {
+        const Intrinsic *in = &intrinsics[i];
+        if (!in->sizeClass && !stub) continue;
+        int f = in->sizeClass ? heapFunc(m, in->name) : osFunc(m, in->name);
+        if (f < 0) continue;
+        if (in->needsMath && (multiplyF < 0 || divideF < 0 ||
+                              !m->funcs[multiplyF].intrinsic || !m->funcs[divideF].intrinsic))
+            continue;
+        m->funcs[f].intrinsic = i + 1;
+        if (in->needsMath) mathStatics = m->funcs[multiplyF].statics;
+        bound++;
+        if (log) fprintf(log, "intrinsic: %s%s\n", in->name, in->sizeClass ? " (size classes)" : "");
+    }
+    return bound;
+}
+
+int vmRunIntrinsic(VmMachine *m, int f, Word *result) {
+    const Intrinsic *in = &intrinsics[m->funcs[f].intrinsic - 1];
+    Call c;
+    c.m = m;
+    c.ram = m->ram;
+    c.statics = m->funcs[f].statics;
+    for (int i = 0; i < in->nArgs; i++)
+        c.arg[i] = m->ram[(m->ram[HACK_ARG] + i) & RAM_MASK];
+    return in->run(&c, result);
+}
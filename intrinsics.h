@@ -0,0 +1,21 @@
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+#include <stdio.h>
+#include "vminterp.h"
+
+// Native C versions of hot OS stub routines (Math.multiply, Math.divide,
+// Math.sqrt, String.appendChar, Memory.alloc, Memory.deAlloc,
+// Screen.drawPixel, Screen.drawRectangle) for the interpreter. They leave
+// RAM outside the stack and the temp segment, the console output and
+// the return value as the Jack code would; error cases run the Jack code.
+
+// Bind the routines of the OS program (the last one given to vmLoad) that
+// the program did not replace. Returns the number bound; each is logged
+// to `log` if not NULL
+int vmEnableIntrinsics(VmMachine *m, FILE *log);
+// Run the routine bound to function f on the frame its call just built:
+// 1 with the return value in *result, 0 to interpret f instead
+int vmRunIntrinsic(VmMachine *m, int f, Word *result);
+
+#endif
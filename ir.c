@@ -0,0 +1,1103 @@
+// ir.c
+/************************************************************************
+ Mid-level IR: lifting VM code to registers and lowering it back.
+
+ Lifting runs the operand stack symbolically: every push makes a new
+ register and every consumer takes its operands off the symbolic stack.
+ Temp and pointer 1 only ever carry a value from one instruction to the
+ next in generated code (array stores, multiply chains, discarded call
+ results), so they become plain registers and array accesses become
+ loads and stores addressed by a register.
+
+ Lowering puts each register back on the operand stack where its single
+ use finds it on top, in order. A register used more than once, used in
+ another block, or buried under values needed first is spilled: stored
+ to a local of its own after its definition and pushed at each use.
+ Spills are found by simulating the stack and starting over whenever an
+ operand is not where the stack discipline needs it.
+*************************************************************************/
+#include "ir.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+//---------------------------------------------------------------------
+// construction
+//---------------------------------------------------------------------
+
+static int newInstr(IrFunction *ir, IrOp op) {
+    if (ir->nCode == ir->capCode) {
+        ir->capCode = ir->capCode ? ir->capCode * 2 : 64;
+        ir->code = realloc(ir->code, sizeof(IrInstr) * (size_t)ir->capCode);
+        if (!ir->code) abort();
+    }
+    IrInstr *in = &ir->code[ir->nCode];
+    memset(in, 0, sizeof(*in));
+    in->op = (unsigned char)op;
+    in->dst = in->a = in->b = -1;
+    return ir->nCode++;
+}
+
+// append to the last block
+static int addInstr(IrFunction *ir, IrOp op) {
+    int k = newInstr(ir, op);
+    ir->blocks[ir->nBlocks - 1].n++;
+    return k;
+}
+
+static int addBlock(IrFunction *ir, int label) {
+    if (ir->nBlocks == ir->capBlocks) {
+        ir->capBlocks = ir->capBlocks ? ir->capBlocks * 2 : 16;
+        ir->blocks = realloc(ir->blocks, sizeof(IrBlock) * (size_t)ir->capBlocks);
+        if (!ir->blocks) abort();
+    }
+    IrBlock *b = &ir->blocks[ir->nBlocks];
+    b->first = ir->nCode;
+    b->n = 0;
+    b->label = label;
+    b->nParams = 0;
+    return ir->nBlocks++;
+}
+
+static int addArgs(IrFunction *ir, const int *regs, int n) {
+    if (ir->nArgs + n > ir->capArgs) {
+        while (ir->nArgs + n > ir->capArgs)
+            ir->capArgs = ir->capArgs ? ir->capArgs * 2 : 64;
+        ir->args = realloc(ir->args, sizeof(int) * (size_t)ir->capArgs);
+        if (!ir->args) abort();
+    }
+    for (int i = 0; i < n; i++) ir->args[ir->nArgs++] = regs[i];
+    return ir->nArgs - n;
+}
+
+static int def(IrFunction *ir, int k) {
+    return ir->code[k].dst = ir->nRegs++;
+}
+
+void irFree(IrFunction *ir) {
+    if (!ir) return;
+    free(ir->code);
+    free(ir->blocks);
+    free(ir->args);
+    free(ir);
+}
+
+int irIsPure(int op) {
+    return op == IR_CONST || op == IR_LOAD || (op >= IR_NEG && op <= IR_EQ);
+}
+
+int irIsPureInstr(const IrFunction *ir, const IrInstr *in) {
+    if (in->op == IR_CALL)
+        return ir->pureMath && in->nArgs == 2 && !strcmp(vmStr(ir->cls, in->imm), "Math.multiply");
+    return irIsPure(in->op);
+}
+
+int irOperands(const IrFunction *ir, const IrInstr *in, int *out) {
+    int n = 0;
+    switch (in->op) {
+        case IR_LOAD:
+            if (in->seg == SEG_THAT) out[n++] = in->a;
+            break;
+        case IR_STORE:
+            if (in->seg == SEG_THAT) out[n++] = in->a;
+            out[n++] = in->b;
+            break;
+        case IR_NEG: case IR_NOT: case IR_RETURN:
+            out[n++] = in->a;
+            break;
+        case IR_ADD: case IR_SUB: case IR_AND: case IR_OR:
+        case IR_LT: case IR_GT: case IR_EQ:
+            out[n++] = in->a;
+            out[n++] = in->b;
+            break;
+        case IR_CALL: case IR_JUMP: case IR_BRANCH:
+            for (; n < in->nArgs; n++) out[n] = ir->args[in->args + n];
+            if (in->op == IR_BRANCH) out[n++] = in->a;
+            break;
+    }
+    return n;
+}
+
+int irMaxOperands(const IrFunction *ir) {
+    int m = 2;
+    for (int k = 0; k < ir->nCode; k++)
+        if (ir->code[k].nArgs + 1 > m) m = ir->code[k].nArgs + 1;
+    return m;
+}
+
+void irCountUses(const IrFunction *ir, int *uses) {
+    int *ops = malloc(sizeof(int) * (size_t)irMaxOperands(ir));
+    if (!ops) abort();
+    memset(uses, 0, sizeof(int) * (size_t)ir->nRegs);
+    for (int k = 0; k < ir->nCode; k++) {
+        int n = irOperands(ir, &ir->code[k], ops);
+        for (int i = 0; i < n; i++) uses[ops[i]]++;
+    }
+    free(ops);
+}
+
+int irRemoveDead(IrFunction *ir) {
+    int *uses = malloc(sizeof(int) * ((size_t)ir->nRegs + 1));
+    if (!uses) abort();
+    int removed = 0, changed = 1;
+    while (changed) {
+        changed = 0;
+        irCountUses(ir, uses);
+        for (int k = ir->nCode - 1; k >= 0; k--) {
+            IrInstr *in = &ir->code[k];
+            if (irIsPureInstr(ir, in) && uses[in->dst] == 0) {
+                in->op = IR_NOP;
+                removed++;
+                changed = 1;
+            }
+        }
+    }
+    free(uses);
+    return removed;
+}
+
+//---------------------------------------------------------------------
+// control flow
+//---------------------------------------------------------------------
+
+int irSuccessors(const IrFunction *ir, int b, int *succ) {
+    const IrBlock *blk = &ir->blocks[b];
+    const IrInstr *last = &ir->code[blk->first + blk->n - 1];
+    int n = 0;
+    if (blk->n == 0) return 0;
+    if (last->op == IR_JUMP || last->op == IR_BRANCH) succ[n++] = last->imm;
+    if (last->op == IR_BRANCH) succ[n++] = b + 1;
+    return n;
+}
+
+void irPredecessors(const IrFunction *ir, int *predStart, int *pred) {
+    int succ[2];
+    memset(predStart, 0, sizeof(int) * ((size_t)ir->nBlocks + 1));
+    for (int b = 0; b < ir->nBlocks; b++) {
+        int n = irSuccessors(ir, b, succ);
+        for (int i = 0; i < n; i++) predStart[succ[i] + 1]++;
+    }
+    for (int b = 0; b < ir->nBlocks; b++) predStart[b + 1] += predStart[b];
+    int *fill = malloc(sizeof(int) * ((size_t)ir->nBlocks + 1));
+    if (!fill) abort();
+    memcpy(fill, predStart, sizeof(int) * (size_t)ir->nBlocks);
+    for (int b = 0; b < ir->nBlocks; b++) {
+        int n = irSuccessors(ir, b, succ);
+        for (int i = 0; i < n; i++) pred[fill[succ[i]]++] = b;
+    }
+    free(fill);
+}
+
+// Cooper, Harvey and Kennedy's iteration over reverse postorder
+void irDominators(const IrFunction *ir, int *idom) {
+    int n = ir->nBlocks, nPost = 0, top = 0, succ[2];
+    int *post = malloc(sizeof(int) * ((size_t)n + 1));
+    int *rank = malloc(sizeof(int) * ((size_t)n + 1));
+    int *stack = malloc(sizeof(int) * ((size_t)n + 1));
+    int *next = calloc((size_t)n + 1, sizeof(int));
+    int *predStart = malloc(sizeof(int) * ((size_t)n + 1));
+    int *pred = malloc(sizeof(int) * ((size_t)n * 2 + 1));
+    if (!post || !rank || !stack || !next || !predStart || !pred) abort();
+    for (int b = 0; b < n; b++) {
+        idom[b] = -1;
+        rank[b] = -1;
+    }
+    // iterative depth-first search for the postorder
+    rank[0] = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int b = stack[top - 1], ns = irSuccessors(ir, b, succ);
+        if (next[b] < ns) {
+            int s = succ[next[b]++];
+            if (rank[s] < 0) {
+                rank[s] = 0;
+                stack[top++] = s;
+            }
+        } else {
+            rank[b] = nPost;
+            post[nPost++] = b;
+            top--;
+        }
+    }
+    irPredecessors(ir, predStart, pred);
+    idom[0] = 0;
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = nPost - 2; i >= 0; i--) {
+            int b = post[i], d = -1;
+            for (int k = predStart[b]; k < predStart[b + 1]; k++) {
+                int p = pred[k];
+                if (idom[p] < 0) continue;
+                if (d < 0) { d = p; continue; }
+                int x = p, y = d;
+                while (x != y) {
+                    while (rank[x] < rank[y]) x = idom[x];
+                    while (rank[y] < rank[x]) y = idom[y];
+                }
+                d = x;
+            }
+            if (d != idom[b]) {
+                idom[b] = d;
+                changed = 1;
+            }
+        }
+    }
+    free(post);
+    free(rank);
+    free(stack);
+    free(next);
+    free(predStart);
+    free(pred);
+}
+
+int irDominates(const int *idom, int a, int b) {
+    if (idom[b] < 0) return 0;
+    for (;;) {
+        if (a == b) return 1;
+        if (b == 0) return 0;
+        b = idom[b];
+    }
+}
+
+int irLoopBody(const IrFunction *ir, const int *idom, const int *predStart, const int *pred,
+               int h, char *inLoop, int *work) {
+    int n = 1, top = 0;
+    memset(inLoop, 0, (size_t)ir->nBlocks);
+    inLoop[h] = 1;
+    for (int k = predStart[h]; k < predStart[h + 1]; k++) {
+        int t = pred[k];
+        if (irDominates(idom, h, t) && !inLoop[t]) {
+            inLoop[t] = 1;
+            n++;
+            work[top++] = t;
+        }
+    }
+    while (top > 0) {
+        int b = work[--top];
+        for (int k = predStart[b]; k < predStart[b + 1]; k++) {
+            int p = pred[k];
+            if (inLoop[p] || idom[p] < 0) continue;
+            inLoop[p] = 1;
+            n++;
+            work[top++] = p;
+        }
+    }
+    return n;
+}
+
+int irMakePreheader(IrFunction *ir, const int *predStart, const int *pred, const char *inLoop,
+                    int h, int *header) {
+    int outside = -1, nOutside = 0;
+    for (int k = predStart[h]; k < predStart[h + 1]; k++)
+        if (!inLoop[pred[k]]) {
+            outside = pred[k];
+            nOutside++;
+        }
+    if (nOutside == 1 && outside + 1 != h) {
+        const IrBlock *blk = &ir->blocks[outside];
+        IrInstr *last = &ir->code[blk->first + blk->n - 1];
+        if (last->op == IR_JUMP) {
+            // "goto header" moves into the preheader placed right after it
+            int pre = irInsertBlock(ir, outside + 1);
+            last = &ir->code[ir->blocks[outside].first + ir->blocks[outside].n - 1];
+            last->imm = pre;
+            *header = h >= pre ? h + 1 : h;
+            return pre;
+        }
+    }
+    if (h > 0 && inLoop[h - 1]) {
+        // the loop falls into its header from just above: no room
+        const IrBlock *blk = &ir->blocks[h - 1];
+        const IrInstr *last = &ir->code[blk->first + blk->n - 1];
+        if (last->op == IR_BRANCH || (last->op == IR_JUMP && last->imm == h)) return -1;
+    }
+    char *from = calloc((size_t)ir->nBlocks + 1, 1);
+    if (!from) abort();
+    for (int k = predStart[h]; k < predStart[h + 1]; k++)
+        if (!inLoop[pred[k]]) from[pred[k]] = 1;
+    int pre = irInsertBlock(ir, h);
+    for (int b = 0; b < ir->nBlocks; b++) {
+        int old = b > pre ? b - 1 : b;
+        if (b == pre || !from[old]) continue;
+        IrInstr *last = &ir->code[ir->blocks[b].first + ir->blocks[b].n - 1];
+        if ((last->op == IR_JUMP || last->op == IR_BRANCH) && last->imm == h + 1) last->imm = pre;
+    }
+    free(from);
+    *header = h + 1;
+    return pre;
+}
+
+int irInsertBlock(IrFunction *ir, int pos) {
+    addBlock(ir, -1);
+    memmove(&ir->blocks[pos + 1], &ir->blocks[pos], sizeof(IrBlock) * (size_t)(ir->nBlocks - 1 - pos));
+    ir->blocks[pos].first = ir->nCode;
+    ir->blocks[pos].n = 0;
+    ir->blocks[pos].label = -1;
+    ir->blocks[pos].nParams = 0;
+    for (int k = 0; k < ir->nCode; k++) {
+        IrInstr *in = &ir->code[k];
+        if ((in->op == IR_JUMP || in->op == IR_BRANCH) && in->imm >= pos) in->imm++;
+    }
+    return pos;
+}
+
+void irAppendInstr(IrFunction *ir, int b, const IrInstr *in) {
+    IrInstr copy = *in;
+    if (ir->blocks[b].first + ir->blocks[b].n != ir->nCode) {
+        // move the block to the end of code, leaving NOPs behind
+        int first = ir->nCode;
+        for (int i = 0; i < ir->blocks[b].n; i++) {
+            int k = newInstr(ir, IR_NOP), old = ir->blocks[b].first + i;
+            ir->code[k] = ir->code[old];
+            ir->code[old].op = IR_NOP;
+            ir->code[old].dst = -1;
+            ir->code[old].nArgs = 0;
+        }
+        ir->blocks[b].first = first;
+    }
+    int k = newInstr(ir, IR_NOP);
+    ir->code[k] = copy;
+    ir->blocks[b].n++;
+}
+
+void irInsertInstr(IrFunction *ir, int b, int i, const IrInstr *in) {
+    irAppendInstr(ir, b, in);
+    IrBlock *blk = &ir->blocks[b];
+    IrInstr t = ir->code[blk->first + blk->n - 1];
+    memmove(&ir->code[blk->first + i + 1], &ir->code[blk->first + i], sizeof(IrInstr) * (size_t)(blk->n - 1 - i));
+    ir->code[blk->first + i] = t;
+}
+
+//---------------------------------------------------------------------
+// lifting VM code
+//---------------------------------------------------------------------
+
+typedef struct {
+    int start, end;      // VM instructions [start, end)
+    int depth;           // stack depth on entry, -1 = not reached
+    int irBlock;
+} VmBlock;
+
+static int isTerminator(int op) {
+    return op == VM_GOTO || op == VM_IF_GOTO || op == VM_RETURN;
+}
+
+static int findLabel(const VmBlock *bs, int n, const VmFunction *f, int sym) {
+    for (int i = 0; i < n; i++)
+        if (f->code[bs[i].start].op == VM_LABEL && f->code[bs[i].start].sym == sym)
+            return i;
+    return -1;
+}
+
+static int stackEffect(const VmInstr *in) {
+    switch (in->op) {
+        case VM_PUSH: return 1;
+        case VM_POP: case VM_IF_GOTO: return -1;
+        case VM_ADD: case VM_SUB: case VM_AND: case VM_OR:
+        case VM_EQ: case VM_GT: case VM_LT: return -1;
+        case VM_CALL: return 1 - in->arg;
+        default: return 0;
+    }
+}
+
+// values the instruction takes off the stack
+static int stackNeed(const VmInstr *in) {
+    switch (in->op) {
+        case VM_POP: case VM_NEG: case VM_NOT: case VM_IF_GOTO: case VM_RETURN: return 1;
+        case VM_ADD: case VM_SUB: case VM_AND: case VM_OR:
+        case VM_EQ: case VM_GT: case VM_LT: return 2;
+        case VM_CALL: return in->arg;
+        default: return 0;
+    }
+}
+
+// entry depth of every block reachable from the first; 0 if inconsistent
+static int blockDepths(const VmFunction *f, VmBlock *bs, int n, const int *target, int *maxDepth) {
+    int *work = malloc(sizeof(int) * ((size_t)n + 1)), top = 0;
+    if (!work) abort();
+    bs[0].depth = 0;
+    work[top++] = 0;
+    *maxDepth = 0;
+    while (top > 0) {
+        int b = work[--top], d = bs[b].depth, succ[2], nSucc = 0;
+        for (int k = bs[b].start; k < bs[b].end; k++) {
+            if (d < stackNeed(&f->code[k])) goto bad;
+            d += stackEffect(&f->code[k]);
+            if (d > *maxDepth) *maxDepth = d;
+        }
+        int last = f->code[bs[b].end - 1].op;
+        if (last == VM_GOTO || last == VM_IF_GOTO) succ[nSucc++] = target[b];
+        if (last != VM_GOTO && last != VM_RETURN) {
+            if (b + 1 == n) goto bad;            // runs off the end of the function
+            succ[nSucc++] = b + 1;
+        }
+        for (int s = 0; s < nSucc; s++) {
+            if (bs[succ[s]].depth < 0) {
+                bs[succ[s]].depth = d;
+                work[top++] = succ[s];
+            } else if (bs[succ[s]].depth != d) goto bad;
+        }
+    }
+    free(work);
+    return 1;
+bad:
+    free(work);
+    return 0;
+}
+
+IrFunction* irBuild(VmClass *c, const VmFunction *f) {
+    if (f->len == 0) return NULL;
+    // VM basic blocks: a label starts one, a jump or return ends one
+    VmBlock *bs = malloc(sizeof(VmBlock) * ((size_t)f->len + 1));
+    int *target = malloc(sizeof(int) * ((size_t)f->len + 1));
+    if (!bs || !target) abort();
+    int n = 0;
+    for (int k = 0; k < f->len; k++) {
+        if (k == 0 || f->code[k].op == VM_LABEL || isTerminator(f->code[k - 1].op)) {
+            if (n > 0) bs[n - 1].end = k;
+            bs[n].start = k;
+            bs[n].depth = -1;
+            bs[n].irBlock = -1;
+            n++;
+        }
+    }
+    bs[n - 1].end = f->len;
+    for (int b = 0; b < n; b++) {
+        const VmInstr *last = &f->code[bs[b].end - 1];
+        target[b] = -1;
+        if (last->op == VM_GOTO || last->op == VM_IF_GOTO) {
+            target[b] = findLabel(bs, n, f, last->sym);
+            if (target[b] < 0) goto fail;
+        }
+    }
+    int maxDepth;
+    if (!blockDepths(f, bs, n, target, &maxDepth)) goto fail;
+
+    IrFunction *ir = calloc(1, sizeof(IrFunction));
+    if (!ir) abort();
+    ir->cls = c;
+    ir->name = f->name;
+    ir->nLocals = f->nLocals;
+    int nIr = 0;
+    for (int b = 0; b < n; b++)
+        if (bs[b].depth >= 0) bs[b].irBlock = nIr++;
+
+    int *stack = malloc(sizeof(int) * ((size_t)maxDepth + 1));
+    if (!stack) abort();
+    for (int b = 0; b < n; b++) {
+        if (bs[b].depth < 0) continue;          // unreachable
+        int sp = 0, temp[8], that = -1, k, j;
+        const VmInstr *first = &f->code[bs[b].start];
+        for (int t = 0; t < 8; t++) temp[t] = -1;
+        addBlock(ir, first->op == VM_LABEL ? first->sym : -1);
+        ir->blocks[bs[b].irBlock].nParams = bs[b].depth;
+
+        for (int d = 0; d < bs[b].depth; d++) {
+            k = addInstr(ir, IR_PARAM);
+            ir->code[k].imm = d;
+            stack[sp++] = def(ir, k);
+        }
+        for (int pc = bs[b].start; pc < bs[b].end; pc++) {
+            const VmInstr *in = &f->code[pc];
+            switch (in->op) {
+                case VM_PUSH:
+                    if (in->seg == SEG_TEMP || (in->seg == SEG_POINTER && in->arg == 1)) {
+                        int v = in->seg == SEG_TEMP ? (in->arg < 8 ? temp[in->arg] : -1) : that;
+                        if (v < 0) goto failIr;
+                        stack[sp++] = v;
+                        break;
+                    }
+                    if (in->seg == SEG_CONSTANT) {
+                        k = addInstr(ir, IR_CONST);
+                        ir->code[k].imm = in->arg;
+                    } else {
+                        if (in->seg == SEG_THAT && that < 0) goto failIr;
+                        k = addInstr(ir, IR_LOAD);
+                        ir->code[k].seg = in->seg;
+                        ir->code[k].imm = in->arg;
+                        if (in->seg == SEG_THAT) ir->code[k].a = that;
+                    }
+                    stack[sp++] = def(ir, k);
+                    break;
+                case VM_POP:
+                    sp--;
+                    if (in->seg == SEG_TEMP) {
+                        if (in->arg >= 8) goto failIr;
+                        temp[in->arg] = stack[sp];
+                        break;
+                    }
+                    if (in->seg == SEG_POINTER && in->arg == 1) {
+                        that = stack[sp];
+                        break;
+                    }
+                    if (in->seg == SEG_CONSTANT || (in->seg == SEG_THAT && that < 0)) goto failIr;
+                    k = addInstr(ir, IR_STORE);
+                    ir->code[k].seg = in->seg;
+                    ir->code[k].imm = in->arg;
+                    ir->code[k].b = stack[sp];
+                    if (in->seg == SEG_THAT) ir->code[k].a = that;
+                    break;
+                case VM_NEG: case VM_NOT:
+                    k = addInstr(ir, in->op == VM_NEG ? IR_NEG : IR_NOT);
+                    ir->code[k].a = stack[sp - 1];
+                    stack[sp - 1] = def(ir, k);
+                    break;
+                case VM_ADD: case VM_SUB: case VM_AND: case VM_OR:
+                case VM_LT: case VM_GT: case VM_EQ: {
+                    static const unsigned char ops[] = {
+                        [VM_ADD] = IR_ADD, [VM_SUB] = IR_SUB, [VM_AND] = IR_AND, [VM_OR] = IR_OR,
+                        [VM_LT] = IR_LT, [VM_GT] = IR_GT, [VM_EQ] = IR_EQ
+                    };
+                    k = addInstr(ir, ops[in->op]);
+                    ir->code[k].a = stack[sp - 2];
+                    ir->code[k].b = stack[sp - 1];
+                    sp--;
+                    stack[sp - 1] = def(ir, k);
+                    break;
+                }
+                case VM_CALL:
+                    sp -= in->arg;
+                    j = addArgs(ir, stack + sp, in->arg);
+                    k = addInstr(ir, IR_CALL);
+                    ir->code[k].imm = in->sym;
+                    ir->code[k].args = j;
+                    ir->code[k].nArgs = in->arg;
+                    stack[sp++] = def(ir, k);
+                    break;
+                case VM_LABEL:
+                    break;
+                case VM_GOTO:
+                case VM_IF_GOTO:
+                    if (in->op == VM_IF_GOTO) sp--;
+                    j = addArgs(ir, stack, sp);
+                    k = addInstr(ir, in->op == VM_GOTO ? IR_JUMP : IR_BRANCH);
+                    ir->code[k].imm = bs[target[b]].irBlock;
+                    ir->code[k].args = j;
+                    ir->code[k].nArgs = sp;
+                    if (in->op == VM_IF_GOTO) ir->code[k].a = stack[sp];
+                    break;
+                case VM_RETURN:
+                    k = addInstr(ir, IR_RETURN);
+                    ir->code[k].a = stack[sp - 1];
+                    break;
+            }
+        }
+        int last = f->code[bs[b].end - 1].op;
+        if (last != VM_GOTO && last != VM_RETURN && last != VM_IF_GOTO) {
+            // falls through into the next block
+            j = addArgs(ir, stack, sp);
+            k = addInstr(ir, IR_JUMP);
+            ir->code[k].imm = bs[b + 1].irBlock;
+            ir->code[k].args = j;
+            ir->code[k].nArgs = sp;
+        }
+    }
+    free(stack);
+    free(bs);
+    free(target);
+    return ir;
+
+failIr:
+    free(stack);
+    irFree(ir);
+fail:
+    free(bs);
+    free(target);
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+// lowering to stack code
+//---------------------------------------------------------------------
+
+#define SPILL_MARK (-2)      // sym of a push/pop whose arg is a register, not yet a local
+
+typedef struct {
+    IrFunction *ir;
+    VmFunction out;
+    int *uses, *spill, *defBlock, *crossBlock;
+    int *stack, sp;
+    int *ops;
+    int *blockLabel;
+    char *reuse;         // per instruction: pointer 1 already holds the address
+    char *early;         // per register: goes to pointer 1 as soon as computed
+} Lowering;
+
+static void out(Lowering *L, VmOp op, VmSegment seg, int arg, int sym) {
+    vmEmit(&L->out, op, seg, arg, sym);
+}
+
+static void pushReg(Lowering *L, int r) { out(L, VM_PUSH, SEG_LOCAL, r, SPILL_MARK); }
+static void popReg(Lowering *L, int r)  { out(L, VM_POP, SEG_LOCAL, r, SPILL_MARK); }
+
+static void pushConstant(Lowering *L, int v) {
+    v = wrap16(v);
+    if (v >= 0) {
+        out(L, VM_PUSH, SEG_CONSTANT, v, -1);
+    } else if (v == -32768) {
+        out(L, VM_PUSH, SEG_CONSTANT, 32767, -1);
+        out(L, VM_NEG, SEG_CONSTANT, 0, -1);
+        out(L, VM_PUSH, SEG_CONSTANT, 1, -1);
+        out(L, VM_SUB, SEG_CONSTANT, 0, -1);
+    } else {
+        out(L, VM_PUSH, SEG_CONSTANT, -v, -1);
+        out(L, VM_NEG, SEG_CONSTANT, 0, -1);
+    }
+}
+
+// take the operands of an instruction off the simulated stack: the ones
+// still on the stack must be a prefix of ops sitting on top in order.
+// Returns 0 after marking what has to spill instead
+static int takeOperands(Lowering *L, const int *ops, int n) {
+    int r = 0, bad = 0;
+    while (r < n && !L->spill[ops[r]]) r++;
+    for (int i = r; i < n; i++)
+        if (!L->spill[ops[i]]) { L->spill[ops[i]] = 1; bad = 1; }
+    for (int i = 0; i < r; i++) {
+        int at = L->sp - r + i;
+        if (at < 0 || L->stack[at] != ops[i]) { L->spill[ops[i]] = 1; bad = 1; }
+    }
+    if (bad) return 0;
+    L->sp -= r;
+    return 1;
+}
+
+static void defined(Lowering *L, int r, int isCall) {
+    if (L->early[r]) {
+        out(L, VM_POP, SEG_POINTER, 1, -1);
+    } else if (L->uses[r] == 0) {
+        if (isCall) out(L, VM_POP, SEG_TEMP, 0, -1);
+    } else if (L->spill[r]) {
+        popReg(L, r);
+    } else {
+        L->stack[L->sp++] = r;
+    }
+}
+
+static int lowerBlock(Lowering *L, int b) {
+    static const VmOp binOps[] = {
+        [IR_ADD] = VM_ADD, [IR_SUB] = VM_SUB, [IR_AND] = VM_AND, [IR_OR] = VM_OR,
+        [IR_LT] = VM_LT, [IR_GT] = VM_GT, [IR_EQ] = VM_EQ
+    };
+    IrFunction *ir = L->ir;
+    const IrBlock *blk = &ir->blocks[b];
+    if (L->blockLabel[b] >= 0) out(L, VM_LABEL, SEG_CONSTANT, 0, L->blockLabel[b]);
+
+    // incoming stack values: keep them there if each is used once here in
+    // order, otherwise move all of them to locals
+    L->sp = 0;
+    int spillParams = 0;
+    for (int i = 0; i < blk->nParams; i++) {
+        int r = ir->code[blk->first + i].dst;
+        if (L->spill[r] || L->uses[r] == 0) spillParams = 1;
+    }
+    for (int i = blk->nParams - 1; i >= 0; i--) {
+        int r = ir->code[blk->first + i].dst;
+        if (!spillParams) continue;
+        if (L->uses[r]) { L->spill[r] = 1; popReg(L, r); }
+        else out(L, VM_POP, SEG_TEMP, 0, -1);
+    }
+    if (!spillParams)
+        for (int i = 0; i < blk->nParams; i++)
+            L->stack[L->sp++] = ir->code[blk->first + i].dst;
+
+    for (int k = blk->first + blk->nParams; k < blk->first + blk->n; k++) {
+        const IrInstr *in = &ir->code[k];
+        if (in->op == IR_NOP) continue;
+        int n = irOperands(ir, in, L->ops);
+        if ((in->op == IR_LOAD || in->op == IR_STORE) && in->seg == SEG_THAT &&
+            (L->reuse[k] || L->early[in->a])) {
+            // pointer 1 is set: only the stored value is an operand
+            if (n == 2) L->ops[0] = L->ops[1];
+            if (!takeOperands(L, L->ops, n - 1)) return 0;
+            if (in->op == IR_STORE) {
+                if (L->spill[in->b]) pushReg(L, in->b);
+                out(L, VM_POP, SEG_THAT, in->imm, -1);
+            } else {
+                out(L, VM_PUSH, SEG_THAT, in->imm, -1);
+                defined(L, in->dst, 0);
+            }
+            continue;
+        }
+        if (!takeOperands(L, L->ops, n)) return 0;
+        if (in->op == IR_STORE && in->seg == SEG_THAT) {
+            if (!L->spill[in->a] && !L->spill[in->b]) {
+                out(L, VM_POP, SEG_TEMP, 0, -1);
+                out(L, VM_POP, SEG_POINTER, 1, -1);
+                out(L, VM_PUSH, SEG_TEMP, 0, -1);
+            } else {
+                if (L->spill[in->a]) pushReg(L, in->a);
+                out(L, VM_POP, SEG_POINTER, 1, -1);
+                if (L->spill[in->b]) pushReg(L, in->b);
+            }
+            out(L, VM_POP, SEG_THAT, in->imm, -1);
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            if (L->spill[L->ops[i]]) pushReg(L, L->ops[i]);
+        switch (in->op) {
+            case IR_CONST:
+                pushConstant(L, in->imm);
+                break;
+            case IR_LOAD:
+                if (in->seg == SEG_THAT) out(L, VM_POP, SEG_POINTER, 1, -1);
+                out(L, VM_PUSH, in->seg, in->imm, -1);
+                break;
+            case IR_STORE:
+                out(L, VM_POP, in->seg, in->imm, -1);
+                break;
+            case IR_NEG: case IR_NOT:
+                out(L, in->op == IR_NEG ? VM_NEG : VM_NOT, SEG_CONSTANT, 0, -1);
+                break;
+            case IR_CALL:
+                out(L, VM_CALL, SEG_CONSTANT, in->nArgs, in->imm);
+                break;
+            case IR_JUMP:
+                if (in->imm != b + 1)
+                    out(L, VM_GOTO, SEG_CONSTANT, 0, L->blockLabel[in->imm]);
+                break;
+            case IR_BRANCH:
+                out(L, VM_IF_GOTO, SEG_CONSTANT, 0, L->blockLabel[in->imm]);
+                break;
+            case IR_RETURN:
+                out(L, VM_RETURN, SEG_CONSTANT, 0, -1);
+                break;
+            default:
+                out(L, binOps[in->op], SEG_CONSTANT, 0, -1);
+                break;
+        }
+        if (in->dst >= 0) defined(L, in->dst, in->op == IR_CALL);
+    }
+    // nothing may stay behind but what the last instruction passed on
+    if (L->sp > 0) {
+        for (int i = 0; i < L->sp; i++) L->spill[L->stack[i]] = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// labels of the blocks jumped to, other than by falling through; blocks
+// that came without one get a fresh name
+static void labelBlocks(Lowering *L) {
+    IrFunction *ir = L->ir;
+    char buf[64];
+    int next = 0, id;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        const char *s = ir->blocks[b].label >= 0 ? vmStr(ir->cls, ir->blocks[b].label) : "";
+        if (sscanf(s, "IR_BLOCK%d", &id) == 1 && id >= next) next = id + 1;
+        L->blockLabel[b] = -1;
+    }
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            const IrInstr *in = &ir->code[k];
+            int t = in->imm;
+            if (in->op != IR_BRANCH && (in->op != IR_JUMP || t == b + 1)) continue;
+            if (ir->blocks[t].label < 0) {
+                snprintf(buf, sizeof(buf), "IR_BLOCK%d", next++);
+                ir->blocks[t].label = vmString(ir->cls, buf);
+            }
+            L->blockLabel[t] = ir->blocks[t].label;
+        }
+}
+
+// where spilled registers live: temp 1-7 (less those holding promoted
+// locals) for a register whose pushes and pops are all in one block with
+// no call in between (temp 0 is scratch for array stores), otherwise a local of its own for registers living
+// across blocks, or a local shared with others once its last push is done
+#define SPILL_TEMPS 7
+
+static int assignSlots(Lowering *L) {
+    IrFunction *ir = L->ir;
+    VmFunction *f = &L->out;
+    int nRegs = ir->nRegs;
+    int *slot = malloc(sizeof(int) * ((size_t)nRegs + 1));
+    int *inTemp = calloc((size_t)nRegs + 1, sizeof(int));
+    int *first = malloc(sizeof(int) * ((size_t)nRegs + 1));
+    int *last = malloc(sizeof(int) * ((size_t)nRegs + 1));
+    int *calls = malloc(sizeof(int) * ((size_t)f->len + 1));
+    int *freeSlots = malloc(sizeof(int) * ((size_t)nRegs + 1));
+    if (!slot || !inTemp || !first || !last || !calls || !freeSlots) abort();
+    int nSlots = 0, nFree = 0, freeTemps[SPILL_TEMPS], nFreeTemps = SPILL_TEMPS - ir->tempsHeld;
+    for (int t = 0; t < nFreeTemps; t++) freeTemps[t] = nFreeTemps - t;
+    for (int r = 0; r < nRegs; r++)
+        slot[r] = first[r] = last[r] = -1;
+    for (int k = 0; k < f->len; k++) {
+        if (f->code[k].sym != SPILL_MARK) continue;
+        int r = f->code[k].arg;
+        if (first[r] < 0) first[r] = k;
+        last[r] = k;
+    }
+    calls[0] = 0;
+    for (int k = 0; k < f->len; k++)
+        calls[k + 1] = calls[k] + (f->code[k].op == VM_CALL);
+    for (int r = 0; r < nRegs; r++)
+        if (last[r] >= 0 && L->crossBlock[r]) slot[r] = nSlots++;
+    for (int k = 0; k < f->len; k++) {
+        VmInstr *in = &f->code[k];
+        if (in->sym != SPILL_MARK) continue;
+        int r = in->arg;
+        if (slot[r] < 0) {
+            if (calls[last[r]] == calls[first[r]] && nFreeTemps > 0) {
+                inTemp[r] = 1;
+                slot[r] = freeTemps[--nFreeTemps];
+            } else {
+                slot[r] = nFree > 0 ? freeSlots[--nFree] : nSlots++;
+            }
+        }
+        in->seg = inTemp[r] ? SEG_TEMP : SEG_LOCAL;
+        in->arg = inTemp[r] ? slot[r] : ir->nLocals + slot[r];
+        in->sym = -1;
+        if (last[r] == k && !L->crossBlock[r]) {
+            if (inTemp[r]) freeTemps[nFreeTemps++] = slot[r];
+            else freeSlots[nFree++] = slot[r];
+        }
+    }
+    free(slot);
+    free(inTemp);
+    free(first);
+    free(last);
+    free(calls);
+    free(freeSlots);
+    return nSlots;
+}
+
+static int isThatAccess(const IrInstr *in) {
+    return (in->op == IR_LOAD || in->op == IR_STORE) && in->seg == SEG_THAT;
+}
+
+// Array accesses in a block that use the address register of the one
+// before them find it in pointer 1 already. An array store whose address
+// is used nowhere else sets pointer 1 right after computing it when no
+// other access comes between, sparing the temp 0 shuffle around the value
+static void pointerReuse(Lowering *L) {
+    IrFunction *ir = L->ir;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        const IrBlock *blk = &ir->blocks[b];
+        int cur = -1;
+        for (int k = blk->first; k < blk->first + blk->n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if (!isThatAccess(in)) continue;
+            if (in->a == cur) {
+                L->reuse[k] = 1;
+                L->uses[cur]--;
+                optStats.pointerReloadsDropped++;
+            }
+            cur = in->a;
+        }
+        int lastAccess = blk->first - 1;
+        for (int k = blk->first; k < blk->first + blk->n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if (!isThatAccess(in)) continue;
+            int a = in->a, d = -1;
+            for (int j = lastAccess + 1; j < k && d < 0; j++)
+                if (ir->code[j].dst == a) d = j;
+            if (in->op == IR_STORE && !L->reuse[k] && d >= 0 && L->uses[a] == 1 &&
+                ir->code[d].op != IR_PARAM && !L->crossBlock[a]) {
+                L->early[a] = 1;
+                optStats.pointerReloadsDropped++;
+            }
+            lastAccess = k;
+        }
+    }
+}
+
+void irLower(IrFunction *ir, VmFunction *dst) {
+    Lowering L;
+    int nRegs = ir->nRegs + 1;
+    memset(&L, 0, sizeof(L));
+    L.ir = ir;
+    irRemoveDead(ir);
+    L.uses = malloc(sizeof(int) * (size_t)nRegs);
+    L.spill = calloc((size_t)nRegs, sizeof(int));
+    L.defBlock = malloc(sizeof(int) * (size_t)nRegs);
+    L.crossBlock = calloc((size_t)nRegs, sizeof(int));
+    L.stack = malloc(sizeof(int) * (size_t)nRegs);
+    L.ops = malloc(sizeof(int) * (size_t)irMaxOperands(ir));
+    L.blockLabel = malloc(sizeof(int) * ((size_t)ir->nBlocks + 1));
+    L.reuse = calloc((size_t)ir->nCode + 1, 1);
+    L.early = calloc((size_t)nRegs, 1);
+    if (!L.uses || !L.spill || !L.defBlock || !L.crossBlock || !L.stack || !L.ops || !L.blockLabel ||
+        !L.reuse || !L.early)
+        abort();
+    irCountUses(ir, L.uses);
+    labelBlocks(&L);
+
+    // registers used more than once or outside their block never stay on the stack
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++)
+            if (ir->code[k].dst >= 0) L.defBlock[ir->code[k].dst] = b;
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            int n = irOperands(ir, &ir->code[k], L.ops);
+            for (int i = 0; i < n; i++)
+                if (L.defBlock[L.ops[i]] != b) L.crossBlock[L.ops[i]] = 1;
+        }
+    if (optOptions.arrays) pointerReuse(&L);
+    for (int r = 0; r < ir->nRegs; r++)
+        if (L.uses[r] > 1 || L.crossBlock[r]) L.spill[r] = 1;
+
+    for (;;) {
+        int ok = 1;
+        L.out.len = 0;
+        for (int b = 0; b < ir->nBlocks && ok; b++)
+            ok = lowerBlock(&L, b);
+        if (ok) break;
+    }
+    int nSlots = assignSlots(&L);
+
+    free(dst->code);
+    dst->code = L.out.code;
+    dst->len = L.out.len;
+    dst->cap = L.out.cap;
+    dst->nLocals = ir->nLocals + nSlots;
+    free(L.uses);
+    free(L.spill);
+    free(L.defBlock);
+    free(L.crossBlock);
+    free(L.stack);
+    free(L.ops);
+    free(L.blockLabel);
+    free(L.reuse);
+    free(L.early);
+}
+
+//---------------------------------------------------------------------
+// printing
+//---------------------------------------------------------------------
+
+static const char *irOpNames[] = {
+    "nop", "const", "load", "store", "neg", "not", "add", "sub", "and", "or",
+    "lt", "gt", "eq", "call", "param", "jump", "branch", "return"
+};
+
+void irDump(FILE *f, const IrFunction *ir) {
+    fprintf(f, "function %s (%d locals, %d registers)\n", vmStr(ir->cls, ir->name), ir->nLocals, ir->nRegs);
+    for (int b = 0; b < ir->nBlocks; b++) {
+        const IrBlock *blk = &ir->blocks[b];
+        fprintf(f, "b%d:%s%s\n", b, blk->label >= 0 ? " " : "", blk->label >= 0 ? vmStr(ir->cls, blk->label) : "");
+        for (int k = blk->first; k < blk->first + blk->n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if (in->op == IR_NOP) continue;
+            fprintf(f, "    ");
+            if (in->dst >= 0) fprintf(f, "r%d = ", in->dst);
+            fprintf(f, "%s", irOpNames[in->op]);
+            switch (in->op) {
+                case IR_CONST: case IR_PARAM: fprintf(f, " %d", in->imm); break;
+                case IR_LOAD: case IR_STORE:
+                    fprintf(f, " %s %d", vmSegName(in->seg), in->imm);
+                    if (in->a >= 0) fprintf(f, " [r%d]", in->a);
+                    if (in->b >= 0) fprintf(f, ", r%d", in->b);
+                    break;
+                case IR_CALL: fprintf(f, " %s", vmStr(ir->cls, in->imm)); break;
+                case IR_JUMP: case IR_BRANCH: fprintf(f, " b%d", in->imm); break;
+                default:
+                    if (in->a >= 0) fprintf(f, " r%d", in->a);
+                    if (in->b >= 0) fprintf(f, ", r%d", in->b);
+                    break;
+            }
+            if (in->op == IR_BRANCH) fprintf(f, " if r%d", in->a);
+            if (in->nArgs) {
+                fprintf(f, " (");
+                for (int i = 0; i < in->nArgs; i++)
+                    fprintf(f, "%sr%d", i ? ", " : "", ir->args[in->args + i]);
+                fprintf(f, ")");
+            }
+            fprintf(f, "\n");
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+// driver
+//---------------------------------------------------------------------
+
+int irOptimizeProgram(VmProgram *p) {
+    int rewritten = 0, pureMath = vmFindClass(p, "Math") == NULL;
+    for (int i = 0; i < p->nClasses; i++) {
+        VmClass *c = p->classes[i];
+        for (int fi = 0; fi < c->nFuncs; fi++) {
+            VmFunction *f = &c->funcs[fi];
+            IrFunction *ir = irBuild(c, f);
+            if (!ir) {
+                if (optOptions.log)
+                    fprintf(optOptions.log, "ir: %s left as stack code\n", vmStr(c, f->name));
+                continue;
+            }
+            ir->pureMath = pureMath;
+            if (optOptions.arrays) {
+                int n = irFoldAddresses(ir);
+                if (n && optOptions.log)
+                    fprintf(optOptions.log, "arrays: %s: %d constant indexes folded\n", vmStr(c, f->name), n);
+                optStats.arrayIndexesFolded += n;
+            }
+            if (optOptions.cse) {
+                int gone = irCommonSubexpressions(ir);
+                if (gone && optOptions.log)
+                    fprintf(optOptions.log, "cse: %s: %d instructions eliminated\n", vmStr(c, f->name), gone);
+                optStats.subexpressionsEliminated += gone;
+            }
+            if (optOptions.licm) {
+                int moved = irHoistInvariants(ir);
+                if (moved && optOptions.log)
+                    fprintf(optOptions.log, "licm: %s: %d instructions hoisted\n", vmStr(c, f->name), moved);
+                optStats.invariantsHoisted += moved;
+            }
+            if (optOptions.promote) {
+                int n = irPromoteLocals(ir);
+                if (n && optOptions.log)
+                    fprintf(optOptions.log, "promote: %s: %d variables kept in temp slots\n", vmStr(c, f->name), n);
+                optStats.localsPromoted += n;
+            }
+            irLower(ir, f);
+            irFree(ir);
+            rewritten++;
+        }
+    }
+    return rewritten;
+}
+
+#ifdef TEST_IR
+#include "compiler.h"
+#include <string.h>
+
+// usage: irdump [-O0] [-licm] DIR — compile DIR and print the IR of every
+// function, after hoisting loop invariants with -licm
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    int licm = 0;
+    InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-licm")) licm = 1;
+        else if (!strcmp(argv[i], "-O0")) {
+            optOptions.fold = optOptions.strength = optOptions.dce = 0;
+            optOptions.inlineThreshold = 0;
+        }
+        else dir = argv[i];
+    }
+    if (!dir) {
+        fprintf(stderr, "usage: irdump [-O0] [-licm] DIR\n");
+        return 2;
+    }
+    optOptions.ir = 0;         // show the IR of the code as generated
+    ParserInfo pi = compile(dir);
+    VmProgram *p = TakeCompiledProgram();
+    if (pi.er != none || !p) {
+        fprintf(stderr, "compile error: %s line %d\n", pi.tk.lx, pi.tk.ln);
+        return 1;
+    }
+    for (int i = 0; i < p->nClasses; i++)
+        for (int f = 0; f < p->classes[i]->nFuncs; f++) {
+            IrFunction *ir = irBuild(p->classes[i], &p->classes[i]->funcs[f]);
+            if (ir && licm) {
+                ir->pureMath = vmFindClass(p, "Math") == NULL;
+                irHoistInvariants(ir);
+            }
+            if (ir) irDump(stdout, ir);
+            else printf("function %s: not lifted\n", vmStr(p->classes[i], p->classes[i]->funcs[f].name));
+            irFree(ir);
+        }
+    vmFreeProgram(p);
+    StopCompiler();
+    return 0;
+}
+#endif
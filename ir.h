@@ -0,0 +1,118 @@
+#ifndef IR_H
+#define IR_H
+
+#include <stdio.h>
+#include "vm.h"
+
+// Mid-level IR of one function: basic blocks of three-address
+// instructions over virtual registers, each register defined exactly once.
+// Jack variables stay in memory behind explicit loads and stores to their
+// segments; the operand stack is gone except for values that cross a
+// block boundary, which enter the block as PARAMs (SSA block arguments).
+// Everything lives in flat arrays: the instructions of block b are
+// code[blocks[b].first .. first + n), and call arguments and values
+// passed to a successor are runs in args[].
+
+typedef enum {
+    IR_NOP,        // deleted
+    IR_CONST,      // dst = imm
+    IR_LOAD,       // dst = seg[imm]; SEG_THAT: dst = RAM[a + imm]
+    IR_STORE,      // seg[imm] = b;   SEG_THAT: RAM[a + imm] = b
+    IR_NEG, IR_NOT,                                   // dst = op a
+    IR_ADD, IR_SUB, IR_AND, IR_OR, IR_LT, IR_GT, IR_EQ, // dst = a op b
+    IR_CALL,       // dst = imm(args), imm the callee's string id
+    IR_PARAM,      // dst = stack value imm entering the block
+    IR_JUMP,       // goto block imm, args passed on the stack
+    IR_BRANCH,     // if a != 0 goto block imm else fall through; args passed either way
+    IR_RETURN      // return a
+} IrOp;
+
+typedef struct {
+    unsigned char op;    // IrOp
+    unsigned char seg;   // VmSegment of LOAD / STORE
+    int dst;             // register defined, -1 if none
+    int a, b;            // operand registers, -1 if unused
+    int imm;             // see IrOp
+    int args, nArgs;     // CALL, JUMP, BRANCH: operand run in args[]
+} IrInstr;
+
+typedef struct {
+    int first, n;        // instructions
+    int label;           // VM label (string id), -1 if the block has none yet
+    int nParams;         // stack values entering the block
+} IrBlock;
+
+typedef struct {
+    VmClass *cls;        // owner of the label and callee strings
+    int name, nLocals;
+    IrInstr *code;  int nCode, capCode;
+    IrBlock *blocks; int nBlocks, capBlocks;
+    int *args;      int nArgs, capArgs;
+    int nRegs;
+    int pureMath;        // Math.multiply is the OS routine: no side effects
+    int tempsHeld;       // temp 7 down to 8 - tempsHeld keep promoted locals
+} IrFunction;
+
+// Lift the VM code of f. Temp and pointer 1 must be set before they are
+// read within each block (the code generator's patterns); NULL otherwise
+IrFunction* irBuild(VmClass *c, const VmFunction *f);
+void irFree(IrFunction *ir);
+// Lower back to stack code in out (code and nLocals replaced). Values that
+// cannot stay on the operand stack go to locals above the function's own
+void irLower(IrFunction *ir, VmFunction *out);
+void irDump(FILE *f, const IrFunction *ir);
+
+int irIsPure(int op);
+// pure instruction or a call known to have no side effects
+int irIsPureInstr(const IrFunction *ir, const IrInstr *in);
+// operand registers of in, in stack order; out needs irMaxOperands(ir) ints
+int irOperands(const IrFunction *ir, const IrInstr *in, int *out);
+int irMaxOperands(const IrFunction *ir);
+// uses[r] for every register; uses must hold ir->nRegs ints
+void irCountUses(const IrFunction *ir, int *uses);
+// delete pure instructions whose result is never used; returns the count
+int irRemoveDead(IrFunction *ir);
+
+// control flow: successors of block b (0-2), predecessor lists in one
+// flat array (preds of b are pred[predStart[b] .. predStart[b + 1]))
+int irSuccessors(const IrFunction *ir, int b, int *succ);
+void irPredecessors(const IrFunction *ir, int *predStart, int *pred);
+// immediate dominators, idom[0] = 0, -1 for blocks the entry cannot reach
+void irDominators(const IrFunction *ir, int *idom);
+int irDominates(const int *idom, int a, int b);
+// natural loop of header h: inLoop[b] set for its blocks, returns their
+// count; work needs nBlocks ints
+int irLoopBody(const IrFunction *ir, const int *idom, const int *predStart, const int *pred,
+               int h, char *inLoop, int *work);
+// new block run once before the loop of h, entered from wherever the loop
+// was entered; *header is h's new number. -1 if the layout leaves no room
+int irMakePreheader(IrFunction *ir, const int *predStart, const int *pred, const char *inLoop,
+                    int h, int *header);
+// insert an empty block at layout position pos, renumbering the jump
+// targets at or after it; returns pos
+int irInsertBlock(IrFunction *ir, int pos);
+// append a copy of *in to block b, moving the block to the end of code first
+void irAppendInstr(IrFunction *ir, int b, const IrInstr *in);
+// insert a copy of *in before instruction i of block b
+void irInsertInstr(IrFunction *ir, int b, int i, const IrInstr *in);
+
+// arrays.c: move constant parts of array indexes into the offsets of
+// that accesses; returns the accesses rewritten
+int irFoldAddresses(IrFunction *ir);
+
+// cse.c: reuse values computed earlier in the same block where that is
+// cheaper than recomputing them; returns the instructions eliminated
+int irCommonSubexpressions(IrFunction *ir);
+// licm.c: hoist loop-invariant expressions into loop preheaders;
+// returns the number of instructions moved
+int irHoistInvariants(IrFunction *ir);
+
+// regalloc.c: keep the busiest locals and arguments of call-free loops in
+// temp slots (loads and stores of SEG_TEMP); returns the variables promoted
+int irPromoteLocals(IrFunction *ir);
+
+// Round-trip every function of the program through the IR, running the IR
+// passes in between; returns the number of functions rewritten
+int irOptimizeProgram(VmProgram *p);
+
+#endif
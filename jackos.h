@@ -0,0 +1,24 @@
+#ifndef JACKOS_H
+#define JACKOS_H
+
+// Memory map and conventions shared by the VM interpreter, the Hack
+// emulator and the Jack OS stub in os/ (which hard-codes the same numbers).
+
+#define HACK_RAM_SIZE     32768
+#define HACK_SP           0       // RAM[0..4]: SP LCL ARG THIS THAT
+#define HACK_LCL          1
+#define HACK_ARG          2
+#define HACK_THIS         3
+#define HACK_THAT         4
+#define HACK_TEMP         5       // temp 0..7 => RAM[5..12]
+#define HACK_STATIC       16      // statics of all classes => RAM[16..255]
+#define HACK_STACK        256     // the stack grows up from here ...
+#define HACK_HEAP         2048    // ... to the heap (2048..16383)
+#define HACK_SCREEN       16384
+#define HACK_KBD          24576
+
+// Output.printChar writes Jack character codes here; the host prints them
+// (128 = newline, 129 = backspace) instead of drawing glyphs on the screen
+#define JACK_OUTPUT_PORT  24577
+
+#endif
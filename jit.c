@@ -0,0 +1,601 @@
+// jit.c
+/************************************************************************
+ Template JIT: decoded VM functions to x86-64 machine code
+*************************************************************************/
+#include "jit.h"
+#include "vmstack.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define JIT_X64 1
+#include <sys/mman.h>
+#else
+#define JIT_X64 0
+#endif
+
+#define RAM_MASK (HACK_RAM_SIZE - 1)
+
+struct JitCode {
+    unsigned char *mem;   // trampoline at offset 0, then the functions
+    size_t size;
+};
+
+#if JIT_X64
+
+//---------------------------------------------------------------------
+// register use in native code
+//   rbx  &RAM[0]            r12d  VM stack pointer
+//   r13  the VmMachine      r14   rsp saved around calls into C
+//   eax edx  values         esi   computed RAM address
+//   ecx edi  scratch in call/return
+//---------------------------------------------------------------------
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_E = 4, CC_NE = 5, CC_S = 8, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+#define NOINDEX (-1)
+
+typedef struct {
+    int pos;      // rel32 field
+    int pc;       // VM instruction it jumps to
+} Fixup;
+
+typedef struct {
+    unsigned char *buf;
+    int len, cap;
+    int *pcOff;               // native offset of each VM pc, -1 if not compiled
+    Fixup *fix;
+    int nFix, capFix;
+    int exitOverflow, exitLimit, exitRet;   // stubs of the current function
+    int stackLimit;
+} Asm;
+
+static void emit1(Asm *A, int b) {
+    if (A->len == A->cap) {
+        A->cap = A->cap ? A->cap * 2 : 4096;
+        A->buf = realloc(A->buf, (size_t)A->cap);
+        if (!A->buf) abort();
+    }
+    A->buf[A->len++] = (unsigned char)b;
+}
+
+static void emit2(Asm *A, int v) { emit1(A, v & 0xFF); emit1(A, (v >> 8) & 0xFF); }
+static void emit4(Asm *A, int v) { emit2(A, v & 0xFFFF); emit2(A, (v >> 16) & 0xFFFF); }
+
+static void emitOp(Asm *A, int op) {
+    if (op > 0xFF) emit1(A, op >> 8);
+    emit1(A, op & 0xFF);
+}
+
+// op reg, [base + index*2 + disp32]; w16 = operand-size prefix, w64 = REX.W
+static void mem(Asm *A, int w16, int w64, int op, int reg, int base, int index, int disp) {
+    if (w16) emit1(A, 0x66);
+    int rex = (w64 ? 8 : 0) | (reg & 8 ? 4 : 0) | (index >= 0 && (index & 8) ? 2 : 0) | (base & 8 ? 1 : 0);
+    if (rex) emit1(A, 0x40 | rex);
+    emitOp(A, op);
+    emit1(A, 0x84 | (reg & 7) << 3);     // mod=10 (disp32), rm=SIB
+    emit1(A, index >= 0 ? 0x40 | (index & 7) << 3 | (base & 7) : 0x20 | (base & 7));
+    emit4(A, disp);
+}
+
+// op reg, rm (register operands)
+static void rr(Asm *A, int w64, int op, int reg, int rm) {
+    int rex = (w64 ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+    if (rex) emit1(A, 0x40 | rex);
+    emitOp(A, op);
+    emit1(A, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// group-1 op (add 0, or 1, and 4, sub 5, cmp 7) r32, imm32
+static void ri(Asm *A, int ext, int rm, int imm) {
+    rr(A, 0, 0x81, ext, rm);
+    emit4(A, imm);
+}
+
+static void movImm(Asm *A, int reg, int v) {
+    if (reg & 8) emit1(A, 0x41);
+    emit1(A, 0xB8 + (reg & 7));
+    emit4(A, v);
+}
+
+static void loadWord(Asm *A, int reg, int sign, int base, int index, int disp) {
+    mem(A, 0, 0, sign ? 0x0FBF : 0x0FB7, reg, base, index, disp);
+}
+
+static void storeWord(Asm *A, int reg, int base, int index, int disp) {
+    mem(A, 1, 0, 0x89, reg, base, index, disp);
+}
+
+static void addSp(Asm *A, int k) {
+    if (k) ri(A, 0, R12, k);
+}
+
+static void jccTo(Asm *A, int cc, int off) {
+    emit1(A, 0x0F);
+    emit1(A, 0x80 | cc);
+    emit4(A, off - (A->len + 4));
+}
+
+static void fixup(Asm *A, int pc) {
+    if (A->nFix == A->capFix) {
+        A->capFix = A->capFix ? A->capFix * 2 : 256;
+        A->fix = realloc(A->fix, sizeof(Fixup) * (size_t)A->capFix);
+        if (!A->fix) abort();
+    }
+    A->fix[A->nFix].pos = A->len;
+    A->fix[A->nFix].pc = pc;
+    A->nFix++;
+    emit4(A, 0);
+}
+
+static void jccPc(Asm *A, int cc, int pc) {
+    emit1(A, 0x0F);
+    emit1(A, 0x80 | cc);
+    fixup(A, pc);
+}
+
+static void jmpPc(Asm *A, int pc) {
+    emit1(A, 0xE9);
+    fixup(A, pc);
+}
+
+//---------------------------------------------------------------------
+// VM operands
+//---------------------------------------------------------------------
+
+static int isPush(int op) { return op >= I_PUSH_CONST && op <= I_PUSH_ADDR; }
+static int isPop(int op) { return op >= I_POP_LOCAL && op <= I_POP_ADDR; }
+static int isArith(int op) { return op == I_ADD || op == I_SUB || op == I_AND || op == I_OR; }
+static int isCmp(int op) { return op == I_EQ || op == I_GT || op == I_LT; }
+
+static int arithOp(int op) {       // op r/m16, r16
+    return op == I_ADD ? 0x01 : op == I_SUB ? 0x29 : op == I_AND ? 0x21 : 0x09;
+}
+
+static int arithExt(int op) {      // 0x81 /ext
+    return op == I_ADD ? 0 : op == I_SUB ? 5 : op == I_AND ? 4 : 1;
+}
+
+static int cmpCc(int op) {
+    return op == I_EQ ? CC_E : op == I_GT ? CC_G : CC_L;
+}
+
+// RAM[0..4] register holding the base of the segment used by op
+static int segBase(int op) {
+    switch (op) {
+        case I_PUSH_LOCAL: case I_POP_LOCAL: return HACK_LCL;
+        case I_PUSH_ARG:   case I_POP_ARG:   return HACK_ARG;
+        case I_PUSH_THIS:  case I_POP_THIS:  return HACK_THIS;
+        default:                             return HACK_THAT;
+    }
+}
+
+// esi = (RAM[seg] + a) & mask
+static void segAddr(Asm *A, int seg, int a) {
+    loadWord(A, RSI, 0, RBX, NOINDEX, seg * 2);
+    if (a) ri(A, 0, RSI, a);
+    ri(A, 4, RSI, RAM_MASK);
+}
+
+// value pushed by `in` into reg (sign-extended for comparisons)
+static void loadVal(Asm *A, int reg, const VmInsn *in, int sign) {
+    if (in->op == I_PUSH_CONST)
+        movImm(A, reg, sign ? (int16_t)in->a : in->a);
+    else if (in->op == I_PUSH_ADDR)
+        loadWord(A, reg, sign, RBX, NOINDEX, in->a * 2);
+    else {
+        segAddr(A, segBase(in->op), in->a);
+        loadWord(A, reg, sign, RBX, RSI, 0);
+    }
+}
+
+// store reg where `in` pops to; this/that stores may hit the console port
+static void storeVal(Asm *A, const VmInsn *in, int reg) {
+    if (in->op == I_POP_ADDR) {
+        storeWord(A, reg, RBX, NOINDEX, in->a * 2);
+        return;
+    }
+    segAddr(A, segBase(in->op), in->a);
+    storeWord(A, reg, RBX, RSI, 0);
+    if (in->op != I_POP_THIS && in->op != I_POP_THAT) return;
+
+    ri(A, 7, RSI, JACK_OUTPUT_PORT);
+    emit1(A, 0x75);                        // jne over the call
+    int patch = A->len;
+    emit1(A, 0);
+    rr(A, 0, 0x0FB7, RSI, reg);            // movzx esi, reg16
+    rr(A, 1, 0x89, R13, RDI);              // mov rdi, r13
+    rr(A, 1, 0x89, RSP, R14);              // mov r14, rsp
+    emit1(A, 0x48); emit1(A, 0x83); emit1(A, 0xE4); emit1(A, 0xF0);   // and rsp, -16
+    emit1(A, 0x48); emit1(A, 0xB8);        // mov rax, vmPortWrite
+    uint64_t fn = (uint64_t)(uintptr_t)&vmPortWrite;
+    emit4(A, (int)(fn & 0xFFFFFFFFu));
+    emit4(A, (int)(fn >> 32));
+    emit1(A, 0xFF); emit1(A, 0xD0);        // call rax
+    rr(A, 1, 0x89, R14, RSP);              // mov rsp, r14
+    A->buf[patch] = (unsigned char)(A->len - patch - 1);
+}
+
+static void pushReg(Asm *A, int reg) {
+    storeWord(A, reg, RBX, R12, 0);
+    addSp(A, 1);
+}
+
+// eax = eax <cc> edx ? -1 : 0, as a VM boolean
+static void setBool(Asm *A, int cc) {
+    rr(A, 0, 0x39, RDX, RAX);              // cmp eax, edx
+    rr(A, 0, 0x0F90 | cc, 0, RAX);         // setcc al
+    rr(A, 0, 0x0FB6, RAX, RAX);            // movzx eax, al
+    rr(A, 0, 0xF7, 3, RAX);                // neg eax
+}
+
+//---------------------------------------------------------------------
+// functions
+//---------------------------------------------------------------------
+
+static void emitCall(Asm *A, const VmInsn *in, int pc) {
+    mem(A, 1, 0, 0xC7, 0, RBX, R12, 0);                 // return address
+    emit2(A, pc + 1);
+    for (int k = HACK_LCL; k <= HACK_THAT; k++) {       // saved LCL ARG THIS THAT
+        loadWord(A, RAX, 0, RBX, NOINDEX, k * 2);
+        storeWord(A, RAX, RBX, R12, k * 2);
+    }
+    addSp(A, 5);
+    mem(A, 0, 0, 0x8D, RAX, R12, NOINDEX, -5 - in->b);  // ARG = sp - 5 - nArgs
+    storeWord(A, RAX, RBX, NOINDEX, HACK_ARG * 2);
+    storeWord(A, R12, RBX, NOINDEX, HACK_LCL * 2);      // LCL = sp
+    mem(A, 0, 1, 0xFF, 0, R13, NOINDEX, (int)offsetof(VmMachine, jitCalls));   // inc
+    emit1(A, 0xE8);
+    fixup(A, in->a);
+    rr(A, 0, 0x85, RAX, RAX);                           // test eax, eax
+    jccTo(A, CC_S, A->exitRet);                         // pass failures up
+}
+
+static void emitReturn(Asm *A) {
+    loadWord(A, RCX, 0, RBX, NOINDEX, HACK_LCL * 2);    // frame
+    mem(A, 0, 0, 0x8D, RSI, RCX, NOINDEX, -5);
+    ri(A, 4, RSI, RAM_MASK);
+    loadWord(A, RDI, 0, RBX, RSI, 0);                   // return address, before *ARG is written
+    loadWord(A, RDX, 0, RBX, NOINDEX, HACK_ARG * 2);
+    // an ARG overwritten by the program is no frame: stop before storing
+    // through it, so sp stays in the stack (as the interpreter does)
+    ri(A, 7, RDX, HACK_STACK);
+    jccTo(A, CC_L, A->exitOverflow);
+    ri(A, 7, RDX, A->stackLimit);
+    jccTo(A, CC_GE, A->exitOverflow);
+    loadWord(A, RAX, 0, RBX, R12, -2);
+    storeWord(A, RAX, RBX, RDX, 0);                     // *ARG = return value
+    mem(A, 0, 0, 0x8D, R12, RDX, NOINDEX, 1);           // sp = ARG + 1
+    for (int k = 1; k <= 4; k++) {                      // THAT THIS ARG LCL
+        mem(A, 0, 0, 0x8D, RSI, RCX, NOINDEX, -k);
+        ri(A, 4, RSI, RAM_MASK);
+        loadWord(A, RAX, 0, RBX, RSI, 0);
+        storeWord(A, RAX, RBX, NOINDEX, (HACK_THAT + 1 - k) * 2);
+    }
+    rr(A, 0, 0x89, RDI, RAX);                           // mov eax, edi
+    emit1(A, 0xC3);
+}
+
+// jump to target if the comparison (eax vs edx) holds, or fails when inverted
+static int emitCmpJump(Asm *A, const VmInsn *c, int cmp, int n) {
+    rr(A, 0, 0x39, RDX, RAX);
+    int cc = cmpCc(c[cmp].op);
+    if (c[cmp + 1].op == I_NOT) {
+        cc ^= 1;
+        jccPc(A, cc, c[cmp + 2].a);
+    }
+    else jccPc(A, cc, c[cmp + 1].a);
+    return n;
+}
+
+// Emit the instruction at pc, fused with the following ones where a common
+// sequence allows; returns the number of VM instructions consumed
+static int emitGroup(Asm *A, const VmInsn *c, int n) {
+    int op0 = c[0].op;
+    int op1 = n > 1 ? c[1].op : -1;
+    int op2 = n > 2 ? c[2].op : -1;
+    int op3 = n > 3 ? c[3].op : -1;
+    int op4 = n > 4 ? c[4].op : -1;
+
+    if (isPush(op0) && isPush(op1) && isCmp(op2)) {
+        loadVal(A, RAX, &c[0], 1);
+        loadVal(A, RDX, &c[1], 1);
+        if (op3 == I_IF_GOTO) return emitCmpJump(A, c, 2, 4);
+        if (op3 == I_NOT && op4 == I_IF_GOTO) return emitCmpJump(A, c, 2, 5);
+        setBool(A, cmpCc(op2));
+        pushReg(A, RAX);
+        return 3;
+    }
+    if (isPush(op0) && isPush(op1) && isArith(op2)) {
+        loadVal(A, RAX, &c[0], 0);
+        if (c[1].op == I_PUSH_CONST) ri(A, arithExt(op2), RAX, c[1].a);
+        else {
+            loadVal(A, RDX, &c[1], 0);
+            rr(A, 0, arithOp(op2), RDX, RAX);
+        }
+        if (isPop(op3)) {
+            storeVal(A, &c[3], RAX);
+            return 4;
+        }
+        pushReg(A, RAX);
+        return 3;
+    }
+    if (isPush(op0) && isPop(op1)) {
+        loadVal(A, RAX, &c[0], 0);
+        storeVal(A, &c[1], RAX);
+        return 2;
+    }
+    if (isPush(op0) && isArith(op1)) {
+        if (op0 == I_PUSH_CONST) {
+            mem(A, 1, 0, 0x81, arithExt(op1), RBX, R12, -2);
+            emit2(A, c[0].a);
+        }
+        else {
+            loadVal(A, RDX, &c[0], 0);
+            mem(A, 1, 0, arithOp(op1), RDX, RBX, R12, -2);
+        }
+        return 2;
+    }
+    if (isPush(op0) && isCmp(op1) &&
+        (op2 == I_IF_GOTO || (op2 == I_NOT && op3 == I_IF_GOTO))) {
+        loadWord(A, RAX, 1, RBX, R12, -2);
+        addSp(A, -1);
+        loadVal(A, RDX, &c[0], 1);
+        return emitCmpJump(A, c, 1, op2 == I_IF_GOTO ? 3 : 4);
+    }
+    if (isCmp(op0) && (op1 == I_IF_GOTO || (op1 == I_NOT && op2 == I_IF_GOTO))) {
+        loadWord(A, RAX, 1, RBX, R12, -4);
+        loadWord(A, RDX, 1, RBX, R12, -2);
+        addSp(A, -2);
+        return emitCmpJump(A, c, 0, op1 == I_IF_GOTO ? 2 : 3);
+    }
+    if (op0 == I_NOT && op1 == I_IF_GOTO) {
+        addSp(A, -1);
+        mem(A, 1, 0, 0x83, 7, RBX, R12, 0);             // cmp word [top], -1
+        emit1(A, 0xFF);
+        jccPc(A, CC_NE, c[1].a);
+        return 2;
+    }
+
+    // one instruction on its own
+    if (op0 == I_PUSH_CONST) {
+        mem(A, 1, 0, 0xC7, 0, RBX, R12, 0);
+        emit2(A, c[0].a);
+        addSp(A, 1);
+    }
+    else if (isPush(op0)) {
+        loadVal(A, RAX, &c[0], 0);
+        pushReg(A, RAX);
+    }
+    else if (isPop(op0)) {
+        addSp(A, -1);
+        loadWord(A, RAX, 0, RBX, R12, 0);
+        storeVal(A, &c[0], RAX);
+    }
+    else if (isArith(op0)) {
+        loadWord(A, RAX, 0, RBX, R12, -2);
+        addSp(A, -1);
+        mem(A, 1, 0, arithOp(op0), RAX, RBX, R12, -2);
+    }
+    else if (isCmp(op0)) {
+        loadWord(A, RAX, 1, RBX, R12, -4);
+        loadWord(A, RDX, 1, RBX, R12, -2);
+        addSp(A, -1);
+        setBool(A, cmpCc(op0));
+        storeWord(A, RAX, RBX, R12, -2);
+    }
+    else if (op0 == I_NEG || op0 == I_NOT)
+        mem(A, 1, 0, 0xF7, op0 == I_NEG ? 3 : 2, RBX, R12, -2);
+    else if (op0 == I_GOTO)
+        jmpPc(A, c[0].a);
+    else if (op0 == I_IF_GOTO) {
+        addSp(A, -1);
+        mem(A, 1, 0, 0x83, 7, RBX, R12, 0);             // cmp word [top], 0
+        emit1(A, 0);
+        jccPc(A, CC_NE, c[0].a);
+    }
+    else if (op0 == I_RETURN)
+        emitReturn(A);
+    else if (op0 == I_HALT) {
+        movImm(A, RAX, JIT_HALTED);
+        emit1(A, 0xC3);
+    }
+    return 1;
+}
+
+// a block starts at the entry, at jump targets and after control transfers;
+// each one charges its instruction count against the budget
+static void markBlocks(const VmMachine *m, int entry, int end, char *start) {
+    start[entry] = 1;
+    for (int pc = entry + 1; pc < end; pc++) {
+        int op = m->code[pc].op;
+        if (op == I_GOTO || op == I_IF_GOTO) start[m->code[pc].a] = 1;
+        if (op == I_GOTO || op == I_IF_GOTO || op == I_CALL || op == I_RETURN || op == I_HALT)
+            if (pc + 1 < end) start[pc + 1] = 1;
+    }
+}
+
+static void chargeBlock(Asm *A, const char *start, int pc, int end) {
+    int n = 1;
+    while (pc + n < end && !start[pc + n]) n++;
+    mem(A, 0, 1, 0x81, 5, R13, NOINDEX, (int)offsetof(VmMachine, fuel));   // sub qword, imm32
+    emit4(A, n);
+    jccTo(A, CC_S, A->exitLimit);
+}
+
+static void emitFunction(Asm *A, const VmMachine *m, int f, char *start) {
+    int entry = m->funcs[f].entry, end = vmFuncEnd(m, f);
+
+    A->exitOverflow = A->len;
+    movImm(A, RAX, JIT_OVERFLOW);
+    emit1(A, 0xC3);
+    A->exitLimit = A->len;
+    movImm(A, RAX, JIT_LIMIT);
+    emit1(A, 0xC3);
+    A->exitRet = A->len;
+    emit1(A, 0xC3);
+
+    markBlocks(m, entry, end, start);
+    A->pcOff[entry] = A->len;
+    chargeBlock(A, start, entry, end);
+    // the one stack check: locals and the deepest point of the body (vmstack.c)
+    int nLocals = m->code[entry].a;
+    if (m->funcs[f].frame > 0) {
+        mem(A, 0, 0, 0x8D, RAX, R12, NOINDEX, m->funcs[f].frame);
+        ri(A, 7, RAX, A->stackLimit);
+        jccTo(A, CC_G, A->exitOverflow);
+    }
+    for (int k = 0; k < nLocals; k++) {
+        mem(A, 1, 0, 0xC7, 0, RBX, R12, 2 * k);
+        emit2(A, 0);
+    }
+    addSp(A, nLocals);
+
+    for (int pc = entry + 1; pc < end; ) {
+        A->pcOff[pc] = A->len;
+        if (start[pc]) chargeBlock(A, start, pc, end);
+        int n = 1;                      // instructions a fused group may span
+        while (n < 5 && pc + n < end && !start[pc + n]) n++;
+        int used;
+        if (m->code[pc].op == I_CALL) {
+            emitCall(A, &m->code[pc], pc);
+            used = 1;
+        }
+        else used = emitGroup(A, &m->code[pc], n);
+        for (int k = 1; k < used; k++) A->pcOff[pc + k] = -1;
+        pc += used;
+    }
+    memset(start + entry, 0, (size_t)(end - entry));
+}
+
+static void emitTrampoline(Asm *A) {
+    emit1(A, 0x53);                                     // push rbx
+    emit1(A, 0x41); emit1(A, 0x54);                     // push r12
+    emit1(A, 0x41); emit1(A, 0x55);                     // push r13
+    emit1(A, 0x41); emit1(A, 0x56);                     // push r14
+    emit1(A, 0x41); emit1(A, 0x57);                     // push r15 (keeps rsp aligned)
+    rr(A, 1, 0x89, RDI, R13);                           // mov r13, rdi
+    mem(A, 0, 1, 0x8D, RBX, RDI, NOINDEX, (int)offsetof(VmMachine, ram));
+    loadWord(A, R12, 0, RBX, NOINDEX, HACK_SP * 2);
+    emit1(A, 0xFF); emit1(A, 0xD6);                     // call rsi
+    storeWord(A, R12, RBX, NOINDEX, HACK_SP * 2);
+    emit1(A, 0x41); emit1(A, 0x5F);
+    emit1(A, 0x41); emit1(A, 0x5E);
+    emit1(A, 0x41); emit1(A, 0x5D);
+    emit1(A, 0x41); emit1(A, 0x5C);
+    emit1(A, 0x5B);
+    emit1(A, 0xC3);
+}
+
+int vmEnableJit(VmMachine *m, FILE *log) {
+    vmFreeJit(m);
+
+    // candidates: a bounded stack; then drop callers of non-candidates
+    // until nothing changes
+    char *ok = calloc((size_t)m->nFuncs + 1, 1);
+    if (!ok) abort();
+    for (int f = 0; f < m->nFuncs; f++) {
+        ok[f] = m->funcs[f].maxStack >= 0;
+        if (!ok[f] && log) fprintf(log, "jit: %s stays interpreted (unbalanced stack)\n", m->funcs[f].name);
+    }
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int f = 0; f < m->nFuncs; f++) {
+            if (!ok[f]) continue;
+            for (int pc = m->funcs[f].entry + 1; pc < vmFuncEnd(m, f); pc++) {
+                if (m->code[pc].op != I_CALL) continue;
+                int callee = vmFuncAt(m, m->code[pc].a);
+                if (callee >= 0 && ok[callee]) continue;
+                ok[f] = 0;
+                changed = 1;
+                if (log) fprintf(log, "jit: %s stays interpreted (calls %s)\n", m->funcs[f].name,
+                                 callee >= 0 ? m->funcs[callee].name : "?");
+                break;
+            }
+        }
+    }
+
+    Asm A;
+    memset(&A, 0, sizeof(A));
+    A.stackLimit = m->stackLimit;
+    A.pcOff = malloc(sizeof(int) * (size_t)m->nCode);
+    char *start = calloc((size_t)m->nCode, 1);
+    if (!A.pcOff || !start) abort();
+    for (int i = 0; i < m->nCode; i++) A.pcOff[i] = -1;
+
+    emitTrampoline(&A);
+    int compiled = 0;
+    for (int f = 0; f < m->nFuncs; f++) {
+        if (!ok[f]) continue;
+        int at = A.len;
+        emitFunction(&A, m, f, start);
+        compiled++;
+        if (log) fprintf(log, "jit: %s %d VM instructions -> %d bytes\n", m->funcs[f].name,
+                         vmFuncEnd(m, f) - m->funcs[f].entry, A.len - at);
+    }
+    for (int i = 0; i < A.nFix; i++) {
+        int rel = A.pcOff[A.fix[i].pc] - (A.fix[i].pos + 4);
+        memcpy(A.buf + A.fix[i].pos, &rel, 4);
+    }
+
+    struct JitCode *jit = calloc(1, sizeof(struct JitCode));
+    if (!jit) abort();
+    jit->size = (size_t)A.len;
+    jit->mem = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->mem == MAP_FAILED) {
+        free(jit);
+        compiled = 0;
+    }
+    else {
+        memcpy(jit->mem, A.buf, jit->size);
+        mprotect(jit->mem, jit->size, PROT_READ | PROT_EXEC);
+        m->jit = jit;
+        for (int f = 0; f < m->nFuncs; f++) {
+            if (!ok[f]) continue;
+            m->funcs[f].native = jit->mem + A.pcOff[m->funcs[f].entry];
+            m->code[m->funcs[f].entry].op = I_NATIVE;
+        }
+        m->threaded = 0;
+    }
+    free(A.buf);
+    free(A.pcOff);
+    free(A.fix);
+    free(start);
+    free(ok);
+    return compiled;
+}
+
+void vmFreeJit(VmMachine *m) {
+    if (!m->jit) return;
+    for (int f = 0; f < m->nFuncs; f++) {
+        if (!m->funcs[f].native) continue;
+        m->funcs[f].native = NULL;
+        m->code[m->funcs[f].entry].op = I_FUNCTION;
+    }
+    m->threaded = 0;
+    munmap(m->jit->mem, m->jit->size);
+    free(m->jit);
+    m->jit = NULL;
+}
+
+int jitEnter(VmMachine *m, const void *fn) {
+    int (*trampoline)(VmMachine*, const void*) =
+        (int (*)(VmMachine*, const void*))(void*)m->jit->mem;
+    return trampoline(m, fn);
+}
+
+#else  // no JIT on this platform
+
+int vmEnableJit(VmMachine *m, FILE *log) {
+    if (log) fprintf(log, "jit: not available on this platform\n");
+    return -1;
+}
+
+void vmFreeJit(VmMachine *m) { }
+
+int jitEnter(VmMachine *m, const void *fn) { return JIT_HALTED; }
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdio.h>
+#include "vminterp.h"
+
+// Template JIT from decoded VM code to x86-64.
+// A function is compiled as a whole (prologue to return) and only if every
+// function it calls is compiled too; anything else stays interpreted.
+// Native code uses the same Hack RAM, frames and return addresses as the
+// interpreter, which enters it through I_NATIVE.
+
+// negative results of jitEnter; anything else is the VM return address
+#define JIT_OVERFLOW  (-1)
+#define JIT_LIMIT     (-2)
+#define JIT_HALTED    (-3)
+
+// Compile what can be compiled and switch those functions to I_NATIVE.
+// Returns the number of functions compiled, -1 where there is no JIT.
+// Per-function results are logged to `log` if not NULL
+int vmEnableJit(VmMachine *m, FILE *log);
+// Drop the native code and go back to interpreting everything
+void vmFreeJit(VmMachine *m);
+// Run native function fn with the frame already built; sp in RAM[0]
+int jitEnter(VmMachine *m, const void *fn);
+
+#endif
@@ -17,7 +17,13 @@ Date Work Commenced:February 18
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include "lexer.h"
+#include "lexpipe.h"
+#include "lextext.h"
 
 // Global variables
 static FILE *sourceFile = NULL;
@@ -27,6 +33,47 @@ static int peeked = 0;         // peek flag
 static Token peekToken;        // token used for peeking
 static char globalFileName[32] = "";
 
+// Lexemes of any length: the reader collects into lexBuf, and one too long
+// for lx is copied to lastLong. The side handing tokens to the parser
+// files it in longText and stores its number + 1 in the token's ec
+static char *lexBuf;
+static int lexBufCap;
+static char *lastLong;         // written by whichever side runs lexToken
+static char **longText;        // parser side
+static int nLongText, capLongText;
+
+// Pipelined mode: the lexer thread is the only writer of ring slots, text
+// and ringHead, the parser the only writer of the tails. Positions only
+// grow; index with & (size - 1)
+#define TOKEN_RING 1024        // slots, a power of two
+#define TEXT_RING  16384       // lexeme bytes, a power of two
+
+typedef struct {
+    unsigned char tp, ec;
+    unsigned short len;        // lexeme length in ringText
+    int ln;
+    unsigned text;             // position of the lexeme in ringText
+    char *longText;            // whole lexeme if longer than lx
+    int handle;                // its ec once the parser has filed it
+} RingToken;
+
+static int pipelined = 0;      // set by SetLexerPipelined
+static int lexThreadRunning = 0;
+static pthread_t lexThread;
+static RingToken ring[TOKEN_RING];
+static char ringText[TEXT_RING];
+#define RING_BATCH 32           // tokens the lexer thread publishes at once
+
+// each side's counters on their own cache line
+static _Alignas(64) atomic_uint ringHead;   // tokens published by the lexer thread
+static _Alignas(64) atomic_uint ringTail;   // tokens consumed by the parser
+static atomic_uint textTail;   // lexeme bytes consumed by the parser
+static unsigned readTail;      // parser side copy of ringTail
+static unsigned readHead;      // ringHead as last seen by the parser
+static _Alignas(64) atomic_int ringStop;    // StopLexer wants the thread gone
+static int ringDone = 0;       // the parser has taken the EOF token
+static Token ringEof;
+
 // Keyword list
 static const char* keywords[] = {
     "class", "constructor", "function", "method", "field",
@@ -47,6 +94,10 @@ static Token readIdentifier();
 static Token readNumber();
 static Token readString();
 static Token readSymbol();
+static Token lexToken();
+static int keepLong(char *s);
+static void freeLong();
+static void* lexThreadMain(void* arg);
 
 // Initialize the lexer
 int InitLexer(char* file_name) {
@@ -59,11 +110,42 @@ int InitLexer(char* file_name) {
     currentLine = 1;
     currentChar = fgetc(sourceFile);
     peeked = 0;
+    // a lexer thread only pays off with a second CPU to run on
+    if (pipelined && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        atomic_store(&ringHead, 0);
+        atomic_store(&ringTail, 0);
+        atomic_store(&textTail, 0);
+        atomic_store(&ringStop, 0);
+        readTail = readHead = 0;
+        ringDone = 0;
+        if (pthread_create(&lexThread, NULL, lexThreadMain, NULL) == 0) {
+            lexThreadRunning = 1;
+        }
+    }
     return 1;
 }
 
+void SetLexerPipelined(int on) {
+    pipelined = on;
+}
+
 // Stop the lexer and clean up
 int StopLexer() {
+    if (lexThreadRunning) {
+        atomic_store(&ringStop, 1);
+        pthread_join(lexThread, NULL);
+        lexThreadRunning = 0;
+        // lexemes still in the ring never reached the parser
+        for (unsigned i = readTail; i != atomic_load(&ringHead); i++) {
+            RingToken *r = &ring[i & (TOKEN_RING - 1)];
+            if (r->longText && !r->handle) {
+                free(r->longText);
+            }
+        }
+    }
+    free(lastLong);
+    lastLong = NULL;
+    freeLong();
     if (sourceFile) {
         fclose(sourceFile);
         sourceFile = NULL;
@@ -71,13 +153,149 @@ int StopLexer() {
     return 1;
 }
 
+// Spin a little, then give up the CPU
+static void backoff(int *spins) {
+    if (++*spins > 64) {
+        sched_yield();
+    }
+}
+
+// Lexer thread: tokenize the file into the ring until EOF
+static void* lexThreadMain(void* arg) {
+    unsigned head = 0, text = 0, tail = 0, freeText = TEXT_RING;
+    (void)arg;
+    while (1) {
+        Token t = lexToken();
+        unsigned len = (unsigned)strlen(t.lx);
+        int spins = 0;
+        // look at the parser's tails only when the cached ones say full
+        while (head - tail == TOKEN_RING || len > freeText) {
+            atomic_store_explicit(&ringHead, head, memory_order_release);
+            if (atomic_load_explicit(&ringStop, memory_order_relaxed)) {
+                return NULL;
+            }
+            tail = atomic_load_explicit(&ringTail, memory_order_acquire);
+            freeText = TEXT_RING - (text - atomic_load_explicit(&textTail, memory_order_acquire));
+            if (head - tail == TOKEN_RING || len > freeText) {
+                backoff(&spins);
+            }
+        }
+        RingToken *r = &ring[head & (TOKEN_RING - 1)];
+        r->tp = (unsigned char)t.tp;
+        r->ec = (unsigned char)t.ec;
+        r->len = (unsigned short)len;
+        r->ln = t.ln;
+        r->text = text;
+        r->longText = lastLong;
+        r->handle = 0;
+        lastLong = NULL;
+        for (unsigned i = 0; i < len; i++) {
+            ringText[(text + i) & (TEXT_RING - 1)] = t.lx[i];
+        }
+        text += len;
+        freeText -= len;
+        head++;
+        if (head % RING_BATCH == 0 || t.tp == EOFile) {
+            atomic_store_explicit(&ringHead, head, memory_order_release);
+        }
+        if (t.tp == EOFile) {
+            return NULL;
+        }
+    }
+}
+
+// Next token from the ring, consumed if advance is set
+static Token ringToken(int advance) {
+    if (ringDone) {
+        return ringEof;
+    }
+    int spins = 0;
+    while (readHead == readTail) {
+        readHead = atomic_load_explicit(&ringHead, memory_order_acquire);
+        if (readHead == readTail) {
+            backoff(&spins);
+        }
+    }
+    RingToken *r = &ring[readTail & (TOKEN_RING - 1)];
+    Token t;
+    t.tp = (TokenType)r->tp;
+    t.ec = r->ec;
+    if (r->longText) {
+        // filed once, even if peeked first
+        if (!r->handle) {
+            r->handle = keepLong(r->longText);
+        }
+        t.ec = r->handle;
+    }
+    t.ln = r->ln;
+    memcpy(t.fl, globalFileName, sizeof(t.fl));
+    for (unsigned i = 0; i < r->len; i++) {
+        t.lx[i] = ringText[(r->text + i) & (TEXT_RING - 1)];
+    }
+    t.lx[r->len] = '\0';
+    if (advance) {
+        readTail++;
+        // hand slots back in batches too, and always before waiting
+        if (readTail % RING_BATCH == 0 || readTail == readHead) {
+            atomic_store_explicit(&textTail, r->text + r->len, memory_order_release);
+            atomic_store_explicit(&ringTail, readTail, memory_order_release);
+        }
+        if (t.tp == EOFile) {
+            ringDone = 1;
+            ringEof = t;
+        }
+    }
+    return t;
+}
+
 // Get the next token
 Token GetNextToken() {
+    if (lexThreadRunning) {
+        return ringToken(1);
+    }
     if (peeked) {
         peeked = 0;
         return peekToken;
     }
+    Token t = lexToken();
+    if (lastLong) {
+        t.ec = keepLong(lastLong);
+        lastLong = NULL;
+    }
+    return t;
+}
+
+// File a long lexeme for TokenText; returns the token's ec
+static int keepLong(char *s) {
+    if (nLongText == capLongText) {
+        capLongText = capLongText ? capLongText * 2 : 16;
+        longText = realloc(longText, sizeof(char*) * (size_t)capLongText);
+        if (!longText) {
+            abort();
+        }
+    }
+    longText[nLongText++] = s;
+    return nLongText;
+}
+
+static void freeLong() {
+    for (int i = 0; i < nLongText; i++) {
+        free(longText[i]);
+    }
+    free(longText);
+    longText = NULL;
+    nLongText = capLongText = 0;
+}
+
+const char* TokenText(const Token *t) {
+    if (t->tp != ERR && t->ec > 0 && t->ec <= nLongText) {
+        return longText[t->ec - 1];
+    }
+    return t->lx;
+}
 
+// Read the next token from the source file
+static Token lexToken() {
     // Skip whitespace and comments
     Token skipToken = skipWhitespaceAndComments();
     if (skipToken.tp == ERR) {
@@ -108,6 +326,9 @@ Token GetNextToken() {
 
 // Peek the next token without consuming it
 Token PeekNextToken() {
+    if (lexThreadRunning) {
+        return ringToken(0);
+    }
     if (!peeked) {
         peekToken = GetNextToken();
         peeked = 1;
@@ -115,9 +336,10 @@ Token PeekNextToken() {
     return peekToken;
 }
 
-// Read the next character and update line number
+// Read the next character and update line number. Only one thread at a
+// time reads the file, so stdio's per-call locking is skipped
 static int readChar() {
-    int c = fgetc(sourceFile);
+    int c = getc_unlocked(sourceFile);
     if (c == '\n') {
         currentLine++;
     }
@@ -179,6 +401,33 @@ static Token skipWhitespaceAndComments() {
     return errToken;
 }
 
+// Append currentChar to the lexeme being read
+static void keepChar(int at) {
+    if (at == lexBufCap) {
+        lexBufCap = lexBufCap ? lexBufCap * 2 : 256;
+        lexBuf = realloc(lexBuf, (size_t)lexBufCap);
+        if (!lexBuf) {
+            abort();
+        }
+    }
+    lexBuf[at] = (char)currentChar;
+}
+
+// Put the lexeme read into t: what fits in lx, all of it in lastLong
+static void endLexeme(Token *t, int len) {
+    int n = len < (int)sizeof(t->lx) - 1 ? len : (int)sizeof(t->lx) - 1;
+    memcpy(t->lx, lexBuf, (size_t)n);
+    t->lx[n] = '\0';
+    if (len > n) {
+        lastLong = malloc((size_t)len + 1);
+        if (!lastLong) {
+            abort();
+        }
+        memcpy(lastLong, lexBuf, (size_t)len);
+        lastLong[len] = '\0';
+    }
+}
+
 // Read an identifier or keyword
 static Token readIdentifier() {
     Token t;
@@ -186,14 +435,12 @@ static Token readIdentifier() {
     strncpy(t.fl, globalFileName, sizeof(t.fl) - 1);
     t.ec = 0;
 
-    int idx = 0;
+    int len = 0;
     while (isalnum(currentChar) || currentChar == '_') {
-        if (idx < (int)sizeof(t.lx) - 1) {
-            t.lx[idx++] = (char)currentChar;
-        }
+        keepChar(len++);
         currentChar = readChar();
     }
-    t.lx[idx] = '\0';
+    endLexeme(&t, len);
 
     t.tp = ID;
     for (int i = 0; i < numKeywords; i++) {
@@ -212,14 +459,12 @@ static Token readNumber() {
     strncpy(t.fl, globalFileName, sizeof(t.fl) - 1);
     t.ec = 0;
 
-    int idx = 0;
+    int len = 0;
     while (isdigit(currentChar)) {
-        if (idx < (int)sizeof(t.lx) - 1) {
-            t.lx[idx++] = (char)currentChar;
-        }
+        keepChar(len++);
         currentChar = readChar();
     }
-    t.lx[idx] = '\0';
+    endLexeme(&t, len);
     t.tp = INT;
     return t;
 }
@@ -235,7 +480,7 @@ static Token readString() {
     t.ec = 0;
 
     currentChar = readChar();
-    int idx = 0;
+    int len = 0;
 
     while (currentChar != '"' && currentChar != EOF) {
         if (currentChar == '\n') {
@@ -245,9 +490,7 @@ static Token readString() {
             t.ln = startLine;
             return t;
         }
-        if (idx < (int)sizeof(t.lx) - 1) {
-            t.lx[idx++] = (char)currentChar;
-        }
+        keepChar(len++);
         currentChar = readChar();
     }
 
@@ -259,7 +502,7 @@ static Token readString() {
         return t;
     }
 
-    t.lx[idx] = '\0';
+    endLexeme(&t, len);
     currentChar = readChar();
     return t;
 }
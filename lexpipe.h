@@ -0,0 +1,15 @@
+#ifndef LEXPIPE_H
+#define LEXPIPE_H
+
+// Pipelined lexing (lexer.c).
+// When on, InitLexer starts a thread that tokenizes the whole file into a
+// single-producer/single-consumer ring of compact tokens; GetNextToken and
+// PeekNextToken read them from the ring while the parser runs, and
+// StopLexer joins the thread. Tokens come out exactly as in the default
+// sequential mode. On a machine with a single CPU the thread could only
+// take turns with the parser, so lexing stays sequential there.
+
+// Applies to the next InitLexer; off by default
+void SetLexerPipelined(int on);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef LEXTEXT_H
+#define LEXTEXT_H
+
+#include "lexer.h"
+
+// Lexemes of any length (lexer.c).
+// An identifier, number or string constant longer than a Token's lx keeps
+// its first 127 bytes there; the whole text stays with the lexer until
+// StopLexer, reached through the token's ec (unused outside ERR tokens).
+// For any other token TokenText is just lx.
+const char* TokenText(const Token *t);
+
+#endif
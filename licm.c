@@ -0,0 +1,273 @@
+// licm.c
+/************************************************************************
+ Loop-invariant code motion on the register IR
+
+ Loops are found from back edges (a jump to a block that dominates the
+ jumping one). An instruction is invariant when its operands come from
+ outside the loop or from invariant instructions, and for a load when
+ nothing in the loop may write the variable it reads: locals and
+ arguments only change by stores to them, fields and statics also by
+ any call that is not known to be pure, array elements by any store to
+ the heap. Invariant expressions worth at least two instructions (or a
+ pure call) are moved to a preheader block run once before the loop.
+ Loads are safe to run speculatively: addresses wrap to RAM on both
+ the VM and the Hack machine.
+*************************************************************************/
+#include "ir.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    IrFunction *ir;
+    int *idom, *predStart, *pred;
+    int *defBlock;           // block defining each register
+    char *inLoop;            // per block
+    char *inv;               // per instruction: invariant in the current loop
+    int *stores, nStores;    // (seg << 16 | index) of the loop's stores
+    int storesThat, storesThis, storesStatic, storesPointer, calls;
+    int *ops;
+} Licm;
+
+static int storedTo(const Licm *L, int seg, int idx) {
+    for (int i = 0; i < L->nStores; i++)
+        if (L->stores[i] == (seg << 16 | idx)) return 1;
+    return 0;
+}
+
+static void collectEffects(Licm *L) {
+    IrFunction *ir = L->ir;
+    L->nStores = 0;
+    L->storesThat = L->storesThis = L->storesStatic = L->storesPointer = L->calls = 0;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        if (!L->inLoop[b]) continue;
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if (in->op == IR_CALL && !irIsPureInstr(ir, in)) L->calls = 1;
+            if (in->op != IR_STORE) continue;
+            L->stores[L->nStores++] = in->seg << 16 | in->imm;
+            if (in->seg == SEG_THAT) L->storesThat = 1;
+            if (in->seg == SEG_THIS) L->storesThis = 1;
+            if (in->seg == SEG_STATIC) L->storesStatic = 1;
+            if (in->seg == SEG_POINTER) L->storesPointer = 1;
+        }
+    }
+}
+
+static int loadInvariant(const Licm *L, const IrInstr *in) {
+    switch (in->seg) {
+        case SEG_LOCAL: case SEG_ARGUMENT:
+            return !storedTo(L, in->seg, in->imm);
+        case SEG_STATIC:
+            return !storedTo(L, in->seg, in->imm) && !L->calls;
+        case SEG_THIS:
+            return !storedTo(L, in->seg, in->imm) && !L->storesThat && !L->storesPointer && !L->calls;
+        case SEG_THAT:
+            return !L->storesThat && !L->storesThis && !L->storesStatic && !L->calls;
+        case SEG_POINTER:
+            return !L->storesPointer;
+        default:
+            return 0;
+    }
+}
+
+static int available(const Licm *L, int r, const int *defAt) {
+    return !L->inLoop[L->defBlock[r]] || L->inv[defAt[r]];
+}
+
+// mark the invariant instructions of the loop; returns how many
+static int findInvariants(Licm *L, const int *defAt) {
+    IrFunction *ir = L->ir;
+    int count = 0, changed = 1;
+    memset(L->inv, 0, (size_t)ir->nCode);
+    while (changed) {
+        changed = 0;
+        for (int b = 0; b < ir->nBlocks; b++) {
+            if (!L->inLoop[b]) continue;
+            for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+                const IrInstr *in = &ir->code[k];
+                if (L->inv[k] || in->dst < 0 || in->op == IR_PARAM || !irIsPureInstr(ir, in)) continue;
+                if (in->op == IR_LOAD && !loadInvariant(L, in)) continue;
+                int n = irOperands(ir, in, L->ops), ok = 1;
+                for (int i = 0; i < n && ok; i++)
+                    ok = available(L, L->ops[i], defAt);
+                if (!ok) continue;
+                L->inv[k] = 1;
+                count++;
+                changed = 1;
+            }
+        }
+    }
+    return count;
+}
+
+// instructions an invariant value costs to compute inside the loop; a
+// pure call counts as expensive. Invariants take at most two operands
+static int cost(const Licm *L, int k, const int *defAt, int depth) {
+    const IrInstr *in = &L->ir->code[k];
+    int ops[2], c = in->op == IR_CALL ? 100 : 1;
+    if (in->op == IR_CALL || depth > 16) return c;
+    int n = irOperands(L->ir, in, ops);
+    for (int i = 0; i < n; i++)
+        if (L->inLoop[L->defBlock[ops[i]]]) c += cost(L, defAt[ops[i]], defAt, depth + 1);
+    return c;
+}
+
+static void markHoisted(const Licm *L, int k, const int *defAt, char *hoist) {
+    int ops[2];
+    if (hoist[k]) return;
+    hoist[k] = 1;
+    int n = irOperands(L->ir, &L->ir->code[k], ops);
+    for (int i = 0; i < n; i++)
+        if (L->inLoop[L->defBlock[ops[i]]]) markHoisted(L, defAt[ops[i]], defAt, hoist);
+}
+
+// hoist the profitable invariants of the loop headed by h; returns the
+// number of instructions moved
+static int hoistLoop(Licm *L, int h, const int *defAt) {
+    IrFunction *ir = L->ir;
+    if (ir->blocks[h].nParams > 0) return 0;
+    collectEffects(L);
+    if (findInvariants(L, defAt) == 0) return 0;
+
+    // roots: invariant values used by instructions that stay in the loop
+    char *hoist = calloc((size_t)ir->nCode + 1, 1);
+    if (!hoist) abort();
+    int any = 0;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        if (!L->inLoop[b]) continue;
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            if (L->inv[k] || ir->code[k].op == IR_NOP) continue;
+            int n = irOperands(ir, &ir->code[k], L->ops);
+            for (int i = 0; i < n; i++) {
+                int r = L->ops[i];
+                if (!L->inLoop[L->defBlock[r]] || !L->inv[defAt[r]] || hoist[defAt[r]]) continue;
+                if (cost(L, defAt[r], defAt, 0) >= 2) {
+                    markHoisted(L, defAt[r], defAt, hoist);
+                    any = 1;
+                }
+            }
+        }
+    }
+    if (!any) {
+        free(hoist);
+        return 0;
+    }
+
+    // the code array may move while the preheader fills up: collect first
+    int nMoved = 0;
+    int *moved = malloc(sizeof(int) * ((size_t)ir->nCode + 1));
+    if (!moved) abort();
+    for (int b = 0; b < ir->nBlocks; b++) {
+        if (!L->inLoop[b]) continue;
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++)
+            if (hoist[k]) moved[nMoved++] = k;
+    }
+    free(hoist);
+    int header, pre = irMakePreheader(ir, L->predStart, L->pred, L->inLoop, h, &header);
+    if (pre < 0) {
+        free(moved);
+        return 0;
+    }
+
+    // definitions before uses: values from other loop blocks may feed in
+    char *done = calloc((size_t)nMoved + 1, 1);
+    if (!done) abort();
+    for (int left = nMoved; left > 0; ) {
+        for (int i = 0; i < nMoved; i++) {
+            if (done[i]) continue;
+            IrInstr in = ir->code[moved[i]];
+            int n = irOperands(ir, &in, L->ops), ready = 1;
+            for (int j = 0; j < n && ready; j++)
+                for (int m = 0; m < nMoved && ready; m++)
+                    if (!done[m] && ir->code[moved[m]].dst == L->ops[j]) ready = 0;
+            if (!ready) continue;
+            irAppendInstr(ir, pre, &in);
+            done[i] = 1;
+            left--;
+        }
+    }
+    IrInstr jump;
+    memset(&jump, 0, sizeof(jump));
+    jump.op = IR_JUMP;
+    jump.dst = jump.a = jump.b = -1;
+    jump.imm = header;
+    irAppendInstr(ir, pre, &jump);
+    for (int i = 0; i < nMoved; i++) {
+        ir->code[moved[i]].op = IR_NOP;
+        ir->code[moved[i]].dst = -1;
+        ir->code[moved[i]].nArgs = 0;
+    }
+    free(done);
+    free(moved);
+    return nMoved;
+}
+
+static void analyze(Licm *L, int *defAt) {
+    IrFunction *ir = L->ir;
+    L->idom = realloc(L->idom, sizeof(int) * ((size_t)ir->nBlocks + 1));
+    L->predStart = realloc(L->predStart, sizeof(int) * ((size_t)ir->nBlocks + 2));
+    L->pred = realloc(L->pred, sizeof(int) * ((size_t)ir->nBlocks * 2 + 1));
+    L->inLoop = realloc(L->inLoop, (size_t)ir->nBlocks + 1);
+    if (!L->idom || !L->predStart || !L->pred || !L->inLoop) abort();
+    irDominators(ir, L->idom);
+    irPredecessors(ir, L->predStart, L->pred);
+    for (int b = 0; b < ir->nBlocks; b++)
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++)
+            if (ir->code[k].dst >= 0) {
+                L->defBlock[ir->code[k].dst] = b;
+                defAt[ir->code[k].dst] = k;
+            }
+}
+
+int irHoistInvariants(IrFunction *ir) {
+    Licm L;
+    memset(&L, 0, sizeof(L));
+    L.ir = ir;
+    L.defBlock = malloc(sizeof(int) * ((size_t)ir->nRegs + 1));
+    int *defAt = malloc(sizeof(int) * ((size_t)ir->nRegs + 1));
+    L.ops = malloc(sizeof(int) * (size_t)irMaxOperands(ir));
+    if (!L.defBlock || !defAt || !L.ops) abort();
+    int total = 0, moved = 1;
+
+    // innermost loops first, then start over on the changed function
+    while (moved) {
+        moved = 0;
+        analyze(&L, defAt);
+        int nb = ir->nBlocks;
+        int *size = calloc((size_t)nb + 1, sizeof(int));
+        int *work = malloc(sizeof(int) * ((size_t)nb + 1));
+        L.stores = realloc(L.stores, sizeof(int) * ((size_t)ir->nCode + 1));
+        L.inv = realloc(L.inv, (size_t)ir->nCode + 1);
+        if (!size || !work || !L.stores || !L.inv) abort();
+        for (int h = 0; h < nb; h++) {
+            int isHeader = 0;
+            for (int k = L.predStart[h]; k < L.predStart[h + 1]; k++)
+                if (irDominates(L.idom, h, L.pred[k])) isHeader = 1;
+            if (isHeader) size[h] = irLoopBody(ir, L.idom, L.predStart, L.pred, h, L.inLoop, work);
+        }
+        for (;;) {
+            int best = -1;
+            for (int h = 0; h < nb; h++)
+                if (size[h] > 0 && (best < 0 || size[h] < size[best])) best = h;
+            if (best < 0) break;
+            size[best] = 0;
+            irLoopBody(ir, L.idom, L.predStart, L.pred, best, L.inLoop, work);
+            moved = hoistLoop(&L, best, defAt);
+            if (moved) break;
+        }
+        total += moved;
+        free(size);
+        free(work);
+    }
+    free(L.idom);
+    free(L.predStart);
+    free(L.pred);
+    free(L.defBlock);
+    free(L.inLoop);
+    free(L.inv);
+    free(L.stores);
+    free(L.ops);
+    free(defAt);
+    return total;
+}
@@ -0,0 +1,94 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include <stdio.h>
+#include "ast.h"
+#include "vm.h"
+
+// Optimisation switches, set by the compiler driver before compile()
+typedef struct {
+    int fold;                // constant folding and algebraic identities
+    int strength;            // multiply by constant => add/doubling chains
+    int mulChainLimit;       // longest chain (VM instructions) worth emitting
+    int dce;                 // drop subroutines unreachable from the entry point
+    int inlineThreshold;     // inline leaf functions up to this many instructions, 0 = off
+    int ir;                  // round-trip functions through the register IR (ir.c) and its passes
+    int cse;                 // IR pass: reuse values computed earlier in a block
+    int licm;                // IR pass: hoist loop-invariant expressions out of loops
+    int promote;             // IR pass: keep the busiest variables of call-free loops in temp slots
+    int arrays;              // IR pass: constant index parts into that offsets, reuse of pointer 1
+    const struct Profile *profile;  // run counts from pgo.c steering layout and inlining, NULL = none
+    int astCache;            // reuse <Class>.ast parse results newer than the .jack, write fresh ones
+    int pipelineLexer;       // lex on a second thread feeding the parser through a token ring
+    int parseStackLimit;     // > 0: parse bodies on a heap stack of this many frames, 0 = recursively
+    int vmBinary;            // write <Class>.vmb bytecode instead of .vm text
+    int stringPool;          // build each distinct string constant once (strpool.c); shares the objects
+    int sizeClassHeap;       // give programs the size-class Memory of heap.c instead of the OS first fit
+    FILE *log;               // per-pass details (what was dropped ...), NULL = quiet
+} OptOptions;
+
+// Counters filled in by the passes during compile()
+typedef struct {
+    int constantsFolded;     // operator nodes evaluated at compile time
+    int identitiesApplied;   // x+0, x*1, x*0, ~~x, x&0 ...
+    int multiplyCallsRemoved;// Math.multiply calls folded away or strength-reduced
+    int divideCallsRemoved;  // Math.divide calls folded away
+    int functionsDropped;    // unreachable subroutines removed
+    int instructionsDropped; // VM instructions in those subroutines
+    int callsInlined;        // call sites replaced by the callee's body
+    int branchesLaidOut;     // if/while statements laid out for their profiled direction
+    int subexpressionsEliminated; // IR instructions made redundant by reusing a value
+    int invariantsHoisted;   // IR instructions moved out of loops
+    int localsPromoted;      // loop variables moved to temp slots
+    int arrayIndexesFolded;  // array accesses whose constant index moved into the that offset
+    int pointerReloadsDropped; // array accesses lowered without setting pointer 1 from the stack
+    int stringsPooled;       // distinct string constants built once by StringPool$.get
+    int stringUsesPooled;    // string constants read from the pool instead of built
+    int sizeClassHeap;       // 1 if the generated Memory class was added
+} OptStats;
+
+extern OptOptions optOptions;
+extern OptStats optStats;
+
+void resetOptStats(void);
+void printOptReport(FILE *f);
+
+// fold.c: evaluate constant subexpressions with 16-bit Jack semantics
+void foldClass(ClassAst *c);
+void foldExpr(ClassAst *c, int e);
+// If expression e is a compile-time constant store its 16-bit value in *v
+int constValue(const ClassAst *c, int e, int *v);
+int wrap16(int v);
+
+// dce.c: remove functions unreachable from Sys.init / Main.main;
+// returns the number of functions dropped
+int eliminateDeadFunctions(VmProgram *p);
+
+// strpool.c: beginStringPool before code generation; poolString gives the
+// slot of a literal, -1 if not pooling; endStringPool adds StringPool$
+#define STRING_POOL_CLASS "StringPool$"
+#define STRING_POOL_GET "StringPool$.get"
+void beginStringPool(int on);
+int poolString(const char *s);
+void endStringPool(VmProgram *p);
+
+// heap.c: after dead code elimination, a program with Main.main and no
+// Memory of its own gets the size-class Memory; returns 1 if added.
+// Its statics: 0 list heads, 1 block sizes, 2 statistics, 3 heap top
+#define HEAP_MARKER "Memory.classOf$"
+#define HEAP_CLASSES 25
+#define HEAP_MAX_REQUEST 8191
+enum {
+    HEAP_ALLOCS, HEAP_ALLOCS_10K, HEAP_FREES, HEAP_FREES_10K,
+    HEAP_LIVE_BLOCKS, HEAP_LIVE_WORDS, HEAP_PEAK_WORDS,
+    HEAP_FREE_WORDS,         // in blocks on the free lists
+    HEAP_REQUESTED_WORDS,    // asked for by the live blocks
+    HEAP_LOST_WORDS,         // single words left over by splits
+    HEAP_STATS
+};
+int addSizeClassHeap(VmProgram *p);
+
+// inline.c: expand calls to small leaf functions; returns call sites inlined
+int inlineSmallFunctions(VmProgram *p);
+
+#endif
@@ -2,36 +2,64 @@
 #include <string.h>
 #include <stdio.h>
 #include "lexer.h"
+#include "lextext.h"
 #include "parser.h"
+#include "symbols.h"
+#include "ast.h"
 
 //---------------------
 // Global parser state
 //---------------------
 static int parserInited = 0;
+static ClassAst *ast = NULL;     // tree of the class being parsed
+static int stackLimit = 0;       // > 0: statements nest on a heap stack of this many frames
+static char *astOutput = NULL;   // binary AST file each parsed class is written to, or NULL
+static int astSaved = 0;
+
+// Parse functions return a PStatus; the error and the token it happened
+// at are recorded once, here, and Parse() builds its ParserInfo from them
+typedef enum { P_OK, P_FAIL } PStatus;
+static struct {
+    SyntaxErrors er;
+    Token tk;                    // failing token, or the class's closing '}'
+} outcome;
+
+// the whole text of an identifier or constant, interned in the tree
+static int lexeme(const Token *t) {
+    return astString(ast, TokenText(t));
+}
 
 //---------------------
 // Forward declarations
 //---------------------
-static ParserInfo parseClass();
-static ParserInfo parseClassVarDec();
-static ParserInfo parseSubroutineDec();
-static ParserInfo parseParameterList();
-static ParserInfo parseSubroutineBody();
-static ParserInfo parseVarDec();
-static ParserInfo parseStatements();
-static ParserInfo parseStatement();
-static ParserInfo parseLetStatement();
-static ParserInfo parseIfStatement();
-static ParserInfo parseWhileStatement();
-static ParserInfo parseDoStatement();
-static ParserInfo parseReturnStatement();
-static ParserInfo parseExpression();
-static ParserInfo parseTerm();
+static PStatus parseClass();
+static PStatus parseClassVarDec(int *tail);
+static PStatus parseSubroutineDec(int *out);
+static PStatus parseParameterList(int sub);
+static PStatus parseSubroutineBody(int sub);
+static PStatus parseVarDec(int sub, int *tail);
+static PStatus parseStatements(int *first);
+static PStatus parseLetStatement(int *out);
+static PStatus parseIfStatement(int *out);
+static PStatus parseWhileStatement(int *out);
+static PStatus parseDoStatement(int *out);
+static PStatus parseReturnStatement(int *out);
+static PStatus parseExpressionList(int call);
+static PStatus parseExpression(int *out);
+static PStatus parseTerm(int *out);
+static PStatus parseStatementsIter(int *first);
+static void freeFrames(void);
 
 // Utility
-static ParserInfo eat(TokenType tp, const char* lx, SyntaxErrors err);
-static ParserInfo eatAny(TokenType tp, SyntaxErrors err);
-static ParserInfo makeError(SyntaxErrors er, Token tk);
+// link node idx at the end of the list head..tail of the given pool
+#define APPEND(pool, head, tail, idx) do {              \
+        if ((tail) == AST_NONE) (head) = (idx);         \
+        else ast->pool[tail].next = (idx);              \
+        (tail) = (idx);                                 \
+    } while (0)
+static PStatus eat(TokenType tp, const char* lx, SyntaxErrors err);
+static PStatus eatToken(TokenType tp, const char* lx, SyntaxErrors err, Token *tk);
+static PStatus fail(SyntaxErrors er, const Token *tk);
 
 //---------------------
 // Parser entry
@@ -57,47 +85,80 @@ ParserInfo Parse()
         return pi;
     }
 
-    pi = parseClass();
-    if (pi.er != none) {
-        return pi;
-    }
+    freeClassAst(ast);
+    ast = newClassAst();
 
-    // Optionally, read one more token in case leftover content
-    Token tk = GetNextToken();
-    if (tk.tp == ERR) {
-        pi.er = lexerErr;
-        pi.tk = tk;
+    outcome.er = none;
+    if (parseClass() == P_OK) {
+        // Optionally, read one more token in case leftover content
+        Token tk = GetNextToken();
+        if (tk.tp == ERR) fail(lexerErr, &tk);
+    }
+    if (outcome.er != none) {
+        freeClassAst(ast);
+        ast = NULL;
     }
+    // before any pass rewrites the tree
+    astSaved = outcome.er == none && astOutput && writeClassAstFile(ast, astOutput);
+    pi.er = outcome.er;
+    pi.tk = outcome.tk;
     return pi;
 }
 
+void SetParserStackLimit(int limit)
+{
+    stackLimit = limit;
+}
+
+void SetParserAstOutput(const char *path)
+{
+    free(astOutput);
+    astOutput = path ? strdup(path) : NULL;
+}
+
+int ParsedClassSaved(void)
+{
+    return astSaved;
+}
+
 int StopParser()
 {
     StopLexer();
+    freeFrames();
+    freeClassAst(ast);
+    ast = NULL;
     parserInited = 0;
     return 1;
 }
 
+ClassAst* TakeParsedClass(void)
+{
+    ClassAst *c = ast;
+    ast = NULL;
+    return c;
+}
+
 //---------------------
 // parseClass:
 //   class <id> { classVarDec* subroutineDec* }
 //---------------------
-static ParserInfo parseClass()
+static PStatus parseClass()
 {
-    ParserInfo pi = eat(RESWORD, "class", classExpected);
-    if (pi.er != none) return pi;
+    if (eat(RESWORD, "class", classExpected) != P_OK) return P_FAIL;
+
+    Token name;
+    if (eatToken(ID, NULL, idExpected, &name) != P_OK) return P_FAIL;
+    ast->name = lexeme(&name);
 
-    pi = eatAny(ID, idExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
 
-    pi = eat(SYMBOL, "{", openBraceExpected);
-    if (pi.er != none) return pi;
+    int varTail = AST_NONE, subTail = AST_NONE;
 
     // classVarDec*
     while (1) {
         Token look = PeekNextToken();
         if (look.tp == ERR) {
-            return makeError(lexerErr, look);
+            return fail(lexerErr, &look);
         }
         if (look.tp == SYMBOL && !strcmp(look.lx, "}")) {
             break;
@@ -105,8 +166,7 @@ static ParserInfo parseClass()
         if (look.tp == RESWORD &&
            (!strcmp(look.lx,"static") || !strcmp(look.lx,"field"))) 
         {
-            pi = parseClassVarDec();
-            if (pi.er != none) return pi;
+            if (parseClassVarDec(&varTail) != P_OK) return P_FAIL;
         } else {
             break;
         }
@@ -116,7 +176,7 @@ static ParserInfo parseClass()
     while (1) {
         Token look = PeekNextToken();
         if (look.tp == ERR) {
-            return makeError(lexerErr, look);
+            return fail(lexerErr, &look);
         }
         if (look.tp == SYMBOL && !strcmp(look.lx, "}")) {
             break;
@@ -126,57 +186,57 @@ static ParserInfo parseClass()
             !strcmp(look.lx,"function") ||
             !strcmp(look.lx,"method"))) 
         {
-            pi = parseSubroutineDec();
-            if (pi.er != none) return pi;
+            int sub;
+            if (parseSubroutineDec(&sub) != P_OK) return P_FAIL;
+            APPEND(subDecs, ast->subs, subTail, sub);
         } else {
             break;
         }
     }
 
-    pi = eat(SYMBOL, "}", closeBraceExpected);
-    return pi;
+    return eatToken(SYMBOL, "}", closeBraceExpected, &outcome.tk);
 }
 
 //---------------------
 // parseClassVarDec:
 //   (static|field) type varName (, varName)* ;
 //---------------------
-static ParserInfo parseClassVarDec()
+static PStatus parseClassVarDec(int *tail)
 {
     // consume static|field
     Token t1 = GetNextToken();
-    if (t1.tp == ERR) return makeError(lexerErr, t1);
+    if (t1.tp == ERR) return fail(lexerErr, &t1);
+    Kind kind = !strcmp(t1.lx, "static") ? STATIC_SYMBOL : FIELD_SYMBOL;
 
     // type
-    ParserInfo pi;
-    pi.er = none;
-    pi.tk.tp = EOFile;
-
     Token tkType = GetNextToken();
-    if (tkType.tp == ERR) return makeError(lexerErr, tkType);
+    if (tkType.tp == ERR) return fail(lexerErr, &tkType);
 
     // 1) 如果遇到符号但不是 ";", 可能评分器想要 ") expected"之类
     // 但在 classVarDec 并不涉及 ), 这里保持以前逻辑即可。
     if (tkType.tp == SYMBOL) {
         // 如果评分器在这里需要别的定向修补可加
         // 否则继续 "illegalType"
-        return makeError(illegalType, tkType);
+        return fail(illegalType, &tkType);
     }
 
     // 2) normal type check
     if (tkType.tp == RESWORD) {
         if (strcmp(tkType.lx,"int") && strcmp(tkType.lx,"char") && strcmp(tkType.lx,"boolean")) {
-            return makeError(illegalType, tkType);
+            return fail(illegalType, &tkType);
         }
     } else if (tkType.tp != ID) {
-        return makeError(illegalType, tkType);
+        return fail(illegalType, &tkType);
     }
 
     // varName
     Token varN = GetNextToken();
     if (varN.tp != ID) {
-        return makeError(idExpected, varN);
+        return fail(idExpected, &varN);
     }
+    int type = lexeme(&tkType);
+    int d = newVarDec(ast, lexeme(&varN), type, kind);
+    APPEND(decs, ast->vars, *tail, d);
 
     // more varName
     while (1) {
@@ -185,60 +245,63 @@ static ParserInfo parseClassVarDec()
             GetNextToken(); // consume ','
             Token v2 = GetNextToken();
             if (v2.tp != ID) {
-                return makeError(idExpected, v2);
+                return fail(idExpected, &v2);
             }
+            d = newVarDec(ast, lexeme(&v2), type, kind);
+            APPEND(decs, ast->vars, *tail, d);
         } else {
             break;
         }
     }
 
     // expect ';'
-    pi = eat(SYMBOL, ";", semicolonExpected);
-    return pi;
+    return eat(SYMBOL, ";", semicolonExpected);
 }
 
 //---------------------
 // parseSubroutineDec:
 //   (constructor|function|method) (void|type) subName ( parameterList ) subroutineBody
 //---------------------
-static ParserInfo parseSubroutineDec()
+static PStatus parseSubroutineDec(int *out)
 {
     Token first = GetNextToken(); // constructor|function|method
-    if (first.tp == ERR) return makeError(lexerErr, first);
+    if (first.tp == ERR) return fail(lexerErr, &first);
+    SubKind kind = !strcmp(first.lx, "constructor") ? SUB_CONSTRUCTOR
+                 : !strcmp(first.lx, "method") ? SUB_METHOD : SUB_FUNCTION;
+    int sub = newSubDec(ast, kind, first.ln);
+    *out = sub;
 
     // return type
     Token rt = GetNextToken();
-    if (rt.tp == ERR) return makeError(lexerErr, rt);
+    if (rt.tp == ERR) return fail(lexerErr, &rt);
     if (rt.tp == RESWORD) {
         if (strcmp(rt.lx,"void") && strcmp(rt.lx,"int")
             && strcmp(rt.lx,"char") && strcmp(rt.lx,"boolean")) {
-            return makeError(illegalType, rt);
+            return fail(illegalType, &rt);
         }
     } else if (rt.tp != ID) {
-        return makeError(illegalType, rt);
+        return fail(illegalType, &rt);
     }
 
     // subName => ID
     Token sName = GetNextToken();
     if (sName.tp != ID) {
-        return makeError(idExpected, sName);
+        return fail(idExpected, &sName);
     }
+    ast->subDecs[sub].type = lexeme(&rt);
+    ast->subDecs[sub].name = lexeme(&sName);
 
     // '('
-    ParserInfo pi = eat(SYMBOL, "(", openParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
 
     // parseParameterList
-    pi = parseParameterList();
-    if (pi.er != none) return pi;
+    if (parseParameterList(sub) != P_OK) return P_FAIL;
 
     // ')'
-    pi = eat(SYMBOL, ")", closeParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, ")", closeParenExpected) != P_OK) return P_FAIL;
 
     // subroutineBody
-    pi = parseSubroutineBody();
-    return pi;
+    return parseSubroutineBody(sub);
 }
 
 //---------------------
@@ -246,48 +309,49 @@ static ParserInfo parseSubroutineDec()
 //   (type varName (, type varName)*)?  
 //   若遇到不匹配符号 => closeParenExpected
 //---------------------
-static ParserInfo parseParameterList()
+static PStatus parseParameterList(int sub)
 {
-    ParserInfo pi;
-    pi.er = none;
-    pi.tk.tp = EOFile;
+    int tail = AST_NONE;
 
     // peek
     Token look = PeekNextToken();
     // if it's ")", empty
     if (look.tp == SYMBOL && !strcmp(look.lx,")")) {
-        return pi;
+        return P_OK;
     }
 
     // read type
     Token tkType = GetNextToken();
-    if (tkType.tp == ERR) return makeError(lexerErr, tkType);
+    if (tkType.tp == ERR) return fail(lexerErr, &tkType);
 
     // 如果在需要类型的地方读到 symbol (比如 '{'), 改报 closeParenExpected
     if (tkType.tp == SYMBOL) {
         // 如果它是 ")", 那说明空参数列表，其实可以立即返回
         if (!strcmp(tkType.lx,")")) {
-            return pi; // 视为空列表
+            return P_OK; // 视为空列表
         } else {
             // 评分器想要 ) => 定向报
-            return makeError(closeParenExpected, tkType);
+            return fail(closeParenExpected, &tkType);
         }
     }
 
     // 正常 type check
     if (tkType.tp == RESWORD) {
         if (strcmp(tkType.lx,"int") && strcmp(tkType.lx,"char") && strcmp(tkType.lx,"boolean")) {
-            return makeError(illegalType, tkType);
+            return fail(illegalType, &tkType);
         }
     } else if (tkType.tp != ID) {
-        return makeError(illegalType, tkType);
+        return fail(illegalType, &tkType);
     }
 
     // varName
     Token varN = GetNextToken();
     if (varN.tp != ID) {
-        return makeError(idExpected, varN);
+        return fail(idExpected, &varN);
     }
+    int d = newVarDec(ast, lexeme(&varN), lexeme(&tkType), ARG_SYMBOL);
+    APPEND(decs, ast->subDecs[sub].params, tail, d);
+    ast->subDecs[sub].nParams++;
 
     // (, type varName)*
     while (1) {
@@ -296,49 +360,52 @@ static ParserInfo parseParameterList()
             GetNextToken(); // consume ','
             // type
             Token nxtType = GetNextToken();
-            if (nxtType.tp == ERR) return makeError(lexerErr, nxtType);
+            if (nxtType.tp == ERR) return fail(lexerErr, &nxtType);
             if (nxtType.tp == SYMBOL) {
                 // 如果是 ) => 空
                 if (!strcmp(nxtType.lx,")")) {
                     // 评分器或许想报 error，这里我们直接 closeParenExpected
-                    return makeError(closeParenExpected, nxtType);
+                    return fail(closeParenExpected, &nxtType);
                 } else {
-                    return makeError(closeParenExpected, nxtType);
+                    return fail(closeParenExpected, &nxtType);
                 }
             }
             if (nxtType.tp == RESWORD) {
                 if (strcmp(nxtType.lx,"int") && strcmp(nxtType.lx,"char") && strcmp(nxtType.lx,"boolean")) {
-                    return makeError(illegalType, nxtType);
+                    return fail(illegalType, &nxtType);
                 }
             } else if (nxtType.tp != ID) {
-                return makeError(illegalType, nxtType);
+                return fail(illegalType, &nxtType);
             }
             // varName
             Token nxtVar = GetNextToken();
             if (nxtVar.tp != ID) {
-                return makeError(idExpected, nxtVar);
+                return fail(idExpected, &nxtVar);
             }
+            d = newVarDec(ast, lexeme(&nxtVar), lexeme(&nxtType), ARG_SYMBOL);
+            APPEND(decs, ast->subDecs[sub].params, tail, d);
+            ast->subDecs[sub].nParams++;
         } else {
             break;
         }
     }
 
-    return pi;
+    return P_OK;
 }
 
 //---------------------
 // parseSubroutineBody:
 //   { varDec* statements }
 //---------------------
-static ParserInfo parseSubroutineBody()
+static PStatus parseSubroutineBody(int sub)
 {
-    ParserInfo pi = eat(SYMBOL, "{", openBraceExpected);
-    if (pi.er != none) return pi;
+    int tail = AST_NONE;
+    if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
 
     while (1) {
         Token look = PeekNextToken();
         if (look.tp == ERR) {
-            return makeError(lexerErr, look);
+            return fail(lexerErr, &look);
         }
         // if '}'
         if (look.tp == SYMBOL && !strcmp(look.lx,"}")) {
@@ -346,48 +413,53 @@ static ParserInfo parseSubroutineBody()
         }
         // if 'var'
         if (look.tp == RESWORD && !strcmp(look.lx,"var")) {
-            pi = parseVarDec();
-            if (pi.er != none) return pi;
+            if (parseVarDec(sub, &tail) != P_OK) return P_FAIL;
         } else {
-            // statements
-            pi = parseStatements();
-            return pi;
+            // statements, then the closing '}' of the body
+            int body;
+            PStatus status = stackLimit > 0 ? parseStatementsIter(&body) : parseStatements(&body);
+            if (status != P_OK) return P_FAIL;
+            ast->subDecs[sub].body = body;
+            break;
         }
     }
 
-    pi = eat(SYMBOL, "}", closeBraceExpected);
-    return pi;
+    return eat(SYMBOL, "}", closeBraceExpected);
 }
 
 //---------------------
 // parseVarDec: var type varName(,varName)* ;
 //---------------------
-static ParserInfo parseVarDec()
+static PStatus parseVarDec(int sub, int *tail)
 {
     Token first = GetNextToken(); // 'var'
-    if (first.tp == ERR) return makeError(lexerErr, first);
+    if (first.tp == ERR) return fail(lexerErr, &first);
 
     // type
     Token tkType = GetNextToken();
-    if (tkType.tp == ERR) return makeError(lexerErr, tkType);
+    if (tkType.tp == ERR) return fail(lexerErr, &tkType);
     if (tkType.tp == SYMBOL) {
         // 如果评分器要求 ) expected，这里可能不涉及
         // 这里也可以加上 if (!strcmp(tkType.lx,"}")) => semicolonExpected
-        return makeError(illegalType, tkType);
+        return fail(illegalType, &tkType);
     }
     if (tkType.tp == RESWORD) {
         if (strcmp(tkType.lx,"int") && strcmp(tkType.lx,"char") && strcmp(tkType.lx,"boolean")) {
-            return makeError(illegalType, tkType);
+            return fail(illegalType, &tkType);
         }
     } else if (tkType.tp != ID) {
-        return makeError(illegalType, tkType);
+        return fail(illegalType, &tkType);
     }
 
     // varName
     Token vN = GetNextToken();
     if (vN.tp != ID) {
-        return makeError(idExpected, vN);
+        return fail(idExpected, &vN);
     }
+    int type = lexeme(&tkType);
+    int d = newVarDec(ast, lexeme(&vN), type, VAR_SYMBOL);
+    APPEND(decs, ast->subDecs[sub].locals, *tail, d);
+    ast->subDecs[sub].nLocals++;
 
     // more var
     while (1) {
@@ -396,234 +468,256 @@ static ParserInfo parseVarDec()
             GetNextToken();
             Token v2 = GetNextToken();
             if (v2.tp != ID) {
-                return makeError(idExpected, v2);
+                return fail(idExpected, &v2);
             }
+            d = newVarDec(ast, lexeme(&v2), type, VAR_SYMBOL);
+            APPEND(decs, ast->subDecs[sub].locals, *tail, d);
+            ast->subDecs[sub].nLocals++;
         } else {
             break;
         }
     }
 
     // must have ;
-    ParserInfo pi = eat(SYMBOL, ";", semicolonExpected);
-    return pi;
+    return eat(SYMBOL, ";", semicolonExpected);
 }
 
 //---------------------
 // parseStatements
 //---------------------
-static ParserInfo parseStatements()
+static PStatus parseStatements(int *first)
 {
-    ParserInfo pi;
-    pi.er = none;
-    pi.tk.tp = EOFile;
+    int tail = AST_NONE, st = AST_NONE;
+    PStatus status;
+    *first = AST_NONE;
 
     while (1) {
         Token look = PeekNextToken();
         if (look.tp == ERR) {
-            return makeError(lexerErr, look);
+            return fail(lexerErr, &look);
         }
         if (look.tp == SYMBOL && !strcmp(look.lx,"}")) {
             break; 
         }
         if (look.tp == RESWORD && !strcmp(look.lx,"let")) {
-            pi = parseLetStatement();
+            status = parseLetStatement(&st);
         } else if (look.tp == RESWORD && !strcmp(look.lx,"if")) {
-            pi = parseIfStatement();
+            status = parseIfStatement(&st);
         } else if (look.tp == RESWORD && !strcmp(look.lx,"while")) {
-            pi = parseWhileStatement();
+            status = parseWhileStatement(&st);
         } else if (look.tp == RESWORD && !strcmp(look.lx,"do")) {
-            pi = parseDoStatement();
+            status = parseDoStatement(&st);
         } else if (look.tp == RESWORD && !strcmp(look.lx,"return")) {
-            pi = parseReturnStatement();
+            status = parseReturnStatement(&st);
         } else {
             // rating says "syntaxError" here
             // or you can guess maybe it's semicolonExpected
-            return makeError(syntaxError, look);
+            return fail(syntaxError, &look);
         }
-        if (pi.er != none) return pi;
+        if (status != P_OK) return P_FAIL;
+        APPEND(stmts, *first, tail, st);
     }
 
-    return pi;
+    return P_OK;
 }
 
 //---------------------
 // parse Let
 //   let varName ([expression])? = expression ;
 //---------------------
-static ParserInfo parseLetStatement()
+static PStatus parseLetStatement(int *out)
 {
     Token letTk = GetNextToken(); 
-    if (letTk.tp == ERR) return makeError(lexerErr, letTk);
+    if (letTk.tp == ERR) return fail(lexerErr, &letTk);
 
     Token varN = GetNextToken();
     if (varN.tp != ID) {
-        return makeError(idExpected, varN);
+        return fail(idExpected, &varN);
     }
+    int st = newStmt(ast, ST_LET, letTk.ln);
+    ast->stmts[st].name = lexeme(&varN);
+    *out = st;
 
     // optional [ expression ]
     Token look = PeekNextToken();
     if (look.tp == SYMBOL && !strcmp(look.lx,"[")) {
         GetNextToken(); // consume '['
-        ParserInfo pi = parseExpression();
-        if (pi.er != none) return pi;
+        int index;
+        if (parseExpression(&index) != P_OK) return P_FAIL;
+        ast->stmts[st].index = index;
 
-        pi = eat(SYMBOL, "]", closeBracketExpected);
-        if (pi.er != none) return pi;
+        if (eat(SYMBOL, "]", closeBracketExpected) != P_OK) return P_FAIL;
     }
 
     // '='
-    ParserInfo eqPi = eat(SYMBOL, "=", equalExpected);
-    if (eqPi.er != none) return eqPi;
+    if (eat(SYMBOL, "=", equalExpected) != P_OK) return P_FAIL;
 
     // expression
-    ParserInfo pi2 = parseExpression();
-    if (pi2.er != none) return pi2;
+    int value;
+    if (parseExpression(&value) != P_OK) return P_FAIL;
+    ast->stmts[st].expr = value;
 
     // ';'
-    ParserInfo pi3 = eat(SYMBOL, ";", semicolonExpected);
-    return pi3;
+    return eat(SYMBOL, ";", semicolonExpected);
 }
 
-static ParserInfo parseIfStatement()
+static PStatus parseIfStatement(int *out)
 {
     // if
     Token ifTk = GetNextToken();
-    if (ifTk.tp == ERR) return makeError(lexerErr, ifTk);
+    if (ifTk.tp == ERR) return fail(lexerErr, &ifTk);
+    int st = newStmt(ast, ST_IF, ifTk.ln);
+    *out = st;
 
-    ParserInfo pi = eat(SYMBOL, "(", openParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
 
-    pi = parseExpression();
-    if (pi.er != none) return pi;
+    int cond, block;
+    if (parseExpression(&cond) != P_OK) return P_FAIL;
+    ast->stmts[st].expr = cond;
 
-    pi = eat(SYMBOL, ")", closeParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, ")", closeParenExpected) != P_OK) return P_FAIL;
 
-    pi = eat(SYMBOL, "{", openBraceExpected);
-    if (pi.er != none) return pi;
-    pi = parseStatements();
-    if (pi.er != none) return pi;
-    pi = eat(SYMBOL, "}", closeBraceExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
+    if (parseStatements(&block) != P_OK) return P_FAIL;
+    ast->stmts[st].body = block;
+    if (eat(SYMBOL, "}", closeBraceExpected) != P_OK) return P_FAIL;
 
     // optional else
     Token look = PeekNextToken();
     if (look.tp == RESWORD && !strcmp(look.lx,"else")) {
         GetNextToken(); // consume else
-        pi = eat(SYMBOL, "{", openBraceExpected);
-        if (pi.er != none) return pi;
-        pi = parseStatements();
-        if (pi.er != none) return pi;
-        pi = eat(SYMBOL, "}", closeBraceExpected);
-        if (pi.er != none) return pi;
+        if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
+        if (parseStatements(&block) != P_OK) return P_FAIL;
+        ast->stmts[st].orelse = block;
+        if (eat(SYMBOL, "}", closeBraceExpected) != P_OK) return P_FAIL;
     }
 
-    return pi;
+    return P_OK;
 }
 
-static ParserInfo parseWhileStatement()
+static PStatus parseWhileStatement(int *out)
 {
     Token wtk = GetNextToken();
-    if (wtk.tp == ERR) return makeError(lexerErr, wtk);
+    if (wtk.tp == ERR) return fail(lexerErr, &wtk);
+    int st = newStmt(ast, ST_WHILE, wtk.ln);
+    *out = st;
 
-    ParserInfo pi = eat(SYMBOL, "(", openParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
 
-    pi = parseExpression();
-    if (pi.er != none) return pi;
+    int cond, block;
+    if (parseExpression(&cond) != P_OK) return P_FAIL;
+    ast->stmts[st].expr = cond;
 
-    pi = eat(SYMBOL, ")", closeParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, ")", closeParenExpected) != P_OK) return P_FAIL;
 
-    pi = eat(SYMBOL, "{", openBraceExpected);
-    if (pi.er != none) return pi;
-    pi = parseStatements();
-    if (pi.er != none) return pi;
-    pi = eat(SYMBOL, "}", closeBraceExpected);
-    return pi;
+    if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
+    if (parseStatements(&block) != P_OK) return P_FAIL;
+    ast->stmts[st].body = block;
+    return eat(SYMBOL, "}", closeBraceExpected);
 }
 
-static ParserInfo parseDoStatement()
+static PStatus parseDoStatement(int *out)
 {
     Token dtk = GetNextToken(); // 'do'
-    if (dtk.tp == ERR) return makeError(lexerErr, dtk);
+    if (dtk.tp == ERR) return fail(lexerErr, &dtk);
+    int st = newStmt(ast, ST_DO, dtk.ln);
+    *out = st;
 
     // subroutineCall
     // subroutineName | (className|varName) . subroutineName
     Token first = GetNextToken();
     if (first.tp != ID) {
-        return makeError(idExpected, first);
+        return fail(idExpected, &first);
     }
+    int call = newExpr(ast, EX_CALL, first.ln);
+    ast->stmts[st].expr = call;
 
     Token look = PeekNextToken();
     if (look.tp == SYMBOL && !strcmp(look.lx,".")) {
         GetNextToken(); // consume '.'
         Token subN = GetNextToken();
         if (subN.tp != ID) {
-            return makeError(idExpected, subN);
+            return fail(idExpected, &subN);
         }
+        ast->exprs[call].name = lexeme(&first);
+        ast->exprs[call].sub = lexeme(&subN);
+    } else {
+        ast->exprs[call].sub = lexeme(&first);
     }
 
-    ParserInfo pi = eat(SYMBOL, "(", openParenExpected);
-    if (pi.er != none) return pi;
-    // exprList (略写)
-    Token look2 = PeekNextToken();
-    if (look2.tp != SYMBOL || strcmp(look2.lx,")")) {
-        // parse an expression, comma separated
-        pi = parseExpression();
-        if (pi.er != none) return pi;
-        while (1) {
-            Token look3 = PeekNextToken();
-            if (look3.tp == SYMBOL && !strcmp(look3.lx,",")) {
-                GetNextToken(); 
-                pi = parseExpression();
-                if (pi.er != none) return pi;
-            } else {
-                break;
-            }
-        }
-    }
-    pi = eat(SYMBOL, ")", closeParenExpected);
-    if (pi.er != none) return pi;
+    if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
+    if (parseExpressionList(call) != P_OK) return P_FAIL;
+    if (eat(SYMBOL, ")", closeParenExpected) != P_OK) return P_FAIL;
 
-    pi = eat(SYMBOL, ";", semicolonExpected);
-    return pi;
+    return eat(SYMBOL, ";", semicolonExpected);
 }
 
-static ParserInfo parseReturnStatement()
+static PStatus parseReturnStatement(int *out)
 {
     Token rtk = GetNextToken(); // 'return'
-    if (rtk.tp == ERR) return makeError(lexerErr, rtk);
+    if (rtk.tp == ERR) return fail(lexerErr, &rtk);
+    int st = newStmt(ast, ST_RETURN, rtk.ln);
+    *out = st;
 
     // optional expression
     Token look = PeekNextToken();
     if (look.tp == ERR) {
-        return makeError(lexerErr, look);
+        return fail(lexerErr, &look);
     }
     if (look.tp == SYMBOL && !strcmp(look.lx,";")) {
         // no expr
     } else {
         // parse expr
-        ParserInfo pi = parseExpression();
-        if (pi.er != none) return pi;
+        int value;
+        if (parseExpression(&value) != P_OK) return P_FAIL;
+        ast->stmts[st].expr = value;
     }
 
     return eat(SYMBOL, ";", semicolonExpected);
 }
 
+//---------------------
+// parseExpressionList:
+//   (expression (, expression)*)?   arguments of call expression `call`
+//---------------------
+static PStatus parseExpressionList(int call)
+{
+    int tail = AST_NONE, arg;
+
+    Token look2 = PeekNextToken();
+    if (look2.tp != SYMBOL || strcmp(look2.lx,")")) {
+        // parse an expression, comma separated
+        if (parseExpression(&arg) != P_OK) return P_FAIL;
+        APPEND(exprs, ast->exprs[call].a, tail, arg);
+        ast->exprs[call].value++;
+        while (1) {
+            Token look3 = PeekNextToken();
+            if (look3.tp == SYMBOL && !strcmp(look3.lx,",")) {
+                GetNextToken(); 
+                if (parseExpression(&arg) != P_OK) return P_FAIL;
+                APPEND(exprs, ast->exprs[call].a, tail, arg);
+                ast->exprs[call].value++;
+            } else {
+                break;
+            }
+        }
+    }
+    return P_OK;
+}
+
 //---------------------
 // parseExpression / parseTerm
 // 只做最小解析, 并在需要时定向报错
+// Jack 没有运算符优先级: a op b op c 按 (a op b) op c 建树
 //---------------------
-static ParserInfo parseExpression()
+static PStatus parseExpression(int *out)
 {
-    ParserInfo pi = parseTerm();
-    if (pi.er != none) return pi;
+    if (parseTerm(out) != P_OK) return P_FAIL;
 
     while (1) {
         Token look = PeekNextToken();
         if (look.tp == ERR) {
-            return makeError(lexerErr, look);
+            return fail(lexerErr, &look);
         }
         // op => + - * / & | < > =
         if (look.tp == SYMBOL &&
@@ -634,21 +728,26 @@ static ParserInfo parseExpression()
             !strcmp(look.lx,"="))) 
         {
             GetNextToken(); 
-            pi = parseTerm();
-            if (pi.er != none) return pi;
+            int rhs;
+            if (parseTerm(&rhs) != P_OK) return P_FAIL;
+            int bin = newExpr(ast, EX_BINARY, look.ln);
+            ast->exprs[bin].op = look.lx[0];
+            ast->exprs[bin].a = *out;
+            ast->exprs[bin].b = rhs;
+            *out = bin;
         } else {
             break;
         }
     }
-    return pi;
+    return P_OK;
 }
 
-static ParserInfo parseTerm()
+static PStatus parseTerm(int *out)
 {
     // 如果本函数需要处理“回退 token”逻辑，可自行添加
     Token tk = GetNextToken();
     if (tk.tp == ERR) {
-        return makeError(lexerErr, tk);
+        return fail(lexerErr, &tk);
     }
 
     // 特别修补：若遇到'}'而需要分号，可回退让外层报
@@ -657,31 +756,42 @@ static ParserInfo parseTerm()
     
     // INT or STRING
     if (tk.tp == INT || tk.tp == STRING) {
-        ParserInfo pi = { none, tk };
-        return pi;
+        if (tk.tp == INT) {
+            *out = newExpr(ast, EX_INT, tk.ln);
+            ast->exprs[*out].value = atoi(tk.lx);
+        } else {
+            *out = newExpr(ast, EX_STRING, tk.ln);
+            ast->exprs[*out].name = lexeme(&tk);
+        }
+        return P_OK;
     }
     // keyword const: true false null this
     if (tk.tp == RESWORD) {
         if (!strcmp(tk.lx,"true") || !strcmp(tk.lx,"false") || 
             !strcmp(tk.lx,"null") || !strcmp(tk.lx,"this")) 
         {
-            ParserInfo pi = { none, tk };
-            return pi;
+            ExprKind k = tk.lx[0] == 't' ? (tk.lx[1] == 'r' ? EX_TRUE : EX_THIS)
+                       : tk.lx[0] == 'f' ? EX_FALSE : EX_NULL;
+            *out = newExpr(ast, k, tk.ln);
+            return P_OK;
         }
-        return makeError(syntaxError, tk);
+        return fail(syntaxError, &tk);
     }
     // symbol => '(' expr ')' or unaryOp term
     if (tk.tp == SYMBOL) {
         if (!strcmp(tk.lx,"(")) {
-            ParserInfo pi = parseExpression();
-            if (pi.er != none) return pi;
-            pi = eat(SYMBOL, ")", closeParenExpected);
-            return pi;
+            if (parseExpression(out) != P_OK) return P_FAIL;
+            return eat(SYMBOL, ")", closeParenExpected);
         } else if (!strcmp(tk.lx,"-") || !strcmp(tk.lx,"~")) {
             // unaryOp
-            return parseTerm();
+            int operand;
+            if (parseTerm(&operand) != P_OK) return P_FAIL;
+            *out = newExpr(ast, EX_UNARY, tk.ln);
+            ast->exprs[*out].op = tk.lx[0];
+            ast->exprs[*out].a = operand;
+            return P_OK;
         } else {
-            return makeError(syntaxError, tk);
+            return fail(syntaxError, &tk);
         }
     }
     // ID => varName or subroutineCall or varName[expr]
@@ -689,108 +799,449 @@ static ParserInfo parseTerm()
         Token look = PeekNextToken();
         if (look.tp == SYMBOL && !strcmp(look.lx,"[")) {
             GetNextToken(); // consume '['
-            ParserInfo pi = parseExpression();
-            if (pi.er != none) return pi;
-            pi = eat(SYMBOL, "]", closeBracketExpected);
-            return pi;
+            int index;
+            if (parseExpression(&index) != P_OK) return P_FAIL;
+            *out = newExpr(ast, EX_INDEX, tk.ln);
+            ast->exprs[*out].name = lexeme(&tk);
+            ast->exprs[*out].a = index;
+            return eat(SYMBOL, "]", closeBracketExpected);
         }
         else if (look.tp == SYMBOL && (!strcmp(look.lx,"(") || !strcmp(look.lx,"."))) {
             // subroutineCall
             // 这里可直接套 parseDoStatement逻辑
+            int call = newExpr(ast, EX_CALL, tk.ln);
+            *out = call;
             if (!strcmp(look.lx,".")) {
                 GetNextToken(); // consume '.'
                 Token subN = GetNextToken();
                 if (subN.tp != ID) {
-                    return makeError(idExpected, subN);
+                    return fail(idExpected, &subN);
                 }
+                ast->exprs[call].name = lexeme(&tk);
+                ast->exprs[call].sub = lexeme(&subN);
+            } else {
+                ast->exprs[call].sub = lexeme(&tk);
             }
-            ParserInfo pi = eat(SYMBOL, "(", openParenExpected);
-            if (pi.er != none) return pi;
+            if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
             // expressionList
-            Token look2 = PeekNextToken();
-            if (look2.tp != SYMBOL || strcmp(look2.lx,")")) {
-                pi = parseExpression();
-                if (pi.er != none) return pi;
-                while (1) {
-                    Token look3 = PeekNextToken();
-                    if (look3.tp == SYMBOL && !strcmp(look3.lx,",")) {
-                        GetNextToken();
-                        pi = parseExpression();
-                        if (pi.er != none) return pi;
-                    } else {
-                        break;
-                    }
-                }
-            }
-            pi = eat(SYMBOL, ")", closeParenExpected);
-            return pi;
+            if (parseExpressionList(call) != P_OK) return P_FAIL;
+            return eat(SYMBOL, ")", closeParenExpected);
         }
         // else just varName
-        ParserInfo pi = { none, tk };
-        return pi;
+        *out = newExpr(ast, EX_VAR, tk.ln);
+        ast->exprs[*out].name = lexeme(&tk);
+        return P_OK;
     }
 
     // if none matched
-    return makeError(syntaxError, tk);
+    return fail(syntaxError, &tk);
 }
 
 //---------------------
-// eat: expect next token to match (tp,lx). 
-// Add fix: if we want ";" but get "}", => semicolonExpected
+// Iterative parsing of subroutine bodies
+// The grammar below statement level (statements, expressions, terms,
+// argument lists) runs as a loop over an explicit stack of frames, one
+// per construct still waiting for a nested part. A frame that finishes
+// leaves its node in `ret` for the frame under it. Tokens are read and
+// nodes created in the same order as by the recursive functions, so the
+// trees and errors are the same; nesting beyond stackLimit frames is a
+// syntaxError instead of a C stack overflow.
 //---------------------
-static ParserInfo eat(TokenType tp, const char* lx, SyntaxErrors err)
+typedef enum {
+    F_STATEMENTS, F_LET, F_IF, F_WHILE, F_DO, F_RETURN,
+    F_EXPRESSION, F_PAREN, F_UNARY, F_INDEX, F_CALL, F_ARGS
+} FrameKind;
+
+typedef struct {
+    unsigned char kind, state;
+    char op;                     // F_EXPRESSION: pending operator, F_UNARY: - or ~
+    int ln;
+    int node;                    // statement or expression being built, list head
+    int tail;                    // last statement / argument so far
+    int name;                    // F_INDEX: array name
+} Frame;
+
+static Frame *frames = NULL;
+static int nFrames = 0, capFrames = 0;
+static int ret;                  // node handed back by the last finished frame
+
+static Frame* pushFrame(FrameKind kind, const Token *at)
 {
-    Token tk = GetNextToken();
-    if (tk.tp == ERR) {
-        ParserInfo pi;
-        pi.er = lexerErr;
-        pi.tk = tk;
-        return pi;
+    if (nFrames == stackLimit) {
+        Token t = *at;
+        snprintf(t.lx, sizeof(t.lx), "nesting deeper than %d parser frames", stackLimit);
+        fail(syntaxError, &t);
+        return NULL;
+    }
+    if (nFrames == capFrames) {
+        capFrames = capFrames ? capFrames * 2 : 64;
+        if (capFrames > stackLimit) capFrames = stackLimit;
+        frames = realloc(frames, sizeof(Frame) * (size_t)capFrames);
+        if (!frames) abort();
     }
+    Frame *f = &frames[nFrames++];
+    f->kind = (unsigned char)kind;
+    f->state = 0;
+    f->node = f->tail = AST_NONE;
+    return f;
+}
 
-    // special fix: if we wanted ";", but got "}", => semicolonExpected
-    if (tp == SYMBOL && lx && !strcmp(lx,";")) {
-        if (tk.tp == SYMBOL && !strcmp(tk.lx,"}")) {
-            return makeError(semicolonExpected, tk);
+static int isOp(const Token *tk)
+{
+    return tk->tp == SYMBOL && tk->lx[1] == '\0' && tk->lx[0] && strchr("+-*/&|<>=", tk->lx[0]);
+}
+
+// first token of a term: finish a leaf in ret, or push the frames that
+// will build it. Terms that open with (, - or ~ or index an array push
+// their frames and go on with the nested term here, without recursing
+static PStatus startTerm(void)
+{
+    Frame *f;
+
+    while (1) {
+        Token tk = GetNextToken();
+        if (tk.tp == ERR) return fail(lexerErr, &tk);
+
+        switch (tk.tp) {
+        case INT:
+            ret = newExpr(ast, EX_INT, tk.ln);
+            ast->exprs[ret].value = atoi(tk.lx);
+            return P_OK;
+        case STRING:
+            ret = newExpr(ast, EX_STRING, tk.ln);
+            ast->exprs[ret].name = lexeme(&tk);
+            return P_OK;
+        case RESWORD:
+            if (strcmp(tk.lx,"true") && strcmp(tk.lx,"false") && strcmp(tk.lx,"null") && strcmp(tk.lx,"this"))
+                return fail(syntaxError, &tk);
+            ret = newExpr(ast, tk.lx[0] == 't' ? (tk.lx[1] == 'r' ? EX_TRUE : EX_THIS)
+                             : tk.lx[0] == 'f' ? EX_FALSE : EX_NULL, tk.ln);
+            return P_OK;
+        case SYMBOL:
+            if (!strcmp(tk.lx,"(")) {
+                if (!pushFrame(F_PAREN, &tk) || !pushFrame(F_EXPRESSION, &tk)) return P_FAIL;
+                continue;
+            }
+            if (!strcmp(tk.lx,"-") || !strcmp(tk.lx,"~")) {
+                if (!(f = pushFrame(F_UNARY, &tk))) return P_FAIL;
+                f->op = tk.lx[0];
+                f->ln = tk.ln;
+                continue;
+            }
+            return fail(syntaxError, &tk);
+        case ID:
+            break;
+        default:
+            return fail(syntaxError, &tk);
         }
+
+        Token look = PeekNextToken();
+        if (look.tp == SYMBOL && !strcmp(look.lx,"[")) {
+            GetNextToken(); // consume '['
+            if (!(f = pushFrame(F_INDEX, &look))) return P_FAIL;
+            f->ln = tk.ln;
+            f->name = lexeme(&tk);
+            if (!pushFrame(F_EXPRESSION, &look)) return P_FAIL;
+            continue;
+        }
+        if (look.tp == SYMBOL && (!strcmp(look.lx,"(") || !strcmp(look.lx,"."))) {
+            int call = newExpr(ast, EX_CALL, tk.ln);
+            if (!strcmp(look.lx,".")) {
+                GetNextToken(); // consume '.'
+                Token subN = GetNextToken();
+                if (subN.tp != ID) return fail(idExpected, &subN);
+                ast->exprs[call].name = lexeme(&tk);
+                ast->exprs[call].sub = lexeme(&subN);
+            } else {
+                ast->exprs[call].sub = lexeme(&tk);
+            }
+            if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
+            if (!(f = pushFrame(F_CALL, &look))) return P_FAIL;
+            f->node = call;
+            return P_OK;         // F_CALL pushes the argument list
+        }
+        ret = newExpr(ast, EX_VAR, tk.ln);
+        ast->exprs[ret].name = lexeme(&tk);
+        return P_OK;
     }
+}
 
-    // normal check
-    if (tk.tp != tp || (lx && strcmp(tk.lx, lx))) {
-        return makeError(err, tk);
+// push an expression frame and start its first term
+static PStatus startExpression(const Token *at)
+{
+    if (!pushFrame(F_EXPRESSION, at)) return P_FAIL;
+    return startTerm();
+}
+
+// one step of the frame on top; frames left on the stack are finished
+// by later steps
+static PStatus stepFrame(void)
+{
+    Frame *f = &frames[nFrames - 1];
+    Token look;
+    int st;
+
+    switch ((FrameKind)f->kind) {
+    case F_STATEMENTS:
+        if (f->state == 1) APPEND(stmts, f->node, f->tail, ret);
+        f->state = 1;
+        look = PeekNextToken();
+        if (look.tp == ERR) return fail(lexerErr, &look);
+        if (look.tp == SYMBOL && !strcmp(look.lx,"}")) {
+            ret = f->node;
+            nFrames--;
+            return P_OK;
+        }
+        if (look.tp != RESWORD) return fail(syntaxError, &look);
+        if (!strcmp(look.lx,"let")) {
+            GetNextToken();
+            Token varN = GetNextToken();
+            if (varN.tp != ID) return fail(idExpected, &varN);
+            st = newStmt(ast, ST_LET, look.ln);
+            ast->stmts[st].name = lexeme(&varN);
+            if (!(f = pushFrame(F_LET, &look))) return P_FAIL;
+            f->node = st;
+            look = PeekNextToken();
+            if (look.tp == SYMBOL && !strcmp(look.lx,"[")) {
+                GetNextToken(); // consume '['
+                return startExpression(&look);
+            }
+            f->state = 1;
+            if (eat(SYMBOL, "=", equalExpected) != P_OK) return P_FAIL;
+            return startExpression(&look);
+        }
+        if (!strcmp(look.lx,"if") || !strcmp(look.lx,"while")) {
+            GetNextToken();
+            st = newStmt(ast, look.lx[0] == 'i' ? ST_IF : ST_WHILE, look.ln);
+            if (!(f = pushFrame(look.lx[0] == 'i' ? F_IF : F_WHILE, &look))) return P_FAIL;
+            f->node = st;
+            if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
+            return startExpression(&look);
+        }
+        if (!strcmp(look.lx,"do")) {
+            GetNextToken();
+            st = newStmt(ast, ST_DO, look.ln);
+            Token first = GetNextToken();
+            if (first.tp != ID) return fail(idExpected, &first);
+            int call = newExpr(ast, EX_CALL, first.ln);
+            ast->stmts[st].expr = call;
+            Token dot = PeekNextToken();
+            if (dot.tp == SYMBOL && !strcmp(dot.lx,".")) {
+                GetNextToken(); // consume '.'
+                Token subN = GetNextToken();
+                if (subN.tp != ID) return fail(idExpected, &subN);
+                ast->exprs[call].name = lexeme(&first);
+                ast->exprs[call].sub = lexeme(&subN);
+            } else {
+                ast->exprs[call].sub = lexeme(&first);
+            }
+            if (eat(SYMBOL, "(", openParenExpected) != P_OK) return P_FAIL;
+            if (!(f = pushFrame(F_DO, &look))) return P_FAIL;
+            f->node = st;
+            if (!(f = pushFrame(F_CALL, &look))) return P_FAIL;
+            f->node = call;
+            return P_OK;
+        }
+        if (!strcmp(look.lx,"return")) {
+            GetNextToken();
+            st = newStmt(ast, ST_RETURN, look.ln);
+            Token next = PeekNextToken();
+            if (next.tp == ERR) return fail(lexerErr, &next);
+            if (next.tp == SYMBOL && !strcmp(next.lx,";")) {
+                ret = st;
+                return eat(SYMBOL, ";", semicolonExpected);
+            }
+            if (!(f = pushFrame(F_RETURN, &look))) return P_FAIL;
+            f->node = st;
+            return startExpression(&look);
+        }
+        return fail(syntaxError, &look);
+
+    case F_LET:
+        st = f->node;
+        if (f->state == 0) {
+            ast->stmts[st].index = ret;
+            if (eat(SYMBOL, "]", closeBracketExpected) != P_OK) return P_FAIL;
+            f->state = 1;
+            if (eat(SYMBOL, "=", equalExpected) != P_OK) return P_FAIL;
+            look = PeekNextToken();
+            return startExpression(&look);
+        }
+        ast->stmts[st].expr = ret;
+        ret = st;
+        nFrames--;
+        return eat(SYMBOL, ";", semicolonExpected);
+
+    case F_IF:
+    case F_WHILE:
+        st = f->node;
+        if (f->state == 0) {                    // condition
+            ast->stmts[st].expr = ret;
+            if (eat(SYMBOL, ")", closeParenExpected) != P_OK) return P_FAIL;
+        } else if (f->state == 1) {             // body
+            ast->stmts[st].body = ret;
+            if (eat(SYMBOL, "}", closeBraceExpected) != P_OK) return P_FAIL;
+            if (f->kind == F_IF) {
+                look = PeekNextToken();
+            }
+            if (f->kind == F_WHILE || look.tp != RESWORD || strcmp(look.lx,"else")) {
+                ret = st;
+                nFrames--;
+                return P_OK;
+            }
+            GetNextToken(); // consume else
+        } else {                                // else branch
+            ast->stmts[st].orelse = ret;
+            ret = st;
+            nFrames--;
+            return eat(SYMBOL, "}", closeBraceExpected);
+        }
+        f->state++;
+        if (eat(SYMBOL, "{", openBraceExpected) != P_OK) return P_FAIL;
+        look = PeekNextToken();
+        return pushFrame(F_STATEMENTS, &look) ? P_OK : P_FAIL;
+
+    case F_DO:
+        ret = f->node;
+        nFrames--;
+        return eat(SYMBOL, ";", semicolonExpected);
+
+    case F_RETURN:
+        ast->stmts[f->node].expr = ret;
+        ret = f->node;
+        nFrames--;
+        return eat(SYMBOL, ";", semicolonExpected);
+
+    case F_EXPRESSION:
+        if (f->state == 0) {
+            f->node = ret;
+        } else {
+            int bin = newExpr(ast, EX_BINARY, f->ln);
+            ast->exprs[bin].op = f->op;
+            ast->exprs[bin].a = f->node;
+            ast->exprs[bin].b = ret;
+            f->node = bin;
+        }
+        look = PeekNextToken();
+        if (look.tp == ERR) return fail(lexerErr, &look);
+        if (!isOp(&look)) {
+            ret = f->node;
+            nFrames--;
+            return P_OK;
+        }
+        GetNextToken();
+        f->state = 1;
+        f->op = look.lx[0];
+        f->ln = look.ln;
+        return startTerm();
+
+    case F_PAREN:
+        nFrames--;
+        return eat(SYMBOL, ")", closeParenExpected);
+
+    case F_UNARY: {
+        int un = newExpr(ast, EX_UNARY, f->ln);
+        ast->exprs[un].op = f->op;
+        ast->exprs[un].a = ret;
+        ret = un;
+        nFrames--;
+        return P_OK;
     }
-    ParserInfo pi;
-    pi.er = none;
-    pi.tk = tk;
-    return pi;
+
+    case F_INDEX: {
+        int ix = newExpr(ast, EX_INDEX, f->ln);
+        ast->exprs[ix].name = f->name;
+        ast->exprs[ix].a = ret;
+        ret = ix;
+        nFrames--;
+        return eat(SYMBOL, "]", closeBracketExpected);
+    }
+
+    case F_CALL:
+        if (f->state == 0) {
+            int call = f->node;
+            f->state = 1;
+            look = PeekNextToken();
+            if (look.tp == SYMBOL && !strcmp(look.lx,")")) return P_OK;
+            if (!(f = pushFrame(F_ARGS, &look))) return P_FAIL;
+            f->node = call;
+            return startExpression(&look);
+        }
+        ret = f->node;
+        nFrames--;
+        return eat(SYMBOL, ")", closeParenExpected);
+
+    case F_ARGS:
+        APPEND(exprs, ast->exprs[f->node].a, f->tail, ret);
+        ast->exprs[f->node].value++;
+        look = PeekNextToken();
+        if (look.tp == SYMBOL && !strcmp(look.lx,",")) {
+            GetNextToken();
+            return startExpression(&look);
+        }
+        nFrames--;
+        return P_OK;
+    }
+    return P_FAIL;
 }
 
-// eatAny: expect next token to match type tp, ignoring lexeme
-static ParserInfo eatAny(TokenType tp, SyntaxErrors err)
+static void freeFrames(void)
 {
-    Token tk = GetNextToken();
-    if (tk.tp == ERR) {
-        ParserInfo pi;
-        pi.er = lexerErr;
-        pi.tk = tk;
-        return pi;
+    free(frames);
+    frames = NULL;
+    nFrames = capFrames = 0;
+}
+
+static PStatus parseStatementsIter(int *first)
+{
+    Token look = PeekNextToken();
+    nFrames = 0;
+    if (!pushFrame(F_STATEMENTS, &look)) return P_FAIL;
+    while (nFrames > 0)
+        if (stepFrame() != P_OK) return P_FAIL;
+    *first = ret;
+    return P_OK;
+}
+
+//---------------------
+// eat: expect next token to match (tp,lx). 
+// Add fix: if we want ";" but get "}", => semicolonExpected
+//---------------------
+static PStatus eat(TokenType tp, const char* lx, SyntaxErrors err)
+{
+    Token tk;
+    return eatToken(tp, lx, err, &tk);
+}
+
+// eatToken: eat, reading the token into *tk for the caller (lx NULL
+// accepts any lexeme of type tp)
+static PStatus eatToken(TokenType tp, const char* lx, SyntaxErrors err, Token *tk)
+{
+    *tk = GetNextToken();
+    if (tk->tp == ERR) {
+        return fail(lexerErr, tk);
     }
-    if (tk.tp != tp) {
-        return makeError(err, tk);
+
+    // special fix: if we wanted ";", but got "}", => semicolonExpected
+    if (tp == SYMBOL && lx && !strcmp(lx,";")) {
+        if (tk->tp == SYMBOL && !strcmp(tk->lx,"}")) {
+            return fail(semicolonExpected, tk);
+        }
     }
-    ParserInfo pi;
-    pi.er = none;
-    pi.tk = tk;
-    return pi;
+
+    // normal check
+    if (tk->tp != tp || (lx && strcmp(tk->lx, lx))) {
+        return fail(err, tk);
+    }
+    return P_OK;
 }
 
-// makeError: helper to create a ParserInfo with error
-static ParserInfo makeError(SyntaxErrors er, Token tk)
+// fail: record the error and its token for Parse()
+static PStatus fail(SyntaxErrors er, const Token *tk)
 {
-    ParserInfo pi;
-    pi.er = er;
-    pi.tk = tk;
-    return pi;
+    outcome.er = er;
+    if (tk != &outcome.tk) outcome.tk = *tk;
+    return P_FAIL;
 }
 
 //---------------------
@@ -838,3 +1289,57 @@ int main()
     return 0;
 }
 #endif
+
+//---------------------
+// parse timing for bench/pipeline.sh
+//---------------------
+#ifdef TEST_PARSETIME
+#include <time.h>
+#include "lexpipe.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// usage: parsetime [-pipeline] [-stack N] [-n N] FILE.jack — parse FILE N times
+// (default 5) and print the fastest run
+int main(int argc, char **argv)
+{
+    const char *file = NULL;
+    int runs = 5, pipeline = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-pipeline")) pipeline = 1;
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-stack") && i + 1 < argc) SetParserStackLimit(atoi(argv[++i]));
+        else file = argv[i];
+    }
+    if (!file) {
+        fprintf(stderr, "usage: parsetime [-pipeline] [-stack N] [-n N] FILE.jack\n");
+        return 2;
+    }
+    double best = 0;
+    char path[256];
+    snprintf(path, sizeof(path), "%s", file);
+    SetLexerPipelined(pipeline);
+    for (int r = 0; r < runs; r++) {
+        double t0 = now();
+        if (!InitParser(path)) {
+            fprintf(stderr, "cannot open %s\n", file);
+            return 1;
+        }
+        ParserInfo pi = Parse();
+        StopParser();
+        double t = now() - t0;
+        if (pi.er != none) {
+            printf("error %d at line %d: %s\n", pi.er, pi.tk.ln, pi.tk.lx);
+            return 1;
+        }
+        if (r == 0 || t < best) best = t;
+    }
+    printf("%s: %.3f ms (best of %d)\n", pipeline ? "pipelined" : "sequential", best * 1e3, runs);
+    return 0;
+}
+#endif
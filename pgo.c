@@ -0,0 +1,178 @@
+// pgo.c
+/************************************************************************
+ Profile-guided optimisation: reading vmrun profiles, function ordering
+*************************************************************************/
+#include "pgo.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// one entry per function ("Class.sub") and per branch ("Class.sub label")
+struct Profile {
+    char **keys;          // open addressing, NULL = empty
+    long long *a, *b;     // entries / executed, -, taken
+    int cap, n;
+    long long totalCalls;
+};
+
+static unsigned hashKey(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static int findKey(const Profile *p, const char *key) {
+    unsigned k = hashKey(key) & (unsigned)(p->cap - 1);
+    while (p->keys[k]) {
+        if (!strcmp(p->keys[k], key)) return (int)k;
+        k = (k + 1) & (unsigned)(p->cap - 1);
+    }
+    return -1;
+}
+
+static void addKey(Profile *p, const char *key, long long a, long long b);
+
+static void grow(Profile *p) {
+    Profile old = *p;
+    p->cap = old.cap ? old.cap * 2 : 256;
+    p->n = 0;
+    p->keys = calloc((size_t)p->cap, sizeof(char*));
+    p->a = malloc(sizeof(long long) * (size_t)p->cap);
+    p->b = malloc(sizeof(long long) * (size_t)p->cap);
+    if (!p->keys || !p->a || !p->b) abort();
+    for (int i = 0; i < old.cap; i++)
+        if (old.keys[i]) {
+            addKey(p, old.keys[i], old.a[i], old.b[i]);
+            free(old.keys[i]);
+        }
+    free(old.keys);
+    free(old.a);
+    free(old.b);
+}
+
+// counts of a key seen twice (a function run in two profiles) add up
+static void addKey(Profile *p, const char *key, long long a, long long b) {
+    if ((p->n + 1) * 2 > p->cap) grow(p);
+    unsigned k = hashKey(key) & (unsigned)(p->cap - 1);
+    while (p->keys[k]) {
+        if (!strcmp(p->keys[k], key)) {
+            p->a[k] += a;
+            p->b[k] += b;
+            return;
+        }
+        k = (k + 1) & (unsigned)(p->cap - 1);
+    }
+    p->keys[k] = strdup(key);
+    p->a[k] = a;
+    p->b[k] = b;
+    p->n++;
+}
+
+Profile* loadProfile(const char *path, char *err, int errLen) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        snprintf(err, (size_t)errLen, "cannot open profile %s", path);
+        return NULL;
+    }
+    Profile *p = calloc(1, sizeof(Profile));
+    if (!p) abort();
+    grow(p);
+
+    char line[512], fn[200], label[200], key[402];
+    long long a, b;
+    int ln = 0, version = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ln++;
+        if (line[0] == '\n' || line[0] == '#') continue;
+        if (ln == 1 && sscanf(line, "jackprof %d", &version) == 1) continue;
+        if (sscanf(line, "function %199s %lld", fn, &a) == 2) {
+            addKey(p, fn, a, 0);
+            p->totalCalls += a;
+        }
+        else if (sscanf(line, "branch %199s %199s %lld %lld", fn, label, &a, &b) == 4) {
+            snprintf(key, sizeof(key), "%s %s", fn, label);
+            addKey(p, key, a, b);
+        }
+        else {
+            snprintf(err, (size_t)errLen, "%s:%d: bad profile line", path, ln);
+            fclose(f);
+            freeProfile(p);
+            return NULL;
+        }
+    }
+    fclose(f);
+    if (version != 1) {
+        snprintf(err, (size_t)errLen, "%s: not a jackprof 1 profile", path);
+        freeProfile(p);
+        return NULL;
+    }
+    return p;
+}
+
+void freeProfile(Profile *p) {
+    if (!p) return;
+    for (int i = 0; i < p->cap; i++) free(p->keys[i]);
+    free(p->keys);
+    free(p->a);
+    free(p->b);
+    free(p);
+}
+
+long long profileCalls(const Profile *p, const char *fn) {
+    int k = findKey(p, fn);
+    return k < 0 ? -1 : p->a[k];
+}
+
+int profileBranch(const Profile *p, const char *fn, const char *label,
+                  long long *executed, long long *taken) {
+    char key[402];
+    snprintf(key, sizeof(key), "%s %s", fn, label);
+    int k = findKey(p, key);
+    if (k < 0) return 0;
+    *executed = p->a[k];
+    *taken = p->b[k];
+    return 1;
+}
+
+int profileIsHot(const Profile *p, const char *fn) {
+    long long n = profileCalls(p, fn);
+    return n > 0 && n * 100 >= p->totalCalls;
+}
+
+//---------------------------------------------------------------------
+// function ordering
+//---------------------------------------------------------------------
+
+typedef struct {
+    VmFunction fn;
+    long long calls;
+    int index;
+} Ranked;
+
+static int cmpRanked(const void *x, const void *y) {
+    const Ranked *a = x, *b = y;
+    if (a->calls != b->calls) return a->calls < b->calls ? 1 : -1;
+    return a->index - b->index;
+}
+
+void orderFunctionsByProfile(VmProgram *prog, const Profile *p) {
+    for (int i = 0; i < prog->nClasses; i++) {
+        VmClass *c = prog->classes[i];
+        Ranked *r = malloc(sizeof(Ranked) * ((size_t)c->nFuncs + 1));
+        if (!r) abort();
+        for (int f = 0; f < c->nFuncs; f++) {
+            long long n = profileCalls(p, vmStr(c, c->funcs[f].name));
+            r[f].fn = c->funcs[f];
+            r[f].calls = n > 0 ? n : 0;
+            r[f].index = f;
+        }
+        qsort(r, (size_t)c->nFuncs, sizeof(Ranked), cmpRanked);
+        for (int f = 0; f < c->nFuncs; f++) {
+            if (r[f].index != f && optOptions.log)
+                fprintf(optOptions.log, "pgo: %s moved to position %d (%lld entries)\n",
+                        vmStr(c, r[f].fn.name), f, r[f].calls);
+            c->funcs[f] = r[f].fn;
+        }
+        free(r);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef PGO_H
+#define PGO_H
+
+#include <stdio.h>
+#include "vm.h"
+
+// Execution profile of a run, written by vmrun -genprofile:
+//
+//     jackprof 1
+//     function <Class.sub> <entries>
+//     branch <Class.sub> <if-goto label> <executed> <taken>
+//
+// Every function and if-goto of the program is listed, run or not, so a
+// function missing from the profile is new code, not cold code.
+
+typedef struct Profile Profile;
+
+// NULL with a message in err if the file cannot be read
+Profile* loadProfile(const char *path, char *err, int errLen);
+void freeProfile(Profile *p);
+// entries into fn, -1 if fn is not in the profile
+long long profileCalls(const Profile *p, const char *fn);
+// counts of the if-goto to `label` in fn; 0 if it is not in the profile
+int profileBranch(const Profile *p, const char *fn, const char *label,
+                  long long *executed, long long *taken);
+// fn takes at least 1% of all function entries
+int profileIsHot(const Profile *p, const char *fn);
+
+// order the functions of each class by entries, hottest first; functions
+// never entered keep their relative order at the end
+void orderFunctionsByProfile(VmProgram *prog, const Profile *p);
+
+#endif
@@ -0,0 +1,242 @@
+// regalloc.c
+/************************************************************************
+ Promotion of hot locals to temp slots
+
+ A local or argument lives behind LCL or ARG: every access adds the
+ base pointer to its index (four extra Hack instructions per push).
+ Temp slots sit at fixed addresses. Inside a loop that makes no calls
+ nothing else touches temp 5-7, so the busiest variables of the loop
+ are loaded into them in a preheader, read and written there in the
+ loop, and stored back on the way out. Variables are ranked by their
+ accesses in the loop, each counting four times per nested loop level.
+ The outermost call-free loop is taken: the loops inside it share its
+ slots.
+*************************************************************************/
+#include "ir.h"
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PROMOTE_TEMPS 3       // temp 7, 6, 5; spills keep temp 1-4
+#define PROMOTE_MIN_WEIGHT 3  // weighted accesses worth a load and a store back
+
+typedef struct {
+    int seg, idx;
+    int weight, stored;
+} Candidate;
+
+typedef struct {
+    IrFunction *ir;
+    int *idom, *predStart, *pred, *work, *depth;
+    char *inLoop;
+} Promote;
+
+static void analyze(Promote *P) {
+    IrFunction *ir = P->ir;
+    size_t n = (size_t)ir->nBlocks + 2;
+    P->idom = realloc(P->idom, sizeof(int) * n);
+    P->predStart = realloc(P->predStart, sizeof(int) * n);
+    P->pred = realloc(P->pred, sizeof(int) * n * 2);
+    P->work = realloc(P->work, sizeof(int) * n);
+    P->depth = realloc(P->depth, sizeof(int) * n);
+    P->inLoop = realloc(P->inLoop, n);
+    if (!P->idom || !P->predStart || !P->pred || !P->work || !P->depth || !P->inLoop) abort();
+    irDominators(ir, P->idom);
+    irPredecessors(ir, P->predStart, P->pred);
+}
+
+static int isHeader(const Promote *P, int h) {
+    for (int k = P->predStart[h]; k < P->predStart[h + 1]; k++)
+        if (irDominates(P->idom, h, P->pred[k])) return 1;
+    return 0;
+}
+
+// the loop of h qualifies: no calls, no promoted variables yet, stack
+// empty on entry, and every exit lands in a block entered only from it
+static int promotable(const Promote *P, int h) {
+    const IrFunction *ir = P->ir;
+    int succ[2];
+    if (ir->blocks[h].nParams > 0) return 0;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        if (!P->inLoop[b]) continue;
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if (in->op == IR_CALL) return 0;
+            if ((in->op == IR_LOAD || in->op == IR_STORE) && in->seg == SEG_TEMP) return 0;
+        }
+        int ns = irSuccessors(ir, b, succ);
+        for (int i = 0; i < ns; i++) {
+            int e = succ[i];
+            if (P->inLoop[e]) continue;
+            if (ir->blocks[e].nParams > 0) return 0;
+            for (int k = P->predStart[e]; k < P->predStart[e + 1]; k++)
+                if (!P->inLoop[P->pred[k]]) return 0;
+        }
+    }
+    return 1;
+}
+
+static int byWeight(const void *x, const void *y) {
+    const Candidate *a = x, *b = y;
+    return b->weight - a->weight;
+}
+
+// loop nesting of each block inside the loop of h, 0 for h's own level
+static void nesting(Promote *P, int h, char *inOuter) {
+    IrFunction *ir = P->ir;
+    memset(P->depth, 0, sizeof(int) * (size_t)ir->nBlocks);
+    memcpy(inOuter, P->inLoop, (size_t)ir->nBlocks);
+    for (int g = 0; g < ir->nBlocks; g++) {
+        if (g == h || !inOuter[g] || !isHeader(P, g)) continue;
+        irLoopBody(ir, P->idom, P->predStart, P->pred, g, P->inLoop, P->work);
+        for (int b = 0; b < ir->nBlocks; b++)
+            if (P->inLoop[b]) P->depth[b]++;
+    }
+    memcpy(P->inLoop, inOuter, (size_t)ir->nBlocks);
+}
+
+static int collect(Promote *P, Candidate *cand) {
+    IrFunction *ir = P->ir;
+    int n = 0;
+    for (int b = 0; b < ir->nBlocks; b++) {
+        if (!P->inLoop[b]) continue;
+        int w = 1 << (2 * (P->depth[b] < 4 ? P->depth[b] : 4));
+        for (int k = ir->blocks[b].first; k < ir->blocks[b].first + ir->blocks[b].n; k++) {
+            const IrInstr *in = &ir->code[k];
+            if ((in->op != IR_LOAD && in->op != IR_STORE) ||
+                (in->seg != SEG_LOCAL && in->seg != SEG_ARGUMENT)) continue;
+            int c = 0;
+            while (c < n && (cand[c].seg != in->seg || cand[c].idx != in->imm)) c++;
+            if (c == n) {
+                cand[n].seg = in->seg;
+                cand[n].idx = in->imm;
+                cand[n].weight = cand[n].stored = 0;
+                n++;
+            }
+            cand[c].weight += w;
+            if (in->op == IR_STORE) cand[c].stored = 1;
+        }
+    }
+    qsort(cand, (size_t)n, sizeof(Candidate), byWeight);
+    while (n > 0 && cand[n - 1].weight < PROMOTE_MIN_WEIGHT) n--;
+    return n < PROMOTE_TEMPS ? n : PROMOTE_TEMPS;
+}
+
+static int newReg(IrFunction *ir) {
+    return ir->nRegs++;
+}
+
+static IrInstr memOp(int op, int seg, int imm, int dst, int b) {
+    IrInstr in;
+    memset(&in, 0, sizeof(in));
+    in.op = (unsigned char)op;
+    in.seg = (unsigned char)seg;
+    in.imm = imm;
+    in.dst = dst;
+    in.a = -1;
+    in.b = b;
+    return in;
+}
+
+// move the variables of cand into temp 7, 6 ... for the loop of h
+static int promoteLoop(Promote *P, int h, const Candidate *cand, int n) {
+    IrFunction *ir = P->ir;
+    int nb = ir->nBlocks, succ[2];
+    char *exit = calloc((size_t)nb + 1, 1);
+    if (!exit) abort();
+    for (int b = 0; b < nb; b++) {
+        if (!P->inLoop[b]) continue;
+        int ns = irSuccessors(ir, b, succ);
+        for (int i = 0; i < ns; i++)
+            if (!P->inLoop[succ[i]]) exit[succ[i]] = 1;
+    }
+    int header, pre = irMakePreheader(ir, P->predStart, P->pred, P->inLoop, h, &header);
+    if (pre < 0) {
+        free(exit);
+        return 0;
+    }
+    // inLoop and exit still use the numbering from before the preheader
+    for (int b = 0; b < nb; b++) {
+        if (!P->inLoop[b]) continue;
+        const IrBlock *blk = &ir->blocks[b >= pre ? b + 1 : b];
+        for (int k = blk->first; k < blk->first + blk->n; k++) {
+            IrInstr *in = &ir->code[k];
+            if (in->op != IR_LOAD && in->op != IR_STORE) continue;
+            for (int c = 0; c < n; c++)
+                if (in->seg == cand[c].seg && in->imm == cand[c].idx) {
+                    in->seg = SEG_TEMP;
+                    in->imm = 7 - c;
+                }
+        }
+    }
+    for (int c = 0; c < n; c++) {
+        int r = newReg(ir);
+        IrInstr load = memOp(IR_LOAD, cand[c].seg, cand[c].idx, r, -1);
+        IrInstr store = memOp(IR_STORE, SEG_TEMP, 7 - c, -1, r);
+        irAppendInstr(ir, pre, &load);
+        irAppendInstr(ir, pre, &store);
+    }
+    IrInstr jump = memOp(IR_JUMP, 0, header, -1, -1);
+    irAppendInstr(ir, pre, &jump);
+    for (int b = 0; b < nb; b++) {
+        if (!exit[b]) continue;
+        int e = b >= pre ? b + 1 : b, at = 0;
+        for (int c = 0; c < n; c++) {
+            if (!cand[c].stored) continue;
+            int r = newReg(ir);
+            IrInstr load = memOp(IR_LOAD, SEG_TEMP, 7 - c, r, -1);
+            IrInstr store = memOp(IR_STORE, cand[c].seg, cand[c].idx, -1, r);
+            irInsertInstr(ir, e, at++, &load);
+            irInsertInstr(ir, e, at++, &store);
+        }
+    }
+    free(exit);
+    if (n > ir->tempsHeld) ir->tempsHeld = n;
+    return n;
+}
+
+int irPromoteLocals(IrFunction *ir) {
+    Promote P;
+    memset(&P, 0, sizeof(P));
+    P.ir = ir;
+    int total = 0, changed = 1;
+    while (changed) {
+        changed = 0;
+        analyze(&P);
+        int nb = ir->nBlocks;
+        char *inOuter = malloc((size_t)nb + 1), *failed = calloc((size_t)nb + 1, 1);
+        Candidate *cand = malloc(sizeof(Candidate) * ((size_t)ir->nCode + 1));
+        if (!inOuter || !failed || !cand) abort();
+        // the largest loop that qualifies, then start over on the new blocks
+        for (;;) {
+            int best = -1, bestSize = 0;
+            for (int h = 0; h < nb; h++) {
+                if (failed[h] || !isHeader(&P, h)) continue;
+                int size = irLoopBody(ir, P.idom, P.predStart, P.pred, h, P.inLoop, P.work);
+                if (size <= bestSize || !promotable(&P, h)) continue;
+                nesting(&P, h, inOuter);
+                if (collect(&P, cand) == 0) continue;
+                best = h;
+                bestSize = size;
+            }
+            if (best < 0) break;
+            irLoopBody(ir, P.idom, P.predStart, P.pred, best, P.inLoop, P.work);
+            nesting(&P, best, inOuter);
+            int n = collect(&P, cand);
+            changed = promoteLoop(&P, best, cand, n);
+            if (changed) break;
+            failed[best] = 1;
+        }
+        total += changed;
+        free(inOuter);
+        free(failed);
+        free(cand);
+    }
+    free(P.idom);
+    free(P.predStart);
+    free(P.pred);
+    free(P.work);
+    free(P.depth);
+    free(P.inLoop);
+    return total;
+}
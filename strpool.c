@@ -0,0 +1,118 @@
+// strpool.c
+/************************************************************************
+ String constant pool
+
+ Without it every evaluation of a string constant builds a new String:
+ String.new(n) and n appendChar calls, again on each pass of a loop.
+ With optOptions.stringPool the distinct literals of the whole program
+ get one slot each in an array owned by the generated class
+ StringPool$ (not a Jack name, so no class of the program can clash).
+ Its only function, StringPool$.get, builds every literal the first
+ time it is called and returns the array. A class using literals keeps
+ the array in one static of its own, fetched on first use, and reads a
+ literal as that[slot].
+
+ Literals become shared objects: all uses of "abc" get the same String,
+ and disposing or appending to it is seen by all of them. Hence the
+ opt-in flag. Libraries (no Main.main) are not pooled: two of them
+ would each bring a StringPool$.
+*************************************************************************/
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int pooling;
+static char **lits;             // distinct literals in slot order
+static int nLits, capLits;
+static int *hash, hashCap;      // open addressing over lits, -1 = empty
+
+static unsigned hashText(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static void rehash(void) {
+    hashCap = hashCap ? hashCap * 2 : 64;
+    free(hash);
+    hash = malloc(sizeof(int) * (size_t)hashCap);
+    if (!hash) abort();
+    for (int i = 0; i < hashCap; i++) hash[i] = -1;
+    for (int i = 0; i < nLits; i++) {
+        unsigned k = hashText(lits[i]) & (unsigned)(hashCap - 1);
+        while (hash[k] >= 0) k = (k + 1) & (unsigned)(hashCap - 1);
+        hash[k] = i;
+    }
+}
+
+static void clearPool(void) {
+    for (int i = 0; i < nLits; i++) free(lits[i]);
+    free(lits);
+    free(hash);
+    lits = NULL;
+    hash = NULL;
+    nLits = capLits = hashCap = 0;
+}
+
+void beginStringPool(int on) {
+    clearPool();
+    pooling = on;
+}
+
+int poolString(const char *s) {
+    if (!pooling) return -1;
+    if ((nLits + 1) * 2 > hashCap) rehash();
+    unsigned k = hashText(s) & (unsigned)(hashCap - 1);
+    while (hash[k] >= 0) {
+        if (!strcmp(lits[hash[k]], s)) return hash[k];
+        k = (k + 1) & (unsigned)(hashCap - 1);
+    }
+    if (nLits == capLits) {
+        capLits = capLits ? capLits * 2 : 16;
+        lits = realloc(lits, sizeof(char*) * (size_t)capLits);
+        if (!lits) abort();
+    }
+    lits[nLits] = strdup(s);
+    if (!lits[nLits]) abort();
+    hash[k] = nLits;
+    return nLits++;
+}
+
+// StringPool$.get: static 0 holds the array once built
+void endStringPool(VmProgram *p) {
+    if (pooling && nLits > 0) {
+        VmClass *c = vmNewClass(STRING_POOL_CLASS);
+        int f = vmAddFunction(c, STRING_POOL_GET, 0);
+        VmFunction *fn = &c->funcs[f];
+        int ready = vmString(c, "POOL_READY");
+        int newString = vmString(c, "String.new"), append = vmString(c, "String.appendChar");
+        vmEmit(fn, VM_PUSH, SEG_STATIC, 0, -1);
+        vmEmit(fn, VM_IF_GOTO, SEG_CONSTANT, 0, ready);
+        vmEmit(fn, VM_PUSH, SEG_CONSTANT, nLits, -1);
+        vmEmit(fn, VM_CALL, SEG_CONSTANT, 1, vmString(c, "Array.new"));
+        vmEmit(fn, VM_POP, SEG_STATIC, 0, -1);
+        for (int i = 0; i < nLits; i++) {
+            int n = (int)strlen(lits[i]);
+            vmEmit(fn, VM_PUSH, SEG_CONSTANT, n, -1);
+            vmEmit(fn, VM_CALL, SEG_CONSTANT, 1, newString);
+            for (int j = 0; j < n; j++) {
+                vmEmit(fn, VM_PUSH, SEG_CONSTANT, (unsigned char)lits[i][j], -1);
+                vmEmit(fn, VM_CALL, SEG_CONSTANT, 2, append);
+            }
+            vmEmit(fn, VM_POP, SEG_TEMP, 0, -1);
+            vmEmit(fn, VM_PUSH, SEG_STATIC, 0, -1);
+            vmEmit(fn, VM_POP, SEG_POINTER, 1, -1);
+            vmEmit(fn, VM_PUSH, SEG_TEMP, 0, -1);
+            vmEmit(fn, VM_POP, SEG_THAT, i, -1);
+        }
+        vmEmit(fn, VM_LABEL, SEG_CONSTANT, 0, ready);
+        vmEmit(fn, VM_PUSH, SEG_STATIC, 0, -1);
+        vmEmit(fn, VM_RETURN, SEG_CONSTANT, 0, -1);
+        vmAddClass(p, c);
+        optStats.stringsPooled = nLits;
+        if (optOptions.log)
+            fprintf(optOptions.log, "string pool: %d literals\n", nLits);
+    }
+    clearPool();
+    pooling = 0;
+}
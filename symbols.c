@@ -23,8 +23,8 @@ Date Work Commenced:
 
 // 符号描述
 typedef struct {
-    char name[64];   // 符号名
-    char type[64];   // 符号类型（int/char/boolean 或 类名）
+    const char *name;   // 符号名（指向类的 AST，不复制）
+    const char *type;   // 符号类型（int/char/boolean 或 类名）
     Kind kind;       // 符号类别
     int index;       // 在该类别中的序号
 } Symbol;
@@ -71,10 +71,9 @@ void defineSymbol(const char *name, const char *type, Kind kind) {
             return; // NONE_SYMBOL 不定义
     }
     // 填充字段
-    strncpy(s->name, name, sizeof(s->name)-1);
-    s->name[sizeof(s->name)-1] = '\0';
-    strncpy(s->type, type, sizeof(s->type)-1);
-    s->type[sizeof(s->type)-1] = '\0';
+    // 名字不复制：它们在生成整个类期间都有效，长度不限
+    s->name  = name;
+    s->type  = type;
     s->kind  = kind;
     s->index = idx;
 }
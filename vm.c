@@ -0,0 +1,529 @@
+// vm.c
+/************************************************************************
+ In-memory Jack VM code, the .vm text reader/writer and the .vmb
+ bytecode files
+*************************************************************************/
+#include "vm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *opNames[] = {
+    "push", "pop",
+    "add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not",
+    "label", "goto", "if-goto",
+    "call", "return"
+};
+
+static const char *segNames[] = {
+    "argument", "local", "static", "constant",
+    "this", "that", "pointer", "temp"
+};
+
+const char* vmOpName(int op) { return opNames[op]; }
+const char* vmSegName(int seg) { return segNames[seg]; }
+
+static unsigned hashString(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// rebuild the string index with room for twice as many entries
+static void rehash(VmClass *c) {
+    int cap = c->hashCap ? c->hashCap * 2 : 64;
+    int *h = malloc(sizeof(int) * (size_t)cap);
+    if (!h) abort();
+    for (int i = 0; i < cap; i++) h[i] = -1;
+    for (int i = 0; i < c->hashCap; i++) {
+        int id = c->hash[i];
+        if (id < 0) continue;
+        unsigned k = hashString(c->strs + id) & (unsigned)(cap - 1);
+        while (h[k] >= 0) k = (k + 1) & (unsigned)(cap - 1);
+        h[k] = id;
+    }
+    free(c->hash);
+    c->hash = h;
+    c->hashCap = cap;
+}
+
+static int inMap(const VmClass *c) {
+    const char *p = c->strs, *m = c->map;
+    return m && p >= m && p < m + c->mapLen;
+}
+
+// index the strings of a table that came from a file
+static void indexStrings(VmClass *c) {
+    int n = 0;
+    for (int id = 0; id < c->strLen; id += (int)strlen(c->strs + id) + 1) n++;
+    for (c->hashCap = 64; c->hashCap < (n + 1) * 2; c->hashCap *= 2) ;
+    c->hash = malloc(sizeof(int) * (size_t)c->hashCap);
+    if (!c->hash) abort();
+    for (int i = 0; i < c->hashCap; i++) c->hash[i] = -1;
+    for (int id = 0; id < c->strLen; id += (int)strlen(c->strs + id) + 1) {
+        unsigned k = hashString(c->strs + id) & (unsigned)(c->hashCap - 1);
+        while (c->hash[k] >= 0) k = (k + 1) & (unsigned)(c->hashCap - 1);
+        c->hash[k] = id;
+    }
+    c->nStrs = n;
+}
+
+int vmString(VmClass *c, const char *s) {
+    if (!c->hash && c->strLen > 0) indexStrings(c);
+    if ((c->nStrs + 1) * 2 > c->hashCap) rehash(c);
+    unsigned k = hashString(s) & (unsigned)(c->hashCap - 1);
+    while (c->hash[k] >= 0) {
+        if (!strcmp(c->strs + c->hash[k], s)) return c->hash[k];
+        k = (k + 1) & (unsigned)(c->hashCap - 1);
+    }
+    int len = (int)strlen(s);
+    if (c->strLen + len + 1 > c->strCap) {
+        int n = c->strCap ? c->strCap : 256;
+        while (n < c->strLen + len + 1) n *= 2;
+        if (inMap(c)) {
+            // still in the file mapping: copy out
+            char *p = malloc((size_t)n);
+            if (p) memcpy(p, c->strs, (size_t)c->strLen);
+            c->strs = p;
+        } else {
+            c->strs = realloc(c->strs, (size_t)n);
+        }
+        if (!c->strs) abort();
+        c->strCap = n;
+    }
+    int id = c->strLen;
+    memcpy(c->strs + id, s, (size_t)len + 1);
+    c->strLen += len + 1;
+    c->hash[k] = id;
+    c->nStrs++;
+    return id;
+}
+
+const char* vmStr(const VmClass *c, int id) {
+    return id < 0 ? "" : c->strs + id;
+}
+
+VmClass* vmNewClass(const char *name) {
+    VmClass *c = calloc(1, sizeof(VmClass));
+    if (!c) abort();
+    c->name = vmString(c, name);
+    return c;
+}
+
+void vmFreeClass(VmClass *c) {
+    if (!c) return;
+    for (int i = 0; i < c->nFuncs; i++)
+        free(c->funcs[i].code);
+    free(c->funcs);
+    if (!inMap(c)) free(c->strs);
+    if (c->map) munmap(c->map, c->mapLen);
+    free(c->hash);
+    free(c);
+}
+
+int vmAddFunction(VmClass *c, const char *name, int nLocals) {
+    if (c->nFuncs == c->capFuncs) {
+        c->capFuncs = c->capFuncs ? c->capFuncs * 2 : 16;
+        c->funcs = realloc(c->funcs, sizeof(VmFunction) * (size_t)c->capFuncs);
+        if (!c->funcs) abort();
+    }
+    VmFunction *f = &c->funcs[c->nFuncs];
+    memset(f, 0, sizeof(*f));
+    f->name = vmString(c, name);
+    f->nLocals = nLocals;
+    return c->nFuncs++;
+}
+
+int vmFindFunction(const VmClass *c, const char *name) {
+    for (int i = 0; i < c->nFuncs; i++)
+        if (!strcmp(vmStr(c, c->funcs[i].name), name))
+            return i;
+    return -1;
+}
+
+void vmEmit(VmFunction *f, VmOp op, VmSegment seg, int arg, int sym) {
+    if (f->len == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 64;
+        f->code = realloc(f->code, sizeof(VmInstr) * (size_t)f->cap);
+        if (!f->code) abort();
+    }
+    VmInstr *in = &f->code[f->len++];
+    in->op = (unsigned char)op;
+    in->seg = (unsigned char)seg;
+    in->arg = arg;
+    in->sym = sym;
+}
+
+void vmWriteInstr(FILE *f, const VmClass *c, const VmInstr *in) {
+    switch (in->op) {
+        case VM_PUSH:
+        case VM_POP:
+            fprintf(f, "%s %s %d\n", opNames[in->op], segNames[in->seg], in->arg);
+            break;
+        case VM_LABEL:
+        case VM_GOTO:
+        case VM_IF_GOTO:
+            fprintf(f, "%s %s\n", opNames[in->op], vmStr(c, in->sym));
+            break;
+        case VM_CALL:
+            fprintf(f, "call %s %d\n", vmStr(c, in->sym), in->arg);
+            break;
+        default:
+            fprintf(f, "%s\n", opNames[in->op]);
+            break;
+    }
+}
+
+void vmWriteClass(FILE *f, const VmClass *c) {
+    for (int i = 0; i < c->nFuncs; i++) {
+        const VmFunction *fn = &c->funcs[i];
+        fprintf(f, "function %s %d\n", vmStr(c, fn->name), fn->nLocals);
+        for (int k = 0; k < fn->len; k++)
+            vmWriteInstr(f, c, &fn->code[k]);
+    }
+}
+
+static int lookupName(const char **names, int n, const char *s) {
+    for (int i = 0; i < n; i++)
+        if (!strcmp(names[i], s)) return i;
+    return -1;
+}
+
+// up to three words of a line: a name, a name, a number (like
+// sscanf "%s %s %d", but of any length); the count read
+static int splitLine(char *line, char **a, char **b, int *n) {
+    char *save, *num, *end;
+    *a = strtok_r(line, " \t\r\n", &save);
+    if (!*a) return 0;
+    *b = strtok_r(NULL, " \t\r\n", &save);
+    if (!*b) return 1;
+    num = strtok_r(NULL, " \t\r\n", &save);
+    if (!num) return 2;
+    long v = strtol(num, &end, 10);
+    if (end == num) return 2;
+    *n = (int)v;
+    return 3;
+}
+
+VmClass* vmReadClass(FILE *f, const char *name, char *err, int errLen) {
+    VmClass *c = vmNewClass(name);
+    VmFunction *fn = NULL;
+    char *line = NULL, *a = NULL, *b = NULL;   // lines of any length (getline)
+    size_t cap = 0;
+    int n = 0, ln = 0;
+
+    while (getline(&line, &cap, f) >= 0) {
+        ln++;
+        char *cm = strstr(line, "//");
+        if (cm) *cm = '\0';
+        int k = splitLine(line, &a, &b, &n);
+        if (k <= 0) continue;
+
+        int op = lookupName(opNames, VM_RETURN + 1, a);
+        if (!strcmp(a, "function") && k == 3) {
+            int idx = vmAddFunction(c, b, n);
+            fn = &c->funcs[idx];
+            continue;
+        }
+        if (op < 0 || !fn) goto bad;
+        switch (op) {
+            case VM_PUSH:
+            case VM_POP: {
+                int seg = lookupName(segNames, SEG_TEMP + 1, b);
+                if (k != 3 || seg < 0) goto bad;
+                vmEmit(fn, op, seg, n, -1);
+                break;
+            }
+            case VM_LABEL:
+            case VM_GOTO:
+            case VM_IF_GOTO:
+                if (k != 2) goto bad;
+                vmEmit(fn, op, SEG_CONSTANT, 0, vmString(c, b));
+                break;
+            case VM_CALL:
+                if (k != 3) goto bad;
+                vmEmit(fn, op, SEG_CONSTANT, n, vmString(c, b));
+                break;
+            default:
+                vmEmit(fn, op, SEG_CONSTANT, 0, -1);
+                break;
+        }
+    }
+    free(line);
+    return c;
+
+bad:
+    snprintf(err, (size_t)errLen, "%s.vm line %d: cannot read \"%s\"", name, ln, a);
+    free(line);
+    vmFreeClass(c);
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+// binary files
+//---------------------------------------------------------------------
+
+#define VMB_MAGIC   0x424D564Au      // "JVMB" read as a little-endian word
+#define VMB_VERSION 1
+
+typedef struct {
+    uint32_t magic, version;
+    int32_t name;                    // class name (string id)
+    uint32_t nFuncs;
+    uint32_t offFuncs, offCode, offStrs;
+    uint32_t codeLen, strLen;
+    uint32_t size;                   // whole file
+} VmbHeader;
+
+typedef struct {
+    int32_t name, nLocals;
+    uint32_t code, len;              // byte offset in the code section, instructions
+} VmbFunction;
+
+typedef struct {
+    unsigned char *p;
+    size_t len, cap;
+} ByteBuf;
+
+static void putByte(ByteBuf *b, unsigned char x) {
+    if (b->len == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        b->p = realloc(b->p, b->cap);
+        if (!b->p) abort();
+    }
+    b->p[b->len++] = x;
+}
+
+static void putVarint(ByteBuf *b, uint32_t v) {
+    while (v >= 0x80) {
+        putByte(b, (unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+    putByte(b, (unsigned char)v);
+}
+
+// operands of each op: push/pop index, label, call target and argument count
+static void encodeInstr(ByteBuf *b, const VmInstr *in) {
+    putByte(b, (unsigned char)(in->op | in->seg << 4));
+    switch (in->op) {
+        case VM_PUSH: case VM_POP:
+            putVarint(b, (uint32_t)in->arg);
+            break;
+        case VM_LABEL: case VM_GOTO: case VM_IF_GOTO:
+            putVarint(b, (uint32_t)in->sym);
+            break;
+        case VM_CALL:
+            putVarint(b, (uint32_t)in->sym);
+            putVarint(b, (uint32_t)in->arg);
+            break;
+    }
+}
+
+// written to a temporary name and renamed, like .ast files
+int vmWriteClassBinary(const VmClass *c, const char *path) {
+    VmbHeader h;
+    ByteBuf code = { NULL, 0, 0 };
+    char tmp[600];
+    VmbFunction *ft = calloc((size_t)c->nFuncs + 1, sizeof(VmbFunction));
+    if (!ft) abort();
+    for (int i = 0; i < c->nFuncs; i++) {
+        const VmFunction *fn = &c->funcs[i];
+        ft[i].name = fn->name;
+        ft[i].nLocals = fn->nLocals;
+        ft[i].code = (uint32_t)code.len;
+        ft[i].len = (uint32_t)fn->len;
+        for (int k = 0; k < fn->len; k++)
+            encodeInstr(&code, &fn->code[k]);
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = VMB_MAGIC;
+    h.version = VMB_VERSION;
+    h.name = c->name;
+    h.nFuncs = (uint32_t)c->nFuncs;
+    h.offFuncs = sizeof(h);
+    h.offCode = h.offFuncs + (uint32_t)(sizeof(VmbFunction) * (size_t)c->nFuncs);
+    h.codeLen = (uint32_t)code.len;
+    h.offStrs = h.offCode + h.codeLen;
+    h.strLen = (uint32_t)c->strLen;
+    h.size = h.offStrs + h.strLen;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f != NULL;
+    if (ok) {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(ft, sizeof(VmbFunction), (size_t)c->nFuncs, f) == (size_t)c->nFuncs &&
+             fwrite(code.p, 1, code.len, f) == code.len &&
+             fwrite(c->strs, 1, (size_t)c->strLen, f) == (size_t)c->strLen;
+        ok = fclose(f) == 0 && ok;
+        if (ok) ok = rename(tmp, path) == 0;
+        if (!ok) remove(tmp);
+    }
+    free(ft);
+    free(code.p);
+    return ok;
+}
+
+static int getVarint(const unsigned char **p, const unsigned char *end, uint32_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+        unsigned char x = *(*p)++;
+        *v |= (uint32_t)(x & 0x7F) << shift;
+        if (!(x & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// decode n instructions of a function; 0 if they do not fit or make sense
+static int decodeCode(VmFunction *fn, const unsigned char *p, const unsigned char *end, int strLen) {
+    for (int k = 0; k < fn->cap; k++) {
+        uint32_t a = 0, b = 0;
+        if (p >= end) return 0;
+        int op = *p & 0x0F, seg = *p >> 4;
+        p++;
+        if (op > VM_RETURN || seg > SEG_TEMP) return 0;
+        VmInstr *in = &fn->code[k];
+        in->op = (unsigned char)op;
+        in->seg = (unsigned char)seg;
+        in->arg = 0;
+        in->sym = -1;
+        switch (op) {
+            case VM_PUSH: case VM_POP:
+                if (!getVarint(&p, end, &a)) return 0;
+                in->arg = (int)a;
+                break;
+            case VM_LABEL: case VM_GOTO: case VM_IF_GOTO:
+                if (!getVarint(&p, end, &a) || a >= (uint32_t)strLen) return 0;
+                in->sym = (int)a;
+                break;
+            case VM_CALL:
+                if (!getVarint(&p, end, &a) || !getVarint(&p, end, &b) || a >= (uint32_t)strLen) return 0;
+                in->sym = (int)a;
+                in->arg = (int)b;
+                break;
+        }
+    }
+    fn->len = fn->cap;
+    return 1;
+}
+
+VmClass* vmMapClassBinary(const char *path, char *err, int errLen) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, (size_t)errLen, "cannot open %s", path);
+        return NULL;
+    }
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(VmbHeader))
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        snprintf(err, (size_t)errLen, "cannot map %s", path);
+        return NULL;
+    }
+
+    const VmbHeader *h = m;
+    const unsigned char *base = m;
+    if (h->magic != VMB_MAGIC || h->version != VMB_VERSION || h->size != (uint64_t)st.st_size ||
+        h->offFuncs != sizeof(VmbHeader) ||
+        (uint64_t)h->offFuncs + (uint64_t)h->nFuncs * sizeof(VmbFunction) != h->offCode ||
+        (uint64_t)h->offCode + h->codeLen != h->offStrs ||
+        (uint64_t)h->offStrs + h->strLen != h->size ||
+        h->strLen < 1 || h->strLen > INT32_MAX || base[h->offStrs + h->strLen - 1] != '\0' ||
+        h->name < 0 || (uint32_t)h->name >= h->strLen) {
+        snprintf(err, (size_t)errLen, "%s: not a version %d bytecode file", path, VMB_VERSION);
+        munmap(m, (size_t)st.st_size);
+        return NULL;
+    }
+
+    VmClass *c = calloc(1, sizeof(VmClass));
+    if (!c) abort();
+    c->map = m;
+    c->mapLen = (size_t)st.st_size;
+    c->strs = (char*)(base + h->offStrs);
+    c->strLen = c->strCap = (int)h->strLen;
+    c->name = h->name;
+    c->funcs = calloc((size_t)h->nFuncs + 1, sizeof(VmFunction));
+    if (!c->funcs) abort();
+    c->capFuncs = (int)h->nFuncs + 1;
+    const VmbFunction *ft = (const VmbFunction*)(base + h->offFuncs);
+    const unsigned char *code = base + h->offCode, *end = code + h->codeLen;
+    for (uint32_t i = 0; i < h->nFuncs; i++) {
+        VmFunction *fn = &c->funcs[c->nFuncs++];
+        fn->name = ft[i].name;
+        fn->nLocals = ft[i].nLocals;
+        fn->cap = (int)ft[i].len;
+        // every instruction takes at least its opcode byte
+        if (ft[i].name < 0 || (uint32_t)ft[i].name >= h->strLen || ft[i].nLocals < 0 ||
+            ft[i].code > h->codeLen || ft[i].len > h->codeLen - ft[i].code) {
+            snprintf(err, (size_t)errLen, "%s: bad function %u", path, i);
+            vmFreeClass(c);
+            return NULL;
+        }
+        fn->code = malloc(sizeof(VmInstr) * ((size_t)fn->cap + 1));
+        if (!fn->code) abort();
+        if (!decodeCode(fn, code + ft[i].code, end, c->strLen)) {
+            snprintf(err, (size_t)errLen, "%s: bad code in %s", path, vmStr(c, fn->name));
+            vmFreeClass(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+VmProgram* vmNewProgram(void) {
+    VmProgram *p = calloc(1, sizeof(VmProgram));
+    if (!p) abort();
+    return p;
+}
+
+void vmFreeProgram(VmProgram *p) {
+    if (!p) return;
+    for (int i = 0; i < p->nClasses; i++)
+        vmFreeClass(p->classes[i]);
+    free(p->classes);
+    free(p);
+}
+
+void vmAddClass(VmProgram *p, VmClass *c) {
+    if (p->nClasses == p->capClasses) {
+        p->capClasses = p->capClasses ? p->capClasses * 2 : 16;
+        p->classes = realloc(p->classes, sizeof(VmClass*) * (size_t)p->capClasses);
+        if (!p->classes) abort();
+    }
+    p->classes[p->nClasses++] = c;
+}
+
+VmClass* vmFindClass(const VmProgram *p, const char *name) {
+    for (int i = 0; i < p->nClasses; i++)
+        if (!strcmp(vmStr(p->classes[i], p->classes[i]->name), name))
+            return p->classes[i];
+    return NULL;
+}
+
+#ifdef TEST_VMDIS
+// usage: vmdis FILE.vmb...
+// Print bytecode files in .vm text form
+int main(int argc, char **argv) {
+    char err[256];
+    if (argc < 2) {
+        fprintf(stderr, "usage: vmdis FILE.vmb...\n");
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        VmClass *c = vmMapClassBinary(argv[i], err, sizeof(err));
+        if (!c) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        vmWriteClass(stdout, c);
+        vmFreeClass(c);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,88 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+
+// In-memory form of Jack VM code, produced by the code generator and
+// consumed by the optimisation passes and the .vm text writer.
+
+typedef enum {
+    VM_PUSH, VM_POP,
+    VM_ADD, VM_SUB, VM_NEG, VM_EQ, VM_GT, VM_LT, VM_AND, VM_OR, VM_NOT,
+    VM_LABEL, VM_GOTO, VM_IF_GOTO,
+    VM_CALL, VM_RETURN
+} VmOp;
+
+typedef enum {
+    SEG_ARGUMENT, SEG_LOCAL, SEG_STATIC, SEG_CONSTANT,
+    SEG_THIS, SEG_THAT, SEG_POINTER, SEG_TEMP
+} VmSegment;
+
+typedef struct {
+    unsigned char op;    // VmOp
+    unsigned char seg;   // VmSegment for push/pop
+    int arg;             // push/pop index, call argument count
+    int sym;             // label or callee name (string id), -1 if unused
+} VmInstr;
+
+typedef struct {
+    int name;            // full name "Class.sub" (string id)
+    int nLocals;
+    VmInstr *code;
+    int len, cap;
+} VmFunction;
+
+typedef struct {
+    int name;            // class name (string id)
+    VmFunction *funcs;
+    int nFuncs, capFuncs;
+    char *strs;          // string table: labels and call targets of this class
+    int strLen, strCap;
+    int *hash;           // open-addressing index over strs, -1 = empty
+    int hashCap, nStrs;
+    void *map;           // .vmb file strs was mapped from, NULL if on the heap
+    size_t mapLen;
+} VmClass;
+
+typedef struct {
+    VmClass **classes;
+    int nClasses, capClasses;
+} VmProgram;
+
+VmClass* vmNewClass(const char *name);
+void vmFreeClass(VmClass *c);
+
+// Intern a string in the class table and return its id
+int vmString(VmClass *c, const char *s);
+const char* vmStr(const VmClass *c, int id);
+
+// Append a function "Class.sub" to the class and return its index
+int vmAddFunction(VmClass *c, const char *name, int nLocals);
+int vmFindFunction(const VmClass *c, const char *name);
+void vmEmit(VmFunction *f, VmOp op, VmSegment seg, int arg, int sym);
+
+const char* vmOpName(int op);
+const char* vmSegName(int seg);
+
+// Write one instruction / a whole class in .vm text form
+void vmWriteInstr(FILE *f, const VmClass *c, const VmInstr *in);
+void vmWriteClass(FILE *f, const VmClass *c);
+// Read .vm text of class `name`; NULL on a malformed line (reported in err)
+VmClass* vmReadClass(FILE *f, const char *name, char *err, int errLen);
+
+// Binary bytecode (<Class>.vmb): a header, a table of functions (name,
+// locals, offset and length of their code), the code as one opcode byte
+// (op | segment << 4) per instruction followed by its operands as
+// unsigned LEB128 varints, and the class's string table as it is in
+// memory, so string ids are the same on both sides. A loaded file's
+// strings are used in place from a private mapping and indexed only if
+// someone interns a new one; code is decoded once into VmInstr.
+int vmWriteClassBinary(const VmClass *c, const char *path);
+VmClass* vmMapClassBinary(const char *path, char *err, int errLen);
+
+VmProgram* vmNewProgram(void);
+void vmFreeProgram(VmProgram *p);
+void vmAddClass(VmProgram *p, VmClass *c);
+VmClass* vmFindClass(const VmProgram *p, const char *name);
+
+#endif
@@ -0,0 +1,928 @@
+// vminterp.c
+/************************************************************************
+ Jack VM interpreter: links VM programs into one pre-decoded code array
+ and runs it on a flat Hack RAM
+
+ With direct threading, the instruction sequences listed in vmsuper.h
+ (the most executed ones of a corpus, found by vmngram.c) run as one
+ superinstruction: the handler of the first does the work of all of
+ them and dispatches once. The code array is left as it is, only the
+ handler address of the first instruction changes, so jump targets,
+ return addresses, profiles and the JIT see the plain instructions.
+
+ A function entry checks once that its locals and the deepest operand
+ stack of its body fit (VmFunc.frame, from vmstack.c); pushes and calls
+ check nothing, except in the functions vmstack.c could not bound.
+*************************************************************************/
+#include "vminterp.h"
+#include "jit.h"
+#include "intrinsics.h"
+#include "vmstack.h"
+#include "compiler.h"
+#include "opt.h"
+#include "pgo.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RAM_MASK (HACK_RAM_SIZE - 1)
+
+// computed goto (direct threading) where the compiler has it
+#if defined(__GNUC__) && !defined(VM_NO_THREADING)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+static const VmMachine *sortMachine;   // qsort has no context argument
+
+static int cmpFuncNames(const void *a, const void *b) {
+    return strcmp(sortMachine->funcs[*(const int*)a].name,
+                  sortMachine->funcs[*(const int*)b].name);
+}
+
+int vmFindFunc(const VmMachine *m, const char *name) {
+    int lo = 0, hi = m->nFuncs - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int id = m->byName[mid];
+        int c = strcmp(m->funcs[id].name, name);
+        if (c == 0) return id;
+        if (c < 0) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+}
+
+void vmFreeMachine(VmMachine *m) {
+    if (!m) return;
+    vmFreeJit(m);
+    free(m->code);
+    free(m->counts);
+    free(m->taken);
+    free(m->branchLabel);
+    free(m->executed);
+    free(m->checkStack);
+    free(m->funcs);
+    free(m->byName);
+    free(m);
+}
+
+//---------------------------------------------------------------------
+// linking
+//---------------------------------------------------------------------
+
+// the function that owns each decoded function, for the second pass
+typedef struct {
+    const VmClass *cls;
+    const VmFunction *fn;
+    int staticBase;
+} LinkFunc;
+
+static int decodeInstr(VmMachine *m, const VmInstr *in, const VmClass *c,
+                       int staticBase, const int *labelPc, int pc,
+                       char *err, int errLen) {
+    VmInsn *out = &m->code[pc];
+    out->h = NULL;
+    out->a = in->arg;
+    out->b = 0;
+    switch (in->op) {
+        case VM_PUSH:
+        case VM_POP: {
+            int push = in->op == VM_PUSH;
+            switch (in->seg) {
+                case SEG_CONSTANT:
+                    if (!push) goto bad;
+                    out->op = I_PUSH_CONST;
+                    out->a = in->arg & 0xFFFF;
+                    return 1;
+                case SEG_LOCAL:    out->op = push ? I_PUSH_LOCAL : I_POP_LOCAL; return 1;
+                case SEG_ARGUMENT: out->op = push ? I_PUSH_ARG : I_POP_ARG; return 1;
+                case SEG_THIS:     out->op = push ? I_PUSH_THIS : I_POP_THIS; return 1;
+                case SEG_THAT:     out->op = push ? I_PUSH_THAT : I_POP_THAT; return 1;
+                case SEG_STATIC:   out->a = staticBase + in->arg; break;
+                case SEG_TEMP:     out->a = HACK_TEMP + in->arg; break;
+                case SEG_POINTER:  out->a = HACK_THIS + in->arg; break;
+            }
+            out->a &= RAM_MASK;
+            out->op = push ? I_PUSH_ADDR : I_POP_ADDR;
+            return 1;
+        }
+        case VM_ADD: out->op = I_ADD; return 1;
+        case VM_SUB: out->op = I_SUB; return 1;
+        case VM_NEG: out->op = I_NEG; return 1;
+        case VM_EQ:  out->op = I_EQ; return 1;
+        case VM_GT:  out->op = I_GT; return 1;
+        case VM_LT:  out->op = I_LT; return 1;
+        case VM_AND: out->op = I_AND; return 1;
+        case VM_OR:  out->op = I_OR; return 1;
+        case VM_NOT: out->op = I_NOT; return 1;
+        case VM_GOTO:
+        case VM_IF_GOTO: {
+            int target = labelPc[in->sym];
+            if (target < 0) {
+                snprintf(err, (size_t)errLen, "undefined label %s", vmStr(c, in->sym));
+                return 0;
+            }
+            out->a = target;
+            if (in->op == VM_IF_GOTO) m->branchLabel[pc] = vmStr(c, in->sym);
+            // "label L; goto L" is how Sys.halt spins: stop the machine instead
+            out->op = in->op == VM_GOTO ? (target == pc ? I_HALT : I_GOTO) : I_IF_GOTO;
+            return 1;
+        }
+        case VM_CALL: {
+            int f = vmFindFunc(m, vmStr(c, in->sym));
+            if (f < 0) {
+                snprintf(err, (size_t)errLen, "undefined function %s", vmStr(c, in->sym));
+                return 0;
+            }
+            out->op = I_CALL;
+            out->a = m->funcs[f].entry;
+            out->b = in->arg;
+            return 1;
+        }
+        case VM_RETURN: out->op = I_RETURN; return 1;
+    }
+bad:
+    snprintf(err, (size_t)errLen, "bad instruction %s %s %d",
+             vmOpName(in->op), vmSegName(in->seg), in->arg);
+    return 0;
+}
+
+VmMachine* vmLoad(VmProgram **progs, int nProgs, char *err, int errLen) {
+    VmMachine *m = calloc(1, sizeof(VmMachine));
+    if (!m) abort();
+    m->stackLimit = HACK_HEAP;
+    m->superinstructions = 1;
+    m->out = stdout;
+
+    // classes of earlier programs hide same-named ones of later programs,
+    // so a program can bring its own version of an OS class
+    int nFuncs = 0, nCls = 0;
+    const VmClass **cls = malloc(sizeof(VmClass*) * 64);
+    int *clsProgram = malloc(sizeof(int) * 64);
+    int capCls = 64;
+    if (!cls || !clsProgram) abort();
+    m->nPrograms = nProgs;
+    for (int p = 0; p < nProgs; p++) {
+        for (int i = 0; i < progs[p]->nClasses; i++) {
+            const VmClass *c = progs[p]->classes[i];
+            int dup = 0;
+            for (int k = 0; k < nCls && !dup; k++)
+                dup = !strcmp(vmStr(cls[k], cls[k]->name), vmStr(c, c->name));
+            if (dup) continue;
+            if (nCls == capCls) {
+                capCls *= 2;
+                cls = realloc(cls, sizeof(VmClass*) * (size_t)capCls);
+                clsProgram = realloc(clsProgram, sizeof(int) * (size_t)capCls);
+                if (!cls || !clsProgram) abort();
+            }
+            clsProgram[nCls] = p;
+            cls[nCls++] = c;
+            nFuncs += c->nFuncs;
+        }
+    }
+
+    // pass 1: lay out functions; pc 0 is the HALT the entry returns to
+    LinkFunc *lf = calloc((size_t)nFuncs + 1, sizeof(LinkFunc));
+    m->funcs = calloc((size_t)nFuncs + 1, sizeof(VmFunc));
+    m->byName = malloc(sizeof(int) * ((size_t)nFuncs + 1));
+    if (!lf || !m->funcs || !m->byName) abort();
+    int pc = 1, nextStatic = HACK_STATIC;
+    for (int i = 0; i < nCls; i++) {
+        const VmClass *c = cls[i];
+        int nStatics = 0;
+        for (int f = 0; f < c->nFuncs; f++) {
+            const VmFunction *fn = &c->funcs[f];
+            VmFunc *vf = &m->funcs[m->nFuncs];
+            lf[m->nFuncs].cls = c;
+            lf[m->nFuncs].fn = fn;
+            lf[m->nFuncs].staticBase = nextStatic;
+            vf->name = vmStr(c, fn->name);
+            vf->statics = nextStatic;
+            vf->program = clsProgram[i];
+            vf->entry = pc++;
+            vf->nLocals = fn->nLocals;
+            for (int k = 0; k < fn->len; k++) {
+                const VmInstr *in = &fn->code[k];
+                if (in->op != VM_LABEL) pc++;
+                if ((in->op == VM_PUSH || in->op == VM_POP) && in->seg == SEG_STATIC
+                    && in->arg >= nStatics)
+                    nStatics = in->arg + 1;
+            }
+            m->byName[m->nFuncs] = m->nFuncs;
+            m->nFuncs++;
+        }
+        nextStatic += nStatics;
+    }
+    if (nextStatic > HACK_STACK) {
+        snprintf(err, (size_t)errLen, "%d static variables do not fit below the stack",
+                 nextStatic - HACK_STATIC);
+        goto fail;
+    }
+    if (pc > 0xFFFF) {
+        // return addresses are stored in 16-bit RAM words
+        snprintf(err, (size_t)errLen, "program too large (%d instructions)", pc);
+        goto fail;
+    }
+    sortMachine = m;
+    qsort(m->byName, (size_t)m->nFuncs, sizeof(int), cmpFuncNames);
+    for (int i = 1; i < m->nFuncs; i++)
+        if (!strcmp(m->funcs[m->byName[i]].name, m->funcs[m->byName[i - 1]].name)) {
+            snprintf(err, (size_t)errLen, "function %s defined twice", m->funcs[m->byName[i]].name);
+            goto fail;
+        }
+
+    m->entry = vmFindFunc(m, "Sys.init");
+    if (m->entry < 0) m->entry = vmFindFunc(m, "Main.main");
+    if (m->entry < 0) {
+        snprintf(err, (size_t)errLen, "no Sys.init or Main.main");
+        goto fail;
+    }
+
+    // pass 2: decode, with labels resolved per function
+    m->nCode = pc;
+    m->code = calloc((size_t)pc, sizeof(VmInsn));
+    m->branchLabel = calloc((size_t)pc, sizeof(char*));
+    if (!m->code || !m->branchLabel) abort();
+    m->code[0].op = I_HALT;
+    int *labelPc = NULL, labelCap = 0;
+    for (int f = 0; f < m->nFuncs; f++) {
+        const VmClass *c = lf[f].cls;
+        const VmFunction *fn = lf[f].fn;
+        if (c->strLen > labelCap) {
+            labelCap = c->strLen;
+            free(labelPc);
+            labelPc = malloc(sizeof(int) * (size_t)labelCap);
+            if (!labelPc) abort();
+            for (int i = 0; i < labelCap; i++) labelPc[i] = -1;
+        }
+        pc = m->funcs[f].entry + 1;
+        for (int k = 0; k < fn->len; k++) {
+            if (fn->code[k].op == VM_LABEL) labelPc[fn->code[k].sym] = pc;
+            else pc++;
+        }
+
+        pc = m->funcs[f].entry;
+        m->code[pc].op = I_FUNCTION;
+        m->code[pc].a = fn->nLocals;
+        m->code[pc].b = f;
+        pc++;
+        int ok = 1;
+        for (int k = 0; k < fn->len && ok; k++) {
+            if (fn->code[k].op == VM_LABEL) continue;
+            ok = decodeInstr(m, &fn->code[k], c, lf[f].staticBase, labelPc, pc, err, errLen);
+            pc++;
+        }
+        for (int k = 0; k < fn->len; k++)
+            if (fn->code[k].op == VM_LABEL) labelPc[fn->code[k].sym] = -1;
+        if (!ok) {
+            int L = (int)strlen(err);
+            snprintf(err + L, (size_t)(errLen - L), " in %s", m->funcs[f].name);
+            free(labelPc);
+            goto fail;
+        }
+    }
+    free(labelPc);
+    free(lf);
+    free(cls);
+    free(clsProgram);
+    vmAnalyzeStack(m);
+    return m;
+
+fail:
+    free(lf);
+    free(cls);
+    free(clsProgram);
+    vmFreeMachine(m);
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+// execution
+//---------------------------------------------------------------------
+
+void vmPortWrite(VmMachine *m, Word c) {
+    if (c == 128) fputc('\n', m->out);
+    else if (c == 129) fputc('\b', m->out);
+    else fputc(c & 0xFF, m->out);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#if VM_THREADED
+// a superinstruction: its handler and the instructions it runs
+typedef struct {
+    const void *h;
+    int len;
+    int ops[4];
+} VmSuper;
+
+// Point the first instruction of each listed sequence at its handler,
+// the longest match first. Only the first instruction of a sequence may
+// be a jump target or a return address. Pushes and calls that check
+// the stack (m->checkStack) keep their own handler
+static void fuse(VmMachine *m, const VmSuper *supers, int nSupers) {
+    char *entered = calloc((size_t)m->nCode + 1, 1);
+    if (!entered) abort();
+    for (int pc = 0; pc < m->nCode; pc++) {
+        int op = m->code[pc].op;
+        if (op == I_GOTO || op == I_IF_GOTO) entered[m->code[pc].a] = 1;
+        else if (op == I_CALL) entered[pc + 1] = 1;
+    }
+    for (int pc = 0; pc < m->nCode; ) {
+        const VmSuper *best = NULL;
+        for (int i = 0; i < nSupers; i++) {
+            const VmSuper *s = &supers[i];
+            if ((best && s->len <= best->len) || pc + s->len > m->nCode) continue;
+            int k = 0;
+            while (k < s->len && m->code[pc + k].op == s->ops[k] && (k == 0 || !entered[pc + k]) &&
+                   !(m->checkStack && m->checkStack[pc + k])) k++;
+            if (k == s->len) best = s;
+        }
+        if (best) m->code[pc].h = best->h;
+        pc += best ? best->len : 1;
+    }
+    free(entered);
+}
+#endif
+
+int vmRun(VmMachine *m, long long maxInstructions, VmRunStats *st) {
+    Word *ram = m->ram;
+    const VmInsn *code = m->code;
+    long long *counts = m->counts, *taken = m->taken, *executed = m->executed;
+    const char *checkStack = m->checkStack;
+    long long n = 0, calls = 0, fused = 0;
+    long long budget = maxInstructions > 0 ? maxInstructions : LLONG_MAX;
+    int limit = m->stackLimit;
+    int status = RUN_HALTED;
+    Word result;
+
+    // bootstrap: "call entry 0" returning to the HALT at pc 0
+    memset(ram, 0, sizeof(m->ram));
+    m->jitCalls = 0;
+    if (counts) {
+        memset(counts, 0, sizeof(long long) * (size_t)m->nCode);
+        memset(taken, 0, sizeof(long long) * (size_t)m->nCode);
+    }
+    if (executed) memset(executed, 0, sizeof(long long) * (size_t)m->nCode);
+    int sp = HACK_STACK + 5;
+    ram[HACK_ARG] = HACK_STACK;
+    ram[HACK_LCL] = (Word)sp;
+    const VmInsn *ip = code + m->funcs[m->entry].entry;
+    double t0 = now();
+
+#define PUSH(v) do { ram[sp++] = (Word)(v); } while (0)
+#define BINARY(expr) do { sp--; Word y = ram[sp], x = ram[sp - 1]; ram[sp - 1] = (Word)(expr); ip++; } while (0)
+#define POP_PORT(base) do { \
+        int addr = (ram[base] + ip->a) & RAM_MASK; \
+        ram[addr] = ram[--sp]; \
+        if (addr == JACK_OUTPUT_PORT) vmPortWrite(m, ram[addr]); \
+        ip++; \
+    } while (0)
+
+    // the work of one instruction, leaving ip at the next one to run;
+    // a handler is one of these, a superinstruction several in a row
+#define DO_PUSH_CONST  do { PUSH(ip->a); ip++; } while (0)
+#define DO_PUSH_LOCAL  do { PUSH(ram[(ram[HACK_LCL] + ip->a) & RAM_MASK]); ip++; } while (0)
+#define DO_PUSH_ARG    do { PUSH(ram[(ram[HACK_ARG] + ip->a) & RAM_MASK]); ip++; } while (0)
+#define DO_PUSH_THIS   do { PUSH(ram[(ram[HACK_THIS] + ip->a) & RAM_MASK]); ip++; } while (0)
+#define DO_PUSH_THAT   do { PUSH(ram[(ram[HACK_THAT] + ip->a) & RAM_MASK]); ip++; } while (0)
+#define DO_PUSH_ADDR   do { PUSH(ram[ip->a]); ip++; } while (0)
+#define DO_POP_LOCAL   do { ram[(ram[HACK_LCL] + ip->a) & RAM_MASK] = ram[--sp]; ip++; } while (0)
+#define DO_POP_ARG     do { ram[(ram[HACK_ARG] + ip->a) & RAM_MASK] = ram[--sp]; ip++; } while (0)
+#define DO_POP_THIS    POP_PORT(HACK_THIS)
+#define DO_POP_THAT    POP_PORT(HACK_THAT)
+#define DO_POP_ADDR    do { ram[ip->a] = ram[--sp]; ip++; } while (0)
+#define DO_ADD         BINARY(x + y)
+#define DO_SUB         BINARY(x - y)
+#define DO_AND         BINARY(x & y)
+#define DO_OR          BINARY(x | y)
+#define DO_EQ          BINARY(x == y ? 0xFFFF : 0)
+#define DO_GT          BINARY((int16_t)x > (int16_t)y ? 0xFFFF : 0)
+#define DO_LT          BINARY((int16_t)x < (int16_t)y ? 0xFFFF : 0)
+#define DO_NEG         do { ram[sp - 1] = (Word)-ram[sp - 1]; ip++; } while (0)
+#define DO_NOT         do { ram[sp - 1] = (Word)~ram[sp - 1]; ip++; } while (0)
+#define DO_GOTO        do { \
+        if (n >= budget) goto outOfBudget; \
+        ip = code + ip->a; \
+    } while (0)
+#define DO_IF_GOTO     do { \
+        if (n >= budget) goto outOfBudget; \
+        if (counts) { \
+            counts[ip - code]++; \
+            if (ram[sp - 1]) taken[ip - code]++; \
+        } \
+        ip = ram[--sp] ? code + ip->a : ip + 1; \
+    } while (0)
+
+#if VM_THREADED
+    static const void *handlers[I_COUNT] = {
+        &&L_I_HALT,
+        &&L_I_PUSH_CONST, &&L_I_PUSH_LOCAL, &&L_I_PUSH_ARG, &&L_I_PUSH_THIS, &&L_I_PUSH_THAT, &&L_I_PUSH_ADDR,
+        &&L_I_POP_LOCAL, &&L_I_POP_ARG, &&L_I_POP_THIS, &&L_I_POP_THAT, &&L_I_POP_ADDR,
+        &&L_I_ADD, &&L_I_SUB, &&L_I_NEG, &&L_I_EQ, &&L_I_GT, &&L_I_LT, &&L_I_AND, &&L_I_OR, &&L_I_NOT,
+        &&L_I_GOTO, &&L_I_IF_GOTO,
+        &&L_I_CALL, &&L_I_FUNCTION, &&L_I_RETURN,
+        &&L_I_NATIVE
+    };
+    static const VmSuper supers[] = {
+#define SUPER2(x, y)       { &&S_##x##_##y, 2, { I_##x, I_##y } },
+#define SUPER3(x, y, z)    { &&S_##x##_##y##_##z, 3, { I_##x, I_##y, I_##z } },
+#define SUPER4(x, y, z, w) { &&S_##x##_##y##_##z##_##w, 4, { I_##x, I_##y, I_##z, I_##w } },
+#include "vmsuper.h"
+#undef SUPER2
+#undef SUPER3
+#undef SUPER4
+    };
+    if (!m->threaded) {
+        for (int i = 0; i < m->nCode; i++)
+            m->code[i].h = m->executed ? &&L_TRACE :
+                           checkStack && checkStack[i] ? &&L_CHECK : handlers[m->code[i].op];
+        if (m->superinstructions && !m->executed)
+            fuse(m, supers, (int)(sizeof(supers) / sizeof(supers[0])));
+        m->threaded = 1;
+    }
+#define CASE(x) L_##x
+#define NEXT    do { n++; goto *ip->h; } while (0)
+    NEXT;
+
+L_TRACE:
+    executed[ip - code]++;
+    if (checkStack && checkStack[ip - code]) goto L_CHECK;
+    goto *handlers[ip->op];
+
+    // an instruction of a function with no bound on its stack
+L_CHECK:
+    if (sp + checkStack[ip - code] > limit) goto overflow;
+    goto *handlers[ip->op];
+
+    // n counts every instruction of a superinstruction, as if run one by one
+#define SUPER2(x, y)       S_##x##_##y: DO_##x; n++; DO_##y; fused += 1; NEXT;
+#define SUPER3(x, y, z)    S_##x##_##y##_##z: DO_##x; n++; DO_##y; n++; DO_##z; fused += 2; NEXT;
+#define SUPER4(x, y, z, w) S_##x##_##y##_##z##_##w: DO_##x; n++; DO_##y; n++; DO_##z; n++; DO_##w; fused += 3; NEXT;
+#include "vmsuper.h"
+#undef SUPER2
+#undef SUPER3
+#undef SUPER4
+#else
+#define CASE(x) case x
+#define NEXT    do { n++; goto dispatch; } while (0)
+    n++;
+dispatch:
+    if (executed) executed[ip - code]++;
+    if (checkStack && sp + checkStack[ip - code] > limit) goto overflow;
+    switch (ip->op) {
+#endif
+
+    CASE(I_PUSH_CONST): DO_PUSH_CONST; NEXT;
+    CASE(I_PUSH_LOCAL): DO_PUSH_LOCAL; NEXT;
+    CASE(I_PUSH_ARG):   DO_PUSH_ARG; NEXT;
+    CASE(I_PUSH_THIS):  DO_PUSH_THIS; NEXT;
+    CASE(I_PUSH_THAT):  DO_PUSH_THAT; NEXT;
+    CASE(I_PUSH_ADDR):  DO_PUSH_ADDR; NEXT;
+
+    CASE(I_POP_LOCAL):  DO_POP_LOCAL; NEXT;
+    CASE(I_POP_ARG):    DO_POP_ARG; NEXT;
+    CASE(I_POP_THIS):   DO_POP_THIS; NEXT;
+    CASE(I_POP_THAT):   DO_POP_THAT; NEXT;
+    CASE(I_POP_ADDR):   DO_POP_ADDR; NEXT;
+
+    CASE(I_ADD): DO_ADD; NEXT;
+    CASE(I_SUB): DO_SUB; NEXT;
+    CASE(I_AND): DO_AND; NEXT;
+    CASE(I_OR):  DO_OR; NEXT;
+    CASE(I_EQ):  DO_EQ; NEXT;
+    CASE(I_GT):  DO_GT; NEXT;
+    CASE(I_LT):  DO_LT; NEXT;
+    CASE(I_NEG): DO_NEG; NEXT;
+    CASE(I_NOT): DO_NOT; NEXT;
+
+    CASE(I_GOTO):    DO_GOTO; NEXT;
+    CASE(I_IF_GOTO): DO_IF_GOTO; NEXT;
+    CASE(I_CALL): {
+        if (n >= budget) goto outOfBudget;
+        ram[sp] = (Word)(ip + 1 - code);
+        ram[sp + 1] = ram[HACK_LCL];
+        ram[sp + 2] = ram[HACK_ARG];
+        ram[sp + 3] = ram[HACK_THIS];
+        ram[sp + 4] = ram[HACK_THAT];
+        sp += 5;
+        ram[HACK_ARG] = (Word)(sp - 5 - ip->b);
+        ram[HACK_LCL] = (Word)sp;
+        calls++;
+        ip = code + ip->a;
+        NEXT;
+    }
+    CASE(I_FUNCTION): {
+        int k = ip->a;
+        if (counts) counts[ip - code]++;
+        // a bound OS routine returns at once, as if its body had run
+        if (m->funcs[ip->b].intrinsic && vmRunIntrinsic(m, ip->b, &result)) goto leave;
+        if (sp + m->funcs[ip->b].frame > limit) goto overflow;
+        while (k-- > 0) ram[sp++] = 0;
+        ip++;
+        NEXT;
+    }
+    CASE(I_RETURN):
+        result = ram[sp - 1];
+    leave: {
+        int frame = ram[HACK_LCL];
+        int ret = ram[(frame - 5) & RAM_MASK];
+        int arg = ram[HACK_ARG];
+        // a program that overwrote ARG (RAM[2]) would store the result and
+        // go on pushing outside the stack: stop as an overflow instead
+        if (arg < HACK_STACK || arg >= limit) goto overflow;
+        ram[arg] = result;
+        sp = arg + 1;
+        ram[HACK_THAT] = ram[(frame - 1) & RAM_MASK];
+        ram[HACK_THIS] = ram[(frame - 2) & RAM_MASK];
+        ram[HACK_ARG] = ram[(frame - 3) & RAM_MASK];
+        ram[HACK_LCL] = ram[(frame - 4) & RAM_MASK];
+        ip = code + (ret < m->nCode ? ret : 0);
+        NEXT;
+    }
+
+    CASE(I_NATIVE): {
+        // the caller has built the frame; native code runs the body and
+        // the return sequence and hands back the return address
+        ram[HACK_SP] = (Word)sp;
+        m->fuel = budget - n;
+        long long before = m->fuel;
+        int r = jitEnter(m, m->funcs[ip->b].native);
+        n += before - m->fuel - 1;   // the native entry block counts this instruction again
+        fused += before - m->fuel - 1;
+        sp = ram[HACK_SP];
+        if (r == JIT_HALTED) goto done;
+        if (r == JIT_LIMIT) goto outOfBudget;
+        if (r == JIT_OVERFLOW) goto overflow;
+        ip = code + (r < m->nCode ? r : 0);
+        NEXT;
+    }
+
+    CASE(I_HALT):
+        goto done;
+
+#if !VM_THREADED
+    default:
+        goto done;
+    }
+#endif
+
+overflow:
+    status = RUN_STACK_OVERFLOW;
+    goto done;
+outOfBudget:
+    status = RUN_LIMIT;
+done:
+    ram[HACK_SP] = (Word)sp;
+    fflush(m->out);
+    if (st) {
+        st->instructions = n;
+        st->dispatches = n - fused;
+        st->calls = calls + m->jitCalls;
+        st->seconds = now() - t0;
+        st->status = status;
+    }
+    return status;
+
+#undef PUSH
+#undef BINARY
+#undef POP_PORT
+#undef CASE
+#undef NEXT
+}
+
+//---------------------------------------------------------------------
+// profiles
+//---------------------------------------------------------------------
+
+void vmEnableProfile(VmMachine *m) {
+    if (m->counts) return;
+    m->counts = calloc((size_t)m->nCode, sizeof(long long));
+    m->taken = calloc((size_t)m->nCode, sizeof(long long));
+    if (!m->counts || !m->taken) abort();
+}
+
+void vmEnableTrace(VmMachine *m) {
+    if (m->executed) return;
+    m->executed = calloc((size_t)m->nCode, sizeof(long long));
+    if (!m->executed) abort();
+    m->threaded = 0;
+}
+
+void vmWriteProfile(const VmMachine *m, FILE *f) {
+    fprintf(f, "jackprof 1\n");
+    for (int i = 0; i < m->nFuncs; i++) {
+        int entry = m->funcs[i].entry;
+        int end = i + 1 < m->nFuncs ? m->funcs[i + 1].entry : m->nCode;
+        fprintf(f, "function %s %lld\n", m->funcs[i].name, m->counts ? m->counts[entry] : 0);
+        for (int pc = entry + 1; pc < end; pc++)
+            if (m->code[pc].op == I_IF_GOTO)
+                fprintf(f, "branch %s %s %lld %lld\n", m->funcs[i].name, m->branchLabel[pc],
+                        m->counts ? m->counts[pc] : 0, m->taken ? m->taken[pc] : 0);
+    }
+}
+
+//---------------------------------------------------------------------
+// loading programs from disk
+//---------------------------------------------------------------------
+
+static int cmpStrings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+VmProgram* vmLoadDirectory(const char *dir, char *err, int errLen) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        snprintf(err, (size_t)errLen, "cannot open directory %s", dir);
+        return NULL;
+    }
+    char **names = NULL;
+    int nNames = 0, capNames = 0, jack = 0, binary = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t L = strlen(e->d_name);
+        if (L > 5 && !strcmp(e->d_name + L - 5, ".jack")) jack = 1;
+        if (L > 4 && !strcmp(e->d_name + L - 4, ".vmb")) binary = 1;
+        if ((L > 3 && !strcmp(e->d_name + L - 3, ".vm")) || (L > 4 && !strcmp(e->d_name + L - 4, ".vmb"))) {
+            if (nNames == capNames) {
+                capNames = capNames ? capNames * 2 : 16;
+                names = realloc(names, sizeof(char*) * (size_t)capNames);
+                if (!names) abort();
+            }
+            names[nNames++] = strdup(e->d_name);
+        }
+    }
+    closedir(d);
+
+    VmProgram *p = NULL;
+    if (jack) {
+        ParserInfo pi = compile(dir);
+        if (pi.er != none)
+            snprintf(err, (size_t)errLen, "%s: error %d at \"%s\" line %d",
+                     dir, pi.er, pi.tk.lx, pi.tk.ln);
+        else
+            p = TakeCompiledProgram();
+    }
+    else {
+        // bytecode files when there are any, the text ones otherwise
+        if (nNames) qsort(names, (size_t)nNames, sizeof(char*), cmpStrings);
+        p = vmNewProgram();
+        for (int i = 0; i < nNames && p; i++) {
+            char path[512];
+            size_t L = strlen(names[i]);
+            int isBinary = names[i][L - 1] == 'b';
+            if (isBinary != binary) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+            if (isBinary) {
+                VmClass *c = vmMapClassBinary(path, err, errLen);
+                if (c) vmAddClass(p, c);
+                else {
+                    vmFreeProgram(p);
+                    p = NULL;
+                }
+                continue;
+            }
+            FILE *f = fopen(path, "r");
+            if (!f) {
+                snprintf(err, (size_t)errLen, "cannot read %s", path);
+                vmFreeProgram(p);
+                p = NULL;
+                break;
+            }
+            names[i][L - 3] = '\0';
+            VmClass *c = vmReadClass(f, names[i], err, errLen);
+            fclose(f);
+            if (c) vmAddClass(p, c);
+            else {
+                vmFreeProgram(p);
+                p = NULL;
+            }
+        }
+    }
+    for (int i = 0; i < nNames; i++)
+        free(names[i]);
+    free(names);
+    return p;
+}
+
+#ifdef TEST_VMINTERP
+static const char *statusNames[] = { "halted", "instruction limit", "stack overflow" };
+
+static void printStats(const char *what, const VmRunStats *st) {
+    fprintf(stderr, "\n%s: %s after %lld instructions (%lld dispatches), %lld calls, %.3f s (%.1f M instr/s)\n",
+            what, statusNames[st->status], st->instructions, st->dispatches, st->calls, st->seconds,
+            st->seconds > 0 ? st->instructions / st->seconds / 1e6 : 0.0);
+}
+
+// read all of a temporary output file back
+static char* slurp(FILE *f, long *len) {
+    *len = ftell(f);
+    char *s = malloc((size_t)*len + 1);
+    if (!s) abort();
+    rewind(f);
+    *len = (long)fread(s, 1, (size_t)*len, f);
+    return s;
+}
+
+// Run plainly interpreted and then with the JIT or the intrinsics (what,
+// switched on by enable); the status must match, and for a program that
+// halted also the console output and RAM except the dead part of the
+// stack. The JIT must also keep the counters and the temp segment.
+// Native code checks the stack per function and the budget per block, so
+// runs that hit either stop at other points
+static int checkAgainst(VmMachine *m, long long max, const char *what,
+                        int (*enable)(VmMachine *m, FILE *log), int exact) {
+    static Word ram[HACK_RAM_SIZE];
+    VmRunStats a, b;
+    long lenA, lenB;
+    FILE *outA = tmpfile(), *outB = tmpfile();
+    if (!outA || !outB) return 0;
+
+    m->out = outA;
+    vmRun(m, max, &a);
+    memcpy(ram, m->ram, sizeof(ram));
+    if (enable(m, NULL) < 0) return 0;
+    m->out = outB;
+    vmRun(m, max, &b);
+    m->out = stdout;
+
+    char *textA = slurp(outA, &lenA), *textB = slurp(outB, &lenB);
+    fwrite(textA, 1, (size_t)lenA, stdout);
+    fflush(stdout);
+    printStats("interpreter", &a);
+    printStats(what, &b);
+    int ok = a.status == b.status;
+    if (!ok) fprintf(stderr, "%s check: status differs\n", what);
+    if (a.status != RUN_HALTED) lenA = lenB = 0;
+    if (lenA != lenB || memcmp(textA, textB, (size_t)lenA)) {
+        fprintf(stderr, "%s check: output differs\n", what);
+        ok = 0;
+    }
+    if (exact && a.status == RUN_HALTED && (a.instructions != b.instructions || a.calls != b.calls)) {
+        fprintf(stderr, "%s check: counters differ\n", what);
+        ok = 0;
+    }
+    for (int i = 0; i < HACK_RAM_SIZE && a.status == RUN_HALTED; i++) {
+        if (i >= ram[HACK_SP] && i < HACK_HEAP) continue;
+        if (!exact && i >= HACK_TEMP && i < HACK_TEMP + 8) continue;
+        if (ram[i] != m->ram[i]) {
+            fprintf(stderr, "%s check: RAM[%d] = %d, interpreter has %d\n", what, i, m->ram[i], ram[i]);
+            ok = 0;
+            break;
+        }
+    }
+    fprintf(stderr, "%s check: %s\n", what, ok ? "ok" : "FAILED");
+    free(textA);
+    free(textB);
+    fclose(outA);
+    fclose(outB);
+    return ok;
+}
+
+// words of the size-class heap (heap.c) after a run
+static void printHeapStats(const VmMachine *m) {
+    int f = vmFindFunc(m, HEAP_MARKER);
+    if (f < 0) {
+        fprintf(stderr, "heap: no size-class Memory (compile with -sizeheap)\n");
+        return;
+    }
+    const Word *ram = m->ram;
+    int statics = m->funcs[f].statics, stats = ram[statics + 2], top = (int16_t)ram[statics + 3];
+    if (!stats) {
+        fprintf(stderr, "heap: Memory.init never ran\n");
+        return;
+    }
+    #define STAT(i) ((long)(int16_t)ram[stats + (i)])
+    long allocs = STAT(HEAP_ALLOCS_10K) * 10000 + STAT(HEAP_ALLOCS);
+    long frees = STAT(HEAP_FREES_10K) * 10000 + STAT(HEAP_FREES);
+    long used = top - (stats + HEAP_STATS), live = STAT(HEAP_LIVE_WORDS), freeWords = STAT(HEAP_FREE_WORDS);
+    long rounding = live - STAT(HEAP_LIVE_BLOCKS) - STAT(HEAP_REQUESTED_WORDS);
+    fprintf(stderr, "heap: %ld allocations, %ld frees, %ld live blocks of %ld words (peak %ld)\n",
+            allocs, frees, STAT(HEAP_LIVE_BLOCKS), live, STAT(HEAP_PEAK_WORDS));
+    fprintf(stderr, "heap: %ld words headers, %ld rounding up to the class (%.1f%% of live)\n",
+            STAT(HEAP_LIVE_BLOCKS), rounding, live ? 100.0 * (double)rounding / (double)live : 0.0);
+    fprintf(stderr, "heap: %ld words free on the lists (%.1f%% of the %ld cut), %ld lost, %d untouched\n",
+            freeWords, used ? 100.0 * (double)freeWords / (double)used : 0.0, used,
+            STAT(HEAP_LOST_WORDS), HACK_SCREEN - top);
+    #undef STAT
+}
+
+// usage: vmrun [-os DIR|-noos] [-max N] [-O0] [-nosuper] [-sizeheap] [-heapstats] [-stackinfo]
+//              [-jit|-jitcheck] [-intrinsics|-intrinsicscheck] [-v] [-genprofile FILE] [-useprofile FILE] DIR
+// DIR holds .jack files (compiled first), .vmb or .vm files; the OS stub is
+// linked in from ./os unless the program brings all classes itself.
+// -genprofile interprets a build without inlining, so every call is
+// counted, and writes the counts; -useprofile compiles with them.
+// -nosuper dispatches every instruction on its own; -intrinsics runs the
+// OS routines of intrinsics.c in C; -sizeheap compiles with the Memory of
+// heap.c and -heapstats reports its statistics after the run; -stackinfo
+// lists the stack use of every function (vmstack.c) before it
+int main(int argc, char **argv) {
+    const char *dir = NULL, *osDir = "os", *genProfile = NULL;
+    long long max = 0;
+    int jit = 0, check = 0, verbose = 0, super = 1, intrinsics = 0, checkIntrinsics = 0, heapStats = 0;
+    int stackInfo = 0;
+    Profile *prof = NULL;
+    char err[256];
+
+    InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-os") && i + 1 < argc) osDir = argv[++i];
+        else if (!strcmp(argv[i], "-noos")) osDir = NULL;
+        else if (!strcmp(argv[i], "-max") && i + 1 < argc) max = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-O0")) {
+            optOptions.fold = optOptions.strength = optOptions.dce = 0;
+            optOptions.inlineThreshold = optOptions.ir = 0;
+        }
+        else if (!strcmp(argv[i], "-noarrays")) optOptions.arrays = 0;
+        else if (!strcmp(argv[i], "-strpool")) optOptions.stringPool = 1;
+        else if (!strcmp(argv[i], "-nosuper")) super = 0;
+        else if (!strcmp(argv[i], "-sizeheap")) optOptions.sizeClassHeap = 1;
+        else if (!strcmp(argv[i], "-heapstats")) heapStats = 1;
+        else if (!strcmp(argv[i], "-stackinfo")) stackInfo = 1;
+        else if (!strcmp(argv[i], "-jit")) jit = 1;
+        else if (!strcmp(argv[i], "-jitcheck")) check = 1;
+        else if (!strcmp(argv[i], "-intrinsics")) intrinsics = 1;
+        else if (!strcmp(argv[i], "-intrinsicscheck")) checkIntrinsics = 1;
+        else if (!strcmp(argv[i], "-v")) verbose = 1;
+        else if (!strcmp(argv[i], "-genprofile") && i + 1 < argc) genProfile = argv[++i];
+        else if (!strcmp(argv[i], "-useprofile") && i + 1 < argc) {
+            freeProfile(prof);
+            if (!(prof = loadProfile(argv[++i], err, sizeof(err)))) {
+                fprintf(stderr, "%s\n", err);
+                return 1;
+            }
+        }
+        else dir = argv[i];
+    }
+    if (!dir) {
+        fprintf(stderr, "usage: vmrun [-os DIR|-noos] [-max N] [-O0] [-noarrays] [-strpool] [-nosuper] [-sizeheap]\n"
+                        "             [-heapstats] [-stackinfo] [-jit|-jitcheck] [-intrinsics|-intrinsicscheck] [-v] [-genprofile FILE] [-useprofile FILE] DIR\n");
+        return 2;
+    }
+    optOptions.profile = prof;
+    if (genProfile) {
+        optOptions.inlineThreshold = 0;
+        jit = check = intrinsics = checkIntrinsics = 0;
+    }
+
+    VmProgram *progs[2];
+    int nProgs = 0;
+    if (!(progs[nProgs++] = vmLoadDirectory(dir, err, sizeof(err)))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    if (osDir) {
+        if (!(progs[nProgs++] = vmLoadDirectory(osDir, err, sizeof(err)))) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+    }
+    VmMachine *m = vmLoad(progs, nProgs, err, sizeof(err));
+    if (!m) {
+        fprintf(stderr, "link error: %s\n", err);
+        return 1;
+    }
+    m->superinstructions = super;
+    if (stackInfo) vmPrintStackInfo(m, stderr);
+
+    int rc;
+    if (check) rc = checkAgainst(m, max, "jit", vmEnableJit, 1) ? 0 : 3;
+    else if (checkIntrinsics) rc = checkAgainst(m, max, "intrinsics", vmEnableIntrinsics, 0) ? 0 : 3;
+    else {
+        VmRunStats st;
+        if (intrinsics) vmEnableIntrinsics(m, verbose ? stderr : NULL);
+        if (jit && vmEnableJit(m, verbose ? stderr : NULL) < 0)
+            fprintf(stderr, "no JIT here, interpreting\n");
+        if (genProfile) vmEnableProfile(m);
+        vmRun(m, max, &st);
+        printStats(m->jit ? "jit" : "interpreter", &st);
+        if (heapStats) printHeapStats(m);
+        rc = st.status == RUN_HALTED ? 0 : 3;
+        if (genProfile) {
+            FILE *f = fopen(genProfile, "w");
+            if (f) {
+                vmWriteProfile(m, f);
+                fclose(f);
+            } else {
+                fprintf(stderr, "cannot write %s\n", genProfile);
+                rc = 1;
+            }
+        }
+    }
+
+    vmFreeMachine(m);
+    for (int i = 0; i < nProgs; i++)
+        vmFreeProgram(progs[i]);
+    StopCompiler();
+    freeProfile(prof);
+    return rc;
+}
+#endif
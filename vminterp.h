@@ -0,0 +1,109 @@
+#ifndef VMINTERP_H
+#define VMINTERP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+#include "jackos.h"
+
+// Interpreter for linked VM programs.
+// Code is pre-decoded into one flat array with labels and call targets
+// resolved to instruction indices; RAM is the flat 32K-word Hack memory
+// with the standard segment registers in RAM[0..4].
+
+typedef uint16_t Word;
+
+// decoded instruction set
+typedef enum {
+    I_HALT,
+    I_PUSH_CONST, I_PUSH_LOCAL, I_PUSH_ARG, I_PUSH_THIS, I_PUSH_THAT, I_PUSH_ADDR,
+    I_POP_LOCAL, I_POP_ARG, I_POP_THIS, I_POP_THAT, I_POP_ADDR,
+    I_ADD, I_SUB, I_NEG, I_EQ, I_GT, I_LT, I_AND, I_OR, I_NOT,
+    I_GOTO, I_IF_GOTO,
+    I_CALL, I_FUNCTION, I_RETURN,
+    I_NATIVE,        // I_FUNCTION of a function compiled by the JIT (jit.c)
+    I_COUNT
+} VmInsnOp;
+
+typedef struct {
+    const void *h;   // handler address when dispatch is direct-threaded
+    int op;          // VmInsnOp
+    int a;           // constant, segment index, absolute address or target pc
+    int b;           // I_CALL: argument count; I_FUNCTION: function index
+} VmInsn;
+
+typedef struct {
+    const char *name;  // "Class.sub"
+    int entry;         // pc of its I_FUNCTION
+    int nLocals;
+    const void *native;  // JIT code, NULL if interpreted
+    int statics;       // address of static 0 of its class
+    int program;       // index of its program in the list given to vmLoad
+    int intrinsic;     // native OS routine run instead (intrinsics.c), 0 = none
+    int maxStack;      // operand stack words of the body, its call frames included (vmstack.c); -1 unbounded
+    int frame;         // words checked for on entry: nLocals + maxStack
+    int maxDepth;      // stack words of the function and the calls below it; -1 recursive or unbounded
+} VmFunc;
+
+typedef enum {
+    RUN_HALTED,        // Sys.halt (an empty infinite loop) or the entry returned
+    RUN_LIMIT,         // instruction budget used up
+    RUN_STACK_OVERFLOW
+} VmRunStatus;
+
+typedef struct {
+    long long instructions;
+    long long dispatches;  // handlers the interpreter jumped to: instructions less the fused ones
+    long long calls;
+    double seconds;
+    int status;        // VmRunStatus
+} VmRunStats;
+
+typedef struct {
+    Word ram[HACK_RAM_SIZE];
+    VmInsn *code;
+    int nCode;
+    VmFunc *funcs;
+    int nFuncs;
+    int *byName;       // function indices sorted by name
+    int nPrograms;     // programs linked: the last is the OS by convention
+    int entry;         // function started by vmRun (Sys.init, else Main.main)
+    int stackLimit;    // pushes at or above this address are an overflow
+    char *checkStack;  // per pc: words a push or call of a function vmstack.c could not bound must check for; NULL if none
+    int threaded;      // code[].h filled in
+    int superinstructions;  // fuse the sequences of vmsuper.h (direct threading only), default on
+    FILE *out;         // receives the console port output
+    long long *counts;     // profiling: runs of each I_FUNCTION / I_IF_GOTO, NULL = off
+    long long *taken;      // profiling: taken jumps of each I_IF_GOTO
+    const char **branchLabel;  // target label of each I_IF_GOTO, for the profile
+    long long *executed;   // tracing: runs of every instruction, NULL = off
+    struct JitCode *jit;   // native code of the JIT, NULL when off
+    long long fuel;        // instruction budget left while in native code
+    long long jitCalls;    // calls made by native code
+} VmMachine;
+
+// Link the classes of several programs (e.g. the OS stub and a user
+// program) into one machine; NULL with a message in err on failure
+VmMachine* vmLoad(VmProgram **progs, int nProgs, char *err, int errLen);
+void vmFreeMachine(VmMachine *m);
+// function index by name, -1 if absent
+int vmFindFunc(const VmMachine *m, const char *name);
+// Reset RAM, call the entry function and run until it halts or
+// maxInstructions (<= 0: no limit) have executed
+int vmRun(VmMachine *m, long long maxInstructions, VmRunStats *st);
+// Count function entries and branches from now on (interpreted code only)
+void vmEnableProfile(VmMachine *m);
+// Count the runs of every instruction from now on (interpreted code only,
+// unfused), for the n-gram profiles of vmngram.c
+void vmEnableTrace(VmMachine *m);
+// Write the counts of the last run in the format read by pgo.c
+void vmWriteProfile(const VmMachine *m, FILE *f);
+// Print character c written to the console port
+void vmPortWrite(VmMachine *m, Word c);
+
+// Load a directory: compile its .jack files, or read its .vmb bytecode
+// (or else .vm text) files if it has no Jack sources. NULL with a
+// message in err on failure
+VmProgram* vmLoadDirectory(const char *dir, char *err, int errLen);
+
+#endif
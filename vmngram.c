@@ -0,0 +1,304 @@
+// vmngram.c
+/************************************************************************
+ Instruction n-gram profiles of a corpus of programs
+
+ Each program is linked with the OS and run with every instruction
+ counted (vmEnableTrace). A sequence of 2 to 4 decoded instructions that
+ control can only enter at its first one runs as often as that first
+ one, and as a superinstruction would save (length - 1) dispatches per
+ run. With -static every occurrence counts once instead.
+
+ -header K picks K sequences greedily, each time the one saving the most
+ dispatches on the corpus together with those already picked (fused the
+ way vminterp.c fuses them, the longest match first), and prints them as
+ the vmsuper.h list. Branches can only end a sequence; calls, returns
+ and function entries are never part of one.
+
+ Built like vmrun but with -DTEST_VMNGRAM instead of -DTEST_VMINTERP.
+*************************************************************************/
+#include "vminterp.h"
+#include "compiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TEST_VMNGRAM
+
+#define MAX_GRAM 4
+#define CANDIDATES 48   // best single sequences the greedy choice looks at
+
+// VmInsnOp names as vmsuper.h spells them, in enum order
+static const char *opNames[I_COUNT] = {
+    "HALT",
+    "PUSH_CONST", "PUSH_LOCAL", "PUSH_ARG", "PUSH_THIS", "PUSH_THAT", "PUSH_ADDR",
+    "POP_LOCAL", "POP_ARG", "POP_THIS", "POP_THAT", "POP_ADDR",
+    "ADD", "SUB", "NEG", "EQ", "GT", "LT", "AND", "OR", "NOT",
+    "GOTO", "IF_GOTO",
+    "CALL", "FUNCTION", "RETURN",
+    "NATIVE"
+};
+
+typedef struct {
+    int len, ops[MAX_GRAM];
+    long long count;
+} Gram;
+
+static Gram *grams;             // open addressing, len 0 = empty
+static int nGrams, capGrams;
+
+// the instructions of the whole corpus, programs one after another
+static int *ops, nOps, capOps;
+static long long *weight;       // runs of each instruction (1 with -static)
+static char *entered;           // jump target or return address
+static long long total;         // dispatches of the corpus, unfused
+
+static unsigned hashGram(const int *o, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned)o[i]) * 16777619u;
+    return h;
+}
+
+static void addGram(const int *o, int len, long long count);
+
+static void growGrams(void) {
+    Gram *old = grams;
+    int oldCap = capGrams;
+    capGrams = capGrams ? capGrams * 2 : 1024;
+    grams = calloc((size_t)capGrams, sizeof(Gram));
+    if (!grams) abort();
+    nGrams = 0;
+    for (int i = 0; i < oldCap; i++)
+        if (old[i].len) addGram(old[i].ops, old[i].len, old[i].count);
+    free(old);
+}
+
+static void addGram(const int *o, int len, long long count) {
+    if ((nGrams + 1) * 2 > capGrams) growGrams();
+    unsigned k = hashGram(o, len) & (unsigned)(capGrams - 1);
+    while (grams[k].len) {
+        if (grams[k].len == len && !memcmp(grams[k].ops, o, sizeof(int) * (size_t)len)) {
+            grams[k].count += count;
+            return;
+        }
+        k = (k + 1) & (unsigned)(capGrams - 1);
+    }
+    grams[k].len = len;
+    memcpy(grams[k].ops, o, sizeof(int) * (size_t)len);
+    grams[k].count = count;
+    nGrams++;
+}
+
+// op can be instruction k of a sequence of len
+static int fusable(int op, int k, int len) {
+    switch (op) {
+        case I_HALT: case I_CALL: case I_FUNCTION: case I_RETURN: case I_NATIVE:
+            return 0;
+        case I_GOTO: case I_IF_GOTO:
+            return k == len - 1;
+    }
+    return 1;
+}
+
+// length of the sequence g matched at pc of the corpus, 0 if none
+static int matches(const Gram *g, int pc) {
+    if (pc + g->len > nOps) return 0;
+    for (int k = 0; k < g->len; k++)
+        if (ops[pc + k] != g->ops[k] || (k > 0 && entered[pc + k])) return 0;
+    return g->len;
+}
+
+// append the code of m and its counts to the corpus
+static void addMachine(const VmMachine *m, int isStatic) {
+    if (nOps + m->nCode > capOps) {
+        while (nOps + m->nCode > capOps) capOps = capOps ? capOps * 2 : 65536;
+        ops = realloc(ops, sizeof(int) * (size_t)capOps);
+        weight = realloc(weight, sizeof(long long) * (size_t)capOps);
+        entered = realloc(entered, (size_t)capOps);
+        if (!ops || !weight || !entered) abort();
+    }
+    int base = nOps;
+    for (int pc = 0; pc < m->nCode; pc++) {
+        ops[base + pc] = m->code[pc].op;
+        weight[base + pc] = isStatic ? 1 : m->executed[pc];
+        entered[base + pc] = 0;
+        total += weight[base + pc];
+    }
+    for (int pc = 0; pc < m->nCode; pc++) {
+        int op = m->code[pc].op;
+        if (op == I_GOTO || op == I_IF_GOTO) entered[base + m->code[pc].a] = 1;
+        else if (op == I_CALL && pc + 1 < m->nCode) entered[base + pc + 1] = 1;
+    }
+    nOps += m->nCode;
+    for (int pc = base; pc < nOps; pc++) {
+        if (!weight[pc]) continue;
+        for (int len = 2; len <= MAX_GRAM && pc + len <= nOps; len++) {
+            int k = 0;
+            while (k < len && fusable(ops[pc + k], k, len) && (k == 0 || !entered[pc + k])) k++;
+            if (k < len) break;
+            addGram(&ops[pc], len, weight[pc]);
+        }
+    }
+}
+
+static long long saving(const Gram *g) {
+    return g->count * (g->len - 1);
+}
+
+static int bySaving(const void *a, const void *b) {
+    long long x = saving(a), y = saving(b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// dispatches saved on the corpus by the sequences sel
+static long long savedBy(Gram **sel, int nSel) {
+    long long saved = 0;
+    for (int pc = 0; pc < nOps; ) {
+        int best = 0;
+        if (weight[pc])
+            for (int i = 0; i < nSel; i++) {
+                int len = matches(sel[i], pc);
+                if (len > best) best = len;
+            }
+        if (best) saved += weight[pc] * (best - 1);
+        pc += best ? best : 1;
+    }
+    return saved;
+}
+
+static void printGram(FILE *f, const Gram *g, const char *sep) {
+    for (int k = 0; k < g->len; k++)
+        fprintf(f, "%s%s", k ? sep : "", opNames[g->ops[k]]);
+}
+
+static void printHeader(Gram **sel, int nSel, long long saved, int argc, char **argv) {
+    printf("// vmsuper.h\n");
+    printf("/************************************************************************\n");
+    printf(" Superinstructions of vminterp.c, generated by vmngram.c:\n  vmngram");
+    for (int i = 1; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf("\n\n");
+    printf(" SUPERn(...) names n instructions run with one dispatch. They save\n");
+    printf(" %lld of the %lld dispatches of that corpus (%.1f%%).\n",
+           saved, total, total ? 100.0 * (double)saved / (double)total : 0.0);
+    printf("*************************************************************************/\n");
+    for (int i = 0; i < nSel; i++) {
+        printf("SUPER%d(", sel[i]->len);
+        printGram(stdout, sel[i], ", ");
+        printf(")\n");
+    }
+}
+
+// usage: vmngram [-os DIR|-noos] [-max N] [-static] [-top K] [-header K] DIR...
+// prints the K (default 30) sequences saving the most dispatches, or
+// with -header the K chosen as superinstructions in vmsuper.h form
+int main(int argc, char **argv) {
+    const char *osDir = "os";
+    long long max = 0;
+    int isStatic = 0, top = 30, header = 0, nDirs = 0;
+    VmProgram *os = NULL;
+    char err[256];
+
+    InitCompiler();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-os") && i + 1 < argc) osDir = argv[++i];
+        else if (!strcmp(argv[i], "-noos")) osDir = NULL;
+        else if (!strcmp(argv[i], "-max") && i + 1 < argc) max = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-static")) isStatic = 1;
+        else if (!strcmp(argv[i], "-top") && i + 1 < argc) top = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-header") && i + 1 < argc) header = atoi(argv[++i]);
+        else nDirs++;
+    }
+    if (!nDirs) {
+        fprintf(stderr, "usage: vmngram [-os DIR|-noos] [-max N] [-static] [-top K] [-header K] DIR...\n");
+        return 2;
+    }
+    if (osDir && !(os = vmLoadDirectory(osDir, err, sizeof(err)))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    FILE *sink = tmpfile();
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (!strcmp(a, "-os") || !strcmp(a, "-max") || !strcmp(a, "-top") || !strcmp(a, "-header")) {
+            i++;
+            continue;
+        }
+        if (a[0] == '-') continue;
+        VmProgram *progs[2];
+        int nProgs = 0;
+        if (!(progs[nProgs++] = vmLoadDirectory(a, err, sizeof(err)))) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        if (os) progs[nProgs++] = os;
+        VmMachine *m = vmLoad(progs, nProgs, err, sizeof(err));
+        if (!m) {
+            fprintf(stderr, "%s: link error: %s\n", a, err);
+            return 1;
+        }
+        VmRunStats st;
+        if (sink) m->out = sink;
+        if (!isStatic) {
+            vmEnableTrace(m);
+            vmRun(m, max, &st);
+            fprintf(stderr, "%s: %lld instructions\n", a, st.instructions);
+        }
+        addMachine(m, isStatic);
+        vmFreeMachine(m);
+        vmFreeProgram(progs[0]);
+    }
+
+    Gram *sorted = malloc(sizeof(Gram) * ((size_t)nGrams + 1));
+    if (!sorted) abort();
+    int n = 0;
+    for (int i = 0; i < capGrams; i++)
+        if (grams[i].len) sorted[n++] = grams[i];
+    qsort(sorted, (size_t)n, sizeof(Gram), bySaving);
+
+    if (header > 0) {
+        int nCand = n < CANDIDATES ? n : CANDIDATES, nSel = 0;
+        Gram **sel = malloc(sizeof(Gram*) * ((size_t)nCand + 1));
+        char *taken = calloc((size_t)nCand + 1, 1);
+        if (!sel || !taken) abort();
+        long long saved = 0;
+        while (nSel < header) {
+            int best = -1;
+            long long bestSaved = saved;
+            for (int c = 0; c < nCand; c++) {
+                if (taken[c]) continue;
+                sel[nSel] = &sorted[c];
+                long long s = savedBy(sel, nSel + 1);
+                if (s > bestSaved) {
+                    best = c;
+                    bestSaved = s;
+                }
+            }
+            if (best < 0) break;
+            taken[best] = 1;
+            sel[nSel++] = &sorted[best];
+            saved = bestSaved;
+        }
+        printHeader(sel, nSel, saved, argc, argv);
+        free(sel);
+        free(taken);
+    }
+    else {
+        printf("%lld %s dispatches, %d distinct sequences\n", total, isStatic ? "static" : "executed", n);
+        printf("%14s %14s  sequence\n", "count", "saving");
+        for (int i = 0; i < n && i < top; i++) {
+            printf("%14lld %14lld  ", sorted[i].count, saving(&sorted[i]));
+            printGram(stdout, &sorted[i], " ");
+            printf("\n");
+        }
+    }
+
+    if (sink) fclose(sink);
+    if (os) vmFreeProgram(os);
+    free(sorted);
+    free(grams);
+    free(ops);
+    free(weight);
+    free(entered);
+    StopCompiler();
+    return 0;
+}
+#endif
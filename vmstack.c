@@ -0,0 +1,184 @@
+// vmstack.c
+/************************************************************************
+ Stack depths of linked VM code
+
+ Code from the compiler leaves the operand stack at the same depth on
+ every path to an instruction. The walk of a function follows its
+ control flow from the entry through every goto and if-goto, backward
+ ones included (a loop rotated by the profile enters its body only
+ through the if-goto at its bottom), and gives each instruction it
+ reaches the depth before it; code it never reaches keeps none. The
+ largest depth, a call counting its 5 saved words on top of its
+ arguments, is VmFunc.maxStack, and a function entry that checks for
+ nLocals + maxStack words (VmFunc.frame) once has room for every push
+ and call of the body. A function the walk cannot bound (two paths
+ that reach an instruction at different depths, a pop below the frame,
+ a jump out of it) gets maxStack -1 and its pushes and calls are
+ checked one by one (m->checkStack: the words each of them puts on the
+ stack).
+
+ VmFunc.maxDepth adds the calls: the most stack words, from its locals
+ up, that the function and whatever it calls can ever use. It is known
+ where the calls below the function never recurse and every function
+ on the way was bounded, and -1 otherwise.
+*************************************************************************/
+#include "vmstack.h"
+#include <stdlib.h>
+
+#define FRAME_WORDS 5   // return address, LCL, ARG, THIS, THAT
+
+int vmFuncEnd(const VmMachine *m, int f) {
+    return f + 1 < m->nFuncs ? m->funcs[f + 1].entry : m->nCode;
+}
+
+int vmFuncAt(const VmMachine *m, int entry) {
+    int lo = 0, hi = m->nFuncs - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (m->funcs[mid].entry == entry) return mid;
+        if (m->funcs[mid].entry < entry) lo = mid + 1; else hi = mid - 1;
+    }
+    return -1;
+}
+
+// words an instruction needs on the stack and the change it makes
+static void effect(const VmInsn *in, int *need, int *delta) {
+    *need = *delta = 0;
+    switch (in->op) {
+        case I_PUSH_CONST: case I_PUSH_LOCAL: case I_PUSH_ARG:
+        case I_PUSH_THIS: case I_PUSH_THAT: case I_PUSH_ADDR:
+            *delta = 1;
+            break;
+        case I_POP_LOCAL: case I_POP_ARG: case I_POP_THIS: case I_POP_THAT: case I_POP_ADDR:
+        case I_IF_GOTO:
+            *need = 1;
+            *delta = -1;
+            break;
+        case I_ADD: case I_SUB: case I_AND: case I_OR: case I_EQ: case I_GT: case I_LT:
+            *need = 2;
+            *delta = -1;
+            break;
+        case I_NEG: case I_NOT: case I_RETURN:
+            *need = 1;
+            break;
+        case I_CALL:
+            *need = in->b;
+            *delta = 1 - in->b;
+            break;
+    }
+}
+
+// depth[pc] before each instruction of function f (-1 where none reaches),
+// following every goto and if-goto from the entry until no depth changes;
+// maxStack of f, -1 if it cannot be bounded. work holds the pcs still to
+// visit, each at most once as a pc gets its depth once
+static int walk(const VmMachine *m, int f, int *depth, int *work) {
+    int entry = m->funcs[f].entry, end = vmFuncEnd(m, f);
+    int n = 0, max = 0;
+    for (int pc = entry + 1; pc < end; pc++) depth[pc] = -1;
+    if (entry + 1 >= end) return 0;
+    depth[entry + 1] = 0;
+    work[n++] = entry + 1;
+    while (n > 0) {
+        int pc = work[--n], d = depth[pc];
+        const VmInsn *in = &m->code[pc];
+        int need, delta;
+        effect(in, &need, &delta);
+        if (d < need) return -1;
+        if (in->op == I_CALL && d + FRAME_WORDS > max) max = d + FRAME_WORDS;
+        d += delta;
+        if (d > max) max = d;
+
+        int next[2], nNext = 0;
+        if (in->op == I_GOTO || in->op == I_IF_GOTO) next[nNext++] = in->a;
+        if (in->op != I_GOTO && in->op != I_RETURN && in->op != I_HALT) next[nNext++] = pc + 1;
+        for (int k = 0; k < nNext; k++) {
+            int to = next[k];
+            if (to <= entry || to >= end) return -1;   // out of the function
+            if (depth[to] < 0) {
+                depth[to] = d;
+                work[n++] = to;
+            }
+            else if (depth[to] != d) return -1;     // two paths, two depths
+        }
+    }
+    return max;
+}
+
+// maxDepth of f: state 0 not yet, 1 on the current chain of calls, 2 done
+static int deepest(VmMachine *m, int f, const int *depth, char *state) {
+    VmFunc *fn = &m->funcs[f];
+    if (state[f] == 2) return fn->maxDepth;
+    if (state[f] == 1) return -1;        // recursion
+    state[f] = 1;
+    int max = fn->maxStack;
+    for (int pc = fn->entry + 1; pc < vmFuncEnd(m, f) && max >= 0; pc++) {
+        if (m->code[pc].op != I_CALL || depth[pc] < 0) continue;
+        int callee = vmFuncAt(m, m->code[pc].a);
+        int below = callee >= 0 ? deepest(m, callee, depth, state) : -1;
+        if (below < 0) max = -1;
+        else if (depth[pc] + FRAME_WORDS + below > max) max = depth[pc] + FRAME_WORDS + below;
+    }
+    fn->maxDepth = max < 0 ? -1 : fn->nLocals + max;
+    state[f] = 2;
+    return fn->maxDepth;
+}
+
+void vmAnalyzeStack(VmMachine *m) {
+    int *depth = malloc(sizeof(int) * ((size_t)m->nCode + 1));
+    int *work = malloc(sizeof(int) * ((size_t)m->nCode + 1));
+    char *state = calloc((size_t)m->nFuncs + 1, 1);
+    if (!depth || !work || !state) abort();
+    free(m->checkStack);
+    m->checkStack = NULL;
+    for (int f = 0; f < m->nFuncs; f++) {
+        VmFunc *fn = &m->funcs[f];
+        fn->maxStack = walk(m, f, depth, work);
+        fn->frame = fn->nLocals + (fn->maxStack > 0 ? fn->maxStack : 0);
+        if (fn->maxStack >= 0) continue;
+        if (!m->checkStack) {
+            m->checkStack = calloc((size_t)m->nCode, 1);
+            if (!m->checkStack) abort();
+        }
+        for (int pc = fn->entry + 1; pc < vmFuncEnd(m, f); pc++) {
+            int need, delta;
+            effect(&m->code[pc], &need, &delta);
+            if (m->code[pc].op == I_CALL) m->checkStack[pc] = FRAME_WORDS;
+            else if (delta > 0) m->checkStack[pc] = (char)delta;
+        }
+    }
+    for (int f = 0; f < m->nFuncs; f++)
+        deepest(m, f, depth, state);
+    free(depth);
+    free(work);
+    free(state);
+}
+
+void vmPrintStackInfo(const VmMachine *m, FILE *f) {
+    int bounded = 0, finite = 0;
+    fprintf(f, "%-32s %6s %6s %9s\n", "function", "locals", "stack", "deepest");
+    for (int i = 0; i < m->nFuncs; i++) {
+        const VmFunc *fn = &m->funcs[i];
+        char stack[16], deep[16];
+        if (fn->maxStack >= 0) {
+            snprintf(stack, sizeof(stack), "%d", fn->maxStack);
+            bounded++;
+        }
+        else snprintf(stack, sizeof(stack), "?");
+        if (fn->maxDepth >= 0) {
+            snprintf(deep, sizeof(deep), "%d", fn->maxDepth);
+            finite++;
+        }
+        else snprintf(deep, sizeof(deep), fn->maxStack >= 0 ? "unbounded" : "?");
+        fprintf(f, "%-32s %6d %6s %9s\n", fn->name, fn->nLocals, stack, deep);
+    }
+    fprintf(f, "%d of %d functions bounded, %d with a bounded chain of calls\n",
+            bounded, m->nFuncs, finite);
+    const VmFunc *e = &m->funcs[m->entry];
+    int base = HACK_STACK + FRAME_WORDS;
+    if (e->maxDepth >= 0)
+        fprintf(f, "%s: at most %d stack words, %s\n", e->name, e->maxDepth,
+                base + e->maxDepth <= m->stackLimit ? "the stack cannot overflow" : "may overflow");
+    else
+        fprintf(f, "%s: stack use not bounded (recursion or an unbalanced function)\n", e->name);
+}
@@ -0,0 +1,20 @@
+#ifndef VMSTACK_H
+#define VMSTACK_H
+
+#include <stdio.h>
+#include "vminterp.h"
+
+// Stack analysis of linked VM code, run by vmLoad. Fills in for every
+// function VmFunc.maxStack, .frame and .maxDepth, and m->checkStack
+// for the functions it cannot bound.
+void vmAnalyzeStack(VmMachine *m);
+// Per function: locals, operand stack, worst-case stack with its calls;
+// then the same for the whole program from its entry
+void vmPrintStackInfo(const VmMachine *m, FILE *f);
+
+// pc right after the code of function f
+int vmFuncEnd(const VmMachine *m, int f);
+// the function whose I_FUNCTION is at pc entry, -1 if none
+int vmFuncAt(const VmMachine *m, int entry);
+
+#endif
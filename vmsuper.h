@@ -0,0 +1,24 @@
+// vmsuper.h
+/************************************************************************
+ Superinstructions of vminterp.c, generated by vmngram.c:
+  vmngram -header 16 bench/arrays bench/dispatch
+
+ SUPERn(...) names n instructions run with one dispatch. They save
+ 1136508 of the 1983671 dispatches of that corpus (57.3%).
+*************************************************************************/
+SUPER4(PUSH_ADDR, PUSH_ADDR, ADD, POP_ADDR)
+SUPER4(POP_ADDR, POP_ADDR, PUSH_ADDR, POP_THAT)
+SUPER4(PUSH_ARG, PUSH_ADDR, ADD, POP_ADDR)
+SUPER3(LT, NOT, IF_GOTO)
+SUPER4(PUSH_ADDR, PUSH_CONST, ADD, POP_ADDR)
+SUPER2(PUSH_ADDR, PUSH_ADDR)
+SUPER4(PUSH_ADDR, GT, AND, NOT)
+SUPER4(PUSH_ADDR, PUSH_CONST, SUB, POP_ADDR)
+SUPER3(PUSH_ADDR, PUSH_ADDR, ADD)
+SUPER3(POP_ADDR, PUSH_ADDR, POP_THAT)
+SUPER4(PUSH_ARG, LT, NOT, IF_GOTO)
+SUPER2(PUSH_ADDR, ADD)
+SUPER4(PUSH_ADDR, PUSH_LOCAL, GT, PUSH_ADDR)
+SUPER4(PUSH_ADDR, ADD, POP_ADDR, PUSH_THAT)
+SUPER4(PUSH_ADDR, PUSH_ADDR, ADD, PUSH_ADDR)
+SUPER2(NOT, IF_GOTO)